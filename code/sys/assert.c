@@ -10,8 +10,11 @@
 // Define a weak kprintf() so that panic() and assert() still work even
 // if the kernel is built without console.o.
 extern void kprintf(const char * fmt, ...) __attribute__ ((weak));
+extern void console_flush(void) __attribute__ ((weak));
 
 void panic_actual(const char * srcfile, int srcline, const char * msg) {    
+    console_flush();
+
     if (msg != NULL && *msg != '\0')
         klprintf("PANIC", srcfile, srcline, "%s\n", msg);
     else
@@ -21,10 +24,15 @@ void panic_actual(const char * srcfile, int srcline, const char * msg) {
 }
 
 void assert_failed(const char * srcfile, int srcline, const char * stmt) {
+    console_flush();
     klprintf("ASSERT", srcfile, srcline, "failed (%s)\n", stmt);
     halt_failure();
 }
 
 void kprintf(const char * fmt, ...) {
     // nothing
+}
+
+void console_flush(void) {
+    // nothing
 }
\ No newline at end of file
@@ -0,0 +1,382 @@
+// bench.c - Kernel image that runs the benchmark suite
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// Linked in place of main.o by make bench. Each result is printed on its own
+// console line as
+//
+//     BENCH <name> <value> <unit>
+//
+// so runs can be compared with grep. The kernel half measures the block cache,
+// the raw block device, KTFS, kernel threads and pipes. It then executes the
+// user half, BENCH_NAME from the filesystem, which measures fork, exec, spawn,
+// page faults, pipes and switches between processes.
+//
+
+#include "conf.h"
+#include "console.h"
+#include "assert.h"
+#include "thread.h"
+#include "process.h"
+#include "memory.h"
+#include "cache.h"
+#include "fs.h"
+#include "io.h"
+#include "device.h"
+#include "dev/rtc.h"
+#include "dev/uart.h"
+#include "intr.h"
+#include "dev/virtio.h"
+#include "riscv.h"
+#include "error.h"
+#include "string.h"
+
+#define VIRTIO_MMIO_STEP (VIRTIO1_MMIO_BASE - VIRTIO0_MMIO_BASE)
+#define NUM_UARTS 3
+
+#ifndef BENCH_NAME
+#define BENCH_NAME "bench"
+#endif
+
+#define BENCH_FILE "bench.tmp"
+#define BENCH_FILE_SIZE (256 * 1024UL)
+#define BENCH_IOSZ 512
+#define BENCH_PIPE_BYTES (1024 * 1024UL)
+
+#define BENCH_NS(ticks) ((ticks) * (1000000000UL / TIMER_FREQ))
+#define BENCH_KBPS(bytes, ticks) \
+    ((ticks) ? (bytes) / 1024 * TIMER_FREQ / (ticks) : 0)
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void bench_report(const char *name, unsigned long long value, const char *unit);
+static unsigned long long bench_next(unsigned long long *seed);
+
+static void bench_cache(struct io *blkio, unsigned long long devsz);
+static void bench_blkdev(struct io *blkio, unsigned long long devsz);
+static void bench_ktfs(void);
+static void bench_switch(void);
+static void bench_pipe(void);
+
+static void switch_func(void);
+static void pipe_writer_func(struct io *wio);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static char bench_buf[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+static struct condition switch_cond;
+static volatile int switch_turn;
+static int switch_iters;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void main(void)
+{
+    unsigned long long devsz;
+    struct io *blkio;
+    struct io *exeio;
+    char *argv[2];
+    int result;
+    int i;
+
+    string_init();
+    console_init();
+    devmgr_init();
+    intrmgr_init();
+    thrmgr_init();
+    memory_init();
+    procmgr_init();
+
+    rtc_attach((void *)RTC_MMIO_BASE);
+
+    for (i = 0; i < NUM_UARTS; i++)
+        uart_attach((void *)UART_MMIO_BASE(i), UART0_INTR_SRCNO + i);
+
+    for (i = 0; i < 8; i++)
+        virtio_attach((void *)VIRTIO0_MMIO_BASE + i * VIRTIO_MMIO_STEP, VIRTIO0_INTR_SRCNO + i);
+
+    enable_interrupts();
+
+    result = open_device("vioblk", 0, &blkio);
+    if (result < 0)
+        panic("bench: failed to open vioblk");
+
+    result = ioctl(blkio, IOCTL_GETEND, &devsz);
+    if (result < 0)
+        panic("bench: failed to size vioblk");
+
+    kprintf("BENCH begin\n");
+
+    bench_cache(blkio, devsz);
+    bench_blkdev(blkio, devsz);
+
+    result = fsmount(blkio);
+    if (result < 0)
+        panic("bench: failed to mount filesystem");
+
+    bench_ktfs();
+    bench_switch();
+    bench_pipe();
+
+    // The user half ends the run when it exits
+
+    result = fsopen(BENCH_NAME, &exeio);
+    if (result < 0)
+    {
+        kprintf("BENCH end\n");
+        kprintf("bench: " BENCH_NAME " not in filesystem (%d), user benchmarks skipped\n", result);
+        return;
+    }
+
+    argv[0] = BENCH_NAME;
+    argv[1] = NULL;
+    result = process_exec(exeio, 1, argv);
+    kprintf("bench: exec " BENCH_NAME " failed (%d)\n", result);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void bench_report(const char *name, unsigned long long value, const char *unit)
+{
+    kprintf("BENCH %s %llu %s\n", name, value, unit);
+}
+
+// Small xorshift generator, so that random offsets are the same each run.
+
+unsigned long long bench_next(unsigned long long *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+// Cache latency: repeated gets of one block (hits), then gets of blocks
+// scattered over the device in a private cache (misses).
+
+void bench_cache(struct io *blkio, unsigned long long devsz)
+{
+    const int iters = 4096;
+    unsigned long long seed = 1;
+    unsigned long long t0, t1;
+    unsigned long long nblks;
+    struct cache *cache;
+    unsigned int blksz;
+    void *blk;
+    int result;
+    int i;
+
+    result = create_cache(blkio, &cache);
+    if (result < 0)
+    {
+        kprintf("bench: create_cache failed (%d)\n", result);
+        return;
+    }
+
+    blksz = cache_get_blksz(cache);
+    nblks = devsz / blksz;
+
+    result = cache_get_block(cache, 0, &blk);
+    if (result < 0)
+        return;
+    cache_release_block(cache, blk, 0);
+
+    t0 = rdtime();
+    for (i = 0; i < iters; i++)
+    {
+        cache_get_block(cache, 0, &blk);
+        cache_release_block(cache, blk, 0);
+    }
+    t1 = rdtime();
+    bench_report("cache_hit", BENCH_NS(t1 - t0) / iters, "ns");
+
+    t0 = rdtime();
+    for (i = 0; i < iters / 16; i++)
+    {
+        if (cache_get_block(cache, bench_next(&seed) % nblks * blksz, &blk) == 0)
+            cache_release_block(cache, blk, 0);
+    }
+    t1 = rdtime();
+    bench_report("cache_miss", BENCH_NS(t1 - t0) / (iters / 16), "ns");
+}
+
+// Raw device: random single-sector reads and sequential page reads.
+
+void bench_blkdev(struct io *blkio, unsigned long long devsz)
+{
+    const int iters = 256;
+    const unsigned long long nsec = devsz / BENCH_IOSZ;
+    unsigned long long seed = 2;
+    unsigned long long t0, t1;
+    int i;
+
+    t0 = rdtime();
+    for (i = 0; i < iters; i++)
+        ioreadat(blkio, bench_next(&seed) % nsec * BENCH_IOSZ, bench_buf, BENCH_IOSZ);
+    t1 = rdtime();
+    bench_report("vioblk_randread_iops", (t1 != t0) ? iters * TIMER_FREQ / (t1 - t0) : 0, "iops");
+
+    t0 = rdtime();
+    for (i = 0; i < iters && (i + 1) * sizeof(bench_buf) <= devsz; i++)
+        ioreadat(blkio, i * sizeof(bench_buf), bench_buf, sizeof(bench_buf));
+    t1 = rdtime();
+    bench_report("vioblk_seqread", BENCH_KBPS(i * sizeof(bench_buf), t1 - t0), "KB/s");
+}
+
+// KTFS: sequential page-sized writes and reads of a scratch file, then random
+// sector-sized ones.
+
+void bench_ktfs(void)
+{
+    const unsigned long long size = BENCH_FILE_SIZE;
+    const int iters = 256;
+    unsigned long long seed = 3;
+    unsigned long long t0, t1;
+    unsigned long long pos;
+    struct io *fio;
+    int result;
+    int i;
+
+    fsdelete(BENCH_FILE);
+    result = fscreate(BENCH_FILE);
+    if (result == 0)
+        result = fsopen(BENCH_FILE, &fio);
+    if (result == 0)
+        result = ioctl(fio, IOCTL_SETEND, (void *)&size);
+    if (result < 0)
+    {
+        kprintf("bench: cannot create " BENCH_FILE " (%d)\n", result);
+        return;
+    }
+
+    memset(bench_buf, 0xA5, sizeof(bench_buf));
+
+    t0 = rdtime();
+    for (pos = 0; pos < size; pos += sizeof(bench_buf))
+        iowriteat(fio, pos, bench_buf, sizeof(bench_buf));
+    ioctl(fio, IOCTL_FLUSH, NULL);
+    t1 = rdtime();
+    bench_report("ktfs_seqwrite", BENCH_KBPS(size, t1 - t0), "KB/s");
+
+    t0 = rdtime();
+    for (pos = 0; pos < size; pos += sizeof(bench_buf))
+        ioreadat(fio, pos, bench_buf, sizeof(bench_buf));
+    t1 = rdtime();
+    bench_report("ktfs_seqread", BENCH_KBPS(size, t1 - t0), "KB/s");
+
+    t0 = rdtime();
+    for (i = 0; i < iters; i++)
+        ioreadat(fio, bench_next(&seed) % (size / BENCH_IOSZ) * BENCH_IOSZ, bench_buf, BENCH_IOSZ);
+    t1 = rdtime();
+    bench_report("ktfs_randread", BENCH_KBPS(iters * BENCH_IOSZ, t1 - t0), "KB/s");
+
+    t0 = rdtime();
+    for (i = 0; i < iters; i++)
+        iowriteat(fio, bench_next(&seed) % (size / BENCH_IOSZ) * BENCH_IOSZ, bench_buf, BENCH_IOSZ);
+    ioctl(fio, IOCTL_FLUSH, NULL);
+    t1 = rdtime();
+    bench_report("ktfs_randwrite", BENCH_KBPS(iters * BENCH_IOSZ, t1 - t0), "KB/s");
+
+    ioclose(fio);
+    fsdelete(BENCH_FILE);
+}
+
+// Context switch: two kernel threads take turns through a condition. Each turn
+// is one switch.
+
+void bench_switch(void)
+{
+    unsigned long long t0, t1;
+    int tid;
+    int pie;
+    int i;
+
+    condition_init(&switch_cond, "bench_switch");
+    switch_iters = 2048;
+    switch_turn = 0;
+
+    tid = thread_spawn("bench_switch", switch_func);
+    if (tid < 0)
+        return;
+
+    t0 = rdtime();
+    pie = disable_interrupts();
+    for (i = 0; i < switch_iters; i++)
+    {
+        switch_turn = 1;
+        condition_broadcast(&switch_cond);
+        while (switch_turn != 0)
+            condition_wait(&switch_cond);
+    }
+    restore_interrupts(pie);
+    t1 = rdtime();
+
+    thread_join(tid);
+    bench_report("kthread_switch", BENCH_NS(t1 - t0) / (2 * switch_iters), "ns");
+}
+
+void switch_func(void)
+{
+    int pie;
+    int i;
+
+    pie = disable_interrupts();
+    for (i = 0; i < switch_iters; i++)
+    {
+        while (switch_turn != 1)
+            condition_wait(&switch_cond);
+        switch_turn = 0;
+        condition_broadcast(&switch_cond);
+    }
+    restore_interrupts(pie);
+}
+
+// Pipe bandwidth between two kernel threads, a page per write.
+
+void bench_pipe(void)
+{
+    unsigned long long t0, t1;
+    unsigned long total = 0;
+    struct io *wio, *rio;
+    long cnt;
+    int tid;
+
+    create_pipe(&wio, &rio);
+
+    t0 = rdtime();
+    tid = thread_spawn("bench_pipe", (void (*)(void))pipe_writer_func, wio);
+    if (tid < 0)
+    {
+        ioclose(wio);
+        ioclose(rio);
+        return;
+    }
+
+    while ((cnt = ioread(rio, bench_buf, sizeof(bench_buf))) > 0)
+        total += cnt;
+    t1 = rdtime();
+
+    thread_join(tid);
+    ioclose(rio);
+    bench_report("kpipe_bw", BENCH_KBPS(total, t1 - t0), "KB/s");
+}
+
+void pipe_writer_func(struct io *wio)
+{
+    static char wbuf[PAGE_SIZE];
+    unsigned long sent;
+
+    for (sent = 0; sent < BENCH_PIPE_BYTES; sent += sizeof(wbuf))
+    {
+        if (iowrite(wio, wbuf, sizeof(wbuf)) < 0)
+            break;
+    }
+
+    ioclose(wio);
+}
@@ -1,4 +1,11 @@
+// cache.c - Block cache for a storage device
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
 #include "cache.h"
+#include "tracepoint.h"
 #include "string.h"
 #include "error.h"
 #include "thread.h"
@@ -8,208 +15,1427 @@
 #include <limits.h>
 #include "heap.h"
 #include "io.h"
+#include "conf.h"
+#include "timer.h"
+#include "riscv.h"
+#include "device.h"
+#include "ioimpl.h"
+#include "memory.h"
+
+// Upper bound on the capacity create_cache() picks from the device size
+
+#ifndef CACHE_CAPACITY_MAX
+#define CACHE_CAPACITY_MAX 1024
+#endif
+
+// create_cache() provides one cache entry per CACHE_DISK_RATIO device blocks,
+// but never fewer than CACHE_CAPACITY or more than CACHE_CAPACITY_MAX.
+
+#define CACHE_DISK_RATIO 64
+
+// Longest run of adjacent dirty blocks written back with a single request
+
+#define CACHE_FLUSH_RUN_MAX 8
+
+// Number of pending read-ahead requests. Must be a power of two.
+
+#define CACHE_RA_QLEN 32
+
+// Write-back timing. The flusher thread wakes every CACHE_FLUSH_INTERVAL_MS and
+// writes back every block that has been dirty for at least CACHE_DIRTY_AGE_MS.
+
+#ifndef CACHE_FLUSH_INTERVAL_MS
+#define CACHE_FLUSH_INTERVAL_MS 100
+#endif
+
+#ifndef CACHE_DIRTY_AGE_MS
+#define CACHE_DIRTY_AGE_MS 500
+#endif
+
+// Each cache entry is on exactly one hash chain (if it holds a valid block).
+// An entry is pinned while it has outstanding references from
+// cache_get_block(). Pinned entries are on no list, so they are never evicted.
+//
+// Replacement follows the simplified 2Q policy. Unpinned entries are on one of
+// three lists, each ordered from most recently released (head) to least
+// recently released (tail):
+//
+//   free: entries holding no block, always used first;
+//   a1:   blocks referenced once since being loaded (probation);
+//   am:   blocks known to be reused (protected).
+//
+// A newly loaded block enters a1. Repeated references to a block while it is
+// in a1 do not promote it, since a sequential reader touches each block
+// several times in quick succession. When a block is evicted from a1, its
+// number is remembered in a bounded ghost list; a block that is loaded again
+// while still in the ghost list goes to am. Eviction takes the a1 tail while
+// a1 holds more than a1_max entries, and otherwise the am tail. A large scan
+// therefore only cycles through a1 and leaves the am working set resident.
+// Blocks released with CACHE_META go straight to am.
+//
+// The cache_lock only protects the index (hash chains, LRU list, pin counts
+// and flags). It is not held while a caller uses a block, so several threads
+// may hold different blocks, and one thread may hold several blocks, at once.
+// Nor is it held during device I/O: a block being read in is marked loading,
+// and the blocks of a run being written back are marked writing. Neither kind
+// of entry is reused until the I/O completes.
+
+struct cache_block
+{
+  long long block_id; // block number or -1 if entry is empty
+  int refcnt;         // number of outstanding cache_get_block() references
+  int loading;        // set while the block is being read from the device
+  int dirty;          // block differs from backing device
+  int writing;        // set while the block is being written back
+  int prefetched;     // loaded by read-ahead and not yet requested
+  int queue;          // CACHE_Q_FREE, CACHE_Q_A1 or CACHE_Q_AM
+  unsigned long long tdirty; // rdtime() when block was first dirtied
+
+  struct cache_block *hash_next; // next entry in hash chain
+  struct cache_block *lru_prev;  // toward most recently used
+  struct cache_block *lru_next;  // toward least recently used
 
-#define CACHE_BLOCK_AMMOUNT 64
-// CHECK EVICTION POLICY METHOD AND IMPLEMENTATION
-// struct cache
-// {
-//   struct io *bkgio;
-//   struct
-//   {
-//     int block_id;
+  uint8_t *data; // blksz bytes in the cache's data pages
+};
+
+#define CACHE_Q_FREE 0
+#define CACHE_Q_A1 1
+#define CACHE_Q_AM 2
 
-//     // uint8_t data[CACHE_BLKSZ];
-//     void *data;
+#define CACHE_GHOST_EMPTY ULLONG_MAX
 
-//     struct lock cache_lock;
+struct cache_list
+{
+  struct cache_block *head;
+  struct cache_block *tail;
+  unsigned int count;
+};
 
-//     // int status; // Dirty (1) or Clean (0) (DO WE NEED STATUS?)
+// A cache, its hash table, its entries and its ghost list are allocated
+// together as one run of physical pages: the struct cache header, then
+// hash_size bucket pointers, then capacity entries, then the ghost list. The
+// hash table size is the smallest power of two that is at least twice the
+// capacity, which keeps chains short. The ghost list is a ring of ghost_max
+// block numbers with its own hash chains (linked by index) sharing the bucket
+// function of the main table.
 
-//     int assign_num;
-//   } cache_blocks[CACHE_BLOCK_AMMOUNT];
-// };
 struct cache
 {
   struct io *bkgio;
-  struct lock cache_lock;
-  int lock_owner;
-  struct
-  {
-    int block_id;
+  unsigned int blksz;      // block size in bytes, a power of two
+  unsigned int capacity;   // number of entries
+  unsigned int hash_mask;  // hash table size minus one
+  unsigned int page_cnt;   // pages backing this cache
+  unsigned int data_page_cnt; // pages backing flush_buf and block data
+  uint8_t *block_data;     // block data of entry i at i * blksz
+  struct lock cache_lock;            // protects the cache index
+  struct condition block_loaded;     // signalled when a block read completes
+  struct condition block_released;   // signalled when an entry becomes unpinned
+  struct condition ra_ready;         // signalled when read-ahead is queued
+  struct condition flush_done;       // signalled when a run write completes
+
+  unsigned long ra_head; // next read-ahead request to service
+  unsigned long ra_tail; // next free read-ahead queue slot
+  unsigned long long ra_queue[CACHE_RA_QLEN];
+
+  struct cache_stats stats; // updated with cache_lock held
+  struct io statio;         // cachestat device endpoint
+  int instno;               // cachestat device instance number
+  int stop;                 // asks the flusher and read-ahead threads to exit
+  int dirty_count;                // number of dirty entries
+
+  struct cache_list queues[3];  // indexed by CACHE_Q_FREE/A1/AM
+  unsigned int a1_max;          // a1 size above which a1 is evicted first
 
-    // uint8_t data[CACHE_BLKSZ];
-    uint8_t data[CACHE_BLKSZ];
-    //int status; // Dirty (1) or Clean (0) Neither (-1)
+  struct cache_block **hash_table;
+  struct cache_block *cache_blocks;
 
-    int assign_num;
-  } cache_blocks[CACHE_BLOCK_AMMOUNT];
+  unsigned int ghost_max;            // ghost ring capacity
+  unsigned int ghost_pos;            // next ghost ring slot to overwrite
+  unsigned long long *ghost_ids;     // ghost ring of evicted a1 block numbers
+  int *ghost_next;                   // ghost hash chain links
+  int *ghost_bucket;                 // ghost hash chain heads
+
+  // Staging buffer used to write a run of adjacent dirty blocks at once. It is
+  // owned by the thread that set flush_busy, so one run is written at a time.
+
+  uint8_t *flush_buf; // CACHE_FLUSH_RUN_MAX blocks, ahead of block_data
+  int flush_busy;     // a run is being written from flush_buf
 };
 
-struct cache cache;
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static inline unsigned int cache_hash(const struct cache *cache, unsigned long long block_id);
+static struct cache_block *hash_find(struct cache *cache, unsigned long long block_id);
+static void hash_insert(struct cache *cache, struct cache_block *blk);
+static void hash_remove(struct cache *cache, struct cache_block *blk);
+static void list_remove(struct cache_list *list, struct cache_block *blk);
+static void list_push_head(struct cache_list *list, struct cache_block *blk);
+static struct cache_block *cache_victim(struct cache *cache);
+static void ghost_add(struct cache *cache, unsigned long long block_id);
+static int ghost_remove(struct cache *cache, unsigned long long block_id);
+static void cache_pin(struct cache *cache, struct cache_block *blk);
+static void cache_unpin(struct cache *cache, struct cache_block *blk);
+static void cache_wait_flush(struct cache *cache);
+static long cache_write_run(struct cache *cache, struct cache_block *blk);
+static int cache_write_dirty(struct cache *cache, unsigned long long min_age);
+static void cache_flusher(struct cache *cache);
+static int cache_lookup(struct cache *cache, unsigned long long block_id,
+                        struct cache_block **bptr, int prefetch);
+static void cache_readahead(struct cache *cache);
+static void cache_stop_threads(struct cache *cache, int flusher_tid, int ra_tid);
+static void cache_drop_range(struct cache *cache, unsigned long long first,
+                             unsigned long long cnt, int zero, const void *src);
+static void cache_drop_block(struct cache *cache, struct cache_block *blk,
+                             int zero, const void *src);
+static int cache_sync_range(struct cache *cache, unsigned long long first,
+                            unsigned long long cnt);
+static int cachestat_open(struct io **ioptr, void *aux);
+static long cachestat_read(struct io *io, void *buf, long bufsz);
+static int cachestat_cntl(struct io *io, int cmd, void *arg);
+
+static const struct iointf cachestat_iointf = {
+    .read = &cachestat_read,
+    .cntl = &cachestat_cntl};
+
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+// Creates a cache of CACHE_BLKSZ-byte blocks for _bkgio_.
 
 int create_cache(struct io *bkgio, struct cache **cptr)
+{
+  return create_cache_blksz(bkgio, CACHE_BLKSZ, cptr);
+}
+
+// Creates a cache of _blksz_-byte blocks for _bkgio_ sized from the device:
+// one entry per CACHE_DISK_RATIO blocks, clamped to [CACHE_CAPACITY,
+// CACHE_CAPACITY_MAX]. The bounds count CACHE_BLKSZ-byte blocks, so a cache of
+// larger blocks has proportionally fewer entries and about the same size.
+
+int create_cache_blksz(struct io *bkgio, unsigned int blksz, struct cache **cptr)
 {
   trace("%s()", __func__);
-  // What am I supposed to do with bkgio, check if it has read and write?s
-  if (bkgio == NULL)
+  const unsigned int scale = (blksz > CACHE_BLKSZ) ? blksz / CACHE_BLKSZ : 1;
+  unsigned long long end;
+  unsigned long long capacity = CACHE_CAPACITY / scale;
+
+  if (bkgio == NULL || blksz == 0)
   {
     return -EINVAL;
   }
 
-  // Initialize Members
-  for (int i = 0; i < CACHE_BLOCK_AMMOUNT; i++)
+  if (ioctl(bkgio, IOCTL_GETEND, &end) == 0)
+  {
+    capacity = end / blksz / CACHE_DISK_RATIO;
+
+    if (capacity < CACHE_CAPACITY / scale)
+    {
+      capacity = CACHE_CAPACITY / scale;
+    }
+
+    if (capacity > CACHE_CAPACITY_MAX / scale)
+    {
+      capacity = CACHE_CAPACITY_MAX / scale;
+    }
+  }
+
+  // Leave room for the blocks a caller may hold at once
+
+  if (capacity < 2 * CACHE_FLUSH_RUN_MAX)
   {
-    cache.cache_blocks[i].block_id = -1;
-    // cache.cache_blocks[i].status = -1;
-    cache.cache_blocks[i].assign_num = 0;
+    capacity = 2 * CACHE_FLUSH_RUN_MAX;
   }
-  cache.bkgio = bkgio;
-  lock_init(&cache.cache_lock);
-  cache.lock_owner = -1;
-  // kprintf("hello %p\n", cache->bkgio);
-  *cptr = &cache;
-  return 0;
+
+  return create_cache_sized(bkgio, blksz, capacity, cptr);
 }
 
-int cache_get_block(struct cache *cache, unsigned long long pos, void **pptr)
+// Creates an independent cache of _capacity_ blocks of _blksz_ bytes for
+// _bkgio_. The block size must be a power of two that is a multiple of the
+// device block size. Each cache has its own index, flusher and read-ahead
+// threads, and cachestat device instance.
+
+int create_cache_sized(struct io *bkgio, unsigned int blksz, unsigned int capacity, struct cache **cptr)
 {
   trace("%s()", __func__);
-  if (cache == NULL || pos % CACHE_BLKSZ != 0)
+  struct cache *cache;
+  unsigned int hash_size;
+  unsigned int ghost_max;
+  unsigned int data_page_cnt;
+  uint8_t *block_data;
+  size_t size;
+  int flusher_tid;
+  int ra_tid;
+  int result;
+
+  if (bkgio == NULL || cptr == NULL || capacity == 0 ||
+      blksz < CACHE_BLKSZ || (blksz & (blksz - 1)) != 0)
   {
     return -EINVAL;
   }
-  // If the block already exists in cache we set pptr to the data
 
-  for (int i = 0; i < CACHE_BLOCK_AMMOUNT; i++) // when you are switching threads, you should flush or not
+  // Block data is page-aligned, so that blocks of PAGE_SIZE bytes or more
+  // start on a page boundary
+
+  data_page_cnt = ((unsigned long long)(CACHE_FLUSH_RUN_MAX + capacity) * blksz +
+                   PAGE_SIZE - 1) / PAGE_SIZE;
+  block_data = alloc_phys_pages(data_page_cnt);
+
+  if (block_data == NULL)
   {
-    if (cache->cache_blocks[i].block_id == (pos / CACHE_BLKSZ))
-    {
-      *pptr = cache->cache_blocks[i].data;
-      lock_acquire(&cache->cache_lock);
-      cache->lock_owner = i;
-      return 0;
-    }
+    return -ENOMEM;
   }
-  // Otherwise we have to read from block device
-  // ioreadat(cache->bkgio, pos, cache->cache_blocks[i].data, CACHE_BLKSZ);
-  for (int i = 0; i < CACHE_BLOCK_AMMOUNT; i++)
+
+  hash_size = 1;
+  while (hash_size < 2 * capacity)
   {
-    if (cache->cache_blocks[i].block_id == -1)
-    {
-      // kprintf("\n !!! BACKING DEVICE CALLED !!!\n");
-      ioreadat(cache->bkgio, pos, cache->cache_blocks[i].data, CACHE_BLKSZ);
-      *pptr = cache->cache_blocks[i].data;
-      cache->cache_blocks[i].block_id = (pos / CACHE_BLKSZ);
-      // kprintf("%d\n",cache->cache_blocks[i].block_id);
-      lock_acquire(&cache->cache_lock);
-      cache->lock_owner = i;
-      return 0;
-      // cache->cache_blocks[i].data = *pptr;
-    }
+    hash_size <<= 1;
+  }
+
+  ghost_max = (capacity + 1) / 2;
+
+  size = sizeof(struct cache) + hash_size * sizeof(struct cache_block *) +
+         capacity * sizeof(struct cache_block) +
+         ghost_max * (sizeof(unsigned long long) + sizeof(int)) +
+         hash_size * sizeof(int);
+
+  cache = alloc_phys_pages((size + PAGE_SIZE - 1) / PAGE_SIZE);
+
+  if (cache == NULL)
+  {
+    free_phys_pages(block_data, data_page_cnt);
+    return -ENOMEM;
   }
-  // Evict if cache is full
-  // QUESTION: are we supposed to evict a block that hasnt even gotten called in cache_release_block yet?
-  int min = cache->cache_blocks[0].assign_num;
-  for (int i = 0; i < CACHE_BLOCK_AMMOUNT; i++)
+
+  // Initialize Members
+  memset(cache, 0, sizeof(struct cache));
+  cache->blksz = blksz;
+  cache->page_cnt = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+  cache->data_page_cnt = data_page_cnt;
+  cache->flush_buf = block_data;
+  cache->block_data = block_data + CACHE_FLUSH_RUN_MAX * blksz;
+  cache->capacity = capacity;
+  cache->hash_mask = hash_size - 1;
+  cache->hash_table = (void *)(cache + 1);
+  cache->cache_blocks = (void *)(cache->hash_table + hash_size);
+  cache->ghost_max = ghost_max;
+  cache->ghost_pos = 0;
+  cache->ghost_ids = (void *)(cache->cache_blocks + capacity);
+  cache->ghost_next = (void *)(cache->ghost_ids + ghost_max);
+  cache->ghost_bucket = cache->ghost_next + ghost_max;
+  cache->a1_max = (capacity + 3) / 4;
+
+  for (unsigned int i = 0; i < hash_size; i++)
   {
-    if (cache->cache_blocks[i].assign_num < min)
-    {
-      min = cache->cache_blocks[i].assign_num;
-    }
+    cache->hash_table[i] = NULL;
+    cache->ghost_bucket[i] = -1;
   }
-  for (int i = 0; i < CACHE_BLOCK_AMMOUNT; i++)
+
+  for (unsigned int i = 0; i < ghost_max; i++)
   {
-    if (cache->cache_blocks[i].assign_num == min)
-    {
-      // kprintf("\n !!! BACKING DEVICE CALLED !!!\n");
-      ioreadat(cache->bkgio, pos, cache->cache_blocks[i].data, CACHE_BLKSZ);
-      *pptr = cache->cache_blocks[i].data;
-      // cache->cache_blocks[i].data = *pptr;
-      cache->cache_blocks[i].block_id = (pos / CACHE_BLKSZ);
-      lock_acquire(&cache->cache_lock);
-      cache->lock_owner = i;
-      return 0;
-    }
+    cache->ghost_ids[i] = CACHE_GHOST_EMPTY;
+  }
+
+  for (unsigned int i = 0; i < capacity; i++)
+  {
+    cache->cache_blocks[i].block_id = -1;
+    cache->cache_blocks[i].data = cache->block_data + (size_t)i * blksz;
+    cache->cache_blocks[i].refcnt = 0;
+    cache->cache_blocks[i].loading = 0;
+    cache->cache_blocks[i].dirty = 0;
+    cache->cache_blocks[i].writing = 0;
+    cache->cache_blocks[i].prefetched = 0;
+    cache->cache_blocks[i].hash_next = NULL;
+    cache->cache_blocks[i].queue = CACHE_Q_FREE;
+    list_push_head(&cache->queues[CACHE_Q_FREE], &cache->cache_blocks[i]);
   }
-  return -EIO;
+
+  cache->bkgio = bkgio;
+  lock_init(&cache->cache_lock);
+  condition_init(&cache->block_loaded, "cache_block_loaded");
+  condition_init(&cache->block_released, "cache_block_released");
+  condition_init(&cache->ra_ready, "cache_ra_ready");
+  condition_init(&cache->flush_done, "cache_flush_done");
+  cache->flush_busy = 0;
+  cache->ra_head = 0;
+  cache->ra_tail = 0;
+  ioinit0(&cache->statio, &cachestat_iointf);
+  cache->dirty_count = 0;
+  cache->stop = 0;
+
+  flusher_tid = thread_spawn("cache_flusher", (void *)&cache_flusher, cache);
+
+  if (flusher_tid < 0)
+  {
+    free_phys_pages(block_data, data_page_cnt);
+    free_phys_pages(cache, cache->page_cnt);
+    return flusher_tid;
+  }
+
+  ra_tid = thread_spawn("cache_readahead", (void *)&cache_readahead, cache);
+
+  if (ra_tid < 0)
+  {
+    cache_stop_threads(cache, flusher_tid, -1);
+    free_phys_pages(block_data, data_page_cnt);
+    free_phys_pages(cache, cache->page_cnt);
+    return ra_tid;
+  }
+
+  // Each cache is its own instance of the cachestat device
+
+  cache->instno = register_device("cachestat", cachestat_open, cache);
+
+  if (cache->instno < 0)
+  {
+    result = cache->instno;
+    cache_stop_threads(cache, flusher_tid, ra_tid);
+    free_phys_pages(block_data, data_page_cnt);
+    free_phys_pages(cache, cache->page_cnt);
+    return result;
+  }
+
+  *cptr = cache;
+  return 0;
 }
 
-void cache_release_block(struct cache *cache, void *pblk, int dirty)
+int cache_get_block(struct cache *cache, unsigned long long pos, void **pptr)
 {
-  trace("%s()", __func__);
-  int block_just_released = -1;
-  int num_released_blocks = 0;
-  for (int i = 0; i < CACHE_BLOCK_AMMOUNT; i++)
+  struct cache_block *blk;
+  int result;
+
+  if (cache == NULL || pos % cache->blksz != 0)
   {
+    return -EINVAL;
+  }
 
-    if (cache->cache_blocks[i].data == pblk)
-    {
-      if (dirty == CACHE_DIRTY)
-      {
-        iowriteat(cache->bkgio, cache->cache_blocks[i].block_id * CACHE_BLKSZ, pblk, CACHE_BLKSZ);
-      }
-      // kprintf("\n%d",i);
-      block_just_released = i;
-      break;
-    }
+  result = cache_lookup(cache, pos / cache->blksz, &blk, 0);
+  tracepoint(TRACEPOINT_CACHE, TRACEPOINT_CACHE_GET, pos, result);
+
+  if (result < 0)
+  {
+    return result;
   }
-  // Tracking the Least Recently Used cache
-  num_released_blocks = (cache->cache_blocks[block_just_released].assign_num == 0) ? 1 : 0;
-  for (int i = 0; i < CACHE_BLOCK_AMMOUNT; i++)
+
+  *pptr = blk->data;
+  return 0;
+}
+
+// Queues an asynchronous read of the block at _pos_ for the read-ahead thread.
+// Returns 0 if the block is cached or queued, -EBUSY if the read-ahead queue
+// is full, or -EINVAL if _pos_ is not block-aligned.
+
+int cache_prefetch(struct cache *cache, unsigned long long pos)
+{
+  trace("%s()", __func__);
+  unsigned long long block_id;
+  int result = 0;
+
+  if (cache == NULL || pos % cache->blksz != 0)
   {
-    if (cache->cache_blocks[i].assign_num != 0)
-    {
-      num_released_blocks++;
-    }
+    return -EINVAL;
   }
-  if (cache->cache_blocks[block_just_released].assign_num != num_released_blocks)
+
+  block_id = pos / cache->blksz;
+  lock_acquire(&cache->cache_lock);
+
+  if (hash_find(cache, block_id) == NULL)
   {
-    if (cache->cache_blocks[block_just_released].assign_num == 0)
+    if (cache->ra_tail - cache->ra_head < CACHE_RA_QLEN)
     {
-      cache->cache_blocks[block_just_released].assign_num = num_released_blocks;
+      cache->ra_queue[cache->ra_tail++ % CACHE_RA_QLEN] = block_id;
+      cache->stats.ra_issued += 1;
+      condition_broadcast(&cache->ra_ready);
     }
     else
     {
-      for (int i = 0; i < CACHE_BLOCK_AMMOUNT; i++)
-      {
-        if ((cache->cache_blocks[i].assign_num > 1))
-        {
-          cache->cache_blocks[i].assign_num -= 1;
-        }
-      }
-      cache->cache_blocks[block_just_released].assign_num = num_released_blocks;
+      result = -EBUSY;
     }
   }
 
-  if (block_just_released != -1)
+  lock_release(&cache->cache_lock);
+  return result;
+}
+
+// Returns the size in bytes of the blocks in _cache_.
+
+unsigned int cache_get_blksz(const struct cache *cache)
+{
+  return cache->blksz;
+}
+
+// Returns the instance number of the cachestat device for _cache_.
+
+int cache_get_instno(const struct cache *cache)
+{
+  return cache->instno;
+}
+
+// Copies a snapshot of the cache counters into _stats_.
+
+void cache_get_stats(struct cache *cache, struct cache_stats *stats)
+{
+  lock_acquire(&cache->cache_lock);
+  *stats = cache->stats;
+  lock_release(&cache->cache_lock);
+}
+
+void cache_release_block(struct cache *cache, void *pblk, int dirty)
+{
+  trace("%s()", __func__);
+  const size_t off = (uint8_t *)pblk - cache->block_data;
+  struct cache_block *const blk = cache->cache_blocks + off / cache->blksz;
+
+  assert((uint8_t *)pblk >= cache->block_data && off % cache->blksz == 0 &&
+         blk < cache->cache_blocks + cache->capacity);
+
+  lock_acquire(&cache->cache_lock);
+
+  // Dirty blocks are written back later by the flusher thread, on eviction,
+  // or by cache_flush().
+
+  if ((dirty & CACHE_DIRTY) && !blk->dirty)
+  {
+    blk->dirty = 1;
+    blk->tdirty = rdtime();
+    cache->dirty_count += 1;
+  }
+
+  // Metadata blocks are protected from scans
+
+  if (dirty & CACHE_META)
   {
-    lock_release(&cache->cache_lock);
-    cache->lock_owner = -1;
+    blk->queue = CACHE_Q_AM;
   }
+
+  cache_unpin(cache, blk);
+  lock_release(&cache->cache_lock);
 }
 
+// Writes every dirty block back to the backing device, then issues one
+// IOCTL_FLUSH barrier. When this returns 0, all blocks released before the
+// call are durable on the device.
+
 int cache_flush(struct cache *cache)
 {
   trace("%s()", __func__);
+  int result;
+
   if (cache == NULL)
   {
     return -EINVAL;
   }
-  if (cache->lock_owner != -1)
+
+  lock_acquire(&cache->cache_lock);
+  result = cache_write_dirty(cache, 0);
+  lock_release(&cache->cache_lock);
+
+  if (result < 0)
+  {
+    return result;
+  }
+
+  // Barrier: the writes above have completed, but may still sit in a
+  // volatile device cache. A backing io without the notion is fine.
+
+  result = ioctl(cache->bkgio, IOCTL_FLUSH, NULL);
+  return (result == -ENOTSUP) ? 0 : result;
+}
+
+// Discards the blocks in [pos, pos+len) on the backing device. The caller
+// must no longer need their contents: cached copies stop being written back.
+// A backing io without discard support is not an error, since a discard is
+// only a hint.
+
+int cache_discard(struct cache *cache, unsigned long long pos,
+                  unsigned long long len)
+{
+  trace("%s()", __func__);
+  struct io_range range;
+  int result;
+
+  if (cache == NULL || pos % cache->blksz != 0 || len % cache->blksz != 0)
+  {
+    return -EINVAL;
+  }
+
+  if (len == 0)
+  {
+    return 0;
+  }
+
+  cache_drop_range(cache, pos / cache->blksz, len / cache->blksz, 0, NULL);
+
+  range.pos = pos;
+  range.len = len;
+  result = ioctl(cache->bkgio, IOCTL_DISCARD, &range);
+  return (result == -ENOTSUP) ? 0 : result;
+}
+
+// Sets the blocks in [pos, pos+len) to zero, both in the cache and on the
+// backing device, without transferring block data when the device supports
+// IOCTL_WRITE_ZEROES. Otherwise falls back to writing zeroed blocks through
+// the cache.
+
+int cache_write_zeroes(struct cache *cache, unsigned long long pos,
+                       unsigned long long len)
+{
+  trace("%s()", __func__);
+  struct io_range range;
+  void *pblk;
+  int result;
+
+  if (cache == NULL || pos % cache->blksz != 0 || len % cache->blksz != 0)
+  {
+    return -EINVAL;
+  }
+
+  if (len == 0)
+  {
+    return 0;
+  }
+
+  cache_drop_range(cache, pos / cache->blksz, len / cache->blksz, 1, NULL);
+
+  range.pos = pos;
+  range.len = len;
+  result = ioctl(cache->bkgio, IOCTL_WRITE_ZEROES, &range);
+
+  if (result != -ENOTSUP)
+  {
+    return result;
+  }
+
+  for (unsigned long long off = 0; off < len; off += cache->blksz)
   {
-    cache_release_block(cache, cache->cache_blocks[cache->lock_owner].data, CACHE_DIRTY);
+    result = cache_get_block(cache, pos + off, &pblk);
+
+    if (result < 0)
+    {
+      return result;
+    }
+
+    memset(pblk, 0, cache->blksz);
+    cache_release_block(cache, pblk, CACHE_DIRTY);
   }
-  // for (int i = 0; i < CACHE_BLOCK_AMMOUNT; i++)
-  // {
-  //   cache_release_block(cache, cache->cache_blocks[i].data, CACHE_DIRTY); // cache->cache_blocks[i].status or 1 to keep writing to the blocks
-  // }
+
   return 0;
 }
 
-// void print_cache(struct cache *cache)
-// {
-//   for (int i = 0; i < CACHE_BLOCK_AMMOUNT; i++)
-//   {
-//     kprintf("Block ID: %d Assign Num:%d\n", cache->cache_blocks[i].block_id, cache->cache_blocks[i].assign_num);
-//   }
-// }
\ No newline at end of file
+// Reads [pos, pos+len) from the backing device straight into _buf_, without
+// loading the blocks into the cache. Dirty cached copies are written back
+// first, so the device holds the latest data. Returns the number of bytes
+// read or a negative error code.
+
+long cache_read_direct(struct cache *cache, unsigned long long pos,
+                       void *buf, unsigned long long len)
+{
+  trace("%s()", __func__);
+  unsigned long long tstart;
+  long result;
+
+  if (cache == NULL || pos % cache->blksz != 0 || len % cache->blksz != 0)
+  {
+    return -EINVAL;
+  }
+
+  result = cache_sync_range(cache, pos / cache->blksz, len / cache->blksz);
+
+  if (result < 0)
+  {
+    return result;
+  }
+
+  tstart = rdtime();
+  result = ioreadat(cache->bkgio, pos, buf, len);
+
+  lock_acquire(&cache->cache_lock);
+  cache->stats.read_ticks += rdtime() - tstart;
+  lock_release(&cache->cache_lock);
+
+  return result;
+}
+
+// Writes [pos, pos+len) from _buf_ straight to the backing device. Cached
+// copies of the blocks are updated and marked clean before the write, so a
+// write-back of older data cannot land after it, and again afterwards, in
+// case a block was read in while the write was in progress. Returns the
+// number of bytes written or a negative error code.
+
+long cache_write_direct(struct cache *cache, unsigned long long pos,
+                        const void *buf, unsigned long long len)
+{
+  trace("%s()", __func__);
+  unsigned long long tstart;
+  long result;
+
+  if (cache == NULL || pos % cache->blksz != 0 || len % cache->blksz != 0)
+  {
+    return -EINVAL;
+  }
+
+  cache_drop_range(cache, pos / cache->blksz, len / cache->blksz, 0, buf);
+
+  tstart = rdtime();
+  result = iowriteat(cache->bkgio, pos, buf, len);
+
+  lock_acquire(&cache->cache_lock);
+  cache->stats.write_ticks += rdtime() - tstart;
+  lock_release(&cache->cache_lock);
+
+  cache_drop_range(cache, pos / cache->blksz, len / cache->blksz, 0, buf);
+  return result;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static inline unsigned int cache_hash(const struct cache *cache, unsigned long long block_id)
+{
+  // Fibonacci hashing spreads sequential block numbers across buckets
+
+  return (unsigned int)((block_id * 0x9E3779B97F4A7C15ULL) >> 32) &
+         cache->hash_mask;
+}
+
+static struct cache_block *hash_find(struct cache *cache, unsigned long long block_id)
+{
+  struct cache_block *blk;
+
+  blk = cache->hash_table[cache_hash(cache, block_id)];
+
+  while (blk != NULL && blk->block_id != block_id)
+  {
+    blk = blk->hash_next;
+  }
+
+  return blk;
+}
+
+static void hash_insert(struct cache *cache, struct cache_block *blk)
+{
+  const unsigned int idx = cache_hash(cache, blk->block_id);
+
+  blk->hash_next = cache->hash_table[idx];
+  cache->hash_table[idx] = blk;
+}
+
+static void hash_remove(struct cache *cache, struct cache_block *blk)
+{
+  struct cache_block **link;
+
+  link = &cache->hash_table[cache_hash(cache, blk->block_id)];
+
+  while (*link != NULL && *link != blk)
+  {
+    link = &(*link)->hash_next;
+  }
+
+  if (*link == blk)
+  {
+    *link = blk->hash_next;
+  }
+
+  blk->hash_next = NULL;
+}
+
+static void list_remove(struct cache_list *list, struct cache_block *blk)
+{
+  if (blk->lru_prev != NULL)
+  {
+    blk->lru_prev->lru_next = blk->lru_next;
+  }
+  else
+  {
+    list->head = blk->lru_next;
+  }
+
+  if (blk->lru_next != NULL)
+  {
+    blk->lru_next->lru_prev = blk->lru_prev;
+  }
+  else
+  {
+    list->tail = blk->lru_prev;
+  }
+
+  blk->lru_prev = NULL;
+  blk->lru_next = NULL;
+  list->count -= 1;
+}
+
+static void list_push_head(struct cache_list *list, struct cache_block *blk)
+{
+  blk->lru_prev = NULL;
+  blk->lru_next = list->head;
+
+  if (list->head != NULL)
+  {
+    list->head->lru_prev = blk;
+  }
+  else
+  {
+    list->tail = blk;
+  }
+
+  list->head = blk;
+  list->count += 1;
+}
+
+// Chooses the unpinned entry to reuse for a new block, or returns NULL if all
+// entries are pinned. Must be called with cache_lock held.
+
+static struct cache_block *cache_victim(struct cache *cache)
+{
+  struct cache_list *const a1 = &cache->queues[CACHE_Q_A1];
+  struct cache_list *const am = &cache->queues[CACHE_Q_AM];
+
+  if (cache->queues[CACHE_Q_FREE].tail != NULL)
+  {
+    return cache->queues[CACHE_Q_FREE].tail;
+  }
+
+  if (a1->tail != NULL && (a1->count > cache->a1_max || am->tail == NULL))
+  {
+    return a1->tail;
+  }
+
+  return (am->tail != NULL) ? am->tail : a1->tail;
+}
+
+// Remembers that _block_id_ was evicted from a1, overwriting the oldest ghost
+// if the ghost ring is full. Must be called with cache_lock held.
+
+static void ghost_add(struct cache *cache, unsigned long long block_id)
+{
+  const unsigned int slot = cache->ghost_pos;
+  unsigned int idx;
+  int *link;
+
+  cache->ghost_pos = (slot + 1) % cache->ghost_max;
+
+  if (cache->ghost_ids[slot] != CACHE_GHOST_EMPTY)
+  {
+    ghost_remove(cache, cache->ghost_ids[slot]);
+  }
+
+  idx = cache_hash(cache, block_id);
+  link = &cache->ghost_bucket[idx];
+  cache->ghost_ids[slot] = block_id;
+  cache->ghost_next[slot] = *link;
+  *link = slot;
+}
+
+// Removes _block_id_ from the ghost list. Returns 1 if it was there, 0
+// otherwise. Must be called with cache_lock held.
+
+static int ghost_remove(struct cache *cache, unsigned long long block_id)
+{
+  int *link;
+
+  link = &cache->ghost_bucket[cache_hash(cache, block_id)];
+
+  while (*link != -1 && cache->ghost_ids[*link] != block_id)
+  {
+    link = &cache->ghost_next[*link];
+  }
+
+  if (*link == -1)
+  {
+    return 0;
+  }
+
+  cache->ghost_ids[*link] = CACHE_GHOST_EMPTY;
+  *link = cache->ghost_next[*link];
+  return 1;
+}
+
+// Waits until no run is being written back. Must be called with cache_lock
+// held. May release and reacquire it.
+
+static void cache_wait_flush(struct cache *cache)
+{
+  int pie;
+
+  while (cache->flush_busy)
+  {
+    lock_release(&cache->cache_lock);
+
+    pie = disable_interrupts();
+    while (cache->flush_busy)
+    {
+      condition_wait(&cache->flush_done);
+    }
+    restore_interrupts(pie);
+
+    lock_acquire(&cache->cache_lock);
+  }
+}
+
+// Writes back the run of adjacent dirty blocks containing _blk_ with a single
+// iowriteat() of up to CACHE_FLUSH_RUN_MAX blocks, after any run already being
+// written. Returns the number of blocks written, 0 if _blk_ is clean by then,
+// or a negative error code. Must be called with cache_lock held. Releases it
+// for the write and reacquires it before returning.
+//
+// The run's entries are marked clean once copied to flush_buf, so a holder
+// that modifies one during the write marks it dirty again on release. They
+// are marked writing until the write completes, which keeps them from being
+// reused and read in again before the device holds their contents.
+
+static long cache_write_run(struct cache *cache, struct cache_block *blk)
+{
+  struct cache_block *run[CACHE_FLUSH_RUN_MAX];
+  struct cache_block *prev;
+  unsigned long long tstart;
+  long result;
+  int back = 0;
+  int cnt = 0;
+
+  cache_wait_flush(cache);
+
+  if (!blk->dirty)
+  {
+    return 0;
+  }
+
+  // Back up to the first dirty block of the run, but no further than keeps
+  // _blk_ itself in the run, so callers can rely on it being clean afterwards.
+
+  while (blk->block_id > 0 && back < CACHE_FLUSH_RUN_MAX - 1)
+  {
+    prev = hash_find(cache, blk->block_id - 1);
+
+    if (prev == NULL || !prev->dirty)
+    {
+      break;
+    }
+
+    blk = prev;
+    back += 1;
+  }
+
+  while (blk != NULL && blk->dirty && cnt < CACHE_FLUSH_RUN_MAX)
+  {
+    memcpy(cache->flush_buf + cnt * cache->blksz, blk->data, cache->blksz);
+    blk->dirty = 0;
+    blk->writing = 1;
+    run[cnt++] = blk;
+    blk = hash_find(cache, blk->block_id + 1);
+  }
+
+  cache->dirty_count -= cnt;
+  cache->flush_busy = 1;
+  lock_release(&cache->cache_lock);
+
+  tstart = rdtime();
+  result = iowriteat(cache->bkgio, run[0]->block_id * cache->blksz,
+                     cache->flush_buf, cnt * cache->blksz);
+
+  lock_acquire(&cache->cache_lock);
+  cache->stats.write_ticks += rdtime() - tstart;
+
+  for (int i = 0; i < cnt; i++)
+  {
+    run[i]->writing = 0;
+
+    // A failed write leaves the block dirty, with its original tdirty
+
+    if (result != cnt * cache->blksz && !run[i]->dirty)
+    {
+      run[i]->dirty = 1;
+      cache->dirty_count += 1;
+    }
+  }
+
+  cache->flush_busy = 0;
+  condition_broadcast(&cache->flush_done);
+
+  if (result != cnt * cache->blksz)
+  {
+    return (result < 0) ? result : -EIO;
+  }
+
+  cache->stats.writebacks += cnt;
+  return cnt;
+}
+
+// Writes back all dirty blocks that have been dirty for at least _min_age_
+// timer ticks, and waits for a write-back already in progress. Must be called
+// with cache_lock held. May release and reacquire it.
+
+static int cache_write_dirty(struct cache *cache, unsigned long long min_age)
+{
+  const unsigned long long now = rdtime();
+  struct cache_block *blk;
+  long result;
+
+  for (unsigned int i = 0; i < cache->capacity && cache->dirty_count != 0; i++)
+  {
+    blk = &cache->cache_blocks[i];
+
+    if (blk->dirty && now - blk->tdirty >= min_age)
+    {
+      result = cache_write_run(cache, blk);
+
+      if (result < 0)
+      {
+        return result;
+      }
+    }
+  }
+
+  cache_wait_flush(cache);
+  return 0;
+}
+
+// Entry point of the write-back thread spawned by create_cache(). A block may
+// be pinned and modified while it is written back; its holder marks it dirty
+// again on release, so the final contents reach the device on a later pass.
+
+static void cache_flusher(struct cache *cache)
+{
+  const unsigned long long max_age =
+      CACHE_DIRTY_AGE_MS * (TIMER_FREQ / 1000);
+  struct alarm al;
+
+  alarm_init(&al, "cache_flusher");
+
+  while (!cache->stop)
+  {
+    alarm_sleep_ms(&al, CACHE_FLUSH_INTERVAL_MS);
+
+    if (cache->stop || cache->dirty_count == 0)
+    {
+      continue;
+    }
+
+    lock_acquire(&cache->cache_lock);
+    cache_write_dirty(cache, max_age);
+    lock_release(&cache->cache_lock);
+  }
+}
+
+// Finds the cache entry for _block_id_, reading it from the backing device if
+// it is not cached, and returns it pinned in _bptr_. Returns 0 on success or a
+// negative error code.
+
+static int cache_lookup(struct cache *cache, unsigned long long block_id,
+                        struct cache_block **bptr, int prefetch)
+{
+  struct cache_block *blk;
+  unsigned long long tstart;
+  long result;
+  int pie;
+
+  lock_acquire(&cache->cache_lock);
+
+retry:
+  // If the block already exists in cache we pin it. If another thread (or the
+  // read-ahead thread) is still reading it in, wait for it to finish.
+
+  blk = hash_find(cache, block_id);
+
+  if (blk != NULL)
+  {
+    cache_pin(cache, blk);
+
+    if (!prefetch)
+    {
+      cache->stats.hits += 1;
+
+      if (blk->prefetched)
+      {
+        blk->prefetched = 0;
+        cache->stats.ra_hits += 1;
+      }
+    }
+
+    lock_release(&cache->cache_lock);
+
+    pie = disable_interrupts();
+    while (blk->loading)
+    {
+      condition_wait(&cache->block_loaded);
+    }
+    restore_interrupts(pie);
+
+    // The thread loading the block failed and gave up the entry
+
+    if (blk->block_id != block_id)
+    {
+      lock_acquire(&cache->cache_lock);
+      cache_unpin(cache, blk);
+      lock_release(&cache->cache_lock);
+      return -EIO;
+    }
+
+    *bptr = blk;
+    return 0;
+  }
+
+  // Otherwise reuse an unpinned entry chosen by the replacement policy. If
+  // every entry is pinned, wait for a release.
+
+  blk = cache_victim(cache);
+
+  if (blk == NULL)
+  {
+    lock_release(&cache->cache_lock);
+
+    pie = disable_interrupts();
+    while (cache_victim(cache) == NULL)
+    {
+      condition_wait(&cache->block_released);
+    }
+    restore_interrupts(pie);
+
+    lock_acquire(&cache->cache_lock);
+    goto retry;
+  }
+
+  // A dirty victim must reach the device before its entry is reused. Writing
+  // it back releases cache_lock, so the lookup starts over afterwards.
+
+  if (blk->dirty || blk->writing)
+  {
+    result = cache_write_run(cache, blk);
+
+    if (result < 0)
+    {
+      lock_release(&cache->cache_lock);
+      return result;
+    }
+
+    goto retry;
+  }
+
+  if (blk->block_id != -1)
+  {
+    if (blk->queue == CACHE_Q_A1)
+    {
+      ghost_add(cache, blk->block_id);
+    }
+
+    hash_remove(cache, blk);
+    cache->stats.evictions += 1;
+  }
+
+  if (!prefetch)
+  {
+    cache->stats.misses += 1;
+  }
+
+  // Publish the entry as loading so that concurrent lookups of the same block
+  // wait for the read below instead of issuing their own. The device read is
+  // done without cache_lock held.
+
+  cache_pin(cache, blk);
+  blk->queue = ghost_remove(cache, block_id) ? CACHE_Q_AM : CACHE_Q_A1;
+  blk->block_id = block_id;
+  blk->loading = 1;
+  blk->prefetched = prefetch;
+  hash_insert(cache, blk);
+  lock_release(&cache->cache_lock);
+
+  tstart = rdtime();
+  result = ioreadat(cache->bkgio, block_id * cache->blksz, blk->data, cache->blksz);
+
+  lock_acquire(&cache->cache_lock);
+  cache->stats.read_ticks += rdtime() - tstart;
+
+  if (result != cache->blksz)
+  {
+    hash_remove(cache, blk);
+    blk->block_id = -1;
+  }
+
+  blk->loading = 0;
+  condition_broadcast(&cache->block_loaded);
+
+  if (result != cache->blksz)
+  {
+    cache_unpin(cache, blk);
+    lock_release(&cache->cache_lock);
+    return (result < 0) ? result : -EIO;
+  }
+
+  lock_release(&cache->cache_lock);
+  *bptr = blk;
+  return 0;
+}
+
+// Makes cached copies of blocks [first, first+cnt) consistent with a
+// discard, write-zeroes or write issued directly to the backing device: they
+// are no longer dirty and, if _src_ is given, block first+i takes the
+// blksz bytes at src+i*blksz, or if _zero_ is set, is zeroed.
+// Entries still being read in or written back are waited for first. Scans the entry array
+// rather than probing every block id when the range is larger than the cache.
+
+static void cache_drop_range(struct cache *cache, unsigned long long first,
+                             unsigned long long cnt, int zero, const void *src)
+{
+  struct cache_block *blk;
+
+  lock_acquire(&cache->cache_lock);
+
+  if (cnt > cache->capacity)
+  {
+    for (unsigned int i = 0; i < cache->capacity; i++)
+    {
+      blk = &cache->cache_blocks[i];
+
+      if (blk->block_id >= 0 &&
+          (unsigned long long)blk->block_id - first < cnt)
+      {
+        cache_drop_block(cache, blk, zero, (src == NULL) ? NULL :
+                         src + (blk->block_id - first) * cache->blksz);
+      }
+    }
+  }
+  else
+  {
+    for (unsigned long long id = first; id < first + cnt; id++)
+    {
+      blk = hash_find(cache, id);
+
+      if (blk != NULL)
+      {
+        cache_drop_block(cache, blk, zero, (src == NULL) ? NULL :
+                         src + (id - first) * cache->blksz);
+      }
+    }
+  }
+
+  lock_release(&cache->cache_lock);
+}
+
+// Must be called with cache_lock held. May release and reacquire it.
+
+static void cache_drop_block(struct cache *cache, struct cache_block *blk,
+                             int zero, const void *src)
+{
+  const long long block_id = blk->block_id;
+  int pie;
+
+  cache_pin(cache, blk);
+
+  if (blk->loading)
+  {
+    lock_release(&cache->cache_lock);
+
+    pie = disable_interrupts();
+    while (blk->loading)
+    {
+      condition_wait(&cache->block_loaded);
+    }
+    restore_interrupts(pie);
+
+    lock_acquire(&cache->cache_lock);
+  }
+
+  // An older write-back of the block must not land after the caller's own
+  // device access
+
+  if (blk->writing)
+  {
+    cache_wait_flush(cache);
+  }
+
+  if (blk->block_id == block_id)
+  {
+    if (blk->dirty)
+    {
+      blk->dirty = 0;
+      cache->dirty_count -= 1;
+    }
+
+    if (src != NULL)
+    {
+      memcpy(blk->data, src, cache->blksz);
+    }
+    else if (zero)
+    {
+      memset(blk->data, 0, cache->blksz);
+    }
+  }
+
+  cache_unpin(cache, blk);
+}
+
+// Writes back the dirty cached blocks in [first, first+cnt), and waits for
+// write-backs of blocks in the range already in progress. Returns 0 or a
+// negative error code.
+
+static int cache_sync_range(struct cache *cache, unsigned long long first,
+                            unsigned long long cnt)
+{
+  struct cache_block *blk;
+  long result = 0;
+
+  lock_acquire(&cache->cache_lock);
+
+  if (cnt > cache->capacity)
+  {
+    for (unsigned int i = 0; i < cache->capacity && result >= 0; i++)
+    {
+      blk = &cache->cache_blocks[i];
+
+      if ((blk->dirty || blk->writing) &&
+          (unsigned long long)blk->block_id - first < cnt)
+      {
+        result = cache_write_run(cache, blk);
+      }
+    }
+  }
+  else
+  {
+    for (unsigned long long id = first; id < first + cnt && result >= 0; id++)
+    {
+      blk = hash_find(cache, id);
+
+      if (blk != NULL && (blk->dirty || blk->writing))
+      {
+        result = cache_write_run(cache, blk);
+      }
+    }
+  }
+
+  lock_release(&cache->cache_lock);
+  return (result < 0) ? result : 0;
+}
+
+// Entry point of the read-ahead thread spawned by create_cache(). Loads the
+// blocks queued by cache_prefetch() into the cache, one at a time.
+
+static void cache_readahead(struct cache *cache)
+{
+  struct cache_block *blk;
+  unsigned long long block_id;
+  int pie;
+
+  for (;;)
+  {
+    pie = disable_interrupts();
+    while (cache->ra_head == cache->ra_tail && !cache->stop)
+    {
+      condition_wait(&cache->ra_ready);
+    }
+    restore_interrupts(pie);
+
+    if (cache->stop)
+    {
+      return;
+    }
+
+    lock_acquire(&cache->cache_lock);
+    block_id = cache->ra_queue[cache->ra_head++ % CACHE_RA_QLEN];
+    lock_release(&cache->cache_lock);
+
+    if (cache_lookup(cache, block_id, &blk, 1) == 0)
+    {
+      lock_acquire(&cache->cache_lock);
+      cache_unpin(cache, blk);
+      lock_release(&cache->cache_lock);
+    }
+  }
+}
+
+// Makes the cache's flusher and read-ahead threads exit and waits for them, so
+// that a cache whose setup failed can be freed. A negative tid stands for a
+// thread that was not started. Neither thread has work to finish at that
+// point: nothing has used the cache yet.
+
+static void cache_stop_threads(struct cache *cache, int flusher_tid, int ra_tid)
+{
+  cache->stop = 1;
+  condition_broadcast(&cache->ra_ready);
+
+  if (flusher_tid >= 0)
+  {
+    thread_join(flusher_tid);
+  }
+
+  if (ra_tid >= 0)
+  {
+    thread_join(ra_tid);
+  }
+}
+
+// Adds a reference to a cache entry. The first reference takes the entry off
+// its replacement list so that it cannot be evicted. Must be called with
+// cache_lock held.
+
+static void cache_pin(struct cache *cache, struct cache_block *blk)
+{
+  if (blk->refcnt++ == 0)
+  {
+    list_remove(&cache->queues[blk->queue], blk);
+  }
+}
+
+// Drops a reference to a cache entry. When the last reference is dropped, the
+// entry goes back on its replacement list as most recently used (or on the
+// free list, if it no longer holds a block). Must be called with cache_lock
+// held.
+
+static void cache_unpin(struct cache *cache, struct cache_block *blk)
+{
+  assert(blk->refcnt > 0);
+
+  if (--blk->refcnt == 0)
+  {
+    if (blk->block_id == -1)
+    {
+      blk->queue = CACHE_Q_FREE;
+    }
+
+    list_push_head(&cache->queues[blk->queue], blk);
+
+    condition_broadcast(&cache->block_released);
+  }
+}
+
+// The cachestat device exposes a cache's counters to user programs. Reading it
+// returns a struct cache_stats snapshot (truncated to the buffer size).
+
+static int cachestat_open(struct io **ioptr, void *aux)
+{
+  struct cache *const cache = aux;
+
+  *ioptr = ioaddref(&cache->statio);
+  return 0;
+}
+
+static long cachestat_read(struct io *io, void *buf, long bufsz)
+{
+  struct cache *const cache = (void *)io - offsetof(struct cache, statio);
+  struct cache_stats stats;
+
+  if (bufsz < 0)
+  {
+    return -EINVAL;
+  }
+
+  if (bufsz > (long)sizeof(stats))
+  {
+    bufsz = sizeof(stats);
+  }
+
+  cache_get_stats(cache, &stats);
+  memcpy(buf, &stats, bufsz);
+  return bufsz;
+}
+
+static int cachestat_cntl(struct io *io, int cmd, void *arg)
+{
+  switch (cmd)
+  {
+  case IOCTL_GETBLKSZ:
+    return sizeof(struct cache_stats);
+  default:
+    return -ENOTSUP;
+  }
+}
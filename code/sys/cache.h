@@ -7,18 +7,45 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 
-#define CACHE_BLKSZ 512UL 
+#define CACHE_BLKSZ 512UL // default and smallest block size
 
 #define CACHE_CLEAN 0
 #define CACHE_DIRTY 1
+#define CACHE_META 2 // may be or'ed with CACHE_CLEAN or CACHE_DIRTY
+
+// Per-cache counters, returned by cache_get_stats() and by reading the
+// cache's instance of the cachestat device, numbered in order of creation and
+// returned by cache_get_instno(). Tick counts are in units of the timer
+// (TIMER_FREQ).
+
+struct cache_stats {
+    unsigned long long hits;        // cache_get_block() found block cached
+    unsigned long long misses;      // cache_get_block() read block from device
+    unsigned long long evictions;   // valid blocks replaced
+    unsigned long long writebacks;  // dirty blocks written to device
+    unsigned long long ra_issued;   // blocks queued for read-ahead
+    unsigned long long ra_hits;     // first request for a prefetched block
+    unsigned long long read_ticks;  // time spent reading from device
+    unsigned long long write_ticks; // time spent writing to device
+};
 
 struct io; // extern decl.
 struct cache; // opaque decl.
 
 extern int create_cache(struct io * bkgio, struct cache ** cptr);
+extern int create_cache_blksz(struct io * bkgio, unsigned int blksz, struct cache ** cptr);
+extern int create_cache_sized(struct io * bkgio, unsigned int blksz, unsigned int capacity, struct cache ** cptr);
+extern unsigned int cache_get_blksz(const struct cache * cache);
+extern int cache_get_instno(const struct cache * cache);
 extern int cache_get_block(struct cache * cache, unsigned long long pos, void ** pptr);
 extern void cache_release_block(struct cache * cache, void * pblk, int dirty);
+extern int cache_prefetch(struct cache * cache, unsigned long long pos);
 extern int cache_flush(struct cache * cache);
+extern int cache_discard(struct cache * cache, unsigned long long pos, unsigned long long len);
+extern int cache_write_zeroes(struct cache * cache, unsigned long long pos, unsigned long long len);
+extern long cache_read_direct(struct cache * cache, unsigned long long pos, void * buf, unsigned long long len);
+extern long cache_write_direct(struct cache * cache, unsigned long long pos, const void * buf, unsigned long long len);
+extern void cache_get_stats(struct cache * cache, struct cache_stats * stats);
 // extern void print_cache(struct cache * cache);
 
 #endif // _CACHE_H_
\ No newline at end of file
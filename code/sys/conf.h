@@ -40,8 +40,22 @@
 
 #define TIMER_FREQ 10000000UL // qemu/include/hw/intc/riscv_aclint.h
 
-#define PLIC_SRC_CNT 96 // QEMU VIRT_IRQCHIP_NUM_SOURCES
-#define PLIC_CTX_CNT 2
+// Harts the kernel runs on. Hart 0 boots the kernel and smp_init() starts the
+// others, which wait in M mode (see.s) until then. The kernel itself runs on
+// one hart at a time under the big kernel lock (smp.h), so every hart can run
+// U mode code at once. Keep QEMU's -smp in the Makefile in step; harts it does
+// not have are never started.
+
+#ifndef NHART
+#define NHART 4
+#endif
+
+#if NHART < 1 || NHART > 8
+#error "NHART must be between 1 and 8 (MAX_HARTS in see.s)"
+#endif
+
+#define PLIC_SRC_CNT 96 // QEMU VIRT_IRQCHIP_NUM_SOURCES
+#define PLIC_CTX_CNT (2*NHART) // M and S mode context per hart
 
 #define RTC_MMIO_BASE 0x00101000L
 
@@ -76,12 +90,23 @@
 #define NIRQ PLIC_SRC_CNT
 #endif
 
-// Maximum number of threads
+// Initial size of the thread table, and the size it may grow to at run time
 
 #ifndef NTHR
 #define NTHR 32
 #endif
 
+#ifndef NTHR_MAX
+#define NTHR_MAX (4*NTHR)
+#endif
+
+// Scheduler time slice in milliseconds. A thread running in U mode is
+// preempted once it has had the CPU this long.
+
+#ifndef THREAD_QUANTUM_MS
+#define THREAD_QUANTUM_MS 10
+#endif
+
 // Maximum number of processes
 
 #ifndef NPROC
@@ -113,6 +138,18 @@
 // KERNEL FEATURES
 //
 
-#if 1 // support for passing command-line arguments to exec'd process
+#if 1 // support for passing command-line arguments to exec'd process
 #define WITH_ARGV
 #endif
+
+#if 0 // per-system-call counts and time spent, read with SYSCALL_SCSTAT
+#define SYSCALL_STATS
+#endif
+
+#if 0 // timer-driven pc and backtrace samples, read from the profile device
+#define WITH_PROFILER
+#endif
+
+#if 0 // copy the vioblk image into a ramdisk at boot and mount that; writes are not kept
+#define RAMDISK_BOOT
+#endif
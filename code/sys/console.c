@@ -7,17 +7,61 @@
 #include "assert.h"
 #include "console.h"
 #include "intr.h"
+#include "thread.h"
+#include "device.h"
+#include "ioimpl.h"
+#include "heap.h"
+#include "error.h"
 
 #include <stdarg.h>
 #include <stdint.h>
 
 #include "string.h"
 
-// INTERNAL FUNCTION DECLARATIONS
+// Once console_start_logger() has run, kputc() appends to a ring of
+// CONSOLE_LOG_SIZE bytes and the klog thread drains it to the console device,
+// so callers do not spin on the UART. Writers only ever run with interrupts
+// disabled on the one hart, which is all the ring needs in place of a lock. If
+// the drain falls a full ring behind, the oldest output is dropped.
+
+#ifndef CONSOLE_LOG_SIZE
+#define CONSOLE_LOG_SIZE 16384 // must be power of two
+#endif
+
+#ifndef CONSOLE_LOG_PRIO
+#define CONSOLE_LOG_PRIO (THREAD_PRIO_IDLE - 1)
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct dmesg_io {
+    struct io io;
+    unsigned long pos;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
 // 
 
 static void vprintf_putc(char c, void * aux);
 
+static void console_emit(char c);
+static void console_drain(void);
+static void klog_func(void);
+
+static int dmesg_open(struct io ** ioptr, void * aux);
+static void dmesg_close(struct io * io);
+static long dmesg_read(struct io * io, void * buf, long bufsz);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static char log_buf[CONSOLE_LOG_SIZE];
+static unsigned long log_head; // total bytes written
+static unsigned long log_tail; // total bytes sent to the console device
+static char log_deferred = 0;
+static struct condition log_ready;
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -31,29 +75,59 @@ void console_init(void) {
     console_initialized = 1;
 }
 
+void console_start_logger(void) {
+    int tid;
+
+    condition_init(&log_ready, "log_ready");
+
+    tid = thread_spawn("klog", klog_func);
+    if (tid < 0) {
+        kprintf("klog: thread_spawn failed (%d)\n", tid);
+        return;
+    }
+
+    thread_setprio(tid, CONSOLE_LOG_PRIO);
+    register_device("dmesg", dmesg_open, NULL);
+    log_deferred = 1;
+}
+
+void console_flush(void) {
+    int pie;
+
+    pie = disable_interrupts();
+    log_deferred = 0;
+    console_drain();
+    restore_interrupts(pie);
+}
+
 void kputc(char c) {
-    static char cprev = '\0';
+    int pie;
 
-    switch (c) {
-    case '\r':
-        console_device_putc(c);
-        console_device_putc('\n');
-        break;
-    case '\n':
-        if (cprev != '\r')
-            console_device_putc('\r');
-        // nobreak
-    default:
-        console_device_putc(c);
-        break;
+    if (!log_deferred) {
+        console_emit(c);
+        return;
     }
 
-    cprev = c;
+    pie = disable_interrupts();
+    log_buf[log_head++ & (CONSOLE_LOG_SIZE - 1)] = c;
+    if (c == '\n')
+        condition_broadcast(&log_ready);
+    restore_interrupts(pie);
 }
 
 char kgetc(void) {
     static char cprev = '\0';
     char c;
+    int pie;
+
+    // Nothing else runs while we spin on the device, so send pending output
+    // (such as a prompt or echo) now.
+
+    if (log_deferred) {
+        pie = disable_interrupts();
+        console_drain();
+        restore_interrupts(pie);
+    }
 
     // Convert \r followed by any number of \n to just \n
 
@@ -162,6 +236,122 @@ void vprintf_putc(char c, void * __attribute__ ((unused)) aux) {
     kputc(c);
 }
 
+// Sends _c_ to the console device, translating a bare \n to \r\n.
+
+void console_emit(char c) {
+    static char cprev = '\0';
+
+    switch (c) {
+    case '\r':
+        console_device_putc(c);
+        console_device_putc('\n');
+        break;
+    case '\n':
+        if (cprev != '\r')
+            console_device_putc('\r');
+        // nobreak
+    default:
+        console_device_putc(c);
+        break;
+    }
+
+    cprev = c;
+}
+
+// Sends everything in the log ring not yet sent to the console device. Must be
+// called with interrupts disabled.
+
+void console_drain(void) {
+    if (CONSOLE_LOG_SIZE < log_head - log_tail)
+        log_tail = log_head - CONSOLE_LOG_SIZE;
+
+    while (log_tail != log_head)
+        console_emit(log_buf[log_tail++ & (CONSOLE_LOG_SIZE - 1)]);
+}
+
+// The klog thread copies batches of the ring out with interrupts disabled and
+// sends them to the device with interrupts enabled, so an ISR that logs only
+// waits for the copy, not the UART. The tail only moves once a batch is out,
+// so a panic in the middle of one repeats it rather than losing it.
+
+void klog_func(void) {
+    char burst[64];
+    unsigned long start, cnt, i;
+    int pie;
+
+    for (;;) {
+        pie = disable_interrupts();
+        while (log_deferred && log_tail == log_head)
+            condition_wait(&log_ready);
+
+        if (CONSOLE_LOG_SIZE < log_head - log_tail)
+            log_tail = log_head - CONSOLE_LOG_SIZE;
+
+        cnt = log_head - log_tail;
+        if (sizeof(burst) < cnt)
+            cnt = sizeof(burst);
+        start = log_tail;
+        for (i = 0; i < cnt; i++)
+            burst[i] = log_buf[(start + i) & (CONSOLE_LOG_SIZE - 1)];
+        restore_interrupts(pie);
+
+        for (i = 0; i < cnt; i++)
+            console_emit(burst[i]);
+
+        pie = disable_interrupts();
+        if (log_tail == start)
+            log_tail = start + cnt;
+        restore_interrupts(pie);
+
+        if (cnt == 0)
+            thread_yield(); // console_flush() took over
+    }
+}
+
+// The dmesg device reads back whatever the log ring still holds, starting
+// with the oldest byte, and reports end of file once caught up.
+
+int dmesg_open(struct io ** ioptr, void * __attribute__ ((unused)) aux) {
+    static const struct iointf dmesg_iointf = {
+        .close = &dmesg_close,
+        .read = &dmesg_read
+    };
+
+    struct dmesg_io * dio;
+
+    dio = kcalloc(1, sizeof(struct dmesg_io));
+    if (dio == NULL)
+        return -ENOMEM;
+
+    *ioptr = ioinit1(&dio->io, &dmesg_iointf);
+    return 0;
+}
+
+void dmesg_close(struct io * io) {
+    kfree((void*)io - offsetof(struct dmesg_io, io));
+}
+
+long dmesg_read(struct io * io, void * buf, long bufsz) {
+    struct dmesg_io * const dio = (void*)io - offsetof(struct dmesg_io, io);
+    char * p = buf;
+    long cnt = 0;
+    int pie;
+
+    if (bufsz < 0)
+        return -EINVAL;
+
+    pie = disable_interrupts();
+
+    if (CONSOLE_LOG_SIZE < log_head - dio->pos)
+        dio->pos = log_head - CONSOLE_LOG_SIZE;
+
+    while (cnt < bufsz && dio->pos != log_head)
+        p[cnt++] = log_buf[dio->pos++ & (CONSOLE_LOG_SIZE - 1)];
+
+    restore_interrupts(pie);
+    return cnt;
+}
+
 // DEFAULT CONSOLE FUNCTION DEFINITIONS
 //
 
@@ -15,6 +15,19 @@
 extern char console_initialized;
 
 extern void console_init(void);
+
+// The console_start_logger() function starts the klog thread, after which
+// kputc() only appends to the kernel log ring and the thread sends it to the
+// console device. It also registers the "dmesg" device, which reads back the
+// contents of the ring. Requires the thread manager.
+
+extern void console_start_logger(void);
+
+// The console_flush() function sends any pending log output and makes console
+// output synchronous again. Called before halting, so nothing is lost.
+
+extern void console_flush(void);
+
 extern void kputc(char c);
 extern char kgetc(void);
 extern void kputs(const char * str);
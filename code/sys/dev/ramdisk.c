@@ -0,0 +1,210 @@
+// ramdisk.c - RAM-backed block device
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef RAMDISK_TRACE
+#define TRACE
+#endif
+
+#ifdef RAMDISK_DEBUG
+#define DEBUG
+#endif
+
+#include "conf.h"
+#include "assert.h"
+#include "ramdisk.h"
+#include "device.h"
+#include "ioimpl.h"
+#include "console.h"
+#include "memory.h"
+#include "string.h"
+#include "heap.h"
+#include "error.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reported block size. Transfers of any size work; this is what KTFS and the
+// block cache see from vioblk.
+
+#define RAMDISK_BLKSZ 512
+
+// Bytes copied per request by ramdisk_load()
+
+#define RAMDISK_LOAD_CHUNK (64 * 1024UL)
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct ramdisk_device {
+    struct io io;
+    uint8_t * buf;
+    unsigned long long size;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int ramdisk_open(struct io ** ioptr, void * aux);
+static int ramdisk_cntl(struct io * io, int cmd, void * arg);
+static long ramdisk_readat(struct io * io, unsigned long long pos, void * buf, long bufsz);
+static long ramdisk_writeat(struct io * io, unsigned long long pos, const void * buf, long len);
+
+static long ramdisk_clamp(const struct ramdisk_device * rd, unsigned long long pos, long len);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+// int ramdisk_create(unsigned long long size)
+// Inputs: unsigned long long size - bytes the ramdisk holds
+// Outputs: instance number of the new device, or -ENOMEM
+// Description: Takes a contiguous run of physical pages, zeroes it and registers it under the
+//              "ramdisk" name.
+// Side Effects: Changes the device table and allocates physical pages
+
+int ramdisk_create(unsigned long long size) {
+    static const struct iointf ramdisk_iointf = {
+        .cntl = &ramdisk_cntl,
+        .readat = &ramdisk_readat,
+        .writeat = &ramdisk_writeat
+    };
+
+    struct ramdisk_device * rd;
+    unsigned long long pgcnt;
+
+    pgcnt = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    if (pgcnt == 0 || pgcnt > free_phys_page_count())
+        return -ENOMEM;
+
+    rd = kcalloc(1, sizeof(struct ramdisk_device));
+    rd->buf = alloc_phys_pages(pgcnt);
+    if (rd->buf == NULL) {
+        kfree(rd);
+        return -ENOMEM;
+    }
+
+    rd->size = pgcnt * PAGE_SIZE;
+    memset(rd->buf, 0, rd->size);
+    ioinit0(&rd->io, &ramdisk_iointf);
+
+    return register_device("ramdisk", ramdisk_open, rd);
+}
+
+// int ramdisk_load(struct io * src)
+// Inputs: struct io * src - block device to copy
+// Outputs: instance number of the new device, or a negative error code
+// Description: Creates a ramdisk as large as _src_ and reads _src_ into it a chunk at a time,
+//              straight into the ramdisk's memory.
+// Side Effects: See ramdisk_create()
+
+int ramdisk_load(struct io * src) {
+    struct ramdisk_device * rd;
+    struct io * io;
+    unsigned long long end;
+    unsigned long long pos;
+    long len, cnt;
+    int instno;
+    int result;
+
+    result = ioctl(src, IOCTL_GETEND, &end);
+    if (result < 0)
+        return result;
+
+    instno = ramdisk_create(end);
+    if (instno < 0)
+        return instno;
+
+    result = open_device("ramdisk", instno, &io);
+    if (result < 0)
+        return result;
+
+    rd = (void*)io - offsetof(struct ramdisk_device, io);
+
+    for (pos = 0; pos < end; pos += cnt) {
+        len = (end - pos < RAMDISK_LOAD_CHUNK) ? end - pos : RAMDISK_LOAD_CHUNK;
+        cnt = ioreadat(src, pos, rd->buf + pos, len);
+        if (cnt <= 0) {
+            ioclose(io);
+            return (cnt < 0) ? cnt : -EIO;
+        }
+    }
+
+    debug("ramdisk%d: loaded %llu bytes", instno, end);
+    ioclose(io);
+    return instno;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+int ramdisk_open(struct io ** ioptr, void * aux) {
+    struct ramdisk_device * const rd = aux;
+
+    *ioptr = ioaddref(&rd->io);
+    return 0;
+}
+
+// int ramdisk_cntl(struct io * io, int cmd, void * arg)
+// Inputs: struct io * io - ramdisk io endpoint, int cmd - IOCTL_xxx command, void * arg - argument
+// Outputs: block size for IOCTL_GETBLKSZ, 0 on success, or a negative error code
+// Description: Reports the size, and zeroes ranges for IOCTL_DISCARD and IOCTL_WRITE_ZEROES.
+//              IOCTL_FLUSH has nothing to wait for.
+// Side Effects: May change the ramdisk contents
+
+int ramdisk_cntl(struct io * io, int cmd, void * arg) {
+    struct ramdisk_device * const rd = (void*)io - offsetof(struct ramdisk_device, io);
+    const struct io_range * range = arg;
+
+    switch (cmd) {
+    case IOCTL_GETBLKSZ:
+        return RAMDISK_BLKSZ;
+    case IOCTL_GETEND:
+        if (arg == NULL)
+            return -EINVAL;
+        *(unsigned long long *)arg = rd->size;
+        return 0;
+    case IOCTL_FLUSH:
+        return 0;
+    case IOCTL_DISCARD:
+    case IOCTL_WRITE_ZEROES:
+        if (range == NULL || range->pos > rd->size || range->len > rd->size - range->pos)
+            return -EINVAL;
+        memset(rd->buf + range->pos, 0, range->len);
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+long ramdisk_readat(struct io * io, unsigned long long pos, void * buf, long bufsz) {
+    struct ramdisk_device * const rd = (void*)io - offsetof(struct ramdisk_device, io);
+
+    bufsz = ramdisk_clamp(rd, pos, bufsz);
+    if (bufsz > 0)
+        memcpy(buf, rd->buf + pos, bufsz);
+    return bufsz;
+}
+
+long ramdisk_writeat(struct io * io, unsigned long long pos, const void * buf, long len) {
+    struct ramdisk_device * const rd = (void*)io - offsetof(struct ramdisk_device, io);
+
+    len = ramdisk_clamp(rd, pos, len);
+    if (len > 0)
+        memcpy(rd->buf + pos, buf, len);
+    return len;
+}
+
+// Returns how many of the _len_ bytes at _pos_ lie on the ramdisk, or -EINVAL
+// if _pos_ is past the end or _len_ is negative.
+
+long ramdisk_clamp(const struct ramdisk_device * rd, unsigned long long pos, long len) {
+    if (len < 0 || pos > rd->size)
+        return -EINVAL;
+
+    if (len > rd->size - pos)
+        len = rd->size - pos;
+
+    return len;
+}
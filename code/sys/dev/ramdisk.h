@@ -0,0 +1,23 @@
+// ramdisk.h - RAM-backed block device
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _RAMDISK_H_
+#define _RAMDISK_H_
+
+#include "io.h"
+
+// Creates a zeroed ramdisk of _size_ bytes, rounded up to whole pages, in
+// contiguous physical memory and registers it as a "ramdisk" device. The
+// memory is never freed. Returns the instance number or -ENOMEM.
+
+extern int ramdisk_create(unsigned long long size);
+
+// Creates a ramdisk the size of the block device _src_ and copies _src_ into
+// it. Returns the instance number or a negative error code.
+
+extern int ramdisk_load(struct io * src);
+
+#endif // _RAMDISK_H_
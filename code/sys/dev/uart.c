@@ -31,7 +31,13 @@
 //
 
 #ifndef UART_RBUFSZ
-#define UART_RBUFSZ 64
+#define UART_RBUFSZ 256 // must be power of two
+#endif
+
+// Bytes the 16550 transmit FIFO takes after each THRE interrupt
+
+#ifndef UART_FIFO_DEPTH
+#define UART_FIFO_DEPTH 16
 #endif
 
 #ifndef UART_INTR_PRIO
@@ -79,6 +85,10 @@ struct uart_regs
 #define LSR_THRE (1 << 5)
 #define IER_DRIE (1 << 0)
 #define IER_THREIE (1 << 1)
+#define FCR_FIFOE (1 << 0)  // enable FIFOs
+#define FCR_RXFR (1 << 1)   // reset receive FIFO
+#define FCR_TXFR (1 << 2)   // reset transmit FIFO
+#define FCR_RXTRIG8 (2 << 6) // receive interrupt at 8 bytes (or timeout)
 
 struct ringbuf
 {
@@ -101,7 +111,8 @@ struct uart_device
     struct ringbuf txbuf;
     struct condition uart_read_cond;
     struct condition uart_write_cond;
-    struct lock uart_lock;
+    struct lock uart_rx_lock; // a blocked reader must not hold up writers
+    struct lock uart_tx_lock;
 };
 
 // INTERNAL FUNCTION DEFINITIONS
@@ -111,6 +122,7 @@ static int uart_open(struct io **ioptr, void *aux);
 static void uart_close(struct io *io);
 static long uart_read(struct io *io, void *buf, long bufsz);
 static long uart_write(struct io *io, const void *buf, long len);
+static int uart_poll(struct io *io, int events);
 
 static void uart_isr(int srcno, void *driver_private);
 
@@ -119,6 +131,8 @@ static int rbuf_empty(const struct ringbuf *rbuf);
 static int rbuf_full(const struct ringbuf *rbuf);
 static void rbuf_putc(struct ringbuf *rbuf, char c);
 static char rbuf_getc(struct ringbuf *rbuf);
+static long rbuf_put(struct ringbuf *rbuf, const char *src, long len);
+static long rbuf_get(struct ringbuf *rbuf, char *dst, long len);
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -134,7 +148,8 @@ void uart_attach(void *mmio_base, int irqno)
     static const struct iointf uart_iointf = {
         .close = &uart_close,
         .read = &uart_read,
-        .write = &uart_write};
+        .write = &uart_write,
+        .poll = &uart_poll};
 
     struct uart_device *uart;
 
@@ -159,6 +174,7 @@ void uart_attach(void *mmio_base, int irqno)
         uart->regs->dlm = 0x00;
         // fence o,o ?
         uart->regs->lcr = 0; // DLAB=0
+        uart->regs->fcr = FCR_FIFOE | FCR_RXFR | FCR_TXFR | FCR_RXTRIG8;
 
         uart->instno = register_device(UART_NAME, uart_open, uart);
     }
@@ -177,7 +193,8 @@ int uart_open(struct io **ioptr, void *aux)
     struct uart_device *const uart = aux;
     condition_init(&uart->uart_read_cond, "uartRead");
     condition_init(&uart->uart_write_cond, "uartWrite");
-    lock_init(&uart->uart_lock);
+    lock_init(&uart->uart_rx_lock);
+    lock_init(&uart->uart_tx_lock);
     if (ioptr == NULL || uart == NULL)
     {
         panic("Bad Args for uart_open");
@@ -239,33 +256,28 @@ long uart_read(struct io *io, void *buf, long bufsz)
     struct uart_device *const uart =
         (void *)io - offsetof(struct uart_device, io);
     // FIXME your code goes here
-    if (bufsz > 0) //&& bufsz < UART_RBUFSZ) ??? do I need this
+    if (bufsz > 0)
     {
-        lock_acquire(&uart->uart_lock);
+        lock_acquire(&uart->uart_rx_lock);
         int pie = disable_interrupts();
         while (rbuf_empty(&uart->rxbuf))
         {
-            // continue;
             //  put thread to sleep via condition wait
-            condition_wait(&uart->uart_read_cond);
-        }
-        restore_interrupts(pie);
-        for (long i = 0; i < bufsz; i++)
-        {
-            if (!rbuf_empty(&uart->rxbuf))
+            if (condition_wait_interruptible(&uart->uart_read_cond) != 0)
             {
-                char c = rbuf_getc(&uart->rxbuf);
-                ((char *)(buf))[i] = c;
-                uart->regs->ier |= IER_DRIE;
-            }
-            else
-            {
-                lock_release(&uart->uart_lock);
-                return i;
+                restore_interrupts(pie);
+                lock_release(&uart->uart_rx_lock);
+                return -EINTR;
             }
         }
-        lock_release(&uart->uart_lock);
-        return bufsz;
+
+        // Take everything there in one go and let the ISR refill
+
+        long cnt = rbuf_get(&uart->rxbuf, buf, bufsz);
+        uart->regs->ier |= IER_DRIE;
+        restore_interrupts(pie);
+        lock_release(&uart->uart_rx_lock);
+        return cnt;
     }
     else if (bufsz == 0)
     {
@@ -297,21 +309,27 @@ long uart_write(struct io *io, const void *buf, long len)
         (void *)io - offsetof(struct uart_device, io);
     if (len > 0)
     {
-        lock_acquire(&uart->uart_lock);
-        for (long i = 0; i < len; i++)
+        lock_acquire(&uart->uart_tx_lock);
+        for (long i = 0; i < len;)
         {
             int pie = disable_interrupts();
             while (rbuf_full(&uart->txbuf))
             {
-                // continue;
-                condition_wait(&uart->uart_write_cond);
+                if (condition_wait_interruptible(&uart->uart_write_cond) != 0)
+                {
+                    restore_interrupts(pie);
+                    lock_release(&uart->uart_tx_lock);
+                    return (i > 0) ? i : -EINTR;
+                }
             }
-            restore_interrupts(pie);
-            char c = ((char *)buf)[i];
-            rbuf_putc(&uart->txbuf, c);
+
+            // Copy as much as fits under one interrupt-disable
+
+            i += rbuf_put(&uart->txbuf, (const char *)buf + i, len - i);
             uart->regs->ier |= IER_THREIE;
+            restore_interrupts(pie);
         }
-        lock_release(&uart->uart_lock);
+        lock_release(&uart->uart_tx_lock);
 
         return len;
     }
@@ -332,14 +350,29 @@ void uart_isr(int srcno, void *aux)
     {
         panic("Bad Args for uart_isr");
     }
-    if (((uart->regs->lsr & LSR_DR) == LSR_DR) && !rbuf_full(&uart->rxbuf))
+
+    // Drain the receive FIFO, then wake readers once
+
+    int rcnt = 0;
+    while ((uart->regs->lsr & LSR_DR) && !rbuf_full(&uart->rxbuf))
     {
         rbuf_putc(&uart->rxbuf, uart->regs->rbr);
+        rcnt += 1;
+    }
+    if (rcnt != 0)
+    {
         condition_broadcast(&uart->uart_read_cond);
+        ionotify();
     }
-    if (!rbuf_empty(&uart->txbuf))
+
+    // THRE means the transmit FIFO is empty, so it takes a full burst
+
+    if ((uart->regs->lsr & LSR_THRE) && !rbuf_empty(&uart->txbuf))
     {
-        uart->regs->thr = rbuf_getc(&uart->txbuf);
+        if (rbuf_full(&uart->txbuf))
+            ionotify(); // POLLOUT only changes on leaving full
+        for (int i = 0; i < UART_FIFO_DEPTH && !rbuf_empty(&uart->txbuf); i++)
+            uart->regs->thr = rbuf_getc(&uart->txbuf);
         condition_broadcast(&uart->uart_write_cond);
     }
     if (rbuf_full(&uart->rxbuf))
@@ -352,6 +385,24 @@ void uart_isr(int srcno, void *aux)
     }
 }
 
+// int uart_poll(struct io *io, int events)
+// Inputs: struct io *io - pointer to the io struct of the uart device
+//         int events - POLLIN and POLLOUT events to check
+// Outputs: The events for which a read or write would not block
+// Description: Checks the receive and transmit ring buffers. The ISR calls ionotify() when either changes.
+// Side Effects: None.
+int uart_poll(struct io *io, int events)
+{
+    struct uart_device *const uart = (void *)io - offsetof(struct uart_device, io);
+    int revents = 0;
+
+    if (!rbuf_empty(&uart->rxbuf))
+        revents |= events & POLLIN;
+    if (!rbuf_full(&uart->txbuf))
+        revents |= events & POLLOUT;
+    return revents;
+}
+
 void rbuf_init(struct ringbuf *rbuf)
 {
     rbuf->hpos = 0;
@@ -390,7 +441,47 @@ char rbuf_getc(struct ringbuf *rbuf)
     return c;
 }
 
-// The functions below provide polled uart input and output for the console.
+// Copies up to _len_ bytes into the ring and returns the number copied.
+// Called with interrupts disabled.
+
+long rbuf_put(struct ringbuf *rbuf, const char *src, long len)
+{
+    const unsigned int tpos = rbuf->tpos;
+    long cnt = UART_RBUFSZ - (tpos - rbuf->hpos);
+    long i;
+
+    if (len < cnt)
+        cnt = len;
+
+    for (i = 0; i < cnt; i++)
+        rbuf->data[(tpos + i) % UART_RBUFSZ] = src[i];
+
+    asm volatile("" ::: "memory");
+    rbuf->tpos = tpos + cnt;
+    return cnt;
+}
+
+// Copies up to _len_ bytes out of the ring and returns the number copied.
+// Called with interrupts disabled.
+
+long rbuf_get(struct ringbuf *rbuf, char *dst, long len)
+{
+    const unsigned int hpos = rbuf->hpos;
+    long cnt = rbuf->tpos - hpos;
+    long i;
+
+    if (len < cnt)
+        cnt = len;
+
+    for (i = 0; i < cnt; i++)
+        dst[i] = rbuf->data[(hpos + i) % UART_RBUFSZ];
+
+    asm volatile("" ::: "memory");
+    rbuf->hpos = hpos + cnt;
+    return cnt;
+}
+
+// The functions below provide polled uart input and output for the console.
 
 #define UART0 (*(volatile struct uart_regs *)UART0_MMIO_BASE)
 
@@ -25,6 +25,8 @@
 #include "io.h"
 #include "conf.h"
 #include "error.h"
+#include "memory.h"
+#include "tracepoint.h"
 #include <limits.h>
 
 // COMPILE-TIME PARAMETERS
@@ -38,10 +40,50 @@
 #define VIOBLK_NAME "vioblk"
 #endif
 
-// INTERNAL CONSTANT DEFINITIONS
+// Largest transfer issued as a single virtio request. Larger reads and writes
+// are split into requests of this size. Must be a multiple of PAGE_SIZE.
+
+#ifndef VIOBLK_MAX_REQSZ
+#define VIOBLK_MAX_REQSZ (16 * 1024UL)
+#endif
+
+// Depth of the request virtqueue, i.e. the number of requests that may be in
+// flight at once. Must be a power of two; reduced to the device's maximum.
+
+#ifndef VIOBLK_QLEN
+#define VIOBLK_QLEN 64
+#endif
+
+// Number of bounce buffers (each VIOBLK_MAX_REQSZ bytes). Only transfers to or
+// from memory outside kernel RAM need one; each such call holds one throughout.
+
+#ifndef VIOBLK_BOUNCE_CNT
+#define VIOBLK_BOUNCE_CNT 4
+#endif
+
+// Maximum number of requests a single read or write call keeps in flight when
+// transferring directly to or from the caller's buffer.
+
+#ifndef VIOBLK_PIPELINE
+#define VIOBLK_PIPELINE 8
+#endif
+
+// How long vioblk_complete() spins for a request of at most VIOBLK_POLL_MAX
+// bytes before sleeping on the interrupt. Small requests often complete in
+// less time than the interrupt round trip takes. Set to 0 to disable polling.
+
+#ifndef VIOBLK_POLL_US
+#define VIOBLK_POLL_US 20
+#endif
+
+#ifndef VIOBLK_POLL_MAX
+#define VIOBLK_POLL_MAX 4096
+#endif
+
+// INTERNAL CONSTANT DEFINITIONS
 //
 
-// VirtIO block device feature bits (number, *not* mask)
+// VirtIO block device feature bits (number, *not* mask)
 
 #define VIRTIO_BLK_F_SIZE_MAX 1
 #define VIRTIO_BLK_F_SEG_MAX 2
@@ -54,16 +96,87 @@
 #define VIRTIO_BLK_F_MQ 12
 #define VIRTIO_BLK_F_DISCARD 13
 #define VIRTIO_BLK_F_WRITE_ZEROES 14
-#define VIOBLK_BLKSZ 512UL
-#define NUM_DESCRIPTORS 4
-#define VQ_SIZE 1
+#define VIOBLK_SECTOR_SIZE 512UL // virtio sector numbers are always in 512-byte units
+#define NUM_DESCRIPTORS 3        // per-request indirect table: header, data, status
 
 #define VIRTIO_BLK_T_IN 0
 #define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_DISCARD 11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP 1
 #define VIRTIO_BLK_S_OK 0
 #define VIRTIO_BLK_S_IOERR 1
 #define VIRTIO_BLK_S_UNSUPP 2
 
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct header
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+// Data of a VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES request. We
+// always send a single segment.
+
+struct vioblk_range_seg
+{
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+// A request slot. Slot i is always submitted through descriptor i of the
+// virtqueue, which points at the slot's own indirect table, so the id in a
+// used ring element identifies the completed request directly.
+
+struct vioblk_req
+{
+    struct header header;
+    struct virtq_desc desc[NUM_DESCRIPTORS];
+    volatile uint8_t status;
+    volatile int done;          // set by vioblk_isr() when the device returns the slot
+    struct condition completed; // signalled when done is set
+    int next_free;              // next slot on the free list, -1 ends the list
+};
+
+struct vioblk_device
+{
+    volatile struct virtio_mmio_regs *regs;
+    int irqno;
+    int instno;
+    struct io io;
+
+    struct
+    {
+        uint16_t len;
+        uint16_t last_used_idx;
+        struct virtq_desc *desc; // one VIRTQ_DESC_F_INDIRECT descriptor per slot
+        volatile struct virtq_used *used;
+        struct virtq_avail *avail;
+    } vq;
+
+    struct vioblk_req *reqs; // vq.len request slots
+    int free_head;           // first free slot, -1 if all are in flight
+    struct condition slot_released;
+
+    uint8_t *bounce[VIOBLK_BOUNCE_CNT]; // each physically contiguous
+    unsigned int bounce_free;           // bitmask of available bounce buffers
+    struct condition bounce_released;
+
+    uint32_t blksz;          // device block size
+    unsigned long max_reqsz; // largest single request in bytes
+    unsigned long long end;  // device size in bytes
+    int can_flush;           // VIRTIO_BLK_F_FLUSH negotiated
+    uint32_t max_discard;    // sectors per discard request, 0 if unsupported
+    uint32_t max_zeroes;     // sectors per write-zeroes request, 0 if unsupported
+    uint32_t zeroes_flags;   // flags for write-zeroes requests
+    int event_idx;           // VIRTIO_F_EVENT_IDX negotiated
+};
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -86,83 +199,97 @@ static int vioblk_cntl(
     struct io *io, int cmd, void *arg);
 
 static void vioblk_isr(int srcno, void *aux);
+static void vioblk_reap(struct vioblk_device *vioblk);
 
-// EXPORTED FUNCTION DEFINITIONS
-//
+static long vioblk_transfer(
+    struct vioblk_device *vioblk,
+    uint32_t type,
+    unsigned long long pos,
+    void *buf,
+    long len);
 
-// Attaches a VirtIO block device. Declared and called directly from virtio.c.
-// vioblk device struct for MMIO comunication
-struct header
-{
-    uint32_t type;
-    uint32_t reserved;
-    uint64_t sector;
-};
-struct vioblk_device
-{
-    volatile struct virtio_mmio_regs *regs;
-    int irqno;
-    int instno;
-    struct io io;
+static long vioblk_transfer_direct(
+    struct vioblk_device *vioblk,
+    uint32_t type,
+    unsigned long long pos,
+    void *buf,
+    unsigned long long len);
 
-    struct condition vioblk_buffer_condition;
-    struct lock vioblk_lock;
-    struct
-    {
-        uint16_t last_used_idx;
+static long vioblk_transfer_bounce(
+    struct vioblk_device *vioblk,
+    uint32_t type,
+    unsigned long long pos,
+    void *buf,
+    unsigned long long len);
 
-        union
-        {
-            struct virtq_avail avail;
-            char _avail_filler[VIRTQ_AVAIL_SIZE(1)];
-        };
+static struct vioblk_req *vioblk_submit(
+    struct vioblk_device *vioblk,
+    uint32_t type,
+    unsigned long long pos,
+    void *buf,
+    unsigned long len,
+    int wait);
 
-        union
-        {
-            volatile struct virtq_used used;
-            char _used_filler[VIRTQ_USED_SIZE(1)];
-        };
+static int vioblk_complete(
+    struct vioblk_device *vioblk,
+    struct vioblk_req *req);
 
-        //  The first descriptor is a regular descriptor and is the one used in
-        //  the avail and used rings.
+static int vioblk_flush(struct vioblk_device *vioblk);
 
-        struct virtq_desc desc[NUM_DESCRIPTORS]; // Do we need to change the ammount of descriptors here?
-                                                 // is it supposed to be num queues defined in thd config?
-    } vq;
+static int vioblk_range_op(
+    struct vioblk_device *vioblk,
+    uint32_t type,
+    const struct io_range *range);
+
+static uint8_t *vioblk_get_bounce(struct vioblk_device *vioblk);
+static void vioblk_put_bounce(struct vioblk_device *vioblk, uint8_t *buf);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
 
-    struct header header;
-    uint8_t data[VIOBLK_BLKSZ];
-    uint8_t status;
-};
 // void vioblk_attach(volatile struct virtio_mmio_regs *regs, int irqno)
 // Inputs: volatile struct virtio_mmio_regs *regs - volatile pointer to the mmio vioblk registers
 //         int irqno - interupt request number
 // Outputs: None
-// Description: Regesters the vioblk device, attaches the io interface, and sets the descriptor for vioblk.
-// Side Effects: Allocates vioblk_device struct instance vioblk.
+// Description: Regesters the vioblk device, attaches the io interface, and sets up the
+//              request virtqueue. Declared and called directly from virtio.c.
+// Side Effects: Allocates vioblk_device struct instance vioblk and its rings.
 void vioblk_attach(volatile struct virtio_mmio_regs *regs, int irqno)
 {
 
-    // Negotiate features. We need:
+    // Negotiate features. We need:
     //  - VIRTIO_F_RING_RESET and
     //  - VIRTIO_F_INDIRECT_DESC
     // We want:
-    //  - VIRTIO_BLK_F_BLK_SIZE and
-    //  - VIRTIO_BLK_F_TOPOLOGY.
-
-    // Step 3,  Signal device that we found a driver
+    //  - VIRTIO_BLK_F_BLK_SIZE,
+    //  - VIRTIO_BLK_F_TOPOLOGY,
+    //  - VIRTIO_BLK_F_SIZE_MAX,
+    //  - VIRTIO_BLK_F_FLUSH,
+    //  - VIRTIO_BLK_F_DISCARD and
+    //  - VIRTIO_BLK_F_WRITE_ZEROES.
+
+    // Step 3, Signal device that we found a driver
     regs->status |= VIRTIO_STAT_DRIVER;
 
     // Steps 4-6, Feature Negotiation
     virtio_featset_t enabled_features, wanted_features, needed_features;
     int result;
     uint32_t blksz;
+    uint32_t qmax;
+    unsigned long ringsz;
+    void *ring;
+    int i;
     virtio_featset_init(needed_features);
     virtio_featset_add(needed_features, VIRTIO_F_RING_RESET);
     virtio_featset_add(needed_features, VIRTIO_F_INDIRECT_DESC);
     virtio_featset_init(wanted_features);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SIZE_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_FLUSH);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_DISCARD);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_WRITE_ZEROES);
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
     result = virtio_negotiate_features(regs,
                                        enabled_features, wanted_features, needed_features);
 
@@ -172,18 +299,16 @@ void vioblk_attach(volatile struct virtio_mmio_regs *regs, int irqno)
         return;
     }
 
-    // If the device provides a block size, use it. Otherwise, use 512.
+    // If the device provides a block size, use it. Otherwise, use 512.
 
     if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_BLK_SIZE))
         blksz = regs->config.blk.blk_size;
     else
         blksz = 512;
 
-    // blksz must be a power of two
+    // blksz must be a power of two
     assert(((blksz - 1) & blksz) == 0);
 
-    // FIX ME
-
     // Step 7, Device specific Set-up
     static const struct iointf vioblk_iointf = {
         .close = &vioblk_close,
@@ -195,52 +320,106 @@ void vioblk_attach(volatile struct virtio_mmio_regs *regs, int irqno)
     struct vioblk_device *vioblk = kcalloc(1, sizeof(struct vioblk_device));
     vioblk->regs = regs;
     vioblk->irqno = irqno;
+    vioblk->blksz = blksz;
+    vioblk->end = regs->config.blk.capacity * VIOBLK_SECTOR_SIZE;
+    vioblk->can_flush = virtio_featset_test(enabled_features, VIRTIO_BLK_F_FLUSH);
+    vioblk->event_idx = virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX);
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_DISCARD))
+        vioblk->max_discard = regs->config.blk.max_discard_sectors;
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_WRITE_ZEROES))
+    {
+        vioblk->max_zeroes = regs->config.blk.max_write_zeroes_sectors;
+        if (regs->config.blk.write_zeroes_may_unmap)
+            vioblk->zeroes_flags = VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP;
+    }
     ioinit0(&vioblk->io, &vioblk_iointf);
+    condition_init(&vioblk->slot_released, "vioblk slot_released");
+    condition_init(&vioblk->bounce_released, "vioblk bounce_released");
 
-    // Regester and init descriptors
-    // TODO FIX!
-    // Set up the indirect discriptors
-    vioblk->instno = register_device(VIOBLK_NAME, vioblk_open, vioblk);
+    // A request moves up to max_reqsz bytes through one data descriptor. The
+    // device may limit the size of a single segment.
+
+    vioblk->max_reqsz = VIOBLK_MAX_REQSZ;
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SIZE_MAX) &&
+        regs->config.blk.size_max < vioblk->max_reqsz)
+    {
+        vioblk->max_reqsz = regs->config.blk.size_max & ~(unsigned long)(blksz - 1);
+    }
 
-    // Descriptor 0 - inderect
-    vioblk->vq.desc[0].addr = (uint64_t)&vioblk->vq.desc[1];
-    vioblk->vq.desc[0].len = 3 * sizeof(struct virtq_desc);
-    vioblk->vq.desc[0].flags = VIRTQ_DESC_F_INDIRECT;
-    vioblk->vq.desc[0].next = -1;
+    if (vioblk->max_reqsz < blksz)
+        vioblk->max_reqsz = blksz;
 
-    // descriptor 1 - header
+    for (i = 0; i < VIOBLK_BOUNCE_CNT; i++)
+        vioblk->bounce[i] = alloc_phys_pages(VIOBLK_MAX_REQSZ / PAGE_SIZE);
+    vioblk->bounce_free = (1U << VIOBLK_BOUNCE_CNT) - 1;
 
-    vioblk->vq.desc[1].addr = (uint64_t)&vioblk->header;
-    vioblk->vq.desc[1].len = sizeof(struct header);
-    vioblk->vq.desc[1].flags = VIRTQ_DESC_F_NEXT;
-    vioblk->vq.desc[1].next = 1;
+    // Size the virtqueue: VIOBLK_QLEN, halved until the device accepts it.
+
+    regs->queue_sel = 0;
+    __sync_synchronize();
+    qmax = regs->queue_num_max;
 
-    // descriptor 2 - data
+    vioblk->vq.len = VIOBLK_QLEN;
+    while (vioblk->vq.len > qmax && vioblk->vq.len > 1)
+        vioblk->vq.len /= 2;
+
+    // The descriptor table, used ring and avail ring share one page-aligned
+    // allocation, laid out in that order to satisfy their alignment rules.
+
+    ringsz = vioblk->vq.len * sizeof(struct virtq_desc) +
+             VIRTQ_USED_SIZE(vioblk->vq.len) + VIRTQ_AVAIL_SIZE(vioblk->vq.len);
+    ring = alloc_phys_pages((ringsz + PAGE_SIZE - 1) / PAGE_SIZE);
+    memset(ring, 0, ringsz);
+
+    vioblk->vq.desc = ring;
+    vioblk->vq.used = (void *)(vioblk->vq.desc + vioblk->vq.len);
+    vioblk->vq.avail = (void *)((char *)vioblk->vq.used + VIRTQ_USED_SIZE(vioblk->vq.len));
+
+    // Each slot's indirect table is header -> data -> status. Only the data
+    // descriptor changes from one request to the next.
+
+    vioblk->reqs = kcalloc(vioblk->vq.len, sizeof(struct vioblk_req));
+
+    for (i = 0; i < vioblk->vq.len; i++)
+    {
+        struct vioblk_req *const req = &vioblk->reqs[i];
 
-    vioblk->vq.desc[2].addr = (uint64_t)&vioblk->data;
-    vioblk->vq.desc[2].len = sizeof(vioblk->data);
-    vioblk->vq.desc[2].flags = VIRTQ_DESC_F_NEXT;
-    vioblk->vq.desc[2].next = 2;
+        req->desc[0].addr = (uint64_t)&req->header;
+        req->desc[0].len = sizeof(struct header);
+        req->desc[0].flags = VIRTQ_DESC_F_NEXT;
+        req->desc[0].next = 1;
 
-    // descriptor 3 - status
+        req->desc[1].flags = VIRTQ_DESC_F_NEXT;
+        req->desc[1].next = 2;
 
-    vioblk->vq.desc[3].addr = (uint64_t)&vioblk->status;
-    vioblk->vq.desc[3].len = sizeof(vioblk->status);
-    vioblk->vq.desc[3].flags = VIRTQ_DESC_F_WRITE;
-    vioblk->vq.desc[3].next = -1;
+        req->desc[2].addr = (uint64_t)&req->status;
+        req->desc[2].len = sizeof(req->status);
+        req->desc[2].flags = VIRTQ_DESC_F_WRITE;
+        req->desc[2].next = -1;
 
-    // Desc 4 - end
-    // vioblk->vq.desc[0].addr = 0;
-    // vioblk->vq.desc[0].len = 0;
-    // vioblk->vq.desc[0].flags = VIRTQ_DESC_F_INDIRECT;
-    // vioblk->vq.desc[0].next = -1;
+        vioblk->vq.desc[i].addr = (uint64_t)req->desc;
+        vioblk->vq.desc[i].len = sizeof(req->desc);
+        vioblk->vq.desc[i].flags = VIRTQ_DESC_F_INDIRECT;
+        vioblk->vq.desc[i].next = -1;
+
+        condition_init(&req->completed, "vioblk completed");
+        req->next_free = (i + 1 < vioblk->vq.len) ? i + 1 : -1;
+    }
+
+    vioblk->free_head = 0;
+
+    vioblk->instno = register_device(VIOBLK_NAME, vioblk_open, vioblk);
 
     // Attach
-    virtio_attach_virtq(regs, 0, 1, (uint64_t)&vioblk->vq.desc[0], (uint64_t)&vioblk->vq.used, (uint64_t)&vioblk->vq.avail); // attaches the avail and used structs togethe
+    virtio_attach_virtq(regs, 0, vioblk->vq.len, (uint64_t)vioblk->vq.desc,
+                        (uint64_t)vioblk->vq.used, (uint64_t)vioblk->vq.avail);
 
     // Step 8, Device is now live.
     regs->status |= VIRTIO_STAT_DRIVER_OK;
-    //  fence o,oi
+    //  fence o,oi
     __sync_synchronize();
 }
 
@@ -248,7 +427,7 @@ void vioblk_attach(volatile struct virtio_mmio_regs *regs, int irqno)
 // Inputs: struct io **ioptr - contains pointer to the referance of the vioblk io struct (for a given vioblk instance)
 //         void *aux - contains a pointer to the vioblk Device struct
 // Outputs: 0 if succesful
-// Description: Associates io reference with the vioblk device, initialize virt queues, and enable vioblk intr source
+// Description: Associates io reference with the vioblk device, enables the virtqueue and the vioblk intr source
 // Side Effects: Modifies ioref count
 static int vioblk_open(struct io **ioptr, void *aux)
 {
@@ -259,11 +438,9 @@ static int vioblk_open(struct io **ioptr, void *aux)
     }
     struct vioblk_device *vioblk = aux;
     // Enable virtqueue, interupts, and set io refereance
-    condition_init(&vioblk->vioblk_buffer_condition, "voiblk buffer_cond");
     virtio_enable_virtq(vioblk->regs, 0);
     enable_intr_source(vioblk->irqno, VIOBLK_INTR_PRIO, vioblk_isr, aux);
     *ioptr = ioaddref(&vioblk->io);
-    lock_init(&vioblk->vioblk_lock);
     return 0;
 }
 
@@ -279,179 +456,435 @@ static int vioblk_cntl(struct io *io, int cmd, void *arg)
 {
     trace("%s()", __func__);
     struct vioblk_device *vioblk = (void *)io - offsetof(struct vioblk_device, io);
-    if (arg == NULL)
-    {
-        return -EINVAL;
-    }
     unsigned long long *ullarg = arg;
 
     switch (cmd)
     {
     case IOCTL_GETBLKSZ: //
-        size_t msize = vioblk->regs->config.blk.blk_size;
-        return msize;
+        return vioblk->blksz;
     case IOCTL_GETEND:
-        *ullarg = vioblk->regs->config.blk.capacity * vioblk->regs->config.blk.blk_size;
+        if (ullarg == NULL)
+            return -EINVAL;
+        *ullarg = vioblk->end;
         return 0;
+    case IOCTL_FLUSH:
+        return vioblk_flush(vioblk);
+    case IOCTL_DISCARD:
+        if (arg == NULL)
+            return -EINVAL;
+        return vioblk_range_op(vioblk, VIRTIO_BLK_T_DISCARD, arg);
+    case IOCTL_WRITE_ZEROES:
+        if (arg == NULL)
+            return -EINVAL;
+        return vioblk_range_op(vioblk, VIRTIO_BLK_T_WRITE_ZEROES, arg);
     default:
         return -ENOTSUP;
     }
 }
 
+// long vioblk_readat(struct io *io, unsigned long long pos, void *buf, long bufsz)
+// Inputs: struct io *io - vioblk io endpoint
+//         unsigned long long pos - device offset to read from (multiple of the block size)
+//         void *buf - destination buffer, long bufsz - number of bytes to read
+// Outputs: number of bytes read, or a negative error code
+// Description: Reads whole blocks from the device. See vioblk_transfer().
+// Side Effects: None
 static long vioblk_readat(struct io *io, unsigned long long pos, void *buf, long bufsz)
+{
+    struct vioblk_device *vioblk = (void *)io - offsetof(struct vioblk_device, io);
+    long result;
+
+    result = vioblk_transfer(vioblk, VIRTIO_BLK_T_IN, pos, buf, bufsz);
+    tracepoint(TRACEPOINT_VIOBLK, TRACEPOINT_VIOBLK_READ, pos, result);
+    return result;
+}
+
+// long vioblk_writeat(struct io *io, unsigned long long pos, const void *buf, long len)
+// Inputs: struct io *io - vioblk io endpoint
+//         unsigned long long pos - device offset to write to (multiple of the block size)
+//         const void *buf - source buffer, long len - number of bytes to write
+// Outputs: number of bytes written, or a negative error code
+// Description: Writes whole blocks to the device. See vioblk_transfer().
+// Side Effects: None
+static long vioblk_writeat(struct io *io, unsigned long long pos, const void *buf, long len)
 {
     trace("%s()", __func__);
-    // kprintf("\nVIOREAD CALLED");
     struct vioblk_device *vioblk = (void *)io - offsetof(struct vioblk_device, io);
-    unsigned long long byteread = 0;
-    uint32_t blkSize = vioblk->regs->config.blk.blk_size;
-    unsigned long long end = vioblk->regs->config.blk.capacity * vioblk->regs->config.blk.blk_size;
+    return vioblk_transfer(vioblk, VIRTIO_BLK_T_OUT, pos, (void *)buf, len);
+}
 
-    if (pos == end)
-    {
-        return 0;
-    }
+// void vioblk_isr(int srcno, void *aux)
+// Inputs: int srcno - interrupt source, void *aux - vioblk device
+// Outputs: None
+// Description: Completes every request the device has returned through the used ring,
+//              then re-arms the interrupt. With VIRTIO_F_EVENT_IDX the device interrupts
+//              only once per batch of completions instead of once per request.
+// Side Effects: Advances vq.last_used_idx
+static void vioblk_isr(int srcno, void *aux)
+{
+    trace("%s()", __func__);
+    struct vioblk_device *const vioblk = aux; // sets blk device to aux
+
+    vioblk->regs->interrupt_ack = vioblk->regs->interrupt_status;
+    __sync_synchronize();
 
-    if (buf == NULL)
+    do
+        vioblk_reap(vioblk);
+    while (virtio_arm_used(vioblk->vq.avail, vioblk->vq.used, vioblk->vq.len,
+                           vioblk->event_idx, vioblk->vq.last_used_idx));
+}
+
+// void vioblk_reap(struct vioblk_device *vioblk)
+// Inputs: vioblk - device
+// Outputs: None
+// Description: Marks every request in the used ring since vq.last_used_idx done and
+//              wakes the thread waiting on each one. Must be called with interrupts
+//              disabled.
+// Side Effects: Advances vq.last_used_idx
+static void vioblk_reap(struct vioblk_device *vioblk)
+{
+    struct vioblk_req *req;
+    uint32_t id;
+
+    while (vioblk->vq.last_used_idx != vioblk->vq.used->idx)
     {
-        return -EINVAL;
+        id = vioblk->vq.used->ring[vioblk->vq.last_used_idx % vioblk->vq.len].id;
+        vioblk->vq.last_used_idx++;
+
+        if (id >= vioblk->vq.len)
+            continue; // device bug; nothing to complete
+
+        req = &vioblk->reqs[id];
+        req->done = 1;
+        condition_broadcast(&req->completed);
     }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
 
-    if (pos > end)
+// long vioblk_transfer(struct vioblk_device *vioblk, uint32_t type,
+//                      unsigned long long pos, void *buf, long len)
+// Inputs: vioblk - device, type - VIRTIO_BLK_T_IN or VIRTIO_BLK_T_OUT,
+//         pos - device offset (multiple of the block size), buf, len - caller's buffer
+// Outputs: number of bytes transferred, or a negative error code
+// Description: Clips the transfer to the end of the device and to whole blocks. Kernel
+//              memory is identity-mapped and therefore physically contiguous, so a buffer
+//              that lies entirely in RAM is handed to the device as is. Anything else (e.g.
+//              a user buffer) is staged through a bounce buffer.
+// Side Effects: None
+static long vioblk_transfer(
+    struct vioblk_device *vioblk, uint32_t type, unsigned long long pos, void *buf, long len)
+{
+    unsigned long long total;
+
+    if (buf == NULL || len < 0 || pos > vioblk->end || (pos & (vioblk->blksz - 1)) != 0)
     {
         return -EINVAL;
     }
 
-    if (bufsz < 0)
-    { // check to make sure busz is not negative
-        return -EINVAL;
-    }
+    total = (pos + len > vioblk->end) ? vioblk->end - pos : (unsigned long long)len;
+    total &= ~(unsigned long long)(vioblk->blksz - 1);
 
-    if (bufsz == 0)
-    { // if bufsz is 0, return 0
+    if (total == 0)
         return 0;
-    }
-    vioblk->vq.desc[2].flags |= VIRTQ_DESC_F_WRITE; // FLAG FOR READ?
-    vioblk->header.type = VIRTIO_BLK_T_IN;
-    vioblk->header.sector = pos / blkSize;
 
-    byteread = pos + bufsz > end ? end - pos : bufsz;
+    if (RAM_START <= buf && (char *)buf + total <= (char *)RAM_END)
+        return vioblk_transfer_direct(vioblk, type, pos, buf, total);
+    else
+        return vioblk_transfer_bounce(vioblk, type, pos, buf, total);
+}
+
+// Splits the transfer into max_reqsz requests and keeps up to VIOBLK_PIPELINE of
+// them in flight, DMAing straight to or from _buf_. Only the first submission may
+// wait for a free slot; a call never waits for a slot while holding others.
 
-    int numBlocks = byteread / blkSize;
-    lock_acquire(&vioblk->vioblk_lock);
-    for (int i = 0; i < numBlocks; i++)
+static long vioblk_transfer_direct(
+    struct vioblk_device *vioblk, uint32_t type, unsigned long long pos, void *buf, unsigned long long len)
+{
+    struct vioblk_req *inflight[VIOBLK_PIPELINE];
+    unsigned long inlen[VIOBLK_PIPELINE];
+    unsigned long long submitted = 0;
+    unsigned long long done = 0;
+    int first = 0;
+    int cnt = 0;
+    int result = 0;
+    int r;
+    unsigned long n;
+    struct vioblk_req *req;
+
+    while (done < len)
     {
-        vioblk->header.sector = (pos / blkSize) + i;
-        vioblk->vq.avail.ring[vioblk->vq.avail.idx % VQ_SIZE] = 0;
-        __sync_synchronize();
-        vioblk->vq.avail.idx++;
-        __sync_synchronize();
-        virtio_notify_avail(vioblk->regs, 0);
-
-        int pie = disable_interrupts();
-        while (vioblk->vq.avail.idx != vioblk->vq.used.idx)
-        { // ensures that the device does not overwrite or reprocess buffers
-            condition_wait(&vioblk->vioblk_buffer_condition);
-        }
-        restore_interrupts(pie);
-
-        if (vioblk->status & VIRTIO_BLK_S_IOERR)
+        while (result == 0 && submitted < len && cnt < VIOBLK_PIPELINE)
         {
-            lock_release(&vioblk->vioblk_lock);
-            return -EIO;
-        }
-        if (vioblk->status & VIRTIO_BLK_S_UNSUPP)
-        {
-            lock_release(&vioblk->vioblk_lock);
-            return -ENOTSUP;
+            n = (len - submitted < vioblk->max_reqsz) ? len - submitted : vioblk->max_reqsz;
+            req = vioblk_submit(vioblk, type, pos + submitted, (char *)buf + submitted, n, cnt == 0);
+
+            if (req == NULL)
+                break;
+
+            inflight[(first + cnt) % VIOBLK_PIPELINE] = req;
+            inlen[(first + cnt) % VIOBLK_PIPELINE] = n;
+            submitted += n;
+            cnt++;
         }
-        memcpy((((char *)buf) + (i * blkSize)), vioblk->data, blkSize);
+
+        if (cnt == 0)
+            break;
+
+        r = vioblk_complete(vioblk, inflight[first]);
+
+        if (r < 0 && result == 0)
+            result = r;
+        else if (result == 0)
+            done += inlen[first];
+
+        first = (first + 1) % VIOBLK_PIPELINE;
+        cnt--;
     }
 
-    lock_release(&vioblk->vioblk_lock);
-    return byteread;
+    return (result < 0) ? result : (long)done;
 }
 
-static long vioblk_writeat(struct io *io, unsigned long long pos, const void *buf, long len)
+// Moves the transfer one request at a time through a bounce buffer.
+
+static long vioblk_transfer_bounce(
+    struct vioblk_device *vioblk, uint32_t type, unsigned long long pos, void *buf, unsigned long long len)
 {
-    trace("%s()", __func__);
-    if (buf == NULL)
+    unsigned long long done = 0;
+    struct vioblk_req *req;
+    uint8_t *bounce;
+    unsigned long n;
+    int result = 0;
+
+    bounce = vioblk_get_bounce(vioblk);
+
+    while (done < len)
     {
-        return -EINVAL;
+        n = (len - done < vioblk->max_reqsz) ? len - done : vioblk->max_reqsz;
+
+        if (type == VIRTIO_BLK_T_OUT)
+            memcpy(bounce, (char *)buf + done, n);
+
+        req = vioblk_submit(vioblk, type, pos + done, bounce, n, 1);
+        result = vioblk_complete(vioblk, req);
+
+        if (result < 0)
+            break;
+
+        if (type == VIRTIO_BLK_T_IN)
+            memcpy((char *)buf + done, bounce, n);
+
+        done += n;
     }
 
-    struct vioblk_device *vioblk = (void *)io - offsetof(struct vioblk_device, io);
-    long bytewritten = 0;
-    uint32_t blkSize = vioblk->regs->config.blk.blk_size;
-    unsigned long long end = vioblk->regs->config.blk.capacity * vioblk->regs->config.blk.blk_size;
-    if (pos == end)
+    vioblk_put_bounce(vioblk, bounce);
+    return (result < 0) ? result : (long)done;
+}
+
+// struct vioblk_req *vioblk_submit(struct vioblk_device *vioblk, uint32_t type,
+//                                  unsigned long long pos, void *buf, unsigned long len, int wait)
+// Inputs: vioblk - device, type - request type (VIRTIO_BLK_T_*),
+//         pos - device byte offset, buf - physically contiguous data buffer,
+//         len - transfer size (at most max_reqsz), wait - wait for a free slot if none
+// Outputs: request token to pass to vioblk_complete(), or NULL if _wait_ is zero and
+//          every slot is in flight
+// Description: Takes a free request slot, fills in its indirect table and places it on
+//              the avail ring. Does not wait for the device; the caller may submit
+//              further requests before completing this one.
+// Side Effects: Notifies the device
+static struct vioblk_req *vioblk_submit(
+    struct vioblk_device *vioblk, uint32_t type, unsigned long long pos, void *buf, unsigned long len, int wait)
+{
+    struct vioblk_req *req;
+    uint16_t old_idx;
+    int id;
+    int pie;
+
+    pie = disable_interrupts();
+    while (vioblk->free_head < 0)
     {
-        return 0;
+        if (!wait)
+        {
+            restore_interrupts(pie);
+            return NULL;
+        }
+        condition_wait(&vioblk->slot_released);
     }
+    id = vioblk->free_head;
+    req = &vioblk->reqs[id];
+    vioblk->free_head = req->next_free;
+    restore_interrupts(pie);
+
+    req->header.type = type;
+    req->header.reserved = 0;
+    req->header.sector = pos / VIOBLK_SECTOR_SIZE;
+    req->status = VIRTIO_BLK_S_IOERR;
+    req->done = 0;
+
+    req->desc[1].addr = (uint64_t)buf;
+    req->desc[1].len = len;
+    req->desc[0].next = (len != 0) ? 1 : 2; // requests without data skip desc[1]
+
+    if (type == VIRTIO_BLK_T_IN)
+        req->desc[1].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE; // device writes the buffer
+    else
+        req->desc[1].flags = VIRTQ_DESC_F_NEXT;
+
+    pie = disable_interrupts();
+    old_idx = vioblk->vq.avail->idx;
+    vioblk->vq.avail->ring[old_idx % vioblk->vq.len] = id;
+    __sync_synchronize();
+    vioblk->vq.avail->idx = old_idx + 1;
+    __sync_synchronize();
+    virtio_kick(vioblk->regs, 0, vioblk->event_idx,
+                vioblk->vq.used, vioblk->vq.len, old_idx, old_idx + 1);
+    restore_interrupts(pie);
+    return req;
+}
 
-    if (pos > end)
+// int vioblk_complete(struct vioblk_device *vioblk, struct vioblk_req *req)
+// Inputs: vioblk - device, req - token returned by vioblk_submit()
+// Outputs: 0 on success, -EIO or -ENOTSUP if the device reports an error
+// Description: Waits for the request to complete and returns its slot to the free list.
+// Side Effects: None
+static int vioblk_complete(struct vioblk_device *vioblk, struct vioblk_req *req)
+{
+    int result;
+    int pie;
+
+    pie = disable_interrupts();
+
+    // Poll briefly for small requests before paying for an interrupt
+
+    if (VIOBLK_POLL_US != 0 && !req->done && req->desc[1].len <= VIOBLK_POLL_MAX)
     {
-        return -EINVAL;
+        if (virtio_poll_used(vioblk->vq.used, vioblk->vq.last_used_idx, VIOBLK_POLL_US))
+            vioblk_reap(vioblk);
     }
 
-    if (len < 0)
-    { // check to make sure len is not negative
-        return -EINVAL;
+    while (!req->done)
+        condition_wait(&req->completed);
+
+    switch (req->status)
+    {
+    case VIRTIO_BLK_S_OK:
+        result = 0;
+        break;
+    case VIRTIO_BLK_S_UNSUPP:
+        result = -ENOTSUP;
+        break;
+    default:
+        result = -EIO;
+        break;
     }
 
-    if (len == 0)
-    { // if len is 0, return 0
+    req->next_free = vioblk->free_head;
+    vioblk->free_head = req - vioblk->reqs;
+    condition_broadcast(&vioblk->slot_released);
+    restore_interrupts(pie);
+
+    return result;
+}
+
+// int vioblk_flush(struct vioblk_device *vioblk)
+// Inputs: vioblk - device
+// Outputs: 0 on success, negative error code if the device reports an error
+// Description: Issues VIRTIO_BLK_T_FLUSH and waits for it, so that every write that
+//              completed before the call is on stable storage when it returns. A device
+//              that does not offer VIRTIO_BLK_F_FLUSH has no volatile write cache, and
+//              completed writes are already durable.
+// Side Effects: None
+static int vioblk_flush(struct vioblk_device *vioblk)
+{
+    struct vioblk_req *req;
+
+    if (!vioblk->can_flush)
         return 0;
-    }
 
-    vioblk->vq.desc[2].flags &= ~(VIRTQ_DESC_F_WRITE); // FLAG FOR READ?
-    vioblk->header.type = VIRTIO_BLK_T_OUT;
-    vioblk->header.sector = pos / blkSize;
+    req = vioblk_submit(vioblk, VIRTIO_BLK_T_FLUSH, 0, NULL, 0, 1);
+    return vioblk_complete(vioblk, req);
+}
+
+// int vioblk_range_op(struct vioblk_device *vioblk, uint32_t type, const struct io_range *range)
+// Inputs: vioblk - device, type - VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES,
+//         range - device byte range (pos and len multiples of the block size)
+// Outputs: 0 on success, -ENOTSUP if the device lacks the feature, other negative
+//          error code on failure
+// Description: Discards or zeroes a range of blocks without transferring any block
+//              data, split into requests of at most the device's per-request limit.
+// Side Effects: None
+static int vioblk_range_op(struct vioblk_device *vioblk, uint32_t type, const struct io_range *range)
+{
+    struct vioblk_range_seg seg; // on the kernel stack, so directly DMA-able
+    struct vioblk_req *req;
+    unsigned long long sector, nsectors;
+    uint32_t max;
+    int result;
+
+    max = (type == VIRTIO_BLK_T_DISCARD) ? vioblk->max_discard : vioblk->max_zeroes;
+
+    if (max == 0)
+        return -ENOTSUP;
+
+    if (((range->pos | range->len) & (vioblk->blksz - 1)) != 0 ||
+        range->pos > vioblk->end || range->len > vioblk->end - range->pos)
+    {
+        return -EINVAL;
+    }
 
-    bytewritten = pos + len > end ? end - pos : len;
+    sector = range->pos / VIOBLK_SECTOR_SIZE;
+    nsectors = range->len / VIOBLK_SECTOR_SIZE;
 
-    int numBlocks = bytewritten / blkSize;
-    lock_acquire(&vioblk->vioblk_lock);
-    for (int i = 0; i < numBlocks; i++)
+    while (nsectors != 0)
     {
-        vioblk->header.sector = (pos / blkSize) + i;
-        memcpy(vioblk->data, (buf + i * blkSize), blkSize);
-        vioblk->vq.avail.ring[vioblk->vq.avail.idx % VQ_SIZE] = 0;
-        __sync_synchronize();
-        vioblk->vq.avail.idx++;
-        __sync_synchronize();
-        virtio_notify_avail(vioblk->regs, 0);
-
-        int pie = disable_interrupts();
-        while (vioblk->vq.avail.idx != vioblk->vq.used.idx)
-        { // ensures that the device does not overwrite or reprocess buffers
-            condition_wait(&vioblk->vioblk_buffer_condition);
-        }
-        restore_interrupts(pie);
+        seg.sector = sector;
+        seg.num_sectors = (nsectors < max) ? nsectors : max;
+        seg.flags = (type == VIRTIO_BLK_T_WRITE_ZEROES) ? vioblk->zeroes_flags : 0;
 
-        if (vioblk->status & VIRTIO_BLK_S_IOERR)
-        {
-            lock_release(&vioblk->vioblk_lock);
-            return -EIO;
-        }
-        if (vioblk->status & VIRTIO_BLK_S_UNSUPP)
-        {
-            lock_release(&vioblk->vioblk_lock);
-            return -ENOTSUP;
-        }
+        req = vioblk_submit(vioblk, type, 0, &seg, sizeof(seg), 1);
+        result = vioblk_complete(vioblk, req);
+
+        if (result < 0)
+            return result;
+
+        sector += seg.num_sectors;
+        nsectors -= seg.num_sectors;
     }
-    lock_release(&vioblk->vioblk_lock);
-    return bytewritten;
+
+    return 0;
 }
 
-static void vioblk_isr(int srcno, void *aux)
+static uint8_t *vioblk_get_bounce(struct vioblk_device *vioblk)
 {
-    trace("%s()", __func__);
-    struct vioblk_device *const vioblk = aux; // sets blk device to aux
-    // const uint32_t USED_BUFFER_NOTIF = (1 << 0);
-    // vioblk->irqno = srcno;
-    // if the interrupt status is the same as the user buffer notification bit, then it will set the interrupt acknowledge bit and condtion broadcast
-    vioblk->regs->interrupt_ack |= vioblk->regs->interrupt_status;
-    condition_broadcast(&vioblk->vioblk_buffer_condition);
-    __sync_synchronize();
-}
\ No newline at end of file
+    int pie;
+    int i;
+
+    pie = disable_interrupts();
+    while (vioblk->bounce_free == 0)
+        condition_wait(&vioblk->bounce_released);
+    i = __builtin_ctz(vioblk->bounce_free);
+    vioblk->bounce_free &= ~(1U << i);
+    restore_interrupts(pie);
+
+    return vioblk->bounce[i];
+}
+
+static void vioblk_put_bounce(struct vioblk_device *vioblk, uint8_t *buf)
+{
+    int pie;
+    int i;
+
+    for (i = 0; i < VIOBLK_BOUNCE_CNT; i++)
+    {
+        if (vioblk->bounce[i] == buf)
+            break;
+    }
+
+    assert(i < VIOBLK_BOUNCE_CNT);
+
+    pie = disable_interrupts();
+    vioblk->bounce_free |= 1U << i;
+    condition_broadcast(&vioblk->bounce_released);
+    restore_interrupts(pie);
+}
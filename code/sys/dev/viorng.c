@@ -22,8 +22,25 @@
 // INTERNAL CONSTANT DEFINITIONS
 //
 
+// Reads are served from an entropy pool of VIORNG_POOLSZ bytes. When it falls
+// below VIORNG_LOW_WATER, the driver asks the device for VIORNG_BUFSZ bytes at
+// a time until it is nearly full again, refilling from the ISR, so a read only
+// waits for the device when the pool is empty.
+
 #ifndef VIORNG_BUFSZ
-#define VIORNG_BUFSZ 256
+#define VIORNG_BUFSZ 1024
+#endif
+
+#ifndef VIORNG_POOLSZ
+#define VIORNG_POOLSZ 4096 // must be power of two
+#endif
+
+#ifndef VIORNG_LOW_WATER
+#define VIORNG_LOW_WATER (VIORNG_POOLSZ / 2)
+#endif
+
+#if VIORNG_POOLSZ < VIORNG_LOW_WATER + VIORNG_BUFSZ
+#error "VIORNG_POOLSZ must hold VIORNG_LOW_WATER + VIORNG_BUFSZ bytes"
 #endif
 
 #ifndef VIORNG_NAME
@@ -34,6 +51,12 @@
 #define VIORNG_IRQ_PRIO 1
 #endif
 
+// How long viorng_read() spins for the device before sleeping on the interrupt
+
+#ifndef VIORNG_POLL_US
+#define VIORNG_POLL_US 20
+#endif
+
 // INTERNAL TYPE DEFINITIONS
 //
 
@@ -43,6 +66,7 @@ struct viorng_device {
     int instno;
 
     struct condition viorng_buffer_condition;
+    int event_idx; // VIRTIO_F_EVENT_IDX negotiated
 
     struct io io;
 
@@ -65,11 +89,14 @@ struct viorng_device {
         struct virtq_desc desc[1];
     } vq;
 
-    // bufcnt is the number of bytes left in buffer. The usable bytes are
-    // between buf+0 and buf+bufcnt. (We read from the end of the buffer.)
+    // The device fills buf; viorng_collect() moves it into the pool. The pool
+    // holds the bytes between pool_tail and pool_head, which only increase.
 
-    unsigned int bufcnt;
+    int inflight; // buf is on the avail ring
+    unsigned long pool_head;
+    unsigned long pool_tail;
     char buf[VIORNG_BUFSZ];
+    char pool[VIORNG_POOLSZ];
 };
 
 // INTERNAL FUNCTION DECLARATIONS
@@ -80,6 +107,10 @@ static void viorng_close(struct io * io);
 static long viorng_read(struct io * io, void * buf, long bufsz);
 static void viorng_isr(int irqno, void * aux);
 
+static void viorng_refill(struct viorng_device * viorng);
+static void viorng_collect(struct viorng_device * viorng);
+static void viorng_collect_bh(void * aux);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -120,6 +151,7 @@ void viorng_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     virtio_featset_init(needed_features);
     virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
     result = virtio_negotiate_features(regs,
         enabled_features, wanted_features, needed_features);
 
@@ -130,6 +162,8 @@ void viorng_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     //           FIXME Finish viorng initialization here! 
     
+    viorng->event_idx = virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX);
+
     regs->status |= VIRTIO_STAT_FEATURES_OK; // sets the correct bits and checks them
     if((regs->status & VIRTIO_STAT_FEATURES_OK) == 0){
         kprintf("%p: virtio feature negotiation failed\n", regs);
@@ -161,6 +195,12 @@ int viorng_open(struct io ** ioptr, void * aux) {
     condition_init(&viorng->viorng_buffer_condition, "buffer_cond"); // Intializes the condition for the VirtIO rng device
     virtio_enable_virtq(viorng->regs, 0); // enables the avail and used queues
     enable_intr_source(viorng->irqno, VIORNG_IRQ_PRIO, viorng_isr, aux); // enables interrupt source for VirtIO rng device and sets up IO operations
+
+    int pie = disable_interrupts(); // start filling the pool before the first read
+    if (!viorng->inflight)
+        viorng_refill(viorng);
+    restore_interrupts(pie);
+
     *ioptr = ioaddref(&viorng->io); 
     return 0;
 }
@@ -177,43 +217,55 @@ void viorng_close(struct io * io) {
     struct viorng_device * viorng = (void*)io - offsetof(struct viorng_device, io);
     virtio_reset_virtq(viorng->regs, 0); //resets the avail and used queues and prevents further interrupts
     disable_intr_source(viorng->irqno);
+    viorng->inflight = 0;
 }
 
 // long viorng_read(struct io * io, void * buf, long bufsz)
 // Inputs: struct io * io - pointer to the IO structure associated with the VirtIO rng device, void * buf -  pointer to the buffer to where the bytes read will be, long bufsz - size of the buffer in bytes
-// Outputs: Returns the minimum number of bytes read, (bufsz or viorng->vq.used.ring[viorng->vq.used.idx % 1].len), or -EINVAL if the read fails
-// Description:  This function reads up to minimum number of bytes that need to be read from the VirtIO Entropy device and writes them to buf. It sets certain registers to request entropy from the device and waits until the randomess has been placed into a buffer and writes it to buf.
-// Side Effects: Changes the buffer, calls condition wait, and calls virtio_notify_avail
+// Outputs: Returns the number of bytes read, at most bufsz, or -EINVAL if bufsz is negative
+// Description: This function copies as many bytes as the entropy pool holds, up to bufsz, into buf. It only waits for the device if the pool is empty, and starts a refill once the pool drops below VIORNG_LOW_WATER.
+// Side Effects: Changes the pool, may call condition wait and submit a request to the device
 
 long viorng_read(struct io * io, void * buf, long bufsz) {
-    //           FIXME your code here
     struct viorng_device * viorng = (void*)io - offsetof(struct viorng_device, io);
-    viorng->vq.avail.ring[viorng->vq.avail.idx % 1] = 0; // setting the avail ring buffer items in the head of the descriptor table
-    __sync_synchronize(); // memory barrier
-    viorng->vq.avail.idx++; // increasing the index of the availiable ring buffer
-    __sync_synchronize();
-    virtio_notify_avail(viorng->regs, 0); // Notifies the device of new elements in the avail ring.
-    if (bufsz > 0){
-        char * word = (char *) buf;
-        int pie = disable_interrupts(); //disables interrupts here for critical section for the condition wait
-        while(viorng->vq.avail.idx != viorng->vq.used.idx){ //ensures that the device does not overwrite or reprocess buffers
-            condition_wait(&viorng->viorng_buffer_condition);
-        }
-        restore_interrupts(pie); //restores interrupts here for end of critical sections
-        long min_bytes_read = (bufsz > viorng->vq.used.ring[viorng->vq.used.idx % 1].len) ? viorng->vq.used.ring[viorng->vq.used.idx % 1].len : bufsz;
-        for(int i = 0; i < min_bytes_read; i++){
-            char c; // writing the data from the device buffer into the buffer in the parameter
-            c = viorng->buf[i];
-            word[i] = c;
-        }
-        return min_bytes_read; 
-    }
-    else if(bufsz == 0){
-        return 0;
-    }
-    else{
+    unsigned long pos, cnt, span;
+    int pie;
+
+    if (bufsz < 0)
         return -EINVAL;
+    if (bufsz == 0)
+        return 0;
+
+    pie = disable_interrupts(); // the ISR also changes the pool
+
+    while (viorng->pool_head == viorng->pool_tail) {
+        if (!viorng->inflight)
+            viorng_refill(viorng);
+        if (VIORNG_POLL_US != 0 && // the device usually answers quickly
+            virtio_poll_used(&viorng->vq.used, viorng->vq.last_used_idx, VIORNG_POLL_US))
+            viorng_collect(viorng);
+        else
+            condition_wait(&viorng->viorng_buffer_condition);
     }
+
+    cnt = viorng->pool_head - viorng->pool_tail;
+    if (bufsz < cnt)
+        cnt = bufsz;
+
+    pos = viorng->pool_tail & (VIORNG_POOLSZ - 1);
+    span = VIORNG_POOLSZ - pos;
+    if (cnt < span)
+        span = cnt;
+
+    memcpy(buf, viorng->pool + pos, span);
+    memcpy(buf + span, viorng->pool, cnt - span);
+    viorng->pool_tail += cnt;
+
+    if (viorng->pool_head - viorng->pool_tail < VIORNG_LOW_WATER && !viorng->inflight)
+        viorng_refill(viorng);
+
+    restore_interrupts(pie);
+    return cnt;
 }
 
 // void viorng_isr(int irqno, void * aux)
@@ -228,7 +280,73 @@ void viorng_isr(int irqno, void * aux) {
     const uint32_t USED_BUFFER_NOTIF = (1 << 0);
     if((viorng->regs->interrupt_status & USED_BUFFER_NOTIF)){ // if the interrupt status is the same as the user buffer notification bit, then it will set the interrupt acknowledge bit and condtion broadcast
         viorng->regs->interrupt_ack |= USED_BUFFER_NOTIF;
-        condition_broadcast(&viorng->viorng_buffer_condition);
         __sync_synchronize();
+        intr_defer(viorng_collect_bh, viorng); // copying into the pool can wait for the intrbh thread
     }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// void viorng_refill(struct viorng_device * viorng)
+// Inputs: struct viorng_device * viorng - pointer to the VirtIO rng device structure
+// Outputs: None
+// Description: This function puts buf on the avail ring so the device fills it with VIORNG_BUFSZ random bytes. Must be called with interrupts disabled and no request in flight.
+// Side Effects: Changes the avail ring and notifies the device
+
+void viorng_refill(struct viorng_device * viorng) {
+    uint16_t old_idx = viorng->vq.avail.idx;
+
+    // ask for an interrupt on the entry this request adds to the used ring
+    virtio_arm_used(&viorng->vq.avail, &viorng->vq.used, 1, viorng->event_idx, viorng->vq.last_used_idx);
+    viorng->vq.avail.ring[old_idx % 1] = 0;
+    __sync_synchronize();
+    viorng->vq.avail.idx = old_idx + 1;
+    viorng->inflight = 1;
+    virtio_kick(viorng->regs, 0, viorng->event_idx, &viorng->vq.used, 1, old_idx, old_idx + 1);
+}
+
+// void viorng_collect(struct viorng_device * viorng)
+// Inputs: struct viorng_device * viorng - pointer to the VirtIO rng device structure
+// Outputs: None
+// Description: If the device has returned buf, this function appends its bytes to the pool, wakes readers, and asks for another chunk while the pool has room for one. Must be called with interrupts disabled.
+// Side Effects: Changes the pool, calls condition broadcast and may submit a request to the device
+
+void viorng_collect(struct viorng_device * viorng) {
+    unsigned long pos, cnt, span;
+
+    if (!viorng->inflight || viorng->vq.used.idx == viorng->vq.last_used_idx)
+        return;
+
+    __sync_synchronize(); // fence r,r: ring entry and buffer after idx
+    cnt = viorng->vq.used.ring[viorng->vq.last_used_idx % 1].len;
+    if (VIORNG_BUFSZ < cnt)
+        cnt = VIORNG_BUFSZ;
+
+    viorng->vq.last_used_idx = viorng->vq.used.idx;
+    viorng->inflight = 0;
+
+    pos = viorng->pool_head & (VIORNG_POOLSZ - 1);
+    span = VIORNG_POOLSZ - pos;
+    if (cnt < span)
+        span = cnt;
+
+    memcpy(viorng->pool + pos, viorng->buf, span);
+    memcpy(viorng->pool, viorng->buf + span, cnt - span);
+    viorng->pool_head += cnt;
+
+    condition_broadcast(&viorng->viorng_buffer_condition);
+
+    if (viorng->pool_head - viorng->pool_tail + VIORNG_BUFSZ <= VIORNG_POOLSZ)
+        viorng_refill(viorng);
+}
+
+// void viorng_collect_bh(void * aux)
+// Inputs: void * aux - pointer to the VirtIO rng device structure
+// Outputs: None
+// Description: Runs viorng_collect() on the intrbh thread for viorng_isr().
+// Side Effects: See viorng_collect()
+
+void viorng_collect_bh(void * aux) {
+    viorng_collect(aux);
 }
\ No newline at end of file
@@ -8,6 +8,8 @@
 #include "assert.h"
 #include "console.h"
 #include "error.h"
+#include "riscv.h"
+#include "conf.h"
 
 #include <stddef.h>
 
@@ -91,15 +93,16 @@ int virtio_negotiate_features (
         }
     }
 
-    // All required features are available. Now request the desired ones (which
-    // should be a superset of the required ones).
+    // All required features are available. Now request them together with the
+    // desired ones.
 
     for (i = 0; i < VIRTIO_FEATLEN; i++) {
-        if (wanted[i] != 0) {
+        enabled[i] = 0;
+        if ((wanted[i] | needed[i]) != 0) {
             regs->device_features_sel = i;
             regs->driver_features_sel = i;
             __sync_synchronize(); // fence o,i
-            enabled[i] = regs->device_features & wanted[i];
+            enabled[i] = regs->device_features & (wanted[i] | needed[i]);
             regs->driver_features = enabled[i];
             __sync_synchronize(); // fence o,o
         }
@@ -124,6 +127,55 @@ void virtio_attach_virtq (
     __sync_synchronize(); // fence o,o
 }
 
+void virtio_kick (
+    volatile struct virtio_mmio_regs * regs, int qid, int event_idx,
+    volatile struct virtq_used * used, uint_fast16_t len,
+    uint16_t old_idx, uint16_t new_idx)
+{
+    uint16_t event;
+
+    __sync_synchronize(); // fence w,r: publish avail idx before reading event
+
+    if (event_idx) {
+        // Same test as vring_need_event(): did [old_idx, new_idx) pass the
+        // index the device asked to be notified at?
+        event = *virtq_avail_event(used, len);
+        if ((uint16_t)(new_idx - event - 1) >= (uint16_t)(new_idx - old_idx))
+            return;
+    } else if (used->flags & VIRTQ_USED_F_NO_NOTIFY)
+        return;
+
+    virtio_notify_avail(regs, qid);
+}
+
+int virtio_arm_used (
+    struct virtq_avail * avail, volatile struct virtq_used * used,
+    uint_fast16_t len, int event_idx, uint16_t last_used_idx)
+{
+    if (event_idx)
+        *virtq_used_event(avail, len) = last_used_idx;
+    else
+        avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+    __sync_synchronize(); // fence w,r
+    return (used->idx != last_used_idx);
+}
+
+int virtio_poll_used (
+    volatile struct virtq_used * used, uint16_t last_used_idx,
+    unsigned long usec)
+{
+    const unsigned long long tend = rdtime() + usec * (TIMER_FREQ / 1000000);
+
+    while (used->idx == last_used_idx) {
+        if (rdtime() >= tend)
+            return 0;
+    }
+
+    __sync_synchronize(); // fence r,r: ring entry after idx
+    return 1;
+}
+
 // The following provide weak no-op attach functions that are overridden if the
 // appropriate device driver is linked in.
 
@@ -149,4 +201,4 @@ void __attribute__ ((weak)) viogpu_attach (
     volatile struct virtio_mmio_regs * regs, int irqno)
 {
     // nothing
-}
\ No newline at end of file
+}
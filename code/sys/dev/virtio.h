@@ -139,7 +139,7 @@ struct virtq_avail {
 // sized for /n/ elements.
 
 #define VIRTQ_AVAIL_SIZE(n) \
-    (sizeof(struct virtq_avail)+(n)*sizeof(uint16_t))
+    (sizeof(struct virtq_avail)+((n)+1)*sizeof(uint16_t)) // +1: used_event
 
 struct virtq_used_elem {
     uint32_t id; // Index of start of used descriptor chain
@@ -157,7 +157,7 @@ struct virtq_used {
 // sized for /n/ elements.
 
 #define VIRTQ_USED_SIZE(n) \
-    (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem))
+    (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem)+sizeof(uint16_t)) // avail_event
 
 
 // EXPORTED FUNCTION DEFINITIONS
@@ -187,6 +187,43 @@ static inline void virtio_enable_virtq (
 static inline void virtio_reset_virtq (
     volatile struct virtio_mmio_regs * regs, int qid);
 
+// With VIRTIO_F_EVENT_IDX negotiated, the driver writes the used ring index
+// it next wants an interrupt at into used_event (after the avail ring), and
+// the device writes the avail ring index it next wants a notification at into
+// avail_event (after the used ring).
+
+static inline volatile uint16_t * virtq_used_event (
+    struct virtq_avail * avail, uint_fast16_t len);
+
+static inline volatile uint16_t * virtq_avail_event (
+    volatile struct virtq_used * used, uint_fast16_t len);
+
+// Notifies the device of avail ring entries [old_idx, new_idx) of queue _qid_
+// unless the device has said it does not need to be: through avail_event
+// when _event_idx_ is set, and through VIRTQ_USED_F_NO_NOTIFY otherwise.
+
+extern void virtio_kick (
+    volatile struct virtio_mmio_regs * regs, int qid, int event_idx,
+    volatile struct virtq_used * used, uint_fast16_t len,
+    uint16_t old_idx, uint16_t new_idx);
+
+// Asks for an interrupt on the next used ring entry after _last_used_idx_.
+// Returns nonzero if entries arrived before the request took effect, in which
+// case the caller must process them itself (and then call again).
+
+extern int virtio_arm_used (
+    struct virtq_avail * avail, volatile struct virtq_used * used,
+    uint_fast16_t len, int event_idx, uint16_t last_used_idx);
+
+// Polled completion: spins for at most _usec_ microseconds waiting for the
+// device to add a used ring entry after _last_used_idx_. Returns nonzero if
+// one arrived. Lets a driver skip the interrupt round trip for requests the
+// device completes quickly.
+
+extern int virtio_poll_used (
+    volatile struct virtq_used * used, uint16_t last_used_idx,
+    unsigned long usec);
+
 static inline void virtio_featset_init(virtio_featset_t fts);
 static inline void virtio_featset_add(virtio_featset_t fts, uint_fast16_t k);
 static inline int virtio_featset_test(virtio_featset_t fts, uint_fast16_t k);
@@ -276,6 +313,18 @@ static inline void virtio_reset_virtq (
     regs->queue_reset = 1;
 }
 
+static inline volatile uint16_t * virtq_used_event (
+    struct virtq_avail * avail, uint_fast16_t len)
+{
+    return &avail->ring[len];
+}
+
+static inline volatile uint16_t * virtq_avail_event (
+    volatile struct virtq_used * used, uint_fast16_t len)
+{
+    return (volatile uint16_t *)&used->ring[len];
+}
+
 static inline void virtio_featset_init(virtio_featset_t fts) {
     uint_fast8_t i;
 
@@ -13,6 +13,8 @@
 #include "error.h"
 #include "heap.h"
 #include "string.h"
+#include "process.h"
+#include "imgcache.h"
 
 #include <stdint.h>
 
@@ -115,6 +117,9 @@ struct elf64_phdr
 
 #define EM_RISCV 243
 
+static int elf_pageable(struct io *elfio, const struct elf64_ehdr *header);
+static int elf_cache(struct io *elfio, unsigned long long id, const struct elf64_ehdr *header);
+
 int elf_load(struct io *elfio, void (**eptr)(void))
 {
     // FIX ME
@@ -133,6 +138,19 @@ int elf_load(struct io *elfio, void (**eptr)(void))
         return -EINVAL;
     }
 
+    // An image executed before is mapped from the image cache, which checked
+    // it when it was added
+
+    unsigned long long id;
+    const int have_id = (ioctl(elfio, IOCTL_GETID, &id) == 0);
+
+    if (have_id && imgcache_map(id, eptr) == 0)
+    {
+        kfree(header);
+        kfree(phdr);
+        return 0;
+    }
+
     unsigned char magicnums[4] = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3}; // magic nums
 
     if (ioreadat(elfio, 0, header, sizeof(struct elf64_ehdr)) != sizeof(struct elf64_ehdr))
@@ -178,6 +196,13 @@ int elf_load(struct io *elfio, void (**eptr)(void))
         return -EBADFMT;
     }
 
+    const int pageable = elf_pageable(elfio, header);
+
+    if (pageable && have_id && elf_cache(elfio, id, header) == 0 && imgcache_map(id, eptr) == 0)
+    {
+        return 0;
+    }
+
     for (int i = 0; i < header->e_phnum; i++)
     {
         // Seek to end of header
@@ -201,6 +226,30 @@ int elf_load(struct io *elfio, void (**eptr)(void))
 
         // size = phdr->p_memsz;
 
+        // Demand paging: record where the segment lives in the image and let
+        // the page fault handler read each page on first touch. If the
+        // process is out of mapping slots, load the segment now instead.
+        if (pageable)
+        {
+            const uintptr_t vma = ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE);
+            const size_t lead = phdr->p_vaddr - vma;
+            int mflags = 0;
+
+            if ((phdr->p_flags & PF_W) == PF_W)
+            {
+                mflags |= MMAP_WRITE;
+            }
+            if ((phdr->p_flags & PF_X) == PF_X)
+            {
+                mflags |= MMAP_EXEC;
+            }
+            if (process_mmap(elfio, vma, lead + phdr->p_memsz, phdr->p_offset - lead,
+                             lead + phdr->p_filesz, mflags) >= 0)
+            {
+                continue;
+            }
+        }
+
         // kprintf("PAGE COUNT: %d\n", free_phys_page_count());
         // kprintf("Memsize: %d\n", phdr->p_memsz);
         void *newvp = alloc_and_map_range(phdr->p_vaddr, phdr->p_memsz, PTE_R | PTE_W | PTE_U);
@@ -230,4 +279,84 @@ int elf_load(struct io *elfio, void (**eptr)(void))
 
     *eptr = (void (*)(void))(header->e_entry);
     return 0;
-}
\ No newline at end of file
+}
+
+// Returns 1 if every PT_LOAD segment of the image can be demand paged: its
+// address and file offset agree within a page, and no page holds parts of two
+// segments. Segments must be in ascending address order, as linkers emit them.
+
+static int elf_pageable(struct io *elfio, const struct elf64_ehdr *header)
+{
+    struct elf64_phdr ph;
+    uintptr_t prev_end = 0;
+
+    for (int i = 0; i < header->e_phnum; i++)
+    {
+        if (ioreadat(elfio, header->e_phoff + i * header->e_phentsize, &ph, sizeof(ph)) != sizeof(ph))
+        {
+            return 0;
+        }
+        if (ph.p_type != PT_LOAD || ph.p_memsz == 0)
+        {
+            continue;
+        }
+        if (ph.p_vaddr % PAGE_SIZE != ph.p_offset % PAGE_SIZE ||
+            ROUND_DOWN(ph.p_vaddr, PAGE_SIZE) < prev_end)
+        {
+            return 0;
+        }
+        prev_end = ROUND_UP(ph.p_vaddr + ph.p_memsz, PAGE_SIZE);
+    }
+    return 1;
+}
+
+// Adds the image to the image cache under _id_. Only called for pageable
+// images, whose segments each start a page of their own. Returns 0 or a
+// negative error code if the image is not cached.
+
+static int elf_cache(struct io *elfio, unsigned long long id, const struct elf64_ehdr *header)
+{
+    struct imgcache_seg segs[IMGCACHE_SEGMAX];
+    struct elf64_phdr ph;
+    int nsegs = 0;
+
+    for (int i = 0; i < header->e_phnum; i++)
+    {
+        if (ioreadat(elfio, header->e_phoff + i * header->e_phentsize, &ph, sizeof(ph)) != sizeof(ph))
+        {
+            return -EIO;
+        }
+        if (ph.p_type != PT_LOAD || ph.p_memsz == 0)
+        {
+            continue;
+        }
+        if (ph.p_vaddr < UMEM_START_VMA || ph.p_vaddr + ph.p_memsz > UMEM_END_VMA ||
+            ph.p_filesz > ph.p_memsz)
+        {
+            return -EBADFMT;
+        }
+        if (nsegs == IMGCACHE_SEGMAX)
+        {
+            return -ENOTSUP;
+        }
+
+        const uintptr_t vma = ROUND_DOWN(ph.p_vaddr, PAGE_SIZE);
+        const size_t lead = ph.p_vaddr - vma;
+
+        segs[nsegs].vma = vma;
+        segs[nsegs].pos = ph.p_offset - lead;
+        segs[nsegs].filesz = lead + ph.p_filesz;
+        segs[nsegs].flags = 0;
+        if ((ph.p_flags & PF_W) == PF_W)
+        {
+            segs[nsegs].flags |= MMAP_WRITE;
+        }
+        if ((ph.p_flags & PF_X) == PF_X)
+        {
+            segs[nsegs].flags |= MMAP_EXEC;
+        }
+        nsegs += 1;
+    }
+
+    return imgcache_add(elfio, id, (void (*)(void))header->e_entry, segs, nsegs);
+}
@@ -24,6 +24,8 @@
 #define EPIPE      15
 #define ENODATABLKS  16
 #define ENOINODEBLKS 17
+#define EAGAIN     18
+#define EINTR      19
 
 
 extern const char * error_name(int code);
@@ -54,6 +54,20 @@ static const char * const excp_names[] = {
 void handle_smode_exception(unsigned int cause, struct trap_frame * tfr) {
     const char * name = NULL;
     char msgbuf[80];
+    uintptr_t vma;
+
+    // The kernel touching user memory on behalf of a process (a system call
+    // reading into a copy-on-write or not yet touched page) is handled the
+    // same way as the process touching it.
+
+    if (cause == RISCV_SCAUSE_LOAD_PAGE_FAULT ||
+        cause == RISCV_SCAUSE_STORE_PAGE_FAULT) {
+        vma = csrr_stval();
+        if (UMEM_START_VMA <= vma && vma < UMEM_END_VMA &&
+            running_thread_process() != NULL &&
+            handle_umode_page_fault(tfr, vma))
+            return;
+    }
 
     if (0 <= cause && cause < sizeof(excp_names)/sizeof(excp_names[0]))
 		name = excp_names[cause];
@@ -93,9 +107,11 @@ void handle_umode_exception(unsigned int cause, struct trap_frame * tfr) { // st
     {
     case RISCV_SCAUSE_ECALL_FROM_UMODE:
         handle_syscall(tfr);
+        process_check_exiting();
         return;
     case RISCV_SCAUSE_STORE_PAGE_FAULT:
     case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+    case RISCV_SCAUSE_INSTR_PAGE_FAULT: // text of a demand-paged image
         int status = handle_umode_page_fault(tfr, csrr_stval());
         if(status == 1){
             return;
@@ -0,0 +1,222 @@
+// futex.c - Wait queues keyed on user memory addresses
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef FUTEX_TRACE
+#define TRACE
+#endif
+
+#ifdef FUTEX_DEBUG
+#define DEBUG
+#endif
+
+#include "futex.h"
+#include "thread.h"
+#include "memory.h"
+#include "intr.h"
+#include "error.h"
+#include "assert.h"
+#include "conf.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of wait queues. Addresses that hash to the same queue share its
+// condition, so a wake-up may also wake unrelated waiters, which go back to
+// sleep.
+
+#ifndef FUTEX_HASH_SIZE
+#define FUTEX_HASH_SIZE 32 // must be power of two
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// A waiter lives on the stack of the thread in futex_wait().
+
+struct futex_waiter
+{
+    struct futex_waiter *next;
+    mtag_t mtag;
+    uintptr_t uaddr;
+    int woken;
+};
+
+struct futex_queue
+{
+    struct futex_waiter *head; // oldest first
+    struct futex_waiter *tail;
+    struct condition woken;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int futex_check_addr(const uint32_t *uaddr);
+static struct futex_queue *futex_queue(mtag_t mtag, uintptr_t uaddr);
+static void futex_dequeue(struct futex_queue *queue, struct futex_waiter *waiter);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct futex_queue futex_queues[FUTEX_HASH_SIZE]; // all-zero conditions are valid
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int futex_wait(uint32_t *uaddr, uint32_t val)
+{
+    struct futex_waiter waiter;
+    struct futex_queue *queue;
+    int pie;
+
+    trace("%s(%p,%u)", __func__, uaddr, val);
+
+    if (futex_check_addr(uaddr) != 0)
+    {
+        return -EINVAL;
+    }
+
+    waiter.mtag = active_mspace();
+    waiter.uaddr = (uintptr_t)uaddr;
+    waiter.woken = 0;
+    queue = futex_queue(waiter.mtag, waiter.uaddr);
+
+    // Reading the word may fault a page in, so do it before it matters that
+    // interrupts stay off. Nothing in user space runs while we hold the CPU,
+    // so the value cannot change between the read and queuing the waiter.
+
+    if (*(volatile uint32_t *)uaddr != val)
+    {
+        return -EAGAIN;
+    }
+
+    pie = disable_interrupts();
+    waiter.next = NULL;
+
+    if (queue->tail != NULL)
+    {
+        queue->tail->next = &waiter;
+    }
+    else
+    {
+        queue->head = &waiter;
+    }
+    queue->tail = &waiter;
+
+    while (!waiter.woken)
+    {
+        if (condition_wait_interruptible(&queue->woken) != 0)
+        {
+            futex_dequeue(queue, &waiter);
+            restore_interrupts(pie);
+            return -EINTR;
+        }
+    }
+
+    restore_interrupts(pie);
+    return 0;
+}
+
+int futex_wake(uint32_t *uaddr, int cnt)
+{
+    const mtag_t mtag = active_mspace();
+    struct futex_queue *queue;
+    struct futex_waiter **link;
+    struct futex_waiter *waiter;
+    int woken = 0;
+    int pie;
+
+    trace("%s(%p,%d)", __func__, uaddr, cnt);
+
+    if (futex_check_addr(uaddr) != 0 || cnt < 0)
+    {
+        return -EINVAL;
+    }
+
+    queue = futex_queue(mtag, (uintptr_t)uaddr);
+    pie = disable_interrupts();
+
+    // Oldest waiters first
+
+    link = &queue->head;
+    waiter = NULL;
+
+    while (*link != NULL && woken < cnt)
+    {
+        if ((*link)->mtag == mtag && (*link)->uaddr == (uintptr_t)uaddr)
+        {
+            (*link)->woken = 1;
+            *link = (*link)->next;
+            woken += 1;
+        }
+        else
+        {
+            waiter = *link;
+            link = &waiter->next;
+        }
+    }
+
+    if (*link == NULL)
+    {
+        queue->tail = waiter;
+    }
+
+    if (woken > 0)
+    {
+        condition_broadcast(&queue->woken);
+    }
+
+    restore_interrupts(pie);
+    return woken;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+int futex_check_addr(const uint32_t *uaddr)
+{
+    const uintptr_t addr = (uintptr_t)uaddr;
+
+    if (addr % sizeof(uint32_t) != 0 || addr < UMEM_START_VMA || addr >= UMEM_END_VMA)
+    {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+struct futex_queue *futex_queue(mtag_t mtag, uintptr_t uaddr)
+{
+    const uint64_t key = (uaddr >> 2) ^ (uint64_t)mtag;
+
+    return &futex_queues[(key ^ (key >> 7) ^ (key >> 17)) & (FUTEX_HASH_SIZE - 1)];
+}
+
+// Takes a waiter that gave up off its queue. Must be called with interrupts
+// disabled.
+
+void futex_dequeue(struct futex_queue *queue, struct futex_waiter *waiter)
+{
+    struct futex_waiter **link = &queue->head;
+    struct futex_waiter *prev = NULL;
+
+    while (*link != NULL && *link != waiter)
+    {
+        prev = *link;
+        link = &prev->next;
+    }
+
+    if (*link == NULL)
+    {
+        return;
+    }
+
+    *link = waiter->next;
+
+    if (queue->tail == waiter)
+    {
+        queue->tail = prev;
+    }
+}
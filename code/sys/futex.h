@@ -0,0 +1,26 @@
+// futex.h - Wait queues keyed on user memory addresses
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <stdint.h>
+
+// Blocks the running thread until futex_wake() is called on _uaddr_ in the
+// active memory space, unless the 32-bit word at _uaddr_ no longer holds _val_
+// when checked. The check and going to sleep are atomic with respect to
+// futex_wake(). Returns 0 when woken, -EAGAIN if the word did not hold _val_,
+// -EINTR if the process is exiting, or -EINVAL if _uaddr_ is not an aligned
+// user address.
+
+extern int futex_wait(uint32_t * uaddr, uint32_t val);
+
+// Wakes up to _cnt_ threads blocked in futex_wait() on _uaddr_ in the active
+// memory space. Returns the number of threads woken or -EINVAL.
+
+extern int futex_wake(uint32_t * uaddr, int cnt);
+
+#endif // _FUTEX_H_
@@ -0,0 +1,303 @@
+// heap1.c - Size-class heap memory manager
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef HEAP_TRACE
+#define TRACE
+#endif
+
+#ifdef HEAP_DEBUG
+#define DEBUG
+#endif
+
+#include "conf.h"
+#include "heap.h"
+#include "string.h"
+#include "riscv.h"
+#include "assert.h"
+#include "memory.h"
+#include "intr.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef HEAP_ALIGN
+#define HEAP_ALIGN 16
+#endif
+
+// Requests up to HEAP_CLASS_MAX bytes are rounded up to a power of two size
+// class of at least HEAP_CLASS_MIN bytes and served from the class free list.
+// Larger requests get whole pages from the page allocator.
+
+#ifndef HEAP_CLASS_MIN
+#define HEAP_CLASS_MIN 16
+#endif
+
+#ifndef HEAP_CLASS_MAX
+#define HEAP_CLASS_MAX 2048
+#endif
+
+#define HEAP_ALLOC_MAGIC 0xEAEAEAEA
+#define HEAP_FREE_MAGIC 0x25252525
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+//        +----------------+----------------+
+//        |  ALLOC_MAGIC   |      size      |
+//        +----------------+----------------+
+//        |   size_inv     |    alloc_ra    |
+// ptr -> +----------------+----------------+
+//        |  FREE_MAGIC    |    free_ra     |
+//        +---------------------------------+
+//        |             next                |
+//        +---------------------------------+
+//
+// The lower part is only present while the block is free. The size field is
+// the size of the class, or the number of bytes in the pages of a large block.
+
+// Header that preceeds each allocated block. Must be a multiple of HEAP_ALIGN.
+
+struct heap_alloc_header {
+    uint32_t magic; ///< HEAP_ALLOC_MAGIC
+    uint32_t size; ///< Usable size of the block
+    uint32_t size_inv; ///< Bitwise not of the size, 0 while free
+    uint32_t ra32;    ///< Caller return address
+};
+
+struct heap_free_record {
+    uint32_t magic; ///< HEAP_FREE_MAGIC
+    uint32_t ra32; ///< Caller return address
+    struct heap_free_record * next; ///< Next free block of the same class
+};
+
+// The ISPOW2 macro evaluates to 1 if its argument is either zero or a power of
+// two. The argument must be an integer type. Cast pointers to uintptr_t to test
+// pointer alignment.
+
+#define ISPOW2(n) (((n)&((n)-1)) == 0)
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Memory not yet carved into blocks. Initially whatever heap_init() was given,
+// later the unused part of the last page taken for a class.
+
+static void * heap_low;
+static void * heap_end;
+
+static struct heap_free_record * free_lists[32];
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static void * heap_malloc_actual(size_t size, void * ra);
+static void * heap_calloc_actual(size_t nelts, size_t eltsz, void * ra);
+static void heap_free_actual(void * ptr, void * ra);
+
+static unsigned int heap_class(size_t size);
+static int heap_refill(unsigned int cls);
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+char heap_initialized = 0;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void heap_init(void * start, void * end) {
+    trace("%s(%p,%p)", __func__, start, end);
+
+    assert (4 <= HEAP_ALIGN);
+    assert (ISPOW2(HEAP_ALIGN));
+    assert (sizeof(struct heap_free_record) <= HEAP_CLASS_MIN);
+    assert (ISPOW2(HEAP_CLASS_MIN) && ISPOW2(HEAP_CLASS_MAX));
+
+    // Round start up and end down to a HEAP_ALIGN boundary
+
+    start = (void*)ROUND_UP((uintptr_t)start, HEAP_ALIGN);
+    end = (void*)ROUND_DOWN((uintptr_t)end, HEAP_ALIGN);
+    assert (start < end);
+
+    heap_low = start;
+    heap_end = end;
+    heap_initialized = 1;
+}
+
+void * kmalloc(size_t size) {
+    return heap_malloc_actual(size, __builtin_return_address(0));
+}
+
+void * kcalloc(size_t nelts, size_t eltsz) {
+    return heap_calloc_actual(nelts, eltsz, __builtin_return_address(0));
+}
+
+void kfree(void * ptr) {
+    return heap_free_actual(ptr, __builtin_return_address(0));
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void * heap_malloc_actual(size_t size, void * ra) {
+    struct heap_alloc_header * hdr;
+    struct heap_free_record * rec;
+    unsigned int cls;
+    size_t pgcnt;
+    int pie;
+
+    trace("%s(%zu,ra=%p)", __func__, size, ra);
+
+    if (size == 0)
+        return NULL;
+
+    if (HEAP_ALLOC_MAX < size)
+        panic("malloc request too large");
+
+    if (HEAP_CLASS_MAX < size) {
+        pgcnt = ROUND_UP(size + sizeof(struct heap_alloc_header), PAGE_SIZE)
+            / PAGE_SIZE;
+        hdr = alloc_phys_pages(pgcnt);
+        if (hdr == NULL)
+            panic("out of memory");
+        size = pgcnt * PAGE_SIZE - sizeof(struct heap_alloc_header);
+    } else {
+        cls = heap_class(size);
+        size = 1UL << cls;
+
+        pie = disable_interrupts();
+
+        if (free_lists[cls] == NULL && heap_refill(cls) != 0)
+            panic("out of memory");
+
+        rec = free_lists[cls];
+        free_lists[cls] = rec->next;
+        restore_interrupts(pie);
+
+        assert (rec->magic == HEAP_FREE_MAGIC);
+        hdr = (struct heap_alloc_header*)rec - 1;
+    }
+
+    hdr->magic = HEAP_ALLOC_MAGIC;
+    hdr->size = size;
+    hdr->size_inv = ~size;
+    hdr->ra32 = (uint32_t)(uintptr_t)ra;
+
+#ifdef HEAP_DEBUG
+    memset(hdr+1, 0x33, size);
+#endif
+
+    return hdr+1;
+}
+
+void * heap_calloc_actual(size_t nelts, size_t eltsz, void * ra) {
+    size_t size;
+    void * ptr;
+
+    trace("%s(%zu,%zu,ra=%p)", __func__, nelts, eltsz, ra);
+
+    assert (nelts <= HEAP_ALLOC_MAX / eltsz);
+    size = nelts * eltsz;
+
+    ptr = heap_malloc_actual(size, ra);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void heap_free_actual(void * ptr, void * ra) {
+    struct heap_alloc_header * hdr;
+    struct heap_free_record * rec;
+    unsigned int cls;
+    int pie;
+
+    trace("%s(%p,ra=%p)", __func__, ptr, ra);
+
+    if (ptr == NULL)
+        return;
+
+    // Make pointers to alloc header and free record
+
+    hdr = ptr;
+    hdr -= 1;
+    rec = ptr;
+
+    // Check integrity
+
+    if (hdr->size != ~hdr->size_inv) {
+        assert(hdr->magic == HEAP_ALLOC_MAGIC);
+        if (hdr->magic != HEAP_ALLOC_MAGIC)
+            panic(NULL);
+        else if (hdr->size_inv == 0 && rec->magic == HEAP_FREE_MAGIC)
+            panic("double free");
+        else
+            panic(NULL);
+    }
+
+    if (HEAP_CLASS_MAX < hdr->size) {
+        free_phys_pages(hdr, (hdr->size + sizeof(struct heap_alloc_header))
+            / PAGE_SIZE);
+        return;
+    }
+
+#ifdef HEAP_DEBUG
+    memset(rec+1, 0x11, hdr->size - sizeof(struct heap_free_record));
+#endif
+
+    cls = heap_class(hdr->size);
+    rec->magic = HEAP_FREE_MAGIC;
+    rec->ra32 = (uint32_t)(uintptr_t)ra;
+    hdr->size_inv = 0;
+
+    pie = disable_interrupts();
+    rec->next = free_lists[cls];
+    free_lists[cls] = rec;
+    restore_interrupts(pie);
+}
+
+// Returns the log2 of the size class for a request of _size_ bytes.
+
+unsigned int heap_class(size_t size) {
+    unsigned int cls = __builtin_ctzl(HEAP_CLASS_MIN);
+
+    while ((1UL << cls) < size)
+        cls += 1;
+
+    return cls;
+}
+
+// Carves as many blocks of class _cls_ as fit out of the uncarved memory onto
+// the class free list, first taking a fresh page if not even one fits. Returns
+// 0 on success or -1 if out of memory. Must be called with interrupts
+// disabled.
+
+int heap_refill(unsigned int cls) {
+    const size_t blksz = sizeof(struct heap_alloc_header) + (1UL << cls);
+    struct heap_alloc_header * hdr;
+    struct heap_free_record * rec;
+    void * newpage;
+
+    if (heap_end - heap_low < blksz) {
+        newpage = alloc_phys_page();
+        if (newpage == NULL)
+            return -1;
+        heap_low = newpage;
+        heap_end = newpage + PAGE_SIZE;
+    }
+
+    while (blksz <= heap_end - heap_low) {
+        hdr = heap_low;
+        hdr->magic = HEAP_ALLOC_MAGIC;
+        hdr->size = 1UL << cls;
+        hdr->size_inv = 0;
+        rec = (void*)(hdr+1);
+        rec->magic = HEAP_FREE_MAGIC;
+        rec->next = free_lists[cls];
+        free_lists[cls] = rec;
+        heap_low += blksz;
+    }
+
+    return 0;
+}
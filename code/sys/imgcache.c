@@ -0,0 +1,304 @@
+// imgcache.c - Cache of loaded executable images
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// Keeps the file-backed pages of recently executed images, keyed by the
+// IOCTL_GETID value of the executable, so that executing the same file again
+// maps pages that are already in memory instead of reading and copying the
+// image. Each entry holds its own reference to every page and to the io it
+// was read from; the io keeps the file's identity stable, so a write to the
+// file changes the identity reported to the next exec, which then misses.
+//
+
+#ifdef IMGCACHE_TRACE
+#define TRACE
+#endif
+
+#ifdef IMGCACHE_DEBUG
+#define DEBUG
+#endif
+
+#include "imgcache.h"
+#include "memory.h"
+#include "process.h"
+#include "thread.h"
+#include "heap.h"
+#include "string.h"
+#include "console.h"
+#include "riscv.h"
+#include "error.h"
+#include "conf.h"
+
+// Images kept, and the pages all of them may hold together
+
+#ifndef IMGCACHE_SLOTS
+#define IMGCACHE_SLOTS 4
+#endif
+
+#ifndef IMGCACHE_PAGES_MAX
+#define IMGCACHE_PAGES_MAX 128
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct imgcache_entry
+{
+    struct io *io; // NULL if the slot is free
+    unsigned long long id;
+    unsigned long long used; // imgcache_clock at the last exec
+    void (*entry)(void);
+    int nsegs;
+    struct imgcache_seg segs[IMGCACHE_SEGMAX];
+    unsigned int npages;
+    void **pages; // file-backed pages of every segment, in order
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static struct imgcache_entry *imgcache_find(unsigned long long id);
+static struct imgcache_entry *imgcache_slot(unsigned int npages);
+static void imgcache_evict(struct imgcache_entry *ent);
+static unsigned int seg_pages(const struct imgcache_seg *seg);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct imgcache_entry imgcache[IMGCACHE_SLOTS];
+static unsigned int imgcache_pages; // held by all entries
+static unsigned long long imgcache_clock;
+static struct lock imgcache_lock; // everything above
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void imgcache_init(void)
+{
+    lock_init(&imgcache_lock);
+}
+
+int imgcache_map(unsigned long long id, void (**eptr)(void))
+{
+    const struct imgcache_seg *seg;
+    struct imgcache_entry *ent;
+    unsigned int i, n, k = 0;
+    int flags;
+    int s;
+
+    trace("%s(%llu)", __func__, id);
+
+    lock_acquire(&imgcache_lock);
+
+    ent = imgcache_find(id);
+    if (ent == NULL)
+    {
+        lock_release(&imgcache_lock);
+        return -ENOENT;
+    }
+
+    for (s = 0; s < ent->nsegs; s++)
+    {
+        seg = &ent->segs[s];
+        flags = PTE_R | PTE_U;
+        if (seg->flags & MMAP_WRITE)
+        {
+            flags |= PTE_W;
+        }
+        if (seg->flags & MMAP_EXEC)
+        {
+            flags |= PTE_X;
+        }
+
+        // Pages past the file contents are left to the anonymous fault path
+
+        n = seg_pages(seg);
+        for (i = 0; i < n; i++)
+        {
+            if (map_shared_page(seg->vma + i * PAGE_SIZE, ent->pages[k++], flags, seg->flags & MMAP_WRITE) != 0)
+            {
+                lock_release(&imgcache_lock);
+                return -ENOMEM;
+            }
+        }
+    }
+
+    ent->used = ++imgcache_clock;
+    *eptr = ent->entry;
+    lock_release(&imgcache_lock);
+
+    fence_i();
+    return 0;
+}
+
+int imgcache_add(
+    struct io *exeio, unsigned long long id, void (*entry)(void),
+    const struct imgcache_seg *segs, int nsegs)
+{
+    struct imgcache_entry *ent;
+    unsigned int npages = 0;
+    unsigned int i, n, k = 0;
+    size_t off;
+    long len;
+    void *pp;
+    int s;
+
+    trace("%s(%llu)", __func__, id);
+
+    if (nsegs > IMGCACHE_SEGMAX)
+    {
+        return -ENOTSUP;
+    }
+
+    for (s = 0; s < nsegs; s++)
+    {
+        npages += seg_pages(&segs[s]);
+    }
+
+    if (npages == 0 || npages > IMGCACHE_PAGES_MAX)
+    {
+        return -ENOTSUP;
+    }
+
+    lock_acquire(&imgcache_lock);
+
+    // Another exec of the same image may have added it while we waited
+
+    if (imgcache_find(id) != NULL)
+    {
+        lock_release(&imgcache_lock);
+        return 0;
+    }
+
+    ent = imgcache_slot(npages);
+    ent->pages = kcalloc(npages, sizeof(void *));
+
+    for (s = 0; s < nsegs; s++)
+    {
+        n = seg_pages(&segs[s]);
+        for (i = 0; i < n; i++)
+        {
+            pp = alloc_phys_page();
+            if (pp == NULL)
+            {
+                goto fail;
+            }
+            ent->pages[k++] = pp;
+
+            off = i * PAGE_SIZE;
+            len = segs[s].filesz - off;
+            if (len > PAGE_SIZE)
+            {
+                len = PAGE_SIZE;
+            }
+            memset(pp + len, 0, PAGE_SIZE - len);
+            if (ioreadat(exeio, segs[s].pos + off, pp, len) != len)
+            {
+                goto fail;
+            }
+        }
+    }
+
+    memcpy(ent->segs, segs, nsegs * sizeof(struct imgcache_seg));
+    ent->nsegs = nsegs;
+    ent->npages = npages;
+    ent->entry = entry;
+    ent->id = id;
+    ent->used = ++imgcache_clock;
+    ent->io = ioaddref(exeio);
+    imgcache_pages += npages;
+
+    lock_release(&imgcache_lock);
+    return 0;
+
+fail:
+    while (k != 0)
+    {
+        put_shared_page(ent->pages[--k]);
+    }
+    kfree(ent->pages);
+    ent->pages = NULL;
+    lock_release(&imgcache_lock);
+    return -ENOMEM;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+struct imgcache_entry *imgcache_find(unsigned long long id)
+{
+    for (int i = 0; i < IMGCACHE_SLOTS; i++)
+    {
+        if (imgcache[i].io != NULL && imgcache[i].id == id)
+        {
+            return &imgcache[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns a free slot with room for _npages_ more pages. Images whose file has
+// changed since they were read go first, then the least recently executed.
+
+struct imgcache_entry *imgcache_slot(unsigned int npages)
+{
+    struct imgcache_entry *ent;
+    struct imgcache_entry *lru;
+    unsigned long long cur;
+
+    for (int i = 0; i < IMGCACHE_SLOTS; i++)
+    {
+        ent = &imgcache[i];
+        if (ent->io != NULL && (ioctl(ent->io, IOCTL_GETID, &cur) != 0 || cur != ent->id))
+        {
+            imgcache_evict(ent);
+        }
+    }
+
+    for (;;)
+    {
+        ent = NULL;
+        lru = NULL;
+        for (int i = 0; i < IMGCACHE_SLOTS; i++)
+        {
+            if (imgcache[i].io == NULL)
+            {
+                ent = &imgcache[i];
+            }
+            else if (lru == NULL || imgcache[i].used < lru->used)
+            {
+                lru = &imgcache[i];
+            }
+        }
+
+        if (ent != NULL && imgcache_pages + npages <= IMGCACHE_PAGES_MAX)
+        {
+            return ent;
+        }
+        imgcache_evict(lru); // npages <= IMGCACHE_PAGES_MAX, so there is one
+    }
+}
+
+// Drops the entry's references. Pages still mapped by processes are freed when
+// the last of them lets go.
+
+void imgcache_evict(struct imgcache_entry *ent)
+{
+    debug("evicting image %llu (%u pages)", ent->id, ent->npages);
+
+    for (unsigned int i = 0; i < ent->npages; i++)
+    {
+        put_shared_page(ent->pages[i]);
+    }
+
+    imgcache_pages -= ent->npages;
+    kfree(ent->pages);
+    ioclose(ent->io);
+    memset(ent, 0, sizeof(struct imgcache_entry));
+}
+
+unsigned int seg_pages(const struct imgcache_seg *seg)
+{
+    return ROUND_UP(seg->filesz, PAGE_SIZE) / PAGE_SIZE;
+}
@@ -0,0 +1,54 @@
+// imgcache.h - Cache of loaded executable images
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _IMGCACHE_H_
+#define _IMGCACHE_H_
+
+#include "io.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Most loadable segments an image can have and still be cached
+
+#define IMGCACHE_SEGMAX 8
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// A loadable segment, as elf_load() checked it. The _filesz_ bytes at file
+// offset _pos_ appear at _vma_, which is page-aligned; the rest of the
+// segment's pages read as zero.
+
+struct imgcache_seg
+{
+    uintptr_t vma;
+    unsigned long long pos;
+    size_t filesz;
+    int flags; // MMAP_WRITE, MMAP_EXEC
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+extern void imgcache_init(void);
+
+// Maps the cached image whose io reported _id_ for IOCTL_GETID into the active
+// memory space and sets *_eptr_ to its entry point. Read-only segments share
+// the cached pages; writable ones map them copy-on-write. Returns 0, -ENOENT
+// if the image is not cached, or -ENOMEM.
+
+extern int imgcache_map(unsigned long long id, void (**eptr)(void));
+
+// Reads the file-backed pages of _segs_ from _exeio_ and keeps them under
+// _id_, evicting the least recently executed images to make room. Returns 0,
+// -ENOTSUP if the image is too large to cache, or a negative error code.
+
+extern int imgcache_add (
+    struct io * exeio, unsigned long long id, void (*entry)(void),
+    const struct imgcache_seg * segs, int nsegs);
+
+#endif // _IMGCACHE_H_
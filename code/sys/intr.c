@@ -19,28 +19,72 @@
 #include "plic.h"
 #include "timer.h"
 #include "thread.h"
+#include "process.h"
+#include "smp.h"
+#include "profile.h"
+#include "console.h"
+#include "device.h"
+#include "ioimpl.h"
+#include "string.h"
+#include "error.h"
+#include "conf.h"
 
 #include <stddef.h>
 
+// Bottom halves that can be pending at once; see intr_defer()
+
+#ifndef INTR_BH_QLEN
+#define INTR_BH_QLEN 16 // must be power of two
+#endif
+
+#ifndef INTR_BH_PRIO
+#define INTR_BH_PRIO 0
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct intr_bh {
+    void (*fn)(void * aux);
+    void * aux;
+};
+
 // EXPORTED GLOBAL VARIABLE DEFINITIONS
 // 
 
 char intrmgr_initialized = 0;
 
-// INTERNAL GLOBAL VARIABLE DEFINITIONS
+// INTERNAL GLOBAL VARIABLE DEFINITIONS
 //
 
 static struct {
-    void (*isr)(int,void*); // isr function
-    void * isr_aux; // isr auxilary var
+    void (*isr)(int,void*); // isr function
+    void * isr_aux; // isr auxilary var
 } isrtab[NIRQ];
 
+static struct intr_stats intr_stats;
+static struct io intrstat_io;
+
+// Bottom-half queue. Only touched with interrupts disabled.
+
+static struct intr_bh bh_queue[INTR_BH_QLEN];
+static unsigned int bh_head; // next to run
+static unsigned int bh_tail; // next free slot
+static struct condition bh_ready;
+static char bh_started;
+
 // INTERNAL FUNCTION DECLARATIONS
 //
-static void handle_interrupt(unsigned int cause);
+static void handle_interrupt(unsigned int cause, const struct trap_frame * tfr, int umode);
 
 static void handle_extern_interrupt(void);
 
+static void intrbh_func(void);
+
+static int intrstat_open(struct io ** ioptr, void * aux);
+static int intrstat_cntl(struct io * io, int cmd, void * arg);
+static long intrstat_read(struct io * io, void * buf, long bufsz);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -50,12 +94,78 @@ void intrmgr_init(void) {
     disable_interrupts(); // should not be enabled yet
     plic_init();
 
-    // Enable timer and external interrupts
-    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_STIE);
+    // Enable timer, external and software (IPI) interrupts
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_STIE | RISCV_SIE_SSIE);
 
     intrmgr_initialized = 1;
 }
 
+void intr_init_hart(void) {
+    trace("%s()", __func__);
+
+    plic_init_hart(running_hart());
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_STIE | RISCV_SIE_SSIE);
+}
+
+void intr_start_bh(void) {
+    static const struct iointf intrstat_iointf = {
+        .cntl = &intrstat_cntl,
+        .read = &intrstat_read
+    };
+
+    int tid;
+
+    condition_init(&bh_ready, "intrbh");
+
+    tid = thread_spawn("intrbh", intrbh_func);
+    if (tid < 0) {
+        kprintf("intrbh: thread_spawn failed (%d)\n", tid);
+    } else {
+        thread_setprio(tid, INTR_BH_PRIO);
+        bh_started = 1;
+    }
+
+    ioinit0(&intrstat_io, &intrstat_iointf);
+    register_device("intrstat", intrstat_open, NULL);
+}
+
+void intr_defer(void (*fn)(void * aux), void * aux) {
+    unsigned int i;
+    int pie;
+
+    pie = disable_interrupts();
+
+    for (i = bh_head; i != bh_tail; i++) {
+        if (bh_queue[i % INTR_BH_QLEN].fn == fn &&
+            bh_queue[i % INTR_BH_QLEN].aux == aux)
+        {
+            restore_interrupts(pie);
+            return;
+        }
+    }
+
+    // Without the thread, or with the queue full, run it here
+
+    if (!bh_started || bh_tail - bh_head == INTR_BH_QLEN) {
+        fn(aux);
+    } else {
+        bh_queue[bh_tail % INTR_BH_QLEN].fn = fn;
+        bh_queue[bh_tail % INTR_BH_QLEN].aux = aux;
+        bh_tail += 1;
+        condition_broadcast(&bh_ready);
+    }
+
+    restore_interrupts(pie);
+}
+
+void intr_get_stats(struct intr_stats * stats) {
+    int pie;
+
+    pie = disable_interrupts();
+    *stats = intr_stats;
+    restore_interrupts(pie);
+}
+
 void enable_intr_source (
     int srcno,
     int prio,
@@ -76,46 +186,116 @@ void disable_intr_source(int srcno) {
     isrtab[srcno].isr_aux = NULL;
 }
 
-void handle_smode_interrupt(unsigned int cause) {
-    handle_interrupt(cause);
+void handle_smode_interrupt(unsigned int cause, struct trap_frame * tfr) {
+    handle_interrupt(cause, tfr, 0);
 }
 
-void handle_umode_interrupt(unsigned int cause) {
-    handle_interrupt(cause);
-    thread_yield();
+void handle_umode_interrupt(unsigned int cause, struct trap_frame * tfr) {
+    handle_interrupt(cause, tfr, 1);
+
+    //  The kernel is not preemptible, so the switch happens on the way back
+    //  to U mode
+
+    if (running_thread_should_yield())
+        thread_yield();
+
+    process_check_exiting();
 }
 
 
 // INTERNAL FUNCTION DEFINITIONS
 //
 
-void handle_interrupt(unsigned int cause) {
+void handle_interrupt(unsigned int cause, const struct trap_frame * tfr, int umode) {
     switch (cause) {
     case RISCV_SCAUSE_STI:
+#ifdef WITH_PROFILER
+        profile_timer(tfr, umode);
+#endif
         handle_timer_interrupt();
         break;
     case RISCV_SCAUSE_SEI:
         handle_extern_interrupt();
         break;
+    case RISCV_SCAUSE_SSI:
+        smp_handle_ipi();
+        break;
     default:
         panic(NULL);
         break;
     }
 }
 
+// Claims and services sources until none is pending, so that interrupts that
+// arrive together cost one trap.
+
 void handle_extern_interrupt(void) {
+    struct intr_src_stat * st;
+    unsigned long long t0, dt;
     int srcno;
 
-    srcno = plic_claim_interrupt();
-    assert (0 <= srcno && srcno < NIRQ);
-    
-    if (srcno == 0)
-        return;
-    
-    if (isrtab[srcno].isr == NULL)
-        panic(NULL);
-    
-    isrtab[srcno].isr(srcno, isrtab[srcno].isr_aux);
+    intr_stats.traps += 1;
+
+    while ((srcno = plic_claim_interrupt()) != 0) {
+        assert (0 < srcno && srcno < NIRQ);
+
+        if (isrtab[srcno].isr == NULL)
+            panic(NULL);
+
+        t0 = rdtime();
+        isrtab[srcno].isr(srcno, isrtab[srcno].isr_aux);
+        dt = rdtime() - t0;
+
+        plic_finish_interrupt(srcno);
+
+        st = &intr_stats.src[srcno];
+        st->count += 1;
+        st->time += dt;
+        if (st->max_time < dt)
+            st->max_time = dt;
+        intr_stats.claims += 1;
+    }
+}
+
+void intrbh_func(void) {
+    struct intr_bh bh;
+    int pie;
+
+    pie = disable_interrupts();
+
+    for (;;) {
+        while (bh_head == bh_tail)
+            condition_wait(&bh_ready);
+
+        bh = bh_queue[bh_head++ % INTR_BH_QLEN];
+        bh.fn(bh.aux);
+        intr_stats.deferred += 1;
+    }
+
+    restore_interrupts(pie);
+}
+
+int intrstat_open(struct io ** ioptr, void * aux) {
+    *ioptr = ioaddref(&intrstat_io);
+    return 0;
+}
+
+int intrstat_cntl(struct io * io, int cmd, void * arg) {
+    switch (cmd) {
+    case IOCTL_GETBLKSZ:
+        return sizeof(struct intr_stats);
+    default:
+        return -ENOTSUP;
+    }
+}
+
+long intrstat_read(struct io * io, void * buf, long bufsz) {
+    struct intr_stats stats;
+
+    if (bufsz > sizeof(stats))
+        bufsz = sizeof(stats);
 
-    plic_finish_interrupt(srcno);
+    intr_get_stats(&stats);
+    memcpy(buf, &stats, bufsz);
+    return bufsz;
 }
\ No newline at end of file
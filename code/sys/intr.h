@@ -9,6 +9,7 @@
 
 #include "riscv.h"
 #include "plic.h"
+#include "conf.h"
 
 // EXPORTED CONSTANT DEFINITIONS
 //
@@ -17,12 +18,40 @@
 #define INTR_PRIO_MAX PLIC_PRIO_MAX
 #define INTR_SRC_CNT PLIC_SRC_CNT
 
+#include <stdint.h>
+
+struct trap_frame; // trap.h
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// Reading the "intrstat" device returns a snapshot of these counters. Times
+// are in timer ticks (TIMER_FREQ per second).
+
+struct intr_src_stat {
+    uint64_t count;    // ISR invocations
+    uint64_t time;     // total ticks spent in the ISR
+    uint64_t max_time; // longest single invocation
+};
+
+struct intr_stats {
+    uint64_t traps;    // external interrupt traps taken
+    uint64_t claims;   // sources claimed across all of them
+    uint64_t deferred; // bottom halves run by the intrbh thread
+    struct intr_src_stat src[NIRQ];
+};
+
 // EXPORTED FUNCTION DECLARATIONS
 // 
 
 extern void intrmgr_init(void);
 extern char intrmgr_initialized;
 
+// Enables interrupts of the running secondary hart at the PLIC and in sie.
+// The hart still has to enable them in sstatus.
+
+extern void intr_init_hart(void);
+
 extern void enable_intr_source (
     int srcno, int prio,
     void (*isr)(int srcno, void * aux),
@@ -30,9 +59,22 @@ extern void enable_intr_source (
 
 extern void disable_intr_source(int srcno);
 
-extern void handle_smode_interrupt(unsigned int cause);
+// Starts the intrbh thread, which runs work deferred by intr_defer(). Called
+// once the thread manager is up; until then deferred work runs at once.
+
+extern void intr_start_bh(void);
+
+// Queues _fn_(_aux_) to run on the intrbh thread, with interrupts disabled.
+// Meant for ISRs with work too heavy for the trap path. Queuing a pair that is
+// already pending does nothing, so a burst of interrupts runs it once.
+
+extern void intr_defer(void (*fn)(void * aux), void * aux);
+
+extern void intr_get_stats(struct intr_stats * stats);
+
+extern void handle_smode_interrupt(unsigned int cause, struct trap_frame * tfr);
 
-extern void handle_umode_interrupt(unsigned int cause);
+extern void handle_umode_interrupt(unsigned int cause, struct trap_frame * tfr);
 
 static inline long enable_interrupts(void) {
     return csrrsi_sstatus_SIE();
@@ -13,6 +13,9 @@
 #include "thread.h"
 #include "memory.h"
 #include "intr.h"
+#include "timer.h"
+#include "tracepoint.h"
+#include "dev/fbuf.h"
 
 #include <stddef.h>
 #include <limits.h>
@@ -30,6 +33,14 @@ struct memio
 
 // #define PIPE_BUFSZ PAGE_SIZE
 
+// A reader wakes blocked writers only once at least this much space is free,
+// so a writer refills the pipe in a few large copies instead of many small
+// ones.
+
+#ifndef PIPE_WAKE_SPACE
+#define PIPE_WAKE_SPACE (PAGE_SIZE / 4)
+#endif
+
 struct seekio
 {
     struct io io;           // I/O struct of seek I/O
@@ -39,6 +50,31 @@ struct seekio
     int blksz;              // Block size of backing endpoint
 };
 
+// Buffers reads from and writes to a backing endpoint. Read-ahead data is
+// buf[rpos, rend); pending write data is buf[0, wlen). Only one of them is
+// non-empty at a time, since each flushes or drops the other first.
+
+struct bufio
+{
+    struct io io;
+    struct io *bkgio; // backing endpoint
+    int mode;         // BUFIO_READ, BUFIO_WRITE
+    char *buf;
+    long bufsz;       // multiple of the backing block size
+    long rpos;
+    long rend;
+    long wlen;
+};
+
+// A thread sleeping in iopollv(). It sleeps on its own alarm, which serves
+// as the timeout and which ionotify() cancels to wake it early.
+
+struct io_poller
+{
+    struct io_poller *next;
+    struct alarm alarm;
+};
+
 // struct nullio
 // {
 //     struct io io;
@@ -64,9 +100,11 @@ struct pipe
     struct condition notfull;  // check this when we want to remove data
 };
 
-// INTERNAL FUNCTION DEFINITIONS
+// INTERNAL FUNCTION DEFINITIONS
 //
 
+static long ioctl_arg_size(int cmd, int *out);
+
 static int memio_cntl(struct io *io, int cmd, void *arg);
 
 static long memio_readat(
@@ -89,19 +127,31 @@ static long seekio_readat(
 static long seekio_writeat(
     struct io *io, unsigned long long pos, const void *buf, long len);
 
+static void bufio_close(struct io *io);
+static int bufio_cntl(struct io *io, int cmd, void *arg);
+static long bufio_read(struct io *io, void *buf, long bufsz);
+static long bufio_write(struct io *io, const void *buf, long len);
+static int bufio_flush(struct bufio *bio);
+static int bufio_poll(struct io *io, int events);
+
 static void pipe_close(struct io *io);
 static long pipe_read(struct io *io, void *buf, long bufsz);
 static long pipe_write(struct io *io, const void *buf, long len);
 static int pipe_cntl(struct io *io, int cmd, void *arg);
+static int pipe_poll(struct io *io, int events);
 int rbuf_full(const struct pipe *rbuf);
-void rbuf_putc(struct pipe *rbuf, char c);
-char rbuf_getc(struct pipe *rbuf);
+long rbuf_put(struct pipe *rbuf, const char *src, long len);
+long rbuf_get(struct pipe *rbuf, char *dst, long len);
 int rbuf_empty(const struct pipe *rbuf);
 // static long null_read(struct io *io, void *buf, long bufsz);
 // static long null_write(struct io *io, const void *buf, long len);
 // static int null_cntl(struct io *io, int cmd, void *arg);
 // static void null_close(struct io *io);
 
+// INTERNAL GLOBAL VARIABLES
+
+static struct io_poller *pollers; // threads in iopollv()
+
 // INTERNAL GLOBAL CONSTANTS
 static const struct iointf seekio_iointf = {
     .close = &seekio_close,
@@ -111,6 +161,13 @@ static const struct iointf seekio_iointf = {
     .readat = &seekio_readat,
     .writeat = &seekio_writeat};
 
+static const struct iointf bufio_iointf = {
+    .close = &bufio_close,
+    .cntl = &bufio_cntl,
+    .read = &bufio_read,
+    .write = &bufio_write,
+    .poll = &bufio_poll};
+
 static const struct iointf memio_iointf = {
     .readat = &memio_readat,
     .writeat = &memio_writeat,
@@ -119,12 +176,14 @@ static const struct iointf memio_iointf = {
 static const struct iointf pipe_read_intf = {
     .close = &pipe_close,
     .read = &pipe_read,
-    .cntl = &pipe_cntl};
+    .cntl = &pipe_cntl,
+    .poll = &pipe_poll};
 
 static const struct iointf pipe_write_intf = {
     .close = &pipe_close,
     .write = &pipe_write,
-    .cntl = &pipe_cntl};
+    .cntl = &pipe_cntl,
+    .poll = &pipe_poll};
 
 // static const struct iointf null_iointf = {
 //     .read = &null_read,
@@ -171,6 +230,12 @@ static void pipe_close(struct io *io)
         p = (struct pipe *)((char *)io - offsetof(struct pipe, writeio));
     }
 
+    // Wake the other end so it sees EOF or EPIPE
+
+    condition_broadcast(&p->notempty);
+    condition_broadcast(&p->notfull);
+    ionotify();
+
     if (p->readio.refcnt == 0 && p->writeio.refcnt == 0)
     {
         free_phys_page(p->buf);
@@ -209,20 +274,17 @@ static long pipe_read(struct io *io, void *buf, long bufsz)
         return -EINVAL;
     }
 
-    // lock_acquire(&p->lock);
-
-    // //What is EOF how should we repersent it?
-    // if ((p->tailpos - p->headpos == PAGE_SIZE) && (p->writeio.refcnt == 0)) {
-    //     return 0; //Reprsent EOF;
-    // }
-
     // Are we supposed to do short read?
     int pie = disable_interrupts();
 
     while (rbuf_empty(p) && p->writeio.refcnt > 0)
     {
         //  put thread to sleep via condition wait
-        condition_wait(&p->notempty);
+        if (condition_wait_interruptible(&p->notempty) != 0)
+        {
+            restore_interrupts(pie);
+            return -EINTR;
+        }
     }
     if (rbuf_empty(p) && p->writeio.refcnt == 0)
     {
@@ -232,26 +294,22 @@ static long pipe_read(struct io *io, void *buf, long bufsz)
 
     restore_interrupts(pie);
 
-    for (long i = 0; i < bufsz; i++)
+    // Take whatever is there in at most two copies, one per contiguous span
+
+    lock_acquire(&p->lock);
+    unsigned long long space = PAGE_SIZE - p->data;
+    long nread = rbuf_get(p, buf, bufsz);
+    lock_release(&p->lock);
+
+    if (space < PIPE_WAKE_SPACE && space + nread >= PIPE_WAKE_SPACE)
     {
-        if (!rbuf_empty(p))
-        {
-            char c = rbuf_getc(p);
-            lock_acquire(&p->lock);
-            ((char *)(buf))[i] = c;
-            p->data--;
-            lock_release(&p->lock);
-            // bytes_read++;
-        }
-        else
-        {
-            condition_broadcast(&p->notfull);
-            return i;
-        }
+        condition_broadcast(&p->notfull);
     }
-
-    condition_broadcast(&p->notfull);
-    return bufsz;
+    if (space == 0)
+    {
+        ionotify();
+    }
+    return nread;
 }
 
 static long pipe_write(struct io *io, const void *buf, long len)
@@ -287,12 +345,17 @@ static long pipe_write(struct io *io, const void *buf, long len)
     {
         return -EPIPE;
     }
-    for (bytes_written = 0; bytes_written < len; bytes_written++)
+    bytes_written = 0;
+    while (bytes_written < len)
     {
         int pie = disable_interrupts();
-        while (rbuf_full(p))
+        while (rbuf_full(p) && p->readio.refcnt > 0)
         {
-            condition_wait(&p->notfull);
+            if (condition_wait_interruptible(&p->notfull) != 0)
+            {
+                restore_interrupts(pie);
+                return (bytes_written > 0) ? bytes_written : -EINTR;
+            }
         }
         restore_interrupts(pie);
 
@@ -300,27 +363,24 @@ static long pipe_write(struct io *io, const void *buf, long len)
         {
             if (bytes_written > 0)
             {
-                condition_broadcast(&p->notempty);
                 return bytes_written;
             }
             return -EPIPE; // epipe or bytes written?
         }
+
         lock_acquire(&p->lock);
-        rbuf_putc(p, ((char *)buf)[bytes_written]);
-        p->data++;
+        int was_empty = rbuf_empty(p);
+        bytes_written += rbuf_put(p, (const char *)buf + bytes_written, len - bytes_written);
         lock_release(&p->lock);
-        // if (p->data == 1)
-        // {
-        //     condition_broadcast(&p->notempty);
-        // }
 
-        if ((bytes_written % PAGE_SIZE) == 0)
+        // Readers only sleep on an empty pipe
+
+        if (was_empty)
         {
             condition_broadcast(&p->notempty);
-            // condition_wait(&p->notfull);
+            ionotify();
         }
     }
-    condition_broadcast(&p->notempty); // data ready to read
     return bytes_written;
 }
 
@@ -331,29 +391,89 @@ int rbuf_empty(const struct pipe *pipe)
 
 int rbuf_full(const struct pipe *pipe)
 {
-    return ((uint16_t)(pipe->tailpos - pipe->headpos) == PAGE_SIZE);
+    return (pipe->tailpos - pipe->headpos == PAGE_SIZE);
 }
 
-void rbuf_putc(struct pipe *pipe, char c)
+static int pipe_poll(struct io *io, int events)
 {
-    uint_fast16_t tpos;
+    struct pipe *p;
+    int revents = 0;
 
-    tpos = pipe->tailpos;
-    pipe->buf[tpos % PAGE_SIZE] = c;
+    if (io->intf == &pipe_read_intf)
+    {
+        p = (struct pipe *)((char *)io - offsetof(struct pipe, readio));
+        if (!rbuf_empty(p))
+        {
+            revents |= events & POLLIN;
+        }
+        if (p->writeio.refcnt == 0)
+        {
+            revents |= POLLHUP | (events & POLLIN);
+        }
+    }
+    else
+    {
+        p = (struct pipe *)((char *)io - offsetof(struct pipe, writeio));
+        if (!rbuf_full(p))
+        {
+            revents |= events & POLLOUT;
+        }
+        if (p->readio.refcnt == 0)
+        {
+            revents |= POLLERR | (events & POLLOUT);
+        }
+    }
+    return revents;
+}
+
+// Copies up to _len_ bytes from _src_ into the ring and returns the number
+// copied. Caller holds the pipe lock.
+
+long rbuf_put(struct pipe *pipe, const char *src, long len)
+{
+    const unsigned long long tpos = pipe->tailpos;
+    const size_t off = tpos % PAGE_SIZE;
+    size_t cnt, span;
+
+    cnt = PAGE_SIZE - (tpos - pipe->headpos);
+    if ((unsigned long)len < cnt)
+        cnt = len;
+
+    span = PAGE_SIZE - off;
+    if (cnt < span)
+        span = cnt;
+
+    memcpy(pipe->buf + off, src, span);
+    memcpy(pipe->buf, src + span, cnt - span);
     asm volatile("" ::: "memory");
-    pipe->tailpos = tpos + 1;
+    pipe->tailpos = tpos + cnt;
+    pipe->data += cnt;
+    return cnt;
 }
 
-char rbuf_getc(struct pipe *pipe)
+// Copies up to _len_ bytes out of the ring into _dst_ and returns the number
+// copied. Caller holds the pipe lock.
+
+long rbuf_get(struct pipe *pipe, char *dst, long len)
 {
-    uint_fast16_t hpos;
-    char c;
+    const unsigned long long hpos = pipe->headpos;
+    const size_t off = hpos % PAGE_SIZE;
+    size_t cnt, span;
+
+    cnt = pipe->tailpos - hpos;
+    if ((unsigned long)len < cnt)
+        cnt = len;
 
-    hpos = pipe->headpos;
-    c = pipe->buf[hpos % PAGE_SIZE];
+    span = PAGE_SIZE - off;
+    if (cnt < span)
+        span = cnt;
+
+    memcpy(dst, pipe->buf + off, span);
+    memcpy(dst + span, pipe->buf, cnt - span);
     asm volatile("" ::: "memory");
-    pipe->headpos = hpos + 1;
-    return c;
+    pipe->headpos = hpos + cnt;
+    pipe->data -= cnt;
+    return cnt;
 }
 
 static int pipe_cntl(struct io *io, int cmd, void *arg)
@@ -516,6 +636,189 @@ long iowrite(struct io *io, const void *buf, long len)
     return bufpos;
 }
 
+// Moves data through one page of kernel memory, so each chunk is copied twice
+// in the kernel instead of crossing into U mode and back.
+
+long iosplice(struct io *out, struct io *in, long len)
+{
+    char *const page = alloc_phys_page();
+    long moved = 0; // bytes written to _out_ so far
+    long nread, n;
+
+    assert(out != NULL && in != NULL);
+
+    if (len < 0)
+        return -EINVAL;
+
+    if (page == NULL)
+        return -ENOMEM;
+
+    while (moved < len)
+    {
+        nread = ioread(in, page, (len - moved < PAGE_SIZE) ? len - moved : PAGE_SIZE);
+
+        if (nread <= 0)
+        {
+            if (nread < 0 && moved == 0)
+                moved = nread;
+            break;
+        }
+
+        n = iowrite(out, page, nread);
+
+        if (n < 0 && moved == 0)
+            moved = n;
+        if (n <= 0)
+            break;
+
+        moved += n;
+
+        if (n < nread)
+            break;
+    }
+
+    free_phys_page(page);
+    return moved;
+}
+
+long ioreadv(struct io *io, const struct iovec *iov, int cnt)
+{
+    long total = 0; // bytes read into all buffers so far
+    long n;
+    int i;
+
+    assert(io != NULL);
+    assert(io->intf != NULL);
+
+    if (cnt < 0 || cnt > IOV_MAX)
+        return -EINVAL;
+
+    if (io->intf->readv != NULL)
+        return io->intf->readv(io, iov, cnt);
+
+    for (i = 0; i < cnt; i++)
+    {
+        if ((long)iov[i].len < 0)
+            return -EINVAL;
+
+        n = ioread(io, iov[i].base, iov[i].len);
+
+        if (n < 0)
+            return (total > 0) ? total : n;
+
+        total += n;
+
+        if (n < (long)iov[i].len)
+            break;
+    }
+
+    return total;
+}
+
+long iowritev(struct io *io, const struct iovec *iov, int cnt)
+{
+    long total = 0; // bytes written from all buffers so far
+    long n;
+    int i;
+
+    assert(io != NULL);
+    assert(io->intf != NULL);
+
+    if (cnt < 0 || cnt > IOV_MAX)
+        return -EINVAL;
+
+    if (io->intf->writev != NULL)
+        return io->intf->writev(io, iov, cnt);
+
+    for (i = 0; i < cnt; i++)
+    {
+        if ((long)iov[i].len < 0)
+            return -EINVAL;
+
+        n = iowrite(io, iov[i].base, iov[i].len);
+
+        if (n < 0)
+            return (total > 0) ? total : n;
+
+        total += n;
+
+        if (n < (long)iov[i].len)
+            break;
+    }
+
+    return total;
+}
+
+int iopoll(struct io *io, int events)
+{
+    assert(io != NULL);
+    assert(io->intf != NULL);
+
+    if (io->intf->poll == NULL)
+        return events & (POLLIN | POLLOUT);
+
+    return io->intf->poll(io, events);
+}
+
+int iopollv(struct iopollfd *fds, int cnt, long timeout_ms)
+{
+    const unsigned long long tstart = rdtime();
+    const unsigned long long tlen = timeout_ms * (TIMER_FREQ / 1000);
+    struct io_poller poller;
+    struct io_poller **link;
+    int ready, i, pie;
+
+    if (cnt < 0 || cnt > IOPOLL_MAX)
+        return -EINVAL;
+
+    alarm_init(&poller.alarm, "poll");
+
+    // Checking and going to sleep are atomic with respect to ionotify()
+
+    pie = disable_interrupts();
+    poller.next = pollers;
+    pollers = &poller;
+
+    for (;;)
+    {
+        ready = 0;
+        for (i = 0; i < cnt; i++)
+        {
+            fds[i].revents = iopoll(fds[i].io, fds[i].events);
+            if (fds[i].revents != 0)
+                ready += 1;
+        }
+
+        if (ready != 0 || timeout_ms == 0)
+            break;
+
+        if (timeout_ms > 0 && rdtime() - tstart >= tlen)
+            break;
+
+        alarm_reset(&poller.alarm);
+        alarm_sleep(&poller.alarm, (timeout_ms < 0) ? UINT64_MAX :
+                    tlen - (rdtime() - tstart));
+    }
+
+    for (link = &pollers; *link != &poller; link = &(*link)->next)
+        continue;
+    *link = poller.next;
+
+    restore_interrupts(pie);
+    return ready;
+}
+
+void ionotify(void)
+{
+    struct io_poller *poller;
+    int pie;
+
+    pie = disable_interrupts();
+    for (poller = pollers; poller != NULL; poller = poller->next)
+        alarm_cancel(&poller->alarm);
+    restore_interrupts(pie);
+}
+
 long ioreadat(
     struct io *io, unsigned long long pos, void *buf, long bufsz)
 {
@@ -559,6 +862,39 @@ int ioctl(struct io *io, int cmd, void *arg)
         return -ENOTSUP;
 }
 
+int ioctl_user(struct io *io, int cmd, void *uarg)
+{
+    union
+    {
+        unsigned long long ull;
+        unsigned int ui;
+        void *ptr;
+        struct io_range range;
+        struct fbuf_conf fbconf;
+    } karg;
+    long size;
+    int out;
+    int result;
+
+    size = ioctl_arg_size(cmd, &out);
+
+    if (size < 0)
+        return -ENOTSUP;
+
+    if (size == 0)
+        return ioctl(io, cmd, NULL);
+
+    if (uarg == NULL || copy_from_user(&karg, uarg, size) != 0)
+        return -EINVAL;
+
+    result = ioctl(io, cmd, &karg);
+
+    if (result >= 0 && out && copy_to_user(uarg, &karg, size) != 0)
+        return -EINVAL;
+
+    return result;
+}
+
 int ioblksz(struct io *io)
 {
     return ioctl(io, IOCTL_GETBLKSZ, NULL);
@@ -608,9 +944,78 @@ struct io *create_seekable_io(struct io *io)
     return ioinit1(&sio->io, &seekio_iointf);
 };
 
-// INTERNAL FUNCTION DEFINITIONS
+struct io *create_buffered_io(struct io *io, long bufsz, int mode)
+{
+    struct bufio *bio;
+    int blksz;
+
+    assert(io != NULL);
+
+    if (bufsz <= 0 || (mode & ~(BUFIO_READ | BUFIO_WRITE)) != 0)
+        return NULL;
+
+    blksz = ioblksz(io);
+    if (blksz <= 0)
+        blksz = 1;
+
+    bio = kcalloc(1, sizeof(struct bufio));
+    bio->bufsz = ROUND_UP(bufsz, blksz);
+    bio->buf = kmalloc(bio->bufsz);
+    bio->mode = mode;
+    bio->bkgio = ioaddref(io);
+
+    return ioinit1(&bio->io, &bufio_iointf);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
 //
 
+// Returns the size of the argument of ioctl command _cmd_, or 0 if it takes
+// none, and sets *_out_ if the command stores a result in it. Returns -1 for
+// a command the kernel does not know.
+
+static long ioctl_arg_size(int cmd, int *out)
+{
+    *out = 0;
+
+    switch (cmd)
+    {
+    case IOCTL_GETBLKSZ:
+    case IOCTL_FLUSH:
+        return 0;
+    case IOCTL_GETEND:
+    case IOCTL_GETPOS:
+    case IOCTL_GETREADAHEAD:
+    case IOCTL_GETID:
+        *out = 1;
+        return sizeof(unsigned long long);
+    case IOCTL_SETEND:
+    case IOCTL_SETPOS:
+    case IOCTL_SETREADAHEAD:
+    case IOCTL_PREALLOC:
+        return sizeof(unsigned long long);
+    case IOCTL_DISCARD:
+    case IOCTL_WRITE_ZEROES:
+        return sizeof(struct io_range);
+    case IOCTL_GETFBUF:
+    case IOCTL_MAPFBUF:
+        *out = 1;
+        return sizeof(void *);
+    case IOCTL_GETFBCONF:
+        *out = 1;
+        return sizeof(struct fbuf_conf);
+    case IOCTL_SETFBCONF:
+        return sizeof(struct fbuf_conf);
+    case IOCTL_GETTRACEMASK:
+        *out = 1;
+        return sizeof(unsigned int);
+    case IOCTL_SETTRACEMASK:
+        return sizeof(unsigned int);
+    default:
+        return -1;
+    }
+}
+
 long memio_readat(
     struct io *io,
     unsigned long long pos,
@@ -721,6 +1126,12 @@ int seekio_cntl(struct io *io, int cmd, void *arg)
         if (result == 0)
             sio->end = *ullarg;
         return result;
+    case IOCTL_PREALLOC:
+        // The backing endpoint may not grow to exactly *ullarg
+        result = ioctl(sio->bkgio, IOCTL_PREALLOC, ullarg);
+        if (result == 0)
+            result = ioctl(sio->bkgio, IOCTL_GETEND, &sio->end);
+        return result;
     default:
         return ioctl(sio->bkgio, cmd, arg);
     }
@@ -806,6 +1217,177 @@ long seekio_writeat(
     return iowriteat(sio->bkgio, pos, buf, len);
 }
 
+void bufio_close(struct io *io)
+{
+    struct bufio *const bio = (void *)io - offsetof(struct bufio, io);
+
+    bufio_flush(bio);
+    ioclose(bio->bkgio);
+    kfree(bio->buf);
+    kfree(bio);
+}
+
+int bufio_cntl(struct io *io, int cmd, void *arg)
+{
+    struct bufio *const bio = (void *)io - offsetof(struct bufio, io);
+    unsigned long long *ullarg = arg;
+    int result;
+
+    // Everything but GETBLKSZ and GETPOS sees the backing endpoint with our
+    // pending writes applied
+
+    switch (cmd)
+    {
+    case IOCTL_GETBLKSZ:
+        return 1;
+    case IOCTL_GETPOS:
+        result = ioctl(bio->bkgio, IOCTL_GETPOS, ullarg);
+        if (result == 0)
+            *ullarg = *ullarg - (bio->rend - bio->rpos) + bio->wlen;
+        return result;
+    case IOCTL_FLUSH:
+        result = bufio_flush(bio);
+        if (result != 0)
+            return result;
+        result = ioctl(bio->bkgio, IOCTL_FLUSH, NULL);
+        return (result == -ENOTSUP) ? 0 : result;
+    default:
+        result = bufio_flush(bio);
+        if (result != 0)
+            return result;
+        if (cmd == IOCTL_SETPOS)
+            bio->rpos = bio->rend = 0;
+        return ioctl(bio->bkgio, cmd, arg);
+    }
+}
+
+long bufio_read(struct io *io, void *buf, long bufsz)
+{
+    struct bufio *const bio = (void *)io - offsetof(struct bufio, io);
+    long cnt, n;
+
+    if (!(bio->mode & BUFIO_READ))
+        return ioread(bio->bkgio, buf, bufsz);
+
+    // Pending output goes first, so a prompt appears before we wait for input
+
+    if (bio->wlen != 0)
+    {
+        n = bufio_flush(bio);
+        if (n < 0)
+            return n;
+    }
+
+    if (bio->rpos == bio->rend)
+    {
+        // Large reads bypass the buffer
+
+        if (bufsz >= bio->bufsz)
+            return ioread(bio->bkgio, buf, bufsz - bufsz % bio->bufsz);
+
+        n = ioread(bio->bkgio, bio->buf, bio->bufsz);
+        if (n <= 0)
+            return n;
+
+        bio->rpos = 0;
+        bio->rend = n;
+    }
+
+    cnt = bio->rend - bio->rpos;
+    if (bufsz < cnt)
+        cnt = bufsz;
+
+    memcpy(buf, bio->buf + bio->rpos, cnt);
+    bio->rpos += cnt;
+    return cnt;
+}
+
+long bufio_write(struct io *io, const void *buf, long len)
+{
+    struct bufio *const bio = (void *)io - offsetof(struct bufio, io);
+    long cnt, n;
+
+    if (!(bio->mode & BUFIO_WRITE))
+        return iowrite(bio->bkgio, buf, len);
+
+    // Read-ahead data is stale once we write. A seekable backend has moved
+    // past it, so move back first.
+
+    if (bio->rpos != bio->rend)
+    {
+        unsigned long long pos;
+
+        if (ioctl(bio->bkgio, IOCTL_GETPOS, &pos) == 0)
+        {
+            pos -= bio->rend - bio->rpos;
+            ioseek(bio->bkgio, pos);
+        }
+        bio->rpos = bio->rend = 0;
+    }
+
+    // Large writes bypass the buffer once it is empty
+
+    if (bio->wlen == 0 && len >= bio->bufsz)
+        return iowrite(bio->bkgio, buf, len - len % bio->bufsz);
+
+    cnt = bio->bufsz - bio->wlen;
+    if (len < cnt)
+        cnt = len;
+
+    memcpy(bio->buf + bio->wlen, buf, cnt);
+    bio->wlen += cnt;
+
+    if (bio->wlen == bio->bufsz)
+    {
+        n = bufio_flush(bio);
+        if (n < 0)
+            return n;
+    }
+
+    return cnt;
+}
+
+int bufio_poll(struct io *io, int events)
+{
+    struct bufio *const bio = (void *)io - offsetof(struct bufio, io);
+    int revents = 0;
+
+    if ((events & POLLIN) && bio->rpos != bio->rend)
+    {
+        revents |= POLLIN;
+        events &= ~POLLIN;
+    }
+    if ((events & POLLOUT) && (bio->mode & BUFIO_WRITE) && bio->wlen < bio->bufsz)
+    {
+        revents |= POLLOUT;
+        events &= ~POLLOUT;
+    }
+    return revents | iopoll(bio->bkgio, events);
+}
+
+// Writes out pending data. Returns 0 or a negative error code; on a short
+// write the unwritten part stays buffered.
+
+int bufio_flush(struct bufio *bio)
+{
+    long n, i;
+
+    if (bio->wlen == 0)
+        return 0;
+
+    n = iowrite(bio->bkgio, bio->buf, bio->wlen);
+    if (n < 0)
+        return n;
+
+    // Copying forward is safe for an overlapping move down
+
+    for (i = 0; i < bio->wlen - n; i++)
+        bio->buf[i] = bio->buf[n + i];
+
+    bio->wlen -= n;
+    return (bio->wlen == 0) ? 0 : -EIO;
+}
+
 // struct io *create_null_io(void)
 // {
 //     // return NULL;
@@ -14,13 +14,59 @@
 
 struct io; // opaque (defined in ioimpl.h)
 
+// One buffer of a vectored read or write
+
+struct iovec
+{
+    void *base;
+    size_t len;
+};
+
+#define IOV_MAX 16 // most buffers in one vectored call
+
+struct io_range
+{
+    unsigned long long pos; // byte offset
+    unsigned long long len; // byte count
+};
+
 #define IOCTL_GETBLKSZ 0 // arg is ignored
 #define IOCTL_GETEND 2   // arg is unsigned long long *
 #define IOCTL_SETEND 3   // arg is const unsigned long long *
 #define IOCTL_GETPOS 4   // arg is unsigned long long *
 #define IOCTL_SETPOS 5   // arg is const unsigned long long *
+#define IOCTL_GETREADAHEAD 6 // arg is unsigned long long * (blocks)
+#define IOCTL_SETREADAHEAD 7 // arg is const unsigned long long * (blocks)
+#define IOCTL_FLUSH 8 // arg is ignored; waits until written data is durable
+#define IOCTL_DISCARD 9 // arg is const struct io_range *; contents become undefined
+#define IOCTL_WRITE_ZEROES 10 // arg is const struct io_range *
+#define IOCTL_PREALLOC 11 // arg is const unsigned long long *; grows end to at least *arg
+#define IOCTL_GETID 12 // arg is unsigned long long *; changes whenever the contents may have
+
+// Readiness events for iopoll()
+
+#define POLLIN 0x01  // read would not block
+#define POLLOUT 0x04 // write would not block
+#define POLLERR 0x08 // write would fail (reported even if not asked for)
+#define POLLHUP 0x10 // other end closed (reported even if not asked for)
+
+#define IOPOLL_MAX 16 // most endpoints in one iopollv() call
+
+// One endpoint of an iopollv() call
 
-// EXPORTED FUNCTION DECLARATIONS
+struct iopollfd
+{
+    struct io *io;
+    int events;  // POLLIN, POLLOUT
+    int revents; // set by iopollv()
+};
+
+// Modes for create_buffered_io()
+
+#define BUFIO_READ 0x1  // read ahead
+#define BUFIO_WRITE 0x2 // coalesce writes
+
+// EXPORTED FUNCTION DECLARATIONS
 //
 
 extern unsigned long iorefcnt(const struct io *io);
@@ -33,6 +79,15 @@ extern int ioctl(
     int cmd,
     void *arg);
 
+// Like ioctl(), but _uarg_ is in the active user memory space. The argument is
+// copied in, and back out for commands that return a result through it, using
+// the size the command defines. Returns -ENOTSUP for an unknown command.
+
+extern int ioctl_user(
+    struct io *io,
+    int cmd,
+    void *uarg);
+
 extern long ioread(
     struct io *io,
     void *buf,
@@ -48,6 +103,47 @@ extern long iowrite(
     const void *buf,
     long len);
 
+// Copies up to _len_ bytes from _in_ to _out_ without going through user
+// memory. Stops early at end of file on _in_ or on a short write to _out_.
+// Returns the number of bytes written to _out_, or a negative error code if
+// nothing was.
+
+extern long iosplice(
+    struct io *out,
+    struct io *in,
+    long len);
+
+// Read into or write from _cnt_ buffers in turn, using the endpoint's
+// vectored operation if it has one. Stop at the first short transfer. Return
+// the total number of bytes transferred or a negative error code.
+
+extern long ioreadv(
+    struct io *io,
+    const struct iovec *iov,
+    int cnt);
+
+extern long iowritev(
+    struct io *io,
+    const struct iovec *iov,
+    int cnt);
+
+// Returns the events of _events_ for which _io_ is ready now, plus POLLERR
+// and POLLHUP if they apply. Endpoints without a poll operation never block
+// and are always ready. Does not block.
+
+extern int iopoll(struct io *io, int events);
+
+// Waits until one of the _cnt_ endpoints of _fds_ is ready, or for at most
+// _timeout_ms_ milliseconds if it is not negative. Sets each revents and
+// returns the number of ready endpoints, 0 on timeout.
+
+extern int iopollv(struct iopollfd *fds, int cnt, long timeout_ms);
+
+// Called by endpoints with a poll operation when they may have become ready.
+// Wakes threads in iopollv() so they check again. May be called from an ISR.
+
+extern void ionotify(void);
+
 extern long ioreadat(
     struct io *io,
     unsigned long long pos,
@@ -67,6 +163,15 @@ extern int ioseek(
 extern int ioblksz(struct io *io);
 extern struct io *create_memory_io(void *buf, size_t size);
 extern struct io *create_seekable_io(struct io *io);
+
+// Returns an endpoint that reads from and writes to _io_ through a buffer of
+// at least _bufsz_ bytes. With BUFIO_READ, reads fill the buffer with one
+// backing read; with BUFIO_WRITE, writes are collected until it is full, the
+// endpoint is closed, or IOCTL_FLUSH. Reading flushes pending writes first.
+// The endpoint takes its own reference to _io_. Returns NULL if _mode_ or
+// _bufsz_ is invalid.
+
+extern struct io *create_buffered_io(struct io *io, long bufsz, int mode);
 // extern struct io *create_null_io(void);
 // extern long null_read(struct io *io, void *buf, long bufsz);
 // extern long null_write(struct io *io, const void *buf, long len);
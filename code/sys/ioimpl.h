@@ -48,6 +48,28 @@ struct iointf {
         const void * buf,
         long len
     );
+
+    // Optional. Without them ioreadv() and iowritev() call ioread() and
+    // iowrite() once per buffer. No endpoint provides them yet.
+
+    long (*readv) (
+        struct io * io,
+        const struct iovec * iov,
+        int cnt
+    );
+    long (*writev) (
+        struct io * io,
+        const struct iovec * iov,
+        int cnt
+    );
+
+    // Optional. Returns the ready events without blocking; see iopoll().
+    // Endpoints that have it call ionotify() when they may become ready.
+
+    int (*poll) (
+        struct io * io,
+        int events
+    );
 };
 
 // EXPORTED FUNCTION DECLARATIONS
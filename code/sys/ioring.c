@@ -0,0 +1,286 @@
+// ioring.c - Submission and completion rings shared with a process
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+// A process batches requests in the submission ring and kicks the kernel with
+// a single SYSCALL_RING_ENTER. A kernel thread in the process takes them one
+// at a time, runs each as the matching system call would, and posts the
+// result to the completion ring. The process can go on running while the
+// thread works, and consumes completions without entering the kernel.
+
+#ifdef IORING_TRACE
+#define TRACE
+#endif
+
+#ifdef IORING_DEBUG
+#define DEBUG
+#endif
+
+#include "ioring.h"
+#include "process.h"
+#include "thread.h"
+#include "memory.h"
+#include "string.h"
+#include "heap.h"
+#include "intr.h"
+#include "error.h"
+#include "riscv.h"
+#include "assert.h"
+#include "io.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct ioring
+{
+    struct ioring_shared *shared; // user address of the rings
+    struct process *proc;
+    int tid;           // ring thread
+    uint32_t sq_head;  // authoritative copies of the kernel-owned indices
+    uint32_t cq_tail;
+    int stop;          // set by ioring_destroy()
+    int stopped;       // set by the ring thread as it exits
+    struct condition kick;      // new submissions or stop
+    struct condition completed; // new completions or stopped
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void ioring_func(struct ioring *ring);
+static int64_t ioring_execute(struct process *proc, const struct ioring_sqe *sqe);
+static uint32_t sq_pending(const struct ioring *ring);
+static uint32_t cq_ready(const struct ioring *ring);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+long ioring_setup(void)
+{
+    struct process *const proc = current_process();
+    struct ioring *ring;
+    void *page;
+    int tid;
+
+    trace("%s()", __func__);
+
+    assert(sizeof(struct ioring_shared) <= PAGE_SIZE);
+
+    if (proc->ioring != NULL)
+    {
+        return -EBUSY;
+    }
+    if (process_find_mmap(PROCESS_RING_VMA) != NULL)
+    {
+        return -ENOMEM;
+    }
+
+    page = alloc_phys_page();
+    if (page == NULL)
+    {
+        return -ENOMEM;
+    }
+    memset(page, 0, PAGE_SIZE);
+
+    // The page belongs to the memory space from here on and is freed with it
+
+    map_page(PROCESS_RING_VMA, page, PTE_R | PTE_W | PTE_U);
+    sfence_vma();
+
+    ring = kcalloc(1, sizeof(struct ioring));
+    ring->shared = (struct ioring_shared *)PROCESS_RING_VMA;
+    ring->proc = proc;
+    condition_init(&ring->kick, "ioring_kick");
+    condition_init(&ring->completed, "ioring_done");
+
+    tid = thread_spawn("ioring", (void *)&ioring_func, ring);
+    if (tid < 0)
+    {
+        unmap_and_free_range((void *)PROCESS_RING_VMA, PAGE_SIZE);
+        sfence_vma();
+        kfree(ring);
+        return tid;
+    }
+    thread_set_process(tid, proc);
+    ring->tid = tid;
+    proc->ioring = ring;
+    return PROCESS_RING_VMA;
+}
+
+int ioring_enter(unsigned int min_complete)
+{
+    struct ioring *const ring = current_process()->ioring;
+    uint32_t ready;
+    int pie;
+
+    trace("%s(%u)", __func__, min_complete);
+
+    if (ring == NULL || min_complete > IORING_ENTRIES)
+    {
+        return -EINVAL;
+    }
+
+    pie = disable_interrupts();
+    condition_broadcast(&ring->kick);
+
+    while ((ready = cq_ready(ring)) < min_complete && !ring->stopped)
+    {
+        condition_wait(&ring->completed);
+    }
+
+    restore_interrupts(pie);
+    return ready;
+}
+
+void ioring_destroy(struct process *proc)
+{
+    struct ioring *const ring = proc->ioring;
+    int pie;
+
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    pie = disable_interrupts();
+    ring->stop = 1;
+    condition_broadcast(&ring->kick);
+
+    while (!ring->stopped)
+    {
+        condition_wait(&ring->completed);
+    }
+
+    restore_interrupts(pie);
+
+    thread_join(ring->tid);
+    proc->ioring = NULL;
+    kfree(ring);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Body of the ring thread. Runs in the process's memory space, so the rings
+// and the buffers named in requests are at their user addresses.
+
+void ioring_func(struct ioring *ring)
+{
+    struct ioring_shared *const shared = ring->shared;
+    struct ioring_sqe sqe;
+    struct ioring_cqe *cqe;
+    int64_t result;
+    int pie;
+
+    for (;;)
+    {
+        pie = disable_interrupts();
+
+        // A full completion ring holds back submissions until it is drained
+
+        while (!ring->stop && (sq_pending(ring) == 0 || cq_ready(ring) == IORING_ENTRIES))
+        {
+            condition_wait(&ring->kick);
+        }
+
+        if (ring->stop)
+        {
+            break;
+        }
+
+        sqe = shared->sqes[ring->sq_head % IORING_ENTRIES];
+        ring->sq_head += 1;
+        __atomic_store_n(&shared->sq_head, ring->sq_head, __ATOMIC_RELEASE);
+        restore_interrupts(pie);
+
+        result = ioring_execute(ring->proc, &sqe);
+
+        pie = disable_interrupts();
+        cqe = &shared->cqes[ring->cq_tail % IORING_ENTRIES];
+        cqe->user_data = sqe.user_data;
+        cqe->result = result;
+        ring->cq_tail += 1;
+        __atomic_store_n(&shared->cq_tail, ring->cq_tail, __ATOMIC_RELEASE);
+        condition_broadcast(&ring->completed);
+        restore_interrupts(pie);
+    }
+
+    // Interrupts stay off until thread_exit() switches away, so
+    // ioring_destroy() finds us exited once it sees stopped.
+
+    ring->stopped = 1;
+    condition_broadcast(&ring->completed);
+    thread_exit();
+}
+
+// Runs one request and returns what the matching system call would.
+
+int64_t ioring_execute(struct process *proc, const struct ioring_sqe *sqe)
+{
+    struct io *io;
+    int64_t result;
+
+    if (sqe->op == IORING_OP_NOP)
+    {
+        return 0;
+    }
+    if (sqe->fd < 0 || sqe->fd >= PROCESS_IOMAX || proc->iotab[sqe->fd] == NULL)
+    {
+        return -EBADFD;
+    }
+
+    if ((sqe->op == IORING_OP_READ || sqe->op == IORING_OP_WRITE) &&
+        validate_user_range((void *)(uintptr_t)sqe->addr, sqe->len) != 0)
+    {
+        return -EINVAL;
+    }
+
+    // The process may close the descriptor while we use it
+
+    io = ioaddref(proc->iotab[sqe->fd]);
+
+    switch (sqe->op)
+    {
+    case IORING_OP_READ:
+        result = ioread(io, (void *)(uintptr_t)sqe->addr, (long)sqe->len);
+        break;
+    case IORING_OP_WRITE:
+        result = iowrite(io, (const void *)(uintptr_t)sqe->addr, (long)sqe->len);
+        break;
+    case IORING_OP_IOCTL:
+        result = ioctl_user(io, (int)sqe->len, (void *)(uintptr_t)sqe->addr);
+        break;
+    default:
+        result = -ENOTSUP;
+        break;
+    }
+
+    ioclose(io);
+    return result;
+}
+
+// Submissions not yet taken. The process owns sq_tail, so a bogus value is
+// clamped rather than trusted.
+
+uint32_t sq_pending(const struct ioring *ring)
+{
+    const uint32_t tail = __atomic_load_n(&ring->shared->sq_tail, __ATOMIC_ACQUIRE);
+    const uint32_t cnt = tail - ring->sq_head;
+
+    return (cnt > IORING_ENTRIES) ? IORING_ENTRIES : cnt;
+}
+
+// Completions not yet consumed, clamped likewise.
+
+uint32_t cq_ready(const struct ioring *ring)
+{
+    const uint32_t head = __atomic_load_n(&ring->shared->cq_head, __ATOMIC_ACQUIRE);
+    const uint32_t cnt = ring->cq_tail - head;
+
+    return (cnt > IORING_ENTRIES) ? IORING_ENTRIES : cnt;
+}
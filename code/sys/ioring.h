@@ -0,0 +1,77 @@
+// ioring.h - Submission and completion rings shared with a process
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _IORING_H_
+#define _IORING_H_
+
+#include <stdint.h>
+
+// Entries in each ring. The shared structure must fit in one page.
+
+#define IORING_ENTRIES 64
+
+// Operations. READ and WRITE transfer len bytes at addr on fd like
+// SYSCALL_READ and SYSCALL_WRITE; IOCTL passes len as the command and addr as
+// the argument.
+
+#define IORING_OP_NOP 0
+#define IORING_OP_READ 1
+#define IORING_OP_WRITE 2
+#define IORING_OP_IOCTL 3
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct ioring_sqe {
+    uint32_t op;
+    int32_t fd;
+    uint64_t addr;
+    uint64_t len;
+    uint64_t user_data; // copied to the completion
+};
+
+struct ioring_cqe {
+    uint64_t user_data;
+    int64_t result; // what the equivalent system call would return
+};
+
+// Layout of the page mapped at PROCESS_RING_VMA. The process fills sqes and
+// advances sq_tail, and consumes cqes by advancing cq_head. The kernel owns
+// sq_head and cq_tail. Indices run freely and are taken modulo
+// IORING_ENTRIES.
+
+struct ioring_shared {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    struct ioring_sqe sqes[IORING_ENTRIES];
+    struct ioring_cqe cqes[IORING_ENTRIES];
+};
+
+struct process;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Maps the rings into the current process and starts the kernel thread that
+// serves them. Returns the address of the rings or a negative error code.
+
+extern long ioring_setup(void);
+
+// Wakes the ring thread to take new submissions, then waits until at least
+// _min_complete_ completions are waiting to be consumed. Returns the number
+// waiting or a negative error code.
+
+extern int ioring_enter(unsigned int min_complete);
+
+// Stops the ring thread of _proc_ once it finishes the operation it is in.
+// The ring page itself goes away with the memory space. Called on exit and
+// exec.
+
+extern void ioring_destroy(struct process *proc);
+
+#endif // _IORING_H_
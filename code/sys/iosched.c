@@ -0,0 +1,410 @@
+// iosched.c - Block I/O request scheduler
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef IOSCHED_TRACE
+#define TRACE
+#endif
+
+#ifdef IOSCHED_DEBUG
+#define DEBUG
+#endif
+
+#include "iosched.h"
+#include "io.h"
+#include "ioimpl.h"
+#include "thread.h"
+#include "intr.h"
+#include "heap.h"
+#include "memory.h"
+#include "string.h"
+#include "error.h"
+#include "assert.h"
+#include "riscv.h"
+#include "conf.h"
+#include "console.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of batches that may be in flight to the backing device at once
+
+#ifndef IOSCHED_DEPTH
+#define IOSCHED_DEPTH 4
+#endif
+
+// Largest merged request in bytes. Must be a multiple of PAGE_SIZE. Requests
+// larger than this bypass the queue.
+
+#ifndef IOSCHED_MERGE_MAX
+#define IOSCHED_MERGE_MAX (32 * 1024UL)
+#endif
+
+// A request pending this long is dispatched next, whatever its position
+
+#ifndef IOSCHED_EXPIRE_MS
+#define IOSCHED_EXPIRE_MS 50
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// A request lives on the stack of the thread that issued it until done is set.
+
+struct iosched_req
+{
+  struct iosched_req *prev; // pending list (ascending pos), then batch list
+  struct iosched_req *next;
+  int write;
+  unsigned long long pos;
+  void *buf;
+  long len;
+  unsigned long long tsubmit; // rdtime() when queued
+  long result;
+  int done;
+};
+
+struct iosched
+{
+  struct io io;
+  struct io *bkgio;
+
+  struct iosched_req *head;    // pending requests, ascending pos
+  unsigned long long next_pos; // elevator position: end of last dispatched batch
+  int inflight;                // batches being dispatched
+  struct condition progress;   // a batch completed
+
+  unsigned int buf_free;             // bitmask of free merge buffers
+  uint8_t *merge_buf[IOSCHED_DEPTH]; // IOSCHED_MERGE_MAX bytes each
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void iosched_close(struct io *io);
+static int iosched_cntl(struct io *io, int cmd, void *arg);
+static long iosched_readat(struct io *io, unsigned long long pos,
+                           void *buf, long bufsz);
+static long iosched_writeat(struct io *io, unsigned long long pos,
+                            const void *buf, long len);
+
+static long iosched_rw(struct iosched *sched, int write,
+                       unsigned long long pos, void *buf, long len);
+static void iosched_insert(struct iosched *sched, struct iosched_req *req);
+static struct iosched_req *iosched_pick(struct iosched *sched);
+static void iosched_dispatch(struct iosched *sched, struct iosched_req *batch);
+
+static const struct iointf iosched_iointf = {
+    .close = &iosched_close,
+    .cntl = &iosched_cntl,
+    .readat = &iosched_readat,
+    .writeat = &iosched_writeat};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+struct io *create_iosched_io(struct io *bkgio)
+{
+  trace("%s()", __func__);
+  struct iosched *sched;
+
+  assert(bkgio != NULL);
+
+  sched = kcalloc(1, sizeof(struct iosched));
+  sched->bkgio = ioaddref(bkgio);
+  condition_init(&sched->progress, "iosched progress");
+
+  for (int i = 0; i < IOSCHED_DEPTH; i++)
+  {
+    sched->merge_buf[i] = alloc_phys_pages(IOSCHED_MERGE_MAX / PAGE_SIZE);
+  }
+
+  sched->buf_free = (1U << IOSCHED_DEPTH) - 1;
+
+  return ioinit1(&sched->io, &iosched_iointf);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static void iosched_close(struct io *io)
+{
+  struct iosched *const sched = (void *)io - offsetof(struct iosched, io);
+
+  assert(sched->head == NULL && sched->inflight == 0);
+
+  for (int i = 0; i < IOSCHED_DEPTH; i++)
+  {
+    free_phys_pages(sched->merge_buf[i], IOSCHED_MERGE_MAX / PAGE_SIZE);
+  }
+
+  ioclose(sched->bkgio);
+  kfree(sched);
+}
+
+// Every request passed through has completed by the time its caller sees the
+// result, so a flush passed straight through still covers everything written.
+
+static int iosched_cntl(struct io *io, int cmd, void *arg)
+{
+  struct iosched *const sched = (void *)io - offsetof(struct iosched, io);
+
+  return ioctl(sched->bkgio, cmd, arg);
+}
+
+static long iosched_readat(struct io *io, unsigned long long pos,
+                           void *buf, long bufsz)
+{
+  struct iosched *const sched = (void *)io - offsetof(struct iosched, io);
+
+  return iosched_rw(sched, 0, pos, buf, bufsz);
+}
+
+static long iosched_writeat(struct io *io, unsigned long long pos,
+                            const void *buf, long len)
+{
+  struct iosched *const sched = (void *)io - offsetof(struct iosched, io);
+
+  return iosched_rw(sched, 1, pos, (void *)buf, len);
+}
+
+// Queues a request and waits for it. There is no dispatcher thread: a waiting
+// thread dispatches the best pending batch, which need not contain its own
+// request, whenever fewer than IOSCHED_DEPTH batches are in flight. Requests
+// that arrive while the device is busy therefore accumulate and get merged.
+// A buffer outside kernel RAM (user memory) is only addressable by the thread
+// that issued the request, so such requests bypass the queue.
+
+static long iosched_rw(struct iosched *sched, int write,
+                       unsigned long long pos, void *buf, long len)
+{
+  struct iosched_req req;
+  struct iosched_req *batch;
+  int pie;
+
+  if (len <= 0 || (unsigned long)len > IOSCHED_MERGE_MAX ||
+      buf < RAM_START || (char *)buf + len > (char *)RAM_END)
+  {
+    if (write)
+      return iowriteat(sched->bkgio, pos, buf, len);
+    else
+      return ioreadat(sched->bkgio, pos, buf, len);
+  }
+
+  req.write = write;
+  req.pos = pos;
+  req.buf = buf;
+  req.len = len;
+  req.done = 0;
+  req.tsubmit = rdtime();
+
+  pie = disable_interrupts();
+  iosched_insert(sched, &req);
+
+  while (!req.done)
+  {
+    if (sched->inflight < IOSCHED_DEPTH && sched->head != NULL)
+    {
+      batch = iosched_pick(sched);
+      sched->inflight += 1;
+      restore_interrupts(pie);
+
+      iosched_dispatch(sched, batch);
+
+      pie = disable_interrupts();
+      sched->inflight -= 1;
+      condition_broadcast(&sched->progress);
+    }
+    else
+    {
+      condition_wait(&sched->progress);
+    }
+  }
+
+  restore_interrupts(pie);
+  return req.result;
+}
+
+// Inserts _req_ into the pending list, after any request at the same position.
+// Must be called with interrupts disabled.
+
+static void iosched_insert(struct iosched *sched, struct iosched_req *req)
+{
+  struct iosched_req *prev = NULL;
+  struct iosched_req *next = sched->head;
+
+  while (next != NULL && next->pos <= req->pos)
+  {
+    prev = next;
+    next = next->next;
+  }
+
+  req->prev = prev;
+  req->next = next;
+
+  if (prev != NULL)
+    prev->next = req;
+  else
+    sched->head = req;
+
+  if (next != NULL)
+    next->prev = req;
+}
+
+// Removes the next batch from the pending list and returns its first request.
+// The batch is a list of adjacent requests in the same direction, linked by
+// next, covering at most IOSCHED_MERGE_MAX bytes. Must be called with
+// interrupts disabled and the pending list non-empty.
+
+static struct iosched_req *iosched_pick(struct iosched *sched)
+{
+  const unsigned long long expire = IOSCHED_EXPIRE_MS * (TIMER_FREQ / 1000);
+  const unsigned long long now = rdtime();
+  struct iosched_req *first, *last, *req, *oldest;
+  unsigned long total;
+
+  // Deadline: an expired request goes first. Otherwise C-SCAN: the first
+  // request at or past the elevator position, wrapping to the lowest.
+
+  oldest = sched->head;
+
+  for (req = sched->head; req != NULL; req = req->next)
+  {
+    if (req->tsubmit < oldest->tsubmit)
+      oldest = req;
+  }
+
+  if (now - oldest->tsubmit >= expire)
+  {
+    first = oldest;
+  }
+  else
+  {
+    first = sched->head;
+
+    while (first != NULL && first->pos < sched->next_pos)
+      first = first->next;
+
+    if (first == NULL)
+      first = sched->head;
+  }
+
+  // Grow the batch backward and forward over adjacent requests
+
+  total = first->len;
+  last = first;
+
+  while (first->prev != NULL && first->prev->write == first->write &&
+         first->prev->pos + first->prev->len == first->pos &&
+         total + first->prev->len <= IOSCHED_MERGE_MAX)
+  {
+    first = first->prev;
+    total += first->len;
+  }
+
+  while (last->next != NULL && last->next->write == last->write &&
+         last->pos + last->len == last->next->pos &&
+         total + last->next->len <= IOSCHED_MERGE_MAX)
+  {
+    last = last->next;
+    total += last->len;
+  }
+
+  // Unlink first..last from the pending list
+
+  if (first->prev != NULL)
+    first->prev->next = last->next;
+  else
+    sched->head = last->next;
+
+  if (last->next != NULL)
+    last->next->prev = first->prev;
+
+  last->next = NULL;
+  sched->next_pos = last->pos + last->len;
+  return first;
+}
+
+// Issues _batch_ as a single request to the backing device and completes
+// each request in it. A batch of one is passed through without copying.
+
+static void iosched_dispatch(struct iosched *sched, struct iosched_req *batch)
+{
+  struct iosched_req *req, *next;
+  unsigned long total = 0;
+  unsigned long off;
+  uint8_t *buf;
+  long result;
+  int pie;
+  int i;
+
+  if (batch->next == NULL)
+  {
+    if (batch->write)
+      result = iowriteat(sched->bkgio, batch->pos, batch->buf, batch->len);
+    else
+      result = ioreadat(sched->bkgio, batch->pos, batch->buf, batch->len);
+
+    pie = disable_interrupts();
+    batch->result = result;
+    batch->done = 1;
+    restore_interrupts(pie);
+    return;
+  }
+
+  // At most IOSCHED_DEPTH batches are in flight, so a buffer is always free
+
+  pie = disable_interrupts();
+  assert(sched->buf_free != 0);
+  i = __builtin_ctz(sched->buf_free);
+  sched->buf_free &= ~(1U << i);
+  restore_interrupts(pie);
+
+  buf = sched->merge_buf[i];
+
+  for (req = batch; req != NULL; req = req->next)
+  {
+    if (req->write)
+      memcpy(buf + total, req->buf, req->len);
+    total += req->len;
+  }
+
+  if (batch->write)
+    result = iowriteat(sched->bkgio, batch->pos, buf, total);
+  else
+    result = ioreadat(sched->bkgio, batch->pos, buf, total);
+
+  // Each request gets its share of a short transfer. Once a request is marked
+  // done its owner may return, so it must not be touched afterwards.
+
+  off = 0;
+
+  for (req = batch; req != NULL; req = req->next)
+  {
+    if (result < 0)
+      req->result = result;
+    else if ((unsigned long)result >= off + req->len)
+      req->result = req->len;
+    else if ((unsigned long)result > off)
+      req->result = result - off;
+    else
+      req->result = 0;
+
+    if (!req->write && req->result > 0)
+      memcpy(req->buf, buf + off, req->result);
+
+    off += req->len;
+  }
+
+  pie = disable_interrupts();
+
+  for (req = batch; req != NULL; req = next)
+  {
+    next = req->next;
+    req->done = 1;
+  }
+
+  sched->buf_free |= 1U << i;
+  restore_interrupts(pie);
+}
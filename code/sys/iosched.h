@@ -0,0 +1,20 @@
+// iosched.h - Block I/O request scheduler
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+struct io; // extern decl.
+
+// Returns an io endpoint that forwards readat and writeat requests to _bkgio_
+// through a request queue. Pending requests are dispatched in elevator order,
+// with a deadline so none starves, and adjacent requests in the same
+// direction are merged into a single request to _bkgio_. Other operations
+// are passed through. The returned endpoint holds a reference to _bkgio_.
+
+extern struct io * create_iosched_io(struct io * bkgio);
+
+#endif // _IOSCHED_H_
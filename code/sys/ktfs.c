@@ -8,7 +8,9 @@
 #define TRACE
 #endif
 
-#define KTFS_BLKSZ 512
+#define KTFS_BLKSZ (filesetup.blksz) // block size of the mounted file system
+#define KTFS_BLKS_PER_INDIRECT (KTFS_BLKSZ / sizeof(uint32_t))
+#define KTFS_BLKS_PER_DINDIRECT (KTFS_BLKS_PER_INDIRECT * KTFS_BLKS_PER_INDIRECT)
 #define FILENAME_SIZE 14
 #define DIR_SIZE (KTFS_BLKSZ / KTFS_DENSZ)
 #define INODES_PER_BLK (KTFS_BLKSZ / KTFS_INOSZ) // inodes
@@ -16,7 +18,15 @@
 #define NUM_DINDIRECT_BLOCKS_NEEDED 3
 #define DIR_INODE_OFFSET 1
 #define BYTE_SIZE 8
-#define ROUND_UP(n, k) (((n) + (k) - 1) / (k) * (k))
+#define KTFS_READAHEAD_DEFAULT 8 // blocks prefetched ahead of a sequential reader
+#define KTFS_READAHEAD_MAX 32
+#define KTFS_DIRECT_MIN_BLKS 8  // aligned transfers this large bypass the cache
+#define KTFS_DIRECT_MAX_BLKS 64 // largest single direct device request
+#define KTFS_DIR_HASH_SIZE 128 // directory index buckets (power of two)
+#define FREEMAP_GROUP_BITS (KTFS_BLKSZ * BYTE_SIZE) // bits per on-disk bitmap block
+#define FREEMAP_GROUP_WORDS (FREEMAP_GROUP_BITS / 64)
+#define KTFS_RESERVE_BLOCKS 16 // blocks reserved ahead of a growing file
+#define KTFS_COMMIT_INTERVAL_MS 1000 // dirty inodes and bitmap blocks are committed this often
 
 #ifdef KTFS_DEBUG
 #define DEBUG
@@ -31,6 +41,10 @@
 #include "string.h"
 #include "console.h"
 #include "cache.h"
+#include "iosched.h"
+#include "timer.h"
+#include "intr.h"
+#include "memory.h"
 #include <assert.h>
 
 // INTERNAL TYPE DEFINITIONS
@@ -41,49 +55,120 @@
 
 // };
 
+// Copy of the index block (indirect block, or indirect block under a doubly
+// indirect one) that maps logical blocks [first, first+KTFS_BLKS_PER_INDIRECT)
+// of a file, so that translating consecutive blocks does not go through the
+// cache each time. Direct blocks are read from the inode.
+struct ktfs_bmap
+{
+    unsigned long long first; // logical block of entries[0]
+    unsigned int gen;         // ktfs_open_inode bmap_gen when loaded
+    int valid;
+    uint32_t entries[KTFS_MAX_BLKSZ / sizeof(uint32_t)];
+};
+
+// In-memory inode shared by every open of a file. Readers hold rwlock shared;
+// writers, and anything that changes the inode, hold it exclusively. Lock
+// order: filesetup_lock before rwlock before a ktfs_file's state_lock.
+// Changes to the inode reach the cache only when ktfs_commit() runs.
+struct ktfs_open_inode
+{
+    struct ktfs_inode disk;        // copy of the on-disk inode, newer if dirty
+    struct ktfs_dir_index *dindex; // directory index entry, NULL once deleted
+    struct ktfs_open_inode *dirty_next; // filesetup.dirty_inodes list
+    uint16_t inum;
+    int dirty;
+    int refcnt;                    // open files
+    int deleted;                   // removed while open; I/O fails with -EIO
+    unsigned int bmap_gen;         // bumped when the file's index blocks change
+    unsigned long long version;    // IOCTL_GETID value, new on open of the inode and on every change
+    unsigned long long resv_start; // next reserved data block (relative to data block 0)
+    unsigned long long resv_count; // reserved blocks not yet in the file
+    struct rwlock rwlock;
+};
+
 struct ktfs_file
 { // file io struct - represents open file
     // Fill to fulfill spec
     struct ktfs_dir_entry *dentry;
-    struct ktfs_inode *file_inode;
+    struct ktfs_inode *file_inode; // &ino->disk
+    struct ktfs_open_inode *ino;
     // unsigned long long pos;
     // unsigned long long end;
     struct io fileio;
-    int name_pos;
     int open;
+    unsigned long long ra_next;  // block index following the last block read
+    unsigned long long ra_end;   // first block index not yet prefetched
+    unsigned int ra_window;      // read-ahead window in blocks (0 disables)
+    struct ktfs_bmap bmap;       // private to this open file
+    struct lock state_lock;      // ra_* and bmap; readers of one open file share them
 };
-struct file_name
+// In-memory index of the root directory, built at mount. Each live dentry
+// has one entry, found by name through a hash chain or by its position in the
+// root directory through dir_slot[].
+struct ktfs_dir_index
 {
-    struct io *fio;
+    struct ktfs_dir_index *next;  // hash chain or free list
+    struct ktfs_open_inode *ino; // shared inode, NULL if not open
+    uint16_t inode;
+    uint16_t slot; // dentry index in the root directory
     char name[KTFS_MAX_FILENAME_LEN + sizeof(uint8_t)];
 };
-// Make larger file system struct
-// Held globally for mount
-struct bitmap_block
+// In-memory allocation bitmap, searched a word at a time. Bit n of words[]
+// (bit n % 64 of word n / 64) is set if item n is in use, matching the byte
+// layout of the on-disk bitmap. Bits are grouped by on-disk bitmap block, with
+// a free count per group so full groups are skipped. A map backed by the disk
+// bitmap marks groups it changed dirty; ktfs_bitmap_writeback() stores them.
+// Its groups are loaded after mount by ktfs_loader(); a group is not touched
+// until it is ready, see ktfs_freemap_wait().
+struct ktfs_freemap
 {
-    uint8_t block[512];
+    uint64_t *words;
+    unsigned long nbits;     // items covered; later bits are never allocated
+    unsigned long cursor;    // word where the next search starts (next fit)
+    unsigned int group_cnt;
+    unsigned int words_pages; // pages backing words[]
+    uint16_t *group_free;    // free items in each group
+    uint8_t *group_dirty;    // NULL if not backed by the disk bitmap
+    uint8_t *group_ready;    // NULL if not backed by the disk bitmap
+    unsigned int demand;     // group a thread is waiting for, loaded next
 };
+
+// Make larger file system struct
+// Held globally for mount
 struct file_setup
 {
     struct ktfs_superblock super_blk;
+    unsigned int blksz; // from the superblock; KTFS_BLKSZ
     struct ktfs_inode root_dir_inode;
     struct io *diskio;
     struct cache *cptr;
-    struct file_name open_file_names[MAX_FILES];
-    int cur_file_count;
-    // struct bitmap_block *bitmap_blocks;
-    uint8_t *inode_bitmap;
+    struct ktfs_dir_index dir_index[MAX_FILES];
+    struct ktfs_dir_index *dir_hash[KTFS_DIR_HASH_SIZE];
+    struct ktfs_dir_index *dir_slot[MAX_FILES];
+    struct ktfs_dir_index *dir_free;
+    struct ktfs_freemap block_map; // data blocks, mirrors the on-disk bitmap
+    struct ktfs_freemap inode_map; // inodes in use, rebuilt from the directory
+    struct ktfs_open_inode *dirty_inodes; // written by ktfs_commit()
     int inodecount;
-    // struct lock filesetup_lock;
+    int dir_ready;               // directory index and inode_map built
+    struct condition loaded;     // dir_ready set or a block_map group ready
+    struct lock filesetup_lock; // everything above and the allocation state
 };
 
-struct indirBlock
+// A run of contiguous device blocks (absolute block numbers) waiting to be
+// discarded or zeroed with a single request.
+struct ktfs_block_run
 {
-    uint32_t data[KTFS_BLKS_PER_INDIRECT];
+    unsigned long long start;
+    unsigned long long count;
+    int zero; // 1 for write-zeroes, 0 for discard
 };
 
 // static struct io *diskio;
 struct file_setup filesetup;
+static struct ktfs_block_run discard_run; // blocks freed but not yet discarded
+static unsigned long long ktfs_version;   // last version handed out
 // static
 
 // INTERNAL FUNCTION DECLARATIONS
@@ -101,19 +186,54 @@ int ktfs_cntl(struct io *io, int cmd, void *arg);
 int blocknum(struct ktfs_file *fio, unsigned long long idx);
 int allocateblk(struct ktfs_file *fio, unsigned long long idx);
 unsigned long long allocate_open_block(void);
-int add_new_inode_datablk(struct ktfs_file *fio, unsigned long long idx);
 void write_inode_to_disk(struct ktfs_file *fio);
-int inodeidxblocknum(struct ktfs_inode *inode, unsigned long long idx, unsigned long long global_datablock_0);
+static int ktfs_bmap_lookup(struct ktfs_bmap *map, const struct ktfs_inode *inode, unsigned long long idx);
 void free_block(int block_num);
+static void ktfs_run_add(struct ktfs_block_run *run, unsigned long long blk);
+static int ktfs_run_issue(struct ktfs_block_run *run);
+static void ktfs_index_init(void);
+static void ktfs_freemap_init(struct ktfs_freemap *map, unsigned int group_cnt, unsigned long nbits, int backed);
+static long ktfs_freemap_alloc(struct ktfs_freemap *map);
+static long ktfs_freemap_find(struct ktfs_freemap *map, unsigned long goal);
+static long ktfs_freemap_alloc_run(struct ktfs_freemap *map, unsigned long goal, unsigned long want, unsigned long *cnt);
+static long long ktfs_alloc_file_block(struct ktfs_file *fio, unsigned long long goal);
+static void ktfs_release_reservation(struct ktfs_open_inode *ino);
+static void ktfs_reserve(struct ktfs_file *fio, unsigned long long goal, unsigned long long want);
+static int ktfs_grow(struct ktfs_file *fio, unsigned long long end);
+static int ktfs_grow_get(unsigned long long blk, uint32_t **pptr, int fresh);
+static void ktfs_grow_put(uint32_t **pptr);
+static long ktfs_file_readat(struct ktfs_file *fio, unsigned long long pos, void *buf, long len);
+static long ktfs_file_writeat(struct ktfs_file *fio, unsigned long long pos, const void *buf, long len);
+static int ktfs_setend(struct ktfs_file *fio, unsigned long long *ullarg);
+static int ktfs_create_entry(const char *name);
+static int ktfs_delete_entry(const char *name);
+static void ktfs_freemap_set(struct ktfs_freemap *map, unsigned long bit);
+static void ktfs_freemap_clear(struct ktfs_freemap *map, unsigned long bit);
+static void ktfs_freemap_recount(struct ktfs_freemap *map);
+static void ktfs_freemap_recount_group(struct ktfs_freemap *map, unsigned int g);
+static void ktfs_freemap_wait(struct ktfs_freemap *map, unsigned long g);
+static void ktfs_loader(void);
+static void ktfs_load_dir(void);
+static void ktfs_load_group(struct ktfs_freemap *map, unsigned int g);
+static int ktfs_bitmap_writeback(void);
+static int ktfs_bitmap_dirty(void);
+static void ktfs_inode_store(struct ktfs_open_inode *ino);
+static void ktfs_inode_clean(struct ktfs_open_inode *ino);
+static void ktfs_inode_touch(struct ktfs_open_inode *ino);
+static int ktfs_commit(void);
+static void ktfs_committer(void);
+static struct ktfs_dir_index *ktfs_index_find(const char *name);
+static struct ktfs_dir_index *ktfs_index_add(const char *name, uint16_t inode, unsigned int slot);
+static void ktfs_index_remove(struct ktfs_dir_index *ent, unsigned int last_slot);
 // int ktfs_getblksz(struct ktfs_file *fd);
 // int ktfs_getend(struct ktfs_file *fd, void *arg);
 
 int ktfs_flush(void);
+static void ktfs_readahead(struct ktfs_file *fio, unsigned long long first_idx, unsigned long long last_idx);
+static long ktfs_direct_run(struct ktfs_file *fio, int write, unsigned long long idx, void *buf, unsigned long long nblks);
 int blkidx;
 int dentryidx;
-uint8_t general_block[CACHE_BLKSZ];
 char *data;
-struct bitmap_block bitmap_data;
 // FUNCTION ALIASES
 //
 
@@ -141,100 +261,44 @@ static const struct iointf ktfs_file_iointf = {
     .readat = &ktfs_readat,
     .cntl = &ktfs_cntl};
 
-// What are we supposed to be doing in mount?
-// int ktfs_mount(struct io *io) // done??
-// {
-//     trace("%s()", __func__);
-//     // Init cache
-//     create_cache(io, &filesetup.cptr);
-//     // lock_init(&filesetup.filesetup_lock);
-
-//     // Save reference to disk I/O endpoint
-//     filesetup.diskio = ioaddref(io);
-//     filesetup.cur_file_count = 0;
-
-//     // populates superblock
-//     cache_get_block(filesetup.cptr, 0, (void **)&data);
-//     memcpy(&filesetup.super_blk, data, sizeof(struct ktfs_superblock));
-//     cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
-
-//     unsigned long long root_idx = filesetup.super_blk.root_directory_inode;
-//     unsigned long long block_idx = root_idx / INODES_PER_BLK;
-//     unsigned long long inode_idx = root_idx % INODES_PER_BLK;
-
-//     unsigned long long global_block_idx = 1 + filesetup.super_blk.bitmap_block_count + block_idx;
-
-//     // Populate root directory inode
-//     // filesetup.root_dir_inode = kcalloc(1, sizeof(struct ktfs_inode));
-
-//     cache_get_block(filesetup.cptr, global_block_idx * KTFS_BLKSZ, (void **)&data);
-//     memcpy(&filesetup.root_dir_inode, (data + (inode_idx * KTFS_INOSZ)), sizeof(struct ktfs_inode));
-//     cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
-
-//     filesetup.inode_bitmap = kmalloc(BYTE_SIZE * INODES_PER_BLK * filesetup.super_blk.inode_block_count);
-//     memset(filesetup.inode_bitmap, 0, BYTE_SIZE * INODES_PER_BLK * filesetup.super_blk.inode_block_count);
-//     filesetup.inode_bitmap[filesetup.super_blk.root_directory_inode] = 1;
-
-//     unsigned long long global_datablock_0 = 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count;
-//     //struct ktfs_dir_entry dir[DIR_SIZE];
-
-//     for (int i = 0; i < (filesetup.root_dir_inode.size)/sizeof(struct ktfs_inode); i++)
-//     {
-//         filesetup.inode_bitmap[i] = 1;
-//     }
-//     // kprintf("Line  181\n");
-//     // for (int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++)
-//     // {
-//     //     kprintf("Line  184\n");
-//     //     cache_get_block(filesetup.cptr, (filesetup.root_dir_inode.block[i] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-//     //     memcpy(dir, data, sizeof(dir));
-//     //     cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
-
-//     //     for (int j = 0; j < DIR_SIZE; j++)
-//     //     {
-//     //         kprintf("Line  191\n");
-//     //         if (i * DIR_SIZE + j >= (filesetup.root_dir_inode.size / KTFS_DENSZ))
-//     //         {
-//     //             kprintf("Line  194\n");
-//     //             filesetup.inodecount = i * DIR_SIZE + j;
-//     //             return 0;
-//     //         }
-//     //         filesetup.inode_bitmap[dir[j].inode] = 1; // mark inode as used
-//     //     }
-
-//     // }
-//     // for (int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++)
-//     // {
-//     //     cache_get_block(filesetup.cptr, (filesetup.root_dir_inode.block[i] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-//     //     memcpy(dir, data, sizeof(dir));
-//     //     cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
-//     //     for (int j = 0; j < DIR_SIZE; j++)
-//     //     {
-//     //         if (dir[j].name != NULL)
-//     //         {
-//     //             filesetup.inode_bitmap[dir[j].inode] = 1;
-//     //         }
-//     //     }
-//     // }
-//     return 0;
-// }
-
 // What are we supposed to be doing in mount?
 int ktfs_mount(struct io *io) // done??
 {
-    // Init cache
-    create_cache(io, &filesetup.cptr);
-    // lock_init(&filesetup.filesetup_lock);
+    int result;
 
-    // Save reference to disk I/O endpoint
-    filesetup.diskio = ioaddref(io);
-    filesetup.cur_file_count = 0;
+    // The superblock gives the block size the cache must use, so it is read
+    // before the cache exists, as one device block
+    int devblksz = ioctl(io, IOCTL_GETBLKSZ, NULL);
+    if (devblksz <= 0 || devblksz > KTFS_MAX_BLKSZ)
+        return -ENOTSUP;
+    if (devblksz < KTFS_MIN_BLKSZ)
+        devblksz = KTFS_MIN_BLKSZ;
 
-    // populates superblock
-    // filesetup.super_blk = kcalloc(1, sizeof(struct ktfs_superblock));
-    cache_get_block(filesetup.cptr, 0, (void **)&data);
+    data = kmalloc(devblksz);
+    result = ioreadat(io, 0, data, devblksz);
     memcpy(&filesetup.super_blk, data, sizeof(struct ktfs_superblock));
-    cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
+    kfree(data);
+    if (result < 0)
+        return result;
+    if (result != devblksz)
+        return -EIO;
+
+    if (filesetup.super_blk.block_shift > KTFS_MAX_BLKSZ_SHIFT)
+        return -ENOTSUP;
+    filesetup.blksz = KTFS_MIN_BLKSZ << filesetup.super_blk.block_shift;
+    if (filesetup.blksz % devblksz != 0)
+        return -ENOTSUP;
+
+    // Init cache on top of a request scheduler, which merges the cache's
+    // write-back runs and read-ahead into larger device requests
+    result = create_cache_blksz(create_iosched_io(io), filesetup.blksz, &filesetup.cptr);
+    if (result < 0)
+        return result;
+    lock_init(&filesetup.filesetup_lock);
+
+    // Save reference to disk I/O endpoint
+    filesetup.diskio = ioaddref(io);
+    ktfs_index_init();
 
     unsigned long long root_idx = filesetup.super_blk.root_directory_inode;
     unsigned long long block_idx = root_idx / INODES_PER_BLK;
@@ -249,52 +313,33 @@ int ktfs_mount(struct io *io) // done??
     // crazy
     cache_get_block(filesetup.cptr, global_block_idx * KTFS_BLKSZ, (void **)&data);
     memcpy(&filesetup.root_dir_inode, (data + (inode_idx * KTFS_INOSZ)), sizeof(struct ktfs_inode));
-    cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
-
-    // filesetup.bitmap_blocks = kmalloc(sizeof(struct bitmap_block) * filesetup.super_blk.bitmap_block_count);
-    // for (uint32_t i = 0; i < filesetup.super_blk.bitmap_block_count; i++)
-    // {
-    //     cache_get_block(filesetup.cptr, (1 + i), (void **)&data);
-    //     memcpy(&filesetup.bitmap_blocks[i], data, sizeof(struct bitmap_block));
-    //     cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
-    // }
-    filesetup.inode_bitmap = kmalloc(BYTE_SIZE * INODES_PER_BLK * filesetup.super_blk.inode_block_count);
-    memset(filesetup.inode_bitmap, 0, BYTE_SIZE * INODES_PER_BLK * filesetup.super_blk.inode_block_count);
-    filesetup.inode_bitmap[filesetup.super_blk.root_directory_inode] = 1;
+    cache_release_block(filesetup.cptr, data, CACHE_CLEAN | CACHE_META);
 
-    struct ktfs_dir_entry dir[DIR_SIZE];
     unsigned long long global_datablock_0 = 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count;
 
-    // for (int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++) {
-    //     if (filesetup.root_dir_inode.block[i] == 0) continue; // Skip unused blocks
+    // Mirror the free-block bitmap. Only bits for blocks that exist on the
+    // device are ever allocated. The bitmap and the directory are read by
+    // ktfs_loader() after mount returns.
+    unsigned long ndata = 0;
+    if (filesetup.super_blk.block_count > global_datablock_0)
+        ndata = filesetup.super_blk.block_count - global_datablock_0;
+    if (ndata > (unsigned long)filesetup.super_blk.bitmap_block_count * FREEMAP_GROUP_BITS)
+        ndata = (unsigned long)filesetup.super_blk.bitmap_block_count * FREEMAP_GROUP_BITS;
 
-    //     cache_get_block(filesetup.cptr, (filesetup.root_dir_inode.block[i] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-    //     memcpy(dir, data, sizeof(dir));
-    //     cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
+    ktfs_freemap_init(&filesetup.block_map, filesetup.super_blk.bitmap_block_count, ndata, 1);
 
-    //     for (int j = 0; j < DIR_SIZE; j++) {
-    //         if (dir[j].name[0] != '\0' && dir[j].name != NULL) {
-    //             filesetup.inode_bitmap[dir[j].inode] = 1; // mark inode as used
-    //         }
-    //     }
-    // }
+    unsigned long ninodes = (unsigned long)INODES_PER_BLK * filesetup.super_blk.inode_block_count;
+    ktfs_freemap_init(&filesetup.inode_map, (ninodes + FREEMAP_GROUP_BITS - 1) / FREEMAP_GROUP_BITS, ninodes, 0);
 
-    for (int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++)
-    {
-        cache_get_block(filesetup.cptr, (filesetup.root_dir_inode.block[i] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-        memcpy(dir, data, sizeof(dir));
-        cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
+    condition_init(&filesetup.loaded, "ktfs_loaded");
+    result = thread_spawn("ktfs_loader", (void *)&ktfs_loader);
+    if (result < 0)
+        return result;
 
-        for (int j = 0; j < DIR_SIZE; j++)
-        {
-            if (i * DIR_SIZE + j >= (filesetup.root_dir_inode.size / KTFS_DENSZ))
-            {
-                filesetup.inodecount = i * DIR_SIZE + j;
-                return 0;
-            }
-            filesetup.inode_bitmap[dir[j].inode] = 1; // mark inode as used
-        }
-    }
+    // Started last, so that it never runs against a partly mounted file system
+    result = thread_spawn("ktfs_committer", (void *)&ktfs_committer);
+    if (result < 0)
+        return result;
 
     // for (int i = 1; i < (filesetup.root_dir_inode.size / sizeof(struct ktfs_dir_entry)) + 1; i++)
     // {
@@ -325,7 +370,9 @@ int ktfs_open(const char *name, struct io **ioptr)
 {
     trace("%s()", __func__);
     struct ktfs_file *fio; // for open file
-    struct ktfs_dir_entry dir[DIR_SIZE];
+    struct ktfs_open_inode *ino;
+    struct ktfs_dir_index *ent;
+    int result;
 
     if (name == NULL || *name == '\0')
         return -ENOENT; // file not found
@@ -336,69 +383,69 @@ int ktfs_open(const char *name, struct io **ioptr)
     // find the num of inodes per block, inode_index / num_inodes = block of inodes we want
     // inode_index % num_inodes is the inode we want within the block.
     // size of inode = 32 byte
-    // size of blk = 512 byte
-    // 16 inode per block
-    // to find specific block that we're looking for is inode_idx / 16 (inodes per block) = block index
-    // to find specific inode index that we're looking for is inode_idx % 16 (inodes per block) = index in block
+    // size of blk = KTFS_BLKSZ, from the superblock
+    // INODES_PER_BLK inodes per block
+    // to find specific block that we're looking for is inode_idx / INODES_PER_BLK = block index
+    // to find specific inode index that we're looking for is inode_idx % INODES_PER_BLK = index in block
 
     // dentry size * inodes in use / dentry size = inodes in use / inodes per blk = num of blks that are in use
-    unsigned long long global_datablock_0 = 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count;
 
-    // lock_acquire(&filesetup.filesetup_lock);
-    for (int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++)
+    lock_acquire(&filesetup.filesetup_lock);
+    ent = ktfs_index_find(name);
+    if (ent == NULL)
     {
-        // cache_get_block();
-        cache_get_block(filesetup.cptr, (filesetup.root_dir_inode.block[i] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-        memcpy(dir, data, sizeof(dir));
-        cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
+        lock_release(&filesetup.filesetup_lock);
+        return -ENOENT;
+    }
 
-        for (int num_dir = 0; num_dir < DIR_SIZE; num_dir++)
-        {
-            if (strncmp(name, dir[num_dir].name, FILENAME_SIZE) == 0)
-            {
-                // kprintf("\nFile Name:%s\n", dir[num_dir].name);
-                for (int name_cnt = 0; name_cnt < filesetup.cur_file_count; name_cnt++)
-                {
-                    if (strncmp(filesetup.open_file_names[name_cnt].name, dir[num_dir].name, FILENAME_SIZE) == 0)
-                    {
-                        // lock_release(&filesetup.filesetup_lock);
-                        return -EBUSY;
-                    }
-                }
+    // The first open reads the inode; later opens share it
+    ino = ent->ino;
+    if (ino == NULL)
+    {
+        ino = kcalloc(1, sizeof(struct ktfs_open_inode));
 
-                fio = kmalloc(sizeof(struct ktfs_file));
-                fio->dentry = kmalloc(sizeof(struct ktfs_dir_entry));
-                fio->file_inode = kmalloc(sizeof(struct ktfs_inode));
-
-                // fio->fileio = kmalloc(sizeof(struct io));
-                *(fio->dentry) = dir[num_dir];
-                strncpy(filesetup.open_file_names[filesetup.cur_file_count].name, dir[num_dir].name, sizeof(struct file_name));
-
-                // does it give index of inode or index of block or something?
-                unsigned long long block_idx = dir[num_dir].inode / INODES_PER_BLK;
-                unsigned long long inode_idx = dir[num_dir].inode % INODES_PER_BLK;
-                unsigned long long global_block_idx = 1 + filesetup.super_blk.bitmap_block_count + block_idx;
-
-                cache_get_block(filesetup.cptr, global_block_idx * KTFS_BLKSZ,
-                                (void **)(&data));
-                memcpy(fio->file_inode, data + (inode_idx * KTFS_INOSZ), sizeof(struct ktfs_inode));
-                cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
-
-                // fio->pos = 0;
-                // fio->end = fio->file_inode->size;
-                fio->open = 1;
-                filesetup.open_file_names[filesetup.cur_file_count].fio = &fio->fileio;
-                fio->name_pos = filesetup.cur_file_count;
-                filesetup.cur_file_count++;
-                struct io *io = ioinit1(&fio->fileio, &ktfs_file_iointf);
-                *ioptr = create_seekable_io(io); // how do we use
-                // lock_release(&filesetup.filesetup_lock);
-                return 0;
-            }
+        // does it give index of inode or index of block or something?
+        unsigned long long block_idx = ent->inode / INODES_PER_BLK;
+        unsigned long long inode_idx = ent->inode % INODES_PER_BLK;
+        unsigned long long global_block_idx = 1 + filesetup.super_blk.bitmap_block_count + block_idx;
+
+        result = cache_get_block(filesetup.cptr, global_block_idx * KTFS_BLKSZ,
+                                 (void **)(&data));
+        if (result < 0)
+        {
+            kfree(ino);
+            lock_release(&filesetup.filesetup_lock);
+            return result;
         }
+        memcpy(&ino->disk, data + (inode_idx * KTFS_INOSZ), sizeof(struct ktfs_inode));
+        cache_release_block(filesetup.cptr, data, CACHE_CLEAN | CACHE_META);
+
+        rwlock_init(&ino->rwlock);
+        ino->inum = ent->inode;
+        ino->dindex = ent;
+        ktfs_inode_touch(ino);
+        ent->ino = ino;
     }
-    // lock_release(&filesetup.filesetup_lock);
-    return -ENOENT;
+    ino->refcnt++;
+
+    fio = kmalloc(sizeof(struct ktfs_file));
+    fio->dentry = kmalloc(sizeof(struct ktfs_dir_entry));
+    fio->dentry->inode = ent->inode;
+    memcpy(fio->dentry->name, ent->name, sizeof(fio->dentry->name));
+    fio->ino = ino;
+    fio->file_inode = &ino->disk;
+
+    fio->open = 1;
+    fio->ra_next = 0;
+    fio->ra_end = 0;
+    fio->ra_window = KTFS_READAHEAD_DEFAULT;
+    fio->bmap.valid = 0;
+    lock_init(&fio->state_lock);
+    struct io *io = ioinit1(&fio->fileio, &ktfs_file_iointf);
+    lock_release(&filesetup.filesetup_lock);
+
+    *ioptr = create_seekable_io(io); // how do we use
+    return 0;
 }
 
 void ktfs_close(struct io *io)
@@ -409,18 +456,31 @@ void ktfs_close(struct io *io)
     // {
     //     // kprintf("Before Close Files: %s\n", filesetup.open_file_names[i].name);
     // }
-    char tmp_name[KTFS_MAX_FILENAME_LEN + sizeof(uint8_t)];
-    strncpy(tmp_name, filesetup.open_file_names[filesetup.cur_file_count - 1].name, sizeof(struct file_name));
+    struct ktfs_open_inode *const ino = fio->ino;
 
-    strncpy(filesetup.open_file_names[filesetup.cur_file_count - 1].name,
-            filesetup.open_file_names[fio->name_pos].name, sizeof(struct file_name));
+    lock_acquire(&filesetup.filesetup_lock);
+    fio->open = 0;
 
-    strncpy(filesetup.open_file_names[fio->name_pos].name, tmp_name, sizeof(struct file_name));
-    filesetup.cur_file_count--; // problem rn
+    // Commit the changes made through this file. There is no way to report
+    // an error; the committer thread retries.
+    if (ino->dirty)
+        ktfs_commit();
 
-    fio->open = 0;
+    if (--ino->refcnt == 0)
+    {
+        // Last close. A deleted file's blocks, reserved ones included, are
+        // already free.
+        if (!ino->deleted)
+        {
+            ktfs_release_reservation(ino);
+            ino->dindex->ino = NULL;
+        }
+        kfree(ino);
+    }
 
-    return;
+    lock_release(&filesetup.filesetup_lock);
+    kfree(fio->dentry);
+    kfree(fio);
 }
 
 // Read len bytes starting at pos from the file associated with io.
@@ -437,6 +497,8 @@ void ktfs_close(struct io *io)
 long ktfs_readat(struct io *io, unsigned long long pos, void *buf, long len)
 {
     trace("%s()", __func__);
+    long result;
+
     if (buf == NULL || io == NULL)
     {
         return -EINVAL;
@@ -444,12 +506,25 @@ long ktfs_readat(struct io *io, unsigned long long pos, void *buf, long len)
 
     // struct ktfs_file *fio = (struct ktfs_file *)(void *)io - offsetof(struct ktfs_file, fileio); // gives us the fio for the open file
     struct ktfs_file *fio = (struct ktfs_file *)((void *)io - offsetof(struct ktfs_file, fileio));
+
+    // Readers of the same file proceed in parallel
+    rwlock_acquire_read(&fio->ino->rwlock);
+    result = ktfs_file_readat(fio, pos, buf, len);
+    rwlock_release_read(&fio->ino->rwlock);
+    return result;
+}
+
+// Does the work of ktfs_readat() with the inode lock held.
+
+static long ktfs_file_readat(struct ktfs_file *fio, unsigned long long pos, void *buf, long len)
+{
     // kprintf("\nFile Size: %d", fio->file_inode->size);
-    if (fio->open == 0)
+    if (fio->open == 0 || fio->ino->deleted)
     {
         return -EIO;
     }
     long bytesread = 0;
+    char *data;
 
     // boundary checking
     if (len < 0)
@@ -477,10 +552,38 @@ long ktfs_readat(struct io *io, unsigned long long pos, void *buf, long len)
     unsigned long long end = pos + len;
     // kprintf("\nEND:%d", end);
     // lock_acquire(&filesetup.filesetup_lock);
+    if (pos % KTFS_BLKSZ == 0 && len >= KTFS_DIRECT_MIN_BLKS * KTFS_BLKSZ)
+    {
+        // Large aligned reads go to the device directly; prefetching the
+        // blocks after them would only fill the cache.
+        lock_acquire(&fio->state_lock);
+        fio->ra_next = (end - 1) / KTFS_BLKSZ + 1;
+        fio->ra_end = 0;
+        lock_release(&fio->state_lock);
+    }
+    else
+    {
+        ktfs_readahead(fio, pos / KTFS_BLKSZ, (end - 1) / KTFS_BLKSZ);
+    }
+
     while (curr < end)
     {
         unsigned long long block_idx = curr / KTFS_BLKSZ; // finds the current block index (disregards direct, indirect) we need to access
         unsigned long long block_offset = curr % KTFS_BLKSZ;
+
+        if (block_offset == 0 && end - curr >= KTFS_DIRECT_MIN_BLKS * KTFS_BLKSZ)
+        {
+            long n = ktfs_direct_run(fio, 0, block_idx, buf + bytesread, (end - curr) / KTFS_BLKSZ);
+            if (n < 0)
+                return n;
+            if (n > 0)
+            {
+                bytesread += n;
+                curr += n;
+                continue;
+            }
+        }
+
         int blknum = blocknum(fio, block_idx); // gets the physical blk num
         if (blknum == -1)
         {
@@ -495,7 +598,6 @@ long ktfs_readat(struct io *io, unsigned long long pos, void *buf, long len)
             bytesleft = end - curr;
         }
         // kprintf("\nBytes Left:%d", bytesleft);
-        // char *data;
 
         cache_get_block(filesetup.cptr, blknum * KTFS_BLKSZ, (void **)&data); // loads the data from the block into data address
         memcpy(buf + bytesread, data + block_offset, bytesleft);
@@ -512,85 +614,156 @@ long ktfs_readat(struct io *io, unsigned long long pos, void *buf, long len)
     return bytesread;
 }
 
+// Detects sequential access and queues asynchronous reads of the blocks that
+// follow. A read is sequential if it starts in the block where the previous
+// read ended or in the block after it. Blocks already queued by an earlier read
+// are not queued again. Takes the file's state_lock, since threads sharing the
+// open file may read at once under the shared inode lock.
+
+static void ktfs_readahead(struct ktfs_file *fio, unsigned long long first_idx, unsigned long long last_idx)
+{
+    unsigned long long const nblks = (fio->file_inode->size + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+    unsigned long long idx;
+    unsigned long long stop;
+    int blknum;
+
+    lock_acquire(&fio->state_lock);
+
+    if (first_idx != fio->ra_next && first_idx + 1 != fio->ra_next)
+    {
+        // Random access: start a new sequential run from here
+        fio->ra_end = 0;
+    }
+    else if (fio->ra_window != 0)
+    {
+        idx = (fio->ra_end > last_idx + 1) ? fio->ra_end : last_idx + 1;
+        stop = last_idx + 1 + fio->ra_window;
+        if (stop > nblks)
+            stop = nblks;
+
+        for (; idx < stop; idx++)
+        {
+            blknum = blocknum(fio, idx);
+            if (blknum == -1 || cache_prefetch(filesetup.cptr, (unsigned long long)blknum * KTFS_BLKSZ) != 0)
+                break;
+        }
+
+        fio->ra_end = idx;
+    }
+
+    fio->ra_next = last_idx + 1;
+    lock_release(&fio->state_lock);
+}
+
+// Transfers the longest run of physically contiguous blocks of _fio_ starting
+// at block index _idx_, at most _nblks_ and KTFS_DIRECT_MAX_BLKS long, between
+// _buf_ and the device in one request that bypasses the cache. Returns the
+// number of bytes transferred, 0 if the run is shorter than
+// KTFS_DIRECT_MIN_BLKS (the caller then goes through the cache), or a
+// negative error code.
+
+static long ktfs_direct_run(struct ktfs_file *fio, int write, unsigned long long idx, void *buf, unsigned long long nblks)
+{
+    int first = blocknum(fio, idx);
+    unsigned long long n = 1;
+
+    if (first == -1)
+        return -ENODATABLKS;
+
+    if (nblks > KTFS_DIRECT_MAX_BLKS)
+        nblks = KTFS_DIRECT_MAX_BLKS;
+
+    while (n < nblks && blocknum(fio, idx + n) == first + (long long)n)
+        n++;
+
+    if (n < KTFS_DIRECT_MIN_BLKS)
+        return 0;
+
+    if (write)
+        return cache_write_direct(filesetup.cptr, (unsigned long long)first * KTFS_BLKSZ, buf, n * KTFS_BLKSZ);
+    else
+        return cache_read_direct(filesetup.cptr, (unsigned long long)first * KTFS_BLKSZ, buf, n * KTFS_BLKSZ);
+}
+
 // returns the physical block num (using the logical index from dividing currpos by blksz)
 int blocknum(struct ktfs_file *fio, unsigned long long idx)
 {
-    // use the blkindex we calculated in the readat to find the actual block (direct, indirect, dindirect)
-    struct ktfs_inode *inode = fio->file_inode; // gets the inode of the file
-    struct indirBlock *indirectdata;
-    // void *dindirectdata;
-    int blknum;
+    int result;
+
+    lock_acquire(&fio->state_lock);
+    if (fio->bmap.gen != fio->ino->bmap_gen)
+    {
+        fio->bmap.valid = 0;
+        fio->bmap.gen = fio->ino->bmap_gen;
+    }
+    result = ktfs_bmap_lookup(&fio->bmap, fio->file_inode, idx);
+    lock_release(&fio->state_lock);
+    return result;
+}
 
+// Returns the physical block number of logical block _idx_ of the file with
+// inode _inode_, or -1. Reloads _map_ when _idx_ is outside the index block
+// it holds.
+static int ktfs_bmap_lookup(struct ktfs_bmap *map, const struct ktfs_inode *inode, unsigned long long idx)
+{
     // Global offset calculation
     unsigned long long global_datablock_0 = 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count;
+    unsigned long long first;
+    uint32_t leaf;
+    uint32_t *blocks;
 
     if (idx < KTFS_NUM_DIRECT_DATA_BLOCKS)
     { // checks if the index is in the direct block
         return inode->block[idx] + global_datablock_0;
     }
-    else if (idx < (KTFS_BLKS_PER_INDIRECT + KTFS_NUM_DIRECT_DATA_BLOCKS))
-    {                                                                                         // indirect block
-        unsigned long long indirectpos = (inode->indirect + global_datablock_0) * KTFS_BLKSZ; // gbl offset
-        // unsigned long long indirect_idx = idx - KTFS_NUM_DIRECT_DATA_BLOCKS;
 
-        cache_get_block(filesetup.cptr, indirectpos, (void **)&indirectdata);
-        uint32_t *indirect_blocks = (uint32_t *)indirectdata;
-        blknum = indirect_blocks[idx - KTFS_NUM_DIRECT_DATA_BLOCKS];
-        // kprintf("\nblocknum\n%d\n",blknum);
-        //  Release the block
-        cache_release_block(filesetup.cptr, indirectdata, CACHE_CLEAN);
+    if (map->valid && idx - map->first < KTFS_BLKS_PER_INDIRECT)
+    {
+        return map->entries[idx - map->first] + global_datablock_0;
+    }
 
-        return blknum + global_datablock_0;
+    if (idx < KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_BLKS_PER_INDIRECT)
+    { // indirect block
+        leaf = inode->indirect;
+        first = KTFS_NUM_DIRECT_DATA_BLOCKS;
     }
-    else if (idx >= KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_BLKS_PER_INDIRECT)
+    else
     {
-        // Adjust for both direct and indirect blocks
+        // Adjust for both direct and indirect blocks, then pick the doubly
+        // indirect block and the indirect block under it
         unsigned long long newidx = idx - KTFS_NUM_DIRECT_DATA_BLOCKS - KTFS_BLKS_PER_INDIRECT;
-        int dindirect_block_idx;
+        unsigned long long dindirect_block_idx = newidx / KTFS_BLKS_PER_DINDIRECT;
 
-        // Calculate which dindirect block to use (0 or 1)
-        if (newidx < KTFS_BLKS_PER_DINDIRECT)
+        if (dindirect_block_idx >= KTFS_NUM_DINDIRECT_BLOCKS)
         {
-            dindirect_block_idx = 0;
+            return -1;
         }
 
-        if (newidx >= KTFS_BLKS_PER_DINDIRECT)
+        newidx %= KTFS_BLKS_PER_DINDIRECT;
+
+        if (cache_get_block(filesetup.cptr, (inode->dindirect[dindirect_block_idx] + global_datablock_0) * KTFS_BLKSZ, (void **)&blocks) < 0)
         {
-            dindirect_block_idx = 1;
-            newidx -= KTFS_BLKS_PER_DINDIRECT;
+            return -1;
         }
+        leaf = blocks[newidx / KTFS_BLKS_PER_INDIRECT];
+        cache_release_block(filesetup.cptr, blocks, CACHE_CLEAN | CACHE_META);
 
-        // Calculate indirect block index and offset within that indirect block
-        int indirectidx = newidx / KTFS_BLKS_PER_INDIRECT;
-        int indirectoffset = newidx % KTFS_BLKS_PER_INDIRECT;
-
-        // Get the doubly indirect block
-        unsigned long long dindirectblkpos = (inode->dindirect[dindirect_block_idx] + global_datablock_0) * KTFS_BLKSZ;
-
-        void *dindirectdata;
-        cache_get_block(filesetup.cptr, dindirectblkpos, (void **)&dindirectdata);
-
-        uint32_t *dindirect_blocks = (uint32_t *)dindirectdata;
-        uint32_t indirectnum = dindirect_blocks[indirectidx];
-
-        // Release the doubly indirect block
-        cache_release_block(filesetup.cptr, dindirectdata, CACHE_CLEAN);
-
-        // Get the indirect block
-        unsigned long long indirectpos = (indirectnum + global_datablock_0) * KTFS_BLKSZ;
-
-        char *indirect_data;
-        cache_get_block(filesetup.cptr, indirectpos, (void **)&indirect_data);
-
-        uint32_t *indirect_blocks = (uint32_t *)indirect_data;
-        blknum = indirect_blocks[indirectoffset];
-
-        cache_release_block(filesetup.cptr, indirect_data, CACHE_CLEAN);
-
-        return blknum + global_datablock_0;
+        first = idx - newidx % KTFS_BLKS_PER_INDIRECT;
     }
 
-    return -1; // error
+    if (cache_get_block(filesetup.cptr, (leaf + global_datablock_0) * KTFS_BLKSZ, (void **)&blocks) < 0)
+    {
+        map->valid = 0;
+        return -1;
+    }
+    // The entries array is sized for the largest block size; only the
+    // KTFS_BLKS_PER_INDIRECT entries of a mounted-size block are valid
+    memcpy(map->entries, blocks, KTFS_BLKS_PER_INDIRECT * sizeof(uint32_t));
+    cache_release_block(filesetup.cptr, blocks, CACHE_CLEAN | CACHE_META);
+
+    map->first = first;
+    map->valid = 1;
+    return map->entries[idx - first] + global_datablock_0;
 }
 
 // Do an special / ioctl function on the filesystem.
@@ -612,277 +785,396 @@ int ktfs_cntl(struct io *io, int cmd, void *arg)
     struct ktfs_file *fio = (struct ktfs_file *)((void *)io - offsetof(struct ktfs_file, fileio));
 
     unsigned long long *ullarg = arg;
+    int result;
 
     switch (cmd)
     {
     case IOCTL_GETBLKSZ:
         return 1;
 
+    case IOCTL_GETREADAHEAD:
+        if (ullarg == NULL)
+        {
+            return -EINVAL;
+        }
+        *ullarg = fio->ra_window;
+        return 0;
+
+    case IOCTL_SETREADAHEAD:
+        if (ullarg == NULL || *ullarg > KTFS_READAHEAD_MAX)
+        {
+            return -EINVAL;
+        }
+        lock_acquire(&fio->state_lock);
+        fio->ra_window = *ullarg;
+        fio->ra_end = 0;
+        lock_release(&fio->state_lock);
+        return 0;
+
+    case IOCTL_FLUSH:
+        return ktfs_flush();
+
     case IOCTL_GETEND:
         // kprintf("\n%p\n",fio->file_inode);
         if (ullarg == NULL)
         {
             return -EINVAL;
         }
+        rwlock_acquire_read(&fio->ino->rwlock);
         *ullarg = fio->file_inode->size;
+        rwlock_release_read(&fio->ino->rwlock);
         return 0;
 
-    case IOCTL_SETEND:
-        // kprintf()
-        //  need to allocate more inode if reach past end
+    case IOCTL_GETID:
         if (ullarg == NULL)
         {
             return -EINVAL;
         }
-        if (*ullarg == fio->file_inode->size)
+        if (fio->ino->deleted)
         {
-            return 0;
+            return -EIO;
         }
-        else if (*ullarg > fio->file_inode->size)
-        {
-            size_t end = *ullarg;
-            // if ((end / KTFS_BLKSZ) == (fio->file_inode->size / KTFS_BLKSZ))
-            // {
-            //     fio->file_inode->size = end;
-            //     unsigned long long block_idx = fio->dentry->inode / INODES_PER_BLK;
-            //     unsigned long long inode_idx = fio->dentry->inode % INODES_PER_BLK;
-            //     unsigned long long global_block_idx = 1 + filesetup.super_blk.bitmap_block_count + block_idx;
-            //     cache_get_block(filesetup.cptr, global_block_idx * KTFS_BLKSZ,
-            //                     (void **)(&data));
-            //     memcpy(data + (inode_idx * KTFS_INOSZ), fio->file_inode, sizeof(struct ktfs_inode));
-            //     cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
-            //     return 0;
-            // }
-            // fio->file_inode->size = (((fio->file_inode->size) + (KTFS_BLKSZ)-1) / (KTFS_BLKSZ) * (KTFS_BLKSZ));
-            while (fio->file_inode->size < end)
-            {
-                // handle case when end is still larger than size but on the same block so no need to allocate
-                fio->file_inode->size = (((fio->file_inode->size) + (KTFS_BLKSZ)-1) / (KTFS_BLKSZ) * (KTFS_BLKSZ));
-                if (end < fio->file_inode->size) //(end / KTFS_BLKSZ) == (fio->file_inode->size / KTFS_BLKSZ)
-                {
-                    fio->file_inode->size = end;
-                    unsigned long long block_idx = fio->dentry->inode / INODES_PER_BLK;
-                    unsigned long long inode_idx = fio->dentry->inode % INODES_PER_BLK;
-                    unsigned long long global_block_idx = 1 + filesetup.super_blk.bitmap_block_count + block_idx;
-                    cache_get_block(filesetup.cptr, global_block_idx * KTFS_BLKSZ,
-                                    (void **)(&data));
-                    memcpy(data + (inode_idx * KTFS_INOSZ), fio->file_inode, sizeof(struct ktfs_inode));
-                    cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
-                    return 0;
-                }
+        *ullarg = fio->ino->version;
+        return 0;
 
-                // call helper to set correct block in inode to newly allocated block.
-                int ret;
-                if (fio->file_inode->size == 0)
-                {
-                    unsigned long long alloc_block = allocate_open_block();
-                    if (alloc_block == -ENODATABLKS)
-                    {
-                        return -ENODATABLKS;
-                    }
-                    fio->file_inode->block[0] = alloc_block;
-                    write_inode_to_disk(fio);
-                }
-                else
-                {
-                    ret = add_new_inode_datablk(fio, ((fio->file_inode->size - 1) / KTFS_BLKSZ));
-                }
-                if (ret == -ENODATABLKS)
-                {
-                    return -ENODATABLKS;
-                }
-                fio->file_inode->size = ((fio->file_inode->size / KTFS_BLKSZ) + 1) * KTFS_BLKSZ;
-            }
-            if (fio->file_inode->size >= end)
-            {
-                fio->file_inode->size = end;
-                unsigned long long block_idx = fio->dentry->inode / INODES_PER_BLK;
-                unsigned long long inode_idx = fio->dentry->inode % INODES_PER_BLK;
-                unsigned long long global_block_idx = 1 + filesetup.super_blk.bitmap_block_count + block_idx;
-                cache_get_block(filesetup.cptr, global_block_idx * KTFS_BLKSZ,
-                                (void **)(&data));
-                memcpy(data + (inode_idx * KTFS_INOSZ), fio->file_inode, sizeof(struct ktfs_inode));
-                cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
-                return 0;
-            }
+    case IOCTL_SETEND:
+        // kprintf()
+        //  need to allocate more inode if reach past end
+        if (ullarg == NULL)
+        {
             return -EINVAL;
         }
-        else
+        lock_acquire(&filesetup.filesetup_lock);
+        rwlock_acquire_write(&fio->ino->rwlock);
+        ktfs_inode_touch(fio->ino);
+        result = ktfs_setend(fio, ullarg);
+        rwlock_release_write(&fio->ino->rwlock);
+        lock_release(&filesetup.filesetup_lock);
+        return result;
+
+    case IOCTL_PREALLOC:
+        if (ullarg == NULL)
         {
             return -EINVAL;
         }
+        lock_acquire(&filesetup.filesetup_lock);
+        rwlock_acquire_write(&fio->ino->rwlock);
+        ktfs_inode_touch(fio->ino);
+        if (fio->ino->deleted)
+            result = -EIO;
+        else if (*ullarg > fio->file_inode->size)
+            result = ktfs_grow(fio, *ullarg);
+        else
+            result = 0;
+        rwlock_release_write(&fio->ino->rwlock);
+        lock_release(&filesetup.filesetup_lock);
+        return result;
 
     default:
         return -ENOTSUP;
     }
 }
 
-// Helper function to find which block you need to set based on the size and set that to newly allocated block_num
-int add_new_inode_datablk(struct ktfs_file *fio, unsigned long long old_idx)
-{
-    // use the blkindex we calculated in the readat to find the actual block (direct, indirect, dindirect)
-    struct ktfs_inode *inode = fio->file_inode; // gets the inode of the file
-    // struct indirBlock *indirectdata;
-    //  void *dindirectdata;
-    // int blknum;
+// Extends the file to *_ullarg_ bytes, zeroing the blocks added. Called with
+// filesetup_lock and the inode lock held.
 
-    // Handle the case where you need to free alrdy allocated data blocks if error occurs!! ASK OH?
-    unsigned long long new_idx = old_idx + 1;
+static int ktfs_setend(struct ktfs_file *fio, unsigned long long *ullarg)
+{
+    if (fio->ino->deleted)
+    {
+        return -EIO;
+    }
+    if (*ullarg == fio->file_inode->size)
+    {
+        return 0;
+    }
+    else if (*ullarg > fio->file_inode->size)
+    {
+        return ktfs_grow(fio, *ullarg);
+    }
+    else
+    {
+        return -EINVAL;
+    }
+}
 
-    // Global offset calculation
-    unsigned long long global_datablock_0 = 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count;
+// Extends the file to _end_ bytes. The blocks needed, data and index blocks
+// alike, are reserved as one run next to the file's last block, and their
+// pointers are filled in a single pass that keeps the index block being
+// filled pinned in the cache. The new data blocks are zeroed on the device
+// without transferring data. Returns 0 on success, negative values on error;
+// on error the file keeps the blocks filled so far. Called with
+// filesetup_lock and the inode lock held.
 
-    if (new_idx < KTFS_NUM_DIRECT_DATA_BLOCKS)
-    { // checks if the index is in the direct block
+static int ktfs_grow(struct ktfs_file *fio, unsigned long long end)
+{
+    struct ktfs_inode *const inode = fio->file_inode;
+    const unsigned long long global_datablock_0 = 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count;
+    const unsigned long long maxblks = KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_BLKS_PER_INDIRECT + KTFS_NUM_DINDIRECT_BLOCKS * KTFS_BLKS_PER_DINDIRECT;
+    struct ktfs_block_run zero_run = {.count = 0, .zero = 1};
+    unsigned long long cur = (inode->size + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+    unsigned long long want = (end + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+    unsigned long long goal = ~0ULL;
+    unsigned long long idx;
+    uint32_t *leaf = NULL; // index block receiving data block pointers
+    uint32_t *dind = NULL; // doubly indirect block receiving leaf pointers
+    long long blk = 0;     // last block allocated, or the allocation error
+    int result = 0;
+
+    // The inode records the size in 32 bits
+    if (want > maxblks || end > UINT32_MAX)
+        return -EINVAL;
 
-        unsigned long long alloc_block = allocate_open_block();
-        if (alloc_block == -ENODATABLKS)
-        {
-            return -ENODATABLKS;
-        }
-        inode->block[new_idx] = alloc_block;
+    if (want == cur)
+    {
+        inode->size = end;
         write_inode_to_disk(fio);
-
-        // cache_get_block(filesetup.cptr, (inode->block[new_idx] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-        // uint32_t *direct_blocks = (uint32_t *)data;
-        // direct_blocks[new_idx] = alloc_block;
-        // inode->block[new_idx] = alloc_block;
-        // cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
-        return 1;
+        return 0;
     }
-    else if (new_idx < (KTFS_BLKS_PER_INDIRECT + KTFS_NUM_DIRECT_DATA_BLOCKS))
-    { // indirect block
-        if (old_idx < KTFS_NUM_DIRECT_DATA_BLOCKS)
-        {
-            unsigned long long alloc_block = allocate_open_block();
-            if (alloc_block == -ENODATABLKS)
-            {
-                return -ENODATABLKS;
-            }
-            inode->indirect = alloc_block;
-            // Save back to disk
-            write_inode_to_disk(fio);
-        }
 
-        unsigned long long indirectpos = (inode->indirect + global_datablock_0) * KTFS_BLKSZ; // gbl offset
-        unsigned long long alloc_block = allocate_open_block();
-        if (alloc_block == -ENODATABLKS)
-        {
-            return -ENODATABLKS;
-        }
-        cache_get_block(filesetup.cptr, indirectpos, (void **)&data);
-        uint32_t *indirect_blocks = (uint32_t *)data;
-        indirect_blocks[new_idx - KTFS_NUM_DIRECT_DATA_BLOCKS] = alloc_block;
-        cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
+    if (cur != 0)
+        goal = blocknum(fio, cur - 1) - global_datablock_0 + 1;
 
-        return 1;
+    // Reserve the data blocks plus a rough count of index blocks in one run
+    ktfs_reserve(fio, goal, want - cur + 2 + (want - cur) / KTFS_BLKS_PER_INDIRECT);
+    fio->ino->bmap_gen++;
+
+    // Resume filling the index block that holds the current last block
+    if (cur > KTFS_NUM_DIRECT_DATA_BLOCKS && cur < KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_BLKS_PER_INDIRECT)
+    {
+        result = ktfs_grow_get(inode->indirect, &leaf, 0);
+    }
+    else if (cur > KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_BLKS_PER_INDIRECT &&
+             (cur - KTFS_NUM_DIRECT_DATA_BLOCKS - KTFS_BLKS_PER_INDIRECT) % KTFS_BLKS_PER_DINDIRECT != 0)
+    {
+        unsigned long long d = cur - KTFS_NUM_DIRECT_DATA_BLOCKS - KTFS_BLKS_PER_INDIRECT;
+
+        result = ktfs_grow_get(inode->dindirect[d / KTFS_BLKS_PER_DINDIRECT], &dind, 0);
+        if (result == 0 && d % KTFS_BLKS_PER_INDIRECT != 0)
+            result = ktfs_grow_get(dind[(d % KTFS_BLKS_PER_DINDIRECT) / KTFS_BLKS_PER_INDIRECT], &leaf, 0);
     }
-    else if (new_idx >= KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_BLKS_PER_INDIRECT)
+
+    for (idx = cur; idx < want && result == 0; idx++)
     {
-        // Adjust for both direct and indirect blocks
-        // unsigned long long old_zero_offset = old_idx - KTFS_NUM_DIRECT_DATA_BLOCKS - KTFS_BLKS_PER_INDIRECT;
-        unsigned long long new_zero_offset = new_idx - KTFS_NUM_DIRECT_DATA_BLOCKS - KTFS_BLKS_PER_INDIRECT;
-        if (new_zero_offset == 0)
+        if (idx >= KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_BLKS_PER_INDIRECT)
         {
-            unsigned long long alloc_block = allocate_open_block();
-            if (alloc_block == -ENODATABLKS)
+            unsigned long long d = idx - KTFS_NUM_DIRECT_DATA_BLOCKS - KTFS_BLKS_PER_INDIRECT;
+
+            if (d % KTFS_BLKS_PER_DINDIRECT == 0)
             {
-                return -ENODATABLKS;
+                ktfs_grow_put(&dind);
+                blk = ktfs_alloc_file_block(fio, goal);
+                if (blk < 0 || (result = ktfs_grow_get(blk, &dind, 1)) < 0)
+                    break;
+                inode->dindirect[d / KTFS_BLKS_PER_DINDIRECT] = blk;
             }
-            inode->dindirect[0] = alloc_block;
-            // Save back to disk
-            write_inode_to_disk(fio);
-        }
-        else if (new_zero_offset == KTFS_BLKS_PER_DINDIRECT)
-        {
-            unsigned long long alloc_block = allocate_open_block();
-            if (alloc_block == -ENODATABLKS)
+
+            if (d % KTFS_BLKS_PER_INDIRECT == 0)
             {
-                return -ENODATABLKS;
+                ktfs_grow_put(&leaf);
+                blk = ktfs_alloc_file_block(fio, goal);
+                if (blk < 0 || (result = ktfs_grow_get(blk, &leaf, 1)) < 0)
+                    break;
+                dind[(d % KTFS_BLKS_PER_DINDIRECT) / KTFS_BLKS_PER_INDIRECT] = blk;
             }
-            inode->dindirect[1] = alloc_block;
-            // Save back to disk
-            write_inode_to_disk(fio);
-        }
-        int dind_blk_idx;
-        if (new_zero_offset < KTFS_BLKS_PER_DINDIRECT)
-        {
-            dind_blk_idx = 0;
         }
-        else
+        else if (idx == KTFS_NUM_DIRECT_DATA_BLOCKS)
         {
-            dind_blk_idx = 1;
-            new_zero_offset -= KTFS_BLKS_PER_DINDIRECT;
+            blk = ktfs_alloc_file_block(fio, goal);
+            if (blk < 0 || (result = ktfs_grow_get(blk, &leaf, 1)) < 0)
+                break;
+            inode->indirect = blk;
         }
-        int indirectidx = new_zero_offset / KTFS_BLKS_PER_INDIRECT;
-        int indirectoffset = new_zero_offset % KTFS_BLKS_PER_INDIRECT;
 
-        if (indirectoffset == 0)
-        {
-            unsigned long long alloc_block = allocate_open_block();
-            if (alloc_block == -ENODATABLKS)
-            {
-                return -ENODATABLKS;
-            }
-            cache_get_block(filesetup.cptr, (inode->dindirect[dind_blk_idx] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-            uint32_t *dindirect_block = (uint32_t *)data;
-            dindirect_block[indirectidx] = alloc_block;
-            cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
-        }
-        // Get index to inder block in dinder block
-        cache_get_block(filesetup.cptr, (inode->dindirect[dind_blk_idx] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-        uint32_t *dindirect_blocks = (uint32_t *)data;
-        uint32_t indirectnum = dindirect_blocks[indirectidx];
-        cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
+        blk = ktfs_alloc_file_block(fio, goal);
+        if (blk < 0)
+            break;
 
-        // Find exact inder pos
-        unsigned long long indirectpos = (indirectnum + global_datablock_0) * KTFS_BLKSZ;
-        unsigned long long alloc_block = allocate_open_block();
-        if (alloc_block == -ENODATABLKS)
-        {
-            return -ENODATABLKS;
-        }
+        if (idx < KTFS_NUM_DIRECT_DATA_BLOCKS)
+            inode->block[idx] = blk;
+        else if (idx < KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_BLKS_PER_INDIRECT)
+            leaf[idx - KTFS_NUM_DIRECT_DATA_BLOCKS] = blk;
+        else
+            leaf[(idx - KTFS_NUM_DIRECT_DATA_BLOCKS - KTFS_BLKS_PER_INDIRECT) % KTFS_BLKS_PER_INDIRECT] = blk;
 
-        // set entry to be new block
-        cache_get_block(filesetup.cptr, indirectpos, (void **)&data);
-        uint32_t *indirect_blocks = (uint32_t *)data;
-        indirect_blocks[indirectoffset] = alloc_block;
-        cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
-        return 1;
+        ktfs_run_add(&zero_run, blk + global_datablock_0);
+        goal = blk + 1;
     }
 
-    return -1; // error
-}
+    ktfs_grow_put(&leaf);
+    ktfs_grow_put(&dind);
 
-void write_inode_to_disk(struct ktfs_file *fio)
-{
-    // write inode back to disk
-    unsigned long long block_idx = fio->dentry->inode / INODES_PER_BLK;
-    unsigned long long inode_idx = fio->dentry->inode % INODES_PER_BLK;
-    unsigned long long global_block_idx = 1 + filesetup.super_blk.bitmap_block_count + block_idx;
-    cache_get_block(filesetup.cptr, global_block_idx * KTFS_BLKSZ,
-                    (void **)(&data));
-    memcpy(data + (inode_idx * KTFS_INOSZ), fio->file_inode, sizeof(struct ktfs_inode));
-    cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
+    inode->size = (idx == want) ? end : idx * KTFS_BLKSZ;
+    write_inode_to_disk(fio);
+
+    // Only a failed allocation stops the loop early without setting result
+    if (result == 0 && idx != want)
+        result = blk;
+
+    ktfs_run_issue(&zero_run);
+    return result;
 }
 
-// Flush the cache to the backing device.
-// Returns 0 if flush successful, negative values if there's an error.
+// Pins index block _blk_ (relative to data block 0) in the cache for
+// ktfs_grow(), storing its address in *_pptr_. A newly allocated index block
+// is cleared first.
 
-int ktfs_flush(void)
+static int ktfs_grow_get(unsigned long long blk, uint32_t **pptr, int fresh)
 {
-    // struct ktfs_file *fio;
-    if (filesetup.cptr == NULL)
+    const unsigned long long global_datablock_0 = 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count;
+    int result;
+
+    result = cache_get_block(filesetup.cptr, (blk + global_datablock_0) * KTFS_BLKSZ, (void **)pptr);
+    if (result < 0)
     {
-        return -EINVAL;
+        *pptr = NULL;
+        return result;
     }
-    cache_flush((filesetup.cptr));
+    if (fresh)
+        memset(*pptr, 0, KTFS_BLKSZ);
     return 0;
 }
 
-long ktfs_writeat(struct io *io, unsigned long long pos, const void *buf, long len)
-{
-    trace("%s()", __func__);
+// Releases an index block pinned by ktfs_grow_get(), if any.
+
+static void ktfs_grow_put(uint32_t **pptr)
+{
+    if (*pptr != NULL)
+    {
+        cache_release_block(filesetup.cptr, *pptr, CACHE_DIRTY | CACHE_META);
+        *pptr = NULL;
+    }
+}
+
+// Marks the inode of _fio_ changed. It is written back by the next
+// ktfs_commit(), so a file grown a block at a time costs one inode write per
+// commit rather than one per block. Must be called with filesetup_lock held.
+void write_inode_to_disk(struct ktfs_file *fio)
+{
+    struct ktfs_open_inode *const ino = fio->ino;
+
+    if (!ino->dirty)
+    {
+        ino->dirty = 1;
+        ino->dirty_next = filesetup.dirty_inodes;
+        filesetup.dirty_inodes = ino;
+    }
+}
+
+// Copies _ino_ into its inode block in the cache.
+static void ktfs_inode_store(struct ktfs_open_inode *ino)
+{
+    unsigned long long block_idx = ino->inum / INODES_PER_BLK;
+    unsigned long long inode_idx = ino->inum % INODES_PER_BLK;
+    unsigned long long global_block_idx = 1 + filesetup.super_blk.bitmap_block_count + block_idx;
+    cache_get_block(filesetup.cptr, global_block_idx * KTFS_BLKSZ,
+                    (void **)(&data));
+    memcpy(data + (inode_idx * KTFS_INOSZ), &ino->disk, sizeof(struct ktfs_inode));
+    cache_release_block(filesetup.cptr, data, CACHE_DIRTY | CACHE_META);
+}
+
+// Takes _ino_ off the dirty list without writing it.
+static void ktfs_inode_clean(struct ktfs_open_inode *ino)
+{
+    struct ktfs_open_inode **pp = &filesetup.dirty_inodes;
+
+    if (!ino->dirty)
+        return;
+
+    while (*pp != ino)
+        pp = &(*pp)->dirty_next;
+
+    *pp = ino->dirty_next;
+    ino->dirty = 0;
+}
+
+// Gives _ino_ a version no inode has had, so that a cached copy of the old
+// contents (see IOCTL_GETID) no longer matches. Called with the inode lock
+// held exclusively, or before the inode is shared.
+static void ktfs_inode_touch(struct ktfs_open_inode *ino)
+{
+    ino->version = ++ktfs_version;
+}
+
+// Writes the dirty inodes and bitmap blocks as one group. Data and index
+// blocks are made durable first, so that a crash never leaves an inode
+// pointing at blocks whose contents did not reach the device. Returns 1 if
+// anything was committed, 0 if there was nothing to commit, negative values
+// on error. Must be called with filesetup_lock held.
+static int ktfs_commit(void)
+{
+    struct ktfs_open_inode *ino;
+    int result;
+
+    if (filesetup.dirty_inodes == NULL && !ktfs_bitmap_dirty())
+        return 0;
+
+    result = cache_flush(filesetup.cptr);
+    if (result < 0)
+        return result;
+
+    result = ktfs_bitmap_writeback();
+    if (result < 0)
+        return result;
+
+    while ((ino = filesetup.dirty_inodes) != NULL)
+    {
+        filesetup.dirty_inodes = ino->dirty_next;
+        ino->dirty = 0;
+        ktfs_inode_store(ino);
+    }
+
+    result = cache_flush(filesetup.cptr);
+    return (result < 0) ? result : 1;
+}
+
+// Commits metadata changed since the last commit every KTFS_COMMIT_INTERVAL_MS.
+static void ktfs_committer(void)
+{
+    struct alarm al;
+
+    alarm_init(&al, "ktfs_committer");
+
+    for (;;)
+    {
+        alarm_sleep_ms(&al, KTFS_COMMIT_INTERVAL_MS);
+
+        if (filesetup.dirty_inodes == NULL && !ktfs_bitmap_dirty())
+            continue;
+
+        lock_acquire(&filesetup.filesetup_lock);
+        ktfs_commit();
+        lock_release(&filesetup.filesetup_lock);
+    }
+}
+
+// Commit pending metadata, then flush the cache to the backing device and
+// wait until the device reports the data durable. Returns 0 if flush
+// successful, negative values if there's an error.
+
+int ktfs_flush(void)
+{
+    // struct ktfs_file *fio;
+    int result;
+
+    if (filesetup.cptr == NULL)
+    {
+        return -EINVAL;
+    }
+    lock_acquire(&filesetup.filesetup_lock);
+    result = ktfs_commit();
+    lock_release(&filesetup.filesetup_lock);
+    if (result != 0)
+    {
+        return (result < 0) ? result : 0;
+    }
+    return cache_flush(filesetup.cptr);
+}
+
+long ktfs_writeat(struct io *io, unsigned long long pos, const void *buf, long len)
+{
+    trace("%s()", __func__);
+    long result;
 
     if (buf == NULL || io == NULL)
     {
@@ -890,11 +1182,24 @@ long ktfs_writeat(struct io *io, unsigned long long pos, const void *buf, long l
     }
     // struct ktfs_file *fio = (struct ktfs_file *)(void *)io - offsetof(struct ktfs_file, fileio); // gives us the fio for the open file
     struct ktfs_file *fio = (struct ktfs_file *)((void *)io - offsetof(struct ktfs_file, fileio));
-    if (fio->open == 0)
+
+    rwlock_acquire_write(&fio->ino->rwlock);
+    ktfs_inode_touch(fio->ino);
+    result = ktfs_file_writeat(fio, pos, buf, len);
+    rwlock_release_write(&fio->ino->rwlock);
+    return result;
+}
+
+// Does the work of ktfs_writeat() with the inode lock held exclusively.
+
+static long ktfs_file_writeat(struct ktfs_file *fio, unsigned long long pos, const void *buf, long len)
+{
+    if (fio->open == 0 || fio->ino->deleted)
     {
         return -EIO;
     }
     long byteswritten = 0;
+    char *data;
 
     // boundary checking
     if (len < 0)
@@ -923,6 +1228,19 @@ long ktfs_writeat(struct io *io, unsigned long long pos, const void *buf, long l
         unsigned long long block_idx = curr / KTFS_BLKSZ;    // Logical block index
         unsigned long long block_offset = curr % KTFS_BLKSZ; // Offset within block
 
+        if (block_offset == 0 && end - curr >= KTFS_DIRECT_MIN_BLKS * KTFS_BLKSZ)
+        {
+            long n = ktfs_direct_run(fio, 1, block_idx, (char *)buf + byteswritten, (end - curr) / KTFS_BLKSZ);
+            if (n < 0)
+                return n;
+            if (n > 0)
+            {
+                byteswritten += n;
+                curr += n;
+                continue;
+            }
+        }
+
         // get physical blk
         int blknum = blocknum(fio, block_idx);
         if (blknum == -1)
@@ -937,8 +1255,6 @@ long ktfs_writeat(struct io *io, unsigned long long pos, const void *buf, long l
             bytesleft = end - curr;
         }
 
-        // char *data;
-
         cache_get_block(filesetup.cptr, blknum * KTFS_BLKSZ, (void **)&data);
         // kprintf("\nDATA PTR:%p", data);
         // kprintf("\nStart Write: %p End Write: %p", (data + block_offset), (data + byteswritten + bytesleft));
@@ -953,30 +1269,115 @@ long ktfs_writeat(struct io *io, unsigned long long pos, const void *buf, long l
     return byteswritten;
 }
 
-// modify create to work with swaps: Done
 int ktfs_create(const char *name)
 {
-    trace("%s()", __func__);
-    if (name == NULL || strlen(name) > KTFS_MAX_FILENAME_LEN || strlen(name) == 0)
+    int result;
+
+    lock_acquire(&filesetup.filesetup_lock);
+    result = ktfs_create_entry(name);
+    lock_release(&filesetup.filesetup_lock);
+    return result;
+}
+
+// Reads the bitmap and the directory of the mounted file system in the
+// background: first the directory index and inode summary, then the free-block
+// bitmap a group at a time. A group some thread is waiting for is loaded
+// next; the others are loaded in order.
+static void ktfs_loader(void)
+{
+    struct ktfs_freemap *const map = &filesetup.block_map;
+    unsigned int next = 0;
+    int pie;
+
+    ktfs_load_dir();
+
+    pie = disable_interrupts();
+    filesetup.dir_ready = 1;
+    condition_broadcast(&filesetup.loaded);
+    restore_interrupts(pie);
+
+    for (unsigned int done = 0; done < map->group_cnt; done++)
     {
-        return -EINVAL;
+        unsigned int g = map->demand;
+
+        if (g >= map->group_cnt || map->group_ready[g])
+        {
+            while (map->group_ready[next])
+                next++;
+            g = next;
+        }
+
+        ktfs_load_group(map, g);
     }
+}
 
-    struct ktfs_dir_entry dir[DIR_SIZE];
+// Builds the directory index and marks the inodes it refers to in use.
+static void ktfs_load_dir(void)
+{
     unsigned long long global_datablock_0 = 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count;
-    for (int blk_idx = 0; blk_idx < KTFS_NUM_DIRECT_DATA_BLOCKS; blk_idx++)
+    struct ktfs_dir_entry *dir;
+
+    ktfs_freemap_recount(&filesetup.inode_map);
+    ktfs_freemap_set(&filesetup.inode_map, filesetup.super_blk.root_directory_inode);
+
+    for (int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++)
     {
-        cache_get_block(filesetup.cptr, (filesetup.root_dir_inode.block[blk_idx] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-        memcpy(dir, data, sizeof(dir));
-        cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
+        cache_get_block(filesetup.cptr, (filesetup.root_dir_inode.block[i] + global_datablock_0) * KTFS_BLKSZ, (void **)&dir);
 
-        for (int dir_idx = 0; dir_idx < DIR_SIZE; dir_idx++)
+        for (int j = 0; j < DIR_SIZE; j++)
         {
-            if (strncmp(name, dir[dir_idx].name, FILENAME_SIZE) == 0)
+            if (i * DIR_SIZE + j >= (filesetup.root_dir_inode.size / KTFS_DENSZ))
             {
-                return -EBUSY;
+                cache_release_block(filesetup.cptr, dir, CACHE_CLEAN | CACHE_META);
+                filesetup.inodecount = i * DIR_SIZE + j;
+                return;
             }
+            ktfs_freemap_set(&filesetup.inode_map, dir[j].inode); // mark inode as used
+            ktfs_index_add(dir[j].name, dir[j].inode, i * DIR_SIZE + j);
         }
+        cache_release_block(filesetup.cptr, dir, CACHE_CLEAN | CACHE_META);
+    }
+}
+
+// Copies bitmap block _g_ into _map_ and marks the group ready. A block that
+// cannot be read is treated as full, so its blocks are never handed out.
+static void ktfs_load_group(struct ktfs_freemap *map, unsigned int g)
+{
+    uint64_t *const words = map->words + g * FREEMAP_GROUP_WORDS;
+    void *blk;
+    int pie;
+
+    if (cache_get_block(filesetup.cptr, (1 + g) * KTFS_BLKSZ, &blk) == 0)
+    {
+        memcpy(words, blk, KTFS_BLKSZ);
+        cache_release_block(filesetup.cptr, blk, CACHE_CLEAN | CACHE_META);
+    }
+    else
+    {
+        memset(words, 0xff, KTFS_BLKSZ);
+    }
+
+    ktfs_freemap_recount_group(map, g);
+
+    pie = disable_interrupts();
+    map->group_ready[g] = 1;
+    condition_broadcast(&filesetup.loaded);
+    restore_interrupts(pie);
+}
+
+// modify create to work with swaps: Done
+static int ktfs_create_entry(const char *name)
+{
+    trace("%s()", __func__);
+    if (name == NULL || strlen(name) > KTFS_MAX_FILENAME_LEN || strlen(name) == 0)
+    {
+        return -EINVAL;
+    }
+
+    unsigned long long global_datablock_0 = 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count;
+    if (ktfs_index_find(name) != NULL)
+    {
+        return -EBUSY;
     }
 
     uint64_t num_files = (filesetup.root_dir_inode.size) / sizeof(struct ktfs_dir_entry);
@@ -1009,23 +1410,15 @@ int ktfs_create(const char *name)
 
         cache_get_block(filesetup.cptr, dir_block_addr, (void **)&data);
         struct ktfs_dir_entry dentry;
-        unsigned long long inodeidx = 0;
-        // If we are not able to assume the inodes are consecutive do we have to make a bitmap
-        // kprintf("Searching for free inode\n");
-        for (int i = 0; i < (filesetup.super_blk.inode_block_count * INODES_PER_BLK); i++)
+        long inodeidx = ktfs_freemap_alloc(&filesetup.inode_map);
+        if (inodeidx < 0)
         {
-            // kprintf("Inode %d is %s\n", i, filesetup.inode_bitmap[i] ? "used" : "free");
-            if (filesetup.inode_bitmap[i] == 0)
-            {
-                filesetup.inode_bitmap[i] = 1;
-                inodeidx = i;
-                // kprintf("Found free inode at index %d\n", inodeidx);
-                break;
-            }
+            cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
+            return -EMFILE;
         }
         // kprintf("\nInode Index:%d\n", inodeidx);
         dentry.inode = inodeidx; // should we keep this here or make some variable for inode count
-        strncpy(dentry.name, name, sizeof(struct file_name));
+        strncpy(dentry.name, name, sizeof(dentry.name));
         // memcpy((data + (dir_idx * sizeof(struct ktfs_dir_entry))), &dentry, sizeof(struct ktfs_dir_entry));
         // cache_release_block(filesetup.cptr, data, CACHE_DIRTY); // the line that fucks it - but its just releasing it
         // unsigned long long dentry_addr = (unsigned long long)(data + (dir_idx * sizeof(struct ktfs_dir_entry)));
@@ -1047,6 +1440,7 @@ int ktfs_create(const char *name)
         memcpy(data + inode_idx, &filesetup.root_dir_inode, sizeof(struct ktfs_inode)); // added * ktfs inode sz
         cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
         filesetup.inodecount++;
+        ktfs_index_add(dentry.name, dentry.inode, num_files);
         return 0;
     }
     return -EMFILE;
@@ -1071,6 +1465,18 @@ int ktfs_create(const char *name)
 // change root directory inode to reflect this information
 // update dentry corrosponding to last inode idx to new inode idx
 int ktfs_delete(const char *name)
+{
+    int result;
+
+    lock_acquire(&filesetup.filesetup_lock);
+    result = ktfs_delete_entry(name);
+    lock_release(&filesetup.filesetup_lock);
+    return result;
+}
+
+// Does the work of ktfs_delete() with filesetup_lock held.
+
+static int ktfs_delete_entry(const char *name)
 {
 
     if (name == NULL || sizeof(name) > KTFS_MAX_FILENAME_LEN)
@@ -1078,44 +1484,35 @@ int ktfs_delete(const char *name)
         return -EINVAL;
     }
 
-    struct ktfs_dir_entry dir[DIR_SIZE];
     unsigned long long global_datablock_0 = 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count;
-    int flag = 0;
+    struct ktfs_dir_index *ent;
     struct ktfs_dir_entry entry;
-    for (int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++)
-    {
-        cache_get_block(filesetup.cptr, (filesetup.root_dir_inode.block[i] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-        memcpy(dir, data, sizeof(dir));
-        cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
 
-        for (int j = 0; j < DIR_SIZE; j++)
-        {
-            if (strncmp(name, dir[j].name, FILENAME_SIZE) == 0)
-            { // found file
-                flag = 1;
-                blkidx = i;
-                dentryidx = j;
-                entry = dir[j]; // we have the directory entry now
-                break;
-            }
-        }
-    }
-    if (flag == 0)
+    ent = ktfs_index_find(name);
+    if (ent == NULL)
     {
         return -ENOENT;
     }
 
-    // close the file
-    for (int f = 0; f < filesetup.cur_file_count; f++)
+    blkidx = ent->slot / DIR_SIZE;
+    dentryidx = ent->slot % DIR_SIZE;
+    entry.inode = ent->inode;
+    memcpy(entry.name, ent->name, sizeof(entry.name));
+
+    // An open file stays open, but once in-flight I/O drains, further I/O
+    // fails. Its blocks, reserved ones included, are freed below.
+    struct ktfs_open_inode *open_ino = ent->ino;
+    if (ent->ino != NULL)
     {
-        if (strncmp(entry.name, filesetup.open_file_names[f].name, FILENAME_SIZE) == 0)
-        {
-            // call ktfs close but with what io?
-            struct io *fio = filesetup.open_file_names[f].fio;
-            ktfs_close(fio);
-            // filesetup.open_file_names[f].name == NULL;
-            break;
-        }
+        struct ktfs_open_inode *ino = ent->ino;
+
+        rwlock_acquire_write(&ino->rwlock);
+        ktfs_release_reservation(ino);
+        ktfs_inode_clean(ino);
+        ino->deleted = 1;
+        ino->dindex = NULL;
+        ent->ino = NULL;
+        rwlock_release_write(&ino->rwlock);
     }
 
     // found the directory entry
@@ -1125,18 +1522,29 @@ int ktfs_delete(const char *name)
     unsigned long long globalinodeblock = 1 + filesetup.super_blk.bitmap_block_count + inodeblockidx;
     int physical_block;
 
+    // An open file's inode may have changes not yet committed
     struct ktfs_inode inode;
-    cache_get_block(filesetup.cptr, globalinodeblock * KTFS_BLKSZ, (void **)&data);
-    memcpy(&inode, data + (inodeoffset * KTFS_INOSZ), sizeof(struct ktfs_inode));
-    cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
+    if (open_ino != NULL)
+    {
+        inode = open_ino->disk;
+    }
+    else
+    {
+        cache_get_block(filesetup.cptr, globalinodeblock * KTFS_BLKSZ, (void **)&data);
+        memcpy(&inode, data + (inodeoffset * KTFS_INOSZ), sizeof(struct ktfs_inode));
+        cache_release_block(filesetup.cptr, data, CACHE_CLEAN | CACHE_META);
+    }
 
     // now we have the actual inode - need to free data blocks
     int filesizeinblocks = (inode.size + KTFS_BLKSZ - 1) / KTFS_BLKSZ; // find the number of blocks the file uses
+    struct ktfs_bmap *bmap = kmalloc(sizeof(struct ktfs_bmap));
+    bmap->valid = 0;
     for (unsigned long long i = 0; i < filesizeinblocks && i < filesizeinblocks; i++)
     {
-        physical_block = inodeidxblocknum(&inode, i, global_datablock_0);
+        physical_block = ktfs_bmap_lookup(bmap, &inode, i);
         free_block(physical_block - global_datablock_0);
     }
+    kfree(bmap);
 
     if (filesizeinblocks > KTFS_NUM_DIRECT_DATA_BLOCKS)
     {
@@ -1179,18 +1587,12 @@ int ktfs_delete(const char *name)
     uint64_t last_blk_idx = (num_files - 1) / DIR_SIZE;
     uint64_t last_entry_idx = (num_files - 1) % DIR_SIZE;
     cache_get_block(filesetup.cptr, (filesetup.root_dir_inode.block[blk_idx] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-    struct ktfs_dir_entry dentryblk[DIR_SIZE];
-    memcpy(dentryblk, data, sizeof(dentryblk));
-
-    struct ktfs_dir_entry last = dentryblk[(num_files - 1) % DIR_SIZE];
-
+    struct ktfs_dir_entry last = ((struct ktfs_dir_entry *)data)[last_entry_idx];
     cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
 
     // copy the last dentry into the spot we want to delete
     cache_get_block(filesetup.cptr, (filesetup.root_dir_inode.block[blkidx] + global_datablock_0) * KTFS_BLKSZ, (void **)&data);
-    memcpy(dir, data, sizeof(dir));
-    dir[dentryidx] = last;
-    memcpy(data, dir, sizeof(dir));
+    ((struct ktfs_dir_entry *)data)[dentryidx] = last;
     cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
 
     if (blkidx != last_blk_idx)
@@ -1207,15 +1609,16 @@ int ktfs_delete(const char *name)
     }
 
     // does "freeing" inode mean when no directory entry points to it anymore?
-    filesetup.inode_bitmap[inodeidx] = 0;
+    ktfs_freemap_clear(&filesetup.inode_map, inodeidx);
 
     // Memset inode to zero for saftey
     cache_get_block(filesetup.cptr, globalinodeblock * KTFS_BLKSZ,
                     (void **)(&data));
     memset(data + (inodeidx * KTFS_INOSZ), 0, sizeof(struct ktfs_inode));
-    cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
+    cache_release_block(filesetup.cptr, data, CACHE_DIRTY | CACHE_META);
 
     filesetup.root_dir_inode.size -= sizeof(struct ktfs_dir_entry); // update root dir inode size
+    ktfs_index_remove(ent, num_files - 1);
 
     // Write updated root directory inode back to disk
     unsigned long long rootidx = filesetup.super_blk.root_directory_inode;
@@ -1224,129 +1627,463 @@ int ktfs_delete(const char *name)
 
     cache_get_block(filesetup.cptr, (1 + filesetup.super_blk.bitmap_block_count + rootblockidx) * KTFS_BLKSZ, (void **)&data);
     memcpy(data + (rootinodeidx * KTFS_INOSZ), &filesetup.root_dir_inode, sizeof(struct ktfs_inode));
-    cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
+    cache_release_block(filesetup.cptr, data, CACHE_DIRTY | CACHE_META);
+    ktfs_run_issue(&discard_run);
     ktfs_flush();
     return 0;
 }
 
-// returns the physical block num (using the inode information for the file we want to delete)
-int inodeidxblocknum(struct ktfs_inode *inode, unsigned long long idx, unsigned long long global_datablock_0)
+// free blk in bitmap - set to 0 - use to freedatablock
+void free_block(int block_num)
 {
-    struct indirBlock *indirectdata;
+    // The on-disk bitmap block is updated by ktfs_bitmap_writeback()
+    ktfs_freemap_clear(&filesetup.block_map, block_num);
 
-    int blknum;
+    // The device may reclaim the block's storage. Freed blocks are batched and
+    // discarded by ktfs_delete() once it is done.
+    ktfs_run_add(&discard_run, 1 + filesetup.super_blk.bitmap_block_count + filesetup.super_blk.inode_block_count + block_num);
+}
 
-    if (idx < KTFS_NUM_DIRECT_DATA_BLOCKS)
-    { // checks if the index is in the direct block
-        return inode->block[idx] + global_datablock_0;
+// Adds _blk_ to _run_, first issuing the run if _blk_ does not extend it.
+static void ktfs_run_add(struct ktfs_block_run *run, unsigned long long blk)
+{
+    if (run->count != 0 && blk == run->start + run->count)
+    {
+        run->count++;
+        return;
     }
 
-    else if (idx < (KTFS_BLKS_PER_INDIRECT + KTFS_NUM_DIRECT_DATA_BLOCKS))
-    {                                                                                         // indirect block
-        unsigned long long indirectpos = (inode->indirect + global_datablock_0) * KTFS_BLKSZ; // gbl offset
-        // unsigned long long indirect_idx = idx - KTFS_NUM_DIRECT_DATA_BLOCKS;
+    ktfs_run_issue(run);
+    run->start = blk;
+    run->count = 1;
+}
 
-        cache_get_block(filesetup.cptr, indirectpos, (void **)&indirectdata);
-        uint32_t *indirect_blocks = (uint32_t *)indirectdata;
-        blknum = indirect_blocks[idx - KTFS_NUM_DIRECT_DATA_BLOCKS];
-        // kprintf("\nblocknum\n%d\n",blknum);
-        //  Release the block
-        cache_release_block(filesetup.cptr, indirectdata, CACHE_CLEAN);
+// Discards or zeroes the blocks in _run_ and empties it.
+static int ktfs_run_issue(struct ktfs_block_run *run)
+{
+    int result;
 
-        return blknum + global_datablock_0;
+    if (run->count == 0)
+    {
+        return 0;
     }
-    else if (idx >= KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_BLKS_PER_INDIRECT)
+
+    if (run->zero)
+        result = cache_write_zeroes(filesetup.cptr, run->start * KTFS_BLKSZ, run->count * KTFS_BLKSZ);
+    else
+        result = cache_discard(filesetup.cptr, run->start * KTFS_BLKSZ, run->count * KTFS_BLKSZ);
+
+    run->count = 0;
+    return result;
+}
+
+unsigned long long allocate_open_block(void)
+{
+    // A freed block must be discarded before it can be handed out again
+    ktfs_run_issue(&discard_run);
+
+    long block = ktfs_freemap_alloc(&filesetup.block_map);
+    if (block >= 0)
     {
-        // Adjust for both direct and indirect blocks
-        unsigned long long newidx = idx - KTFS_NUM_DIRECT_DATA_BLOCKS - KTFS_BLKS_PER_INDIRECT;
-        int dindirect_block_idx;
+        return block;
+    }
+    return -ENODATABLKS;
+}
 
-        // Calculate which dindirect block to use (0 or 1)
-        if (newidx < KTFS_BLKS_PER_DINDIRECT)
-        {
-            dindirect_block_idx = 0;
-        }
+// Allocates a data block for _fio_, preferably _goal_ (relative to data block
+// 0; ~0ULL if the file has no blocks yet). Blocks come from a run reserved for
+// the file, which is refilled up to KTFS_RESERVE_BLOCKS at a time starting at
+// _goal_, so a growing file stays physically contiguous even when several
+// files are extended in turn. Unused reserved blocks are returned when the
+// file is closed. Returns the block, or a negative error code.
+static long long ktfs_alloc_file_block(struct ktfs_file *fio, unsigned long long goal)
+{
+    unsigned long cnt;
+    long start;
 
-        if (newidx >= KTFS_BLKS_PER_DINDIRECT)
-        {
-            dindirect_block_idx = 1;
-            newidx -= KTFS_BLKS_PER_DINDIRECT;
-        }
+    struct ktfs_open_inode *const ino = fio->ino;
+
+    if (ino->resv_count == 0)
+    {
+        // A freed block must be discarded before it can be handed out again
+        ktfs_run_issue(&discard_run);
+
+        if (goal == ~0ULL)
+            goal = filesetup.block_map.cursor * 64;
+
+        start = ktfs_freemap_alloc_run(&filesetup.block_map, goal, KTFS_RESERVE_BLOCKS, &cnt);
+        if (start < 0)
+            return -ENODATABLKS;
 
-        // Calculate indirect block index and offset within that indirect block
-        int indirectidx = newidx / KTFS_BLKS_PER_INDIRECT;
-        int indirectoffset = newidx % KTFS_BLKS_PER_INDIRECT;
+        ino->resv_start = start;
+        ino->resv_count = cnt;
+    }
 
-        // Get the doubly indirect block
-        unsigned long long dindirectblkpos = (inode->dindirect[dindirect_block_idx] + global_datablock_0) * KTFS_BLKSZ;
+    ino->resv_count--;
+    return ino->resv_start++;
+}
 
-        void *dindirectdata;
-        cache_get_block(filesetup.cptr, dindirectblkpos, (void **)&dindirectdata);
+// Makes the reservation of _fio_ at least _want_ blocks, as one run starting
+// at or after _goal_ if the free map allows. Blocks still reserved are
+// returned first, so the new run may include them. A short run is not an
+// error: ktfs_alloc_file_block() refills the reservation as usual.
+static void ktfs_reserve(struct ktfs_file *fio, unsigned long long goal, unsigned long long want)
+{
+    struct ktfs_open_inode *const ino = fio->ino;
+    unsigned long cnt;
+    long start;
 
-        uint32_t *dindirect_blocks = (uint32_t *)dindirectdata;
-        uint32_t indirectnum = dindirect_blocks[indirectidx];
+    if (ino->resv_count >= want)
+        return;
 
-        // Release the doubly indirect block
-        cache_release_block(filesetup.cptr, dindirectdata, CACHE_CLEAN);
+    if (ino->resv_count != 0)
+        goal = ino->resv_start;
+    ktfs_release_reservation(ino);
 
-        // Get the indirect block
-        unsigned long long indirectpos = (indirectnum + global_datablock_0) * KTFS_BLKSZ;
+    // A freed block must be discarded before it can be handed out again
+    ktfs_run_issue(&discard_run);
 
-        char *indirect_data;
-        cache_get_block(filesetup.cptr, indirectpos, (void **)&indirect_data);
+    if (goal == ~0ULL)
+        goal = filesetup.block_map.cursor * 64;
 
-        uint32_t *indirect_blocks = (uint32_t *)indirect_data;
-        blknum = indirect_blocks[indirectoffset];
+    start = ktfs_freemap_alloc_run(&filesetup.block_map, goal, want, &cnt);
+    if (start < 0)
+        return;
 
-        cache_release_block(filesetup.cptr, indirect_data, CACHE_CLEAN);
+    ino->resv_start = start;
+    ino->resv_count = cnt;
+}
 
-        return blknum + global_datablock_0;
+// Returns the blocks reserved for _ino_ but not used to the free map.
+static void ktfs_release_reservation(struct ktfs_open_inode *ino)
+{
+    while (ino->resv_count != 0)
+    {
+        ktfs_freemap_clear(&filesetup.block_map, ino->resv_start++);
+        ino->resv_count--;
     }
+}
+
+// Empties the directory index.
+static void ktfs_index_init(void)
+{
+    memset(filesetup.dir_hash, 0, sizeof(filesetup.dir_hash));
+    memset(filesetup.dir_slot, 0, sizeof(filesetup.dir_slot));
+    filesetup.dir_free = NULL;
 
-    return -1; // error
+    for (int i = MAX_FILES - 1; i >= 0; i--)
+    {
+        filesetup.dir_index[i].next = filesetup.dir_free;
+        filesetup.dir_free = &filesetup.dir_index[i];
+    }
 }
 
-// free blk in bitmap - set to 0 - use to freedatablock
-void free_block(int block_num)
+// FNV-1a over the significant part of a dentry name.
+static unsigned int ktfs_name_hash(const char *name)
 {
-    unsigned int bitmap_block_idx = 1 + block_num / (KTFS_BLKSZ * BYTE_SIZE);
-    unsigned int bit_offset_in_bitmap = block_num % (KTFS_BLKSZ * BYTE_SIZE);
+    unsigned int h = 2166136261U;
 
-    // Get bitmap block from cache
-    char *data;
-    cache_get_block(filesetup.cptr, bitmap_block_idx * KTFS_BLKSZ, (void **)&data);
+    for (int i = 0; i < FILENAME_SIZE && name[i] != '\0'; i++)
+    {
+        h = (h ^ (unsigned char)name[i]) * 16777619U;
+    }
 
-    data[bit_offset_in_bitmap / BYTE_SIZE] &= ~(1 << (bit_offset_in_bitmap % BYTE_SIZE));
+    return h & (KTFS_DIR_HASH_SIZE - 1);
+}
 
-    cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
+// Returns the index entry for _name_, or NULL if there is no such file.
+static struct ktfs_dir_index *ktfs_index_find(const char *name)
+{
+    struct ktfs_dir_index *ent;
+    int pie;
+
+    // The index is built by ktfs_loader() after mount
+    if (!filesetup.dir_ready)
+    {
+        pie = disable_interrupts();
+        while (!filesetup.dir_ready)
+            condition_wait(&filesetup.loaded);
+        restore_interrupts(pie);
+    }
+
+    for (ent = filesetup.dir_hash[ktfs_name_hash(name)]; ent != NULL; ent = ent->next)
+    {
+        if (strncmp(name, ent->name, FILENAME_SIZE) == 0)
+            return ent;
+    }
+
+    return NULL;
 }
 
-unsigned long long allocate_open_block(void)
+// Records that dentry _slot_ of the root directory names _inode_.
+static struct ktfs_dir_index *ktfs_index_add(const char *name, uint16_t inode, unsigned int slot)
+{
+    struct ktfs_dir_index *ent = filesetup.dir_free;
+    unsigned int h;
+
+    if (ent == NULL || slot >= MAX_FILES)
+        return NULL;
+
+    filesetup.dir_free = ent->next;
+    strncpy(ent->name, name, sizeof(ent->name));
+    ent->name[sizeof(ent->name) - 1] = '\0';
+    ent->inode = inode;
+    ent->slot = slot;
+    ent->ino = NULL;
+
+    h = ktfs_name_hash(ent->name);
+    ent->next = filesetup.dir_hash[h];
+    filesetup.dir_hash[h] = ent;
+    filesetup.dir_slot[slot] = ent;
+    return ent;
+}
+
+// Removes _ent_ after its dentry has been overwritten by the one in
+// _last_slot_, mirroring the swap delete done on the directory itself.
+static void ktfs_index_remove(struct ktfs_dir_index *ent, unsigned int last_slot)
+{
+    struct ktfs_dir_index **pp = &filesetup.dir_hash[ktfs_name_hash(ent->name)];
+
+    while (*pp != ent)
+        pp = &(*pp)->next;
+    *pp = ent->next;
+
+    if (ent->slot != last_slot)
+    {
+        filesetup.dir_slot[ent->slot] = filesetup.dir_slot[last_slot];
+        filesetup.dir_slot[ent->slot]->slot = ent->slot;
+    }
+
+    filesetup.dir_slot[last_slot] = NULL;
+    ent->next = filesetup.dir_free;
+    filesetup.dir_free = ent;
+}
+
+// Sets up an empty map of _group_cnt_ groups covering _nbits_ items.
+// The bitmap words come from whole pages rather than the kernel heap, which
+// never frees, since a large image has a large bitmap.
+static void ktfs_freemap_init(struct ktfs_freemap *map, unsigned int group_cnt, unsigned long nbits, int backed)
+{
+    size_t size = (size_t)group_cnt * FREEMAP_GROUP_WORDS * sizeof(uint64_t);
+
+    map->words_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    map->words = (map->words_pages != 0) ? alloc_phys_pages(map->words_pages) : NULL;
+    if (map->words != NULL)
+        memset(map->words, 0, size);
+    map->nbits = (map->words != NULL) ? nbits : 0;
+    map->cursor = 0;
+    map->group_cnt = group_cnt;
+    map->group_free = kcalloc(group_cnt, sizeof(uint16_t));
+    map->group_dirty = backed ? kcalloc(group_cnt, sizeof(uint8_t)) : NULL;
+    map->group_ready = backed ? kcalloc(group_cnt, sizeof(uint8_t)) : NULL;
+    map->demand = group_cnt;
+}
+
+// Recomputes the per-group free counts after words[] was filled in directly.
+static void ktfs_freemap_recount(struct ktfs_freemap *map)
 {
-    // kprintf("bitmap blk count: %d", filesetup.super_blk.bitmap_block_count);
+    for (unsigned int g = 0; g < map->group_cnt; g++)
+        ktfs_freemap_recount_group(map, g);
+}
+
+// Recomputes the free count of group _g_.
+static void ktfs_freemap_recount_group(struct ktfs_freemap *map, unsigned int g)
+{
+    unsigned long first = (unsigned long)g * FREEMAP_GROUP_BITS;
+    unsigned long cnt = 0;
 
-    for (int block = 0; block < filesetup.super_blk.bitmap_block_count; block++)
+    for (unsigned int i = 0; i < FREEMAP_GROUP_WORDS; i++)
     {
-        cache_get_block(filesetup.cptr, (1 + block) * KTFS_BLKSZ, (void **)&data);
-        // for (int i = 0; i < KTFS_BLKSZ; i++)
-        // {
-        //     kprintf("%02x ", (char)(data[i]));
-        // }
+        unsigned long bit = first + i * 64;
+        uint64_t free = ~map->words[g * FREEMAP_GROUP_WORDS + i];
 
-        // memcpy(&filesetup.bitmap_blocks[i], data, sizeof(struct bitmap_block));
-        for (int byte = 0; byte < KTFS_BLKSZ; byte++)
+        if (bit >= map->nbits)
+            break;
+        if (map->nbits - bit < 64)
+            free &= (1ULL << (map->nbits - bit)) - 1;
+        cnt += __builtin_popcountll(free);
+    }
+
+    map->group_free[g] = cnt;
+}
+
+// Waits until group _g_ of _map_ is loaded, asking ktfs_loader() for it next.
+// Only the groups a search or update reaches are waited for. May be called
+// with filesetup_lock held, which the loader never takes.
+static void ktfs_freemap_wait(struct ktfs_freemap *map, unsigned long g)
+{
+    int pie;
+
+    if (map->group_ready == NULL || map->group_ready[g])
+        return;
+
+    pie = disable_interrupts();
+    while (!map->group_ready[g])
+    {
+        map->demand = g;
+        condition_wait(&filesetup.loaded);
+    }
+    restore_interrupts(pie);
+}
+
+// Returns the first free item at or after _goal_, wrapping around once, or -1
+// if the map is full. Nothing is allocated.
+static long ktfs_freemap_find(struct ktfs_freemap *map, unsigned long goal)
+{
+    const unsigned long nwords = (map->nbits + 63) / 64;
+    unsigned long scanned = 0;
+    unsigned long w, g, bit, next;
+    uint64_t free;
+
+    if (goal >= map->nbits)
+        goal = 0;
+
+    w = goal / 64;
+
+    // The first word is visited twice: from _goal_ on, and after wrapping
+    // around, in full.
+
+    while (scanned <= nwords)
+    {
+        if (w >= nwords)
+            w = 0;
+
+        g = w / FREEMAP_GROUP_WORDS;
+        ktfs_freemap_wait(map, g);
+        if (map->group_free[g] == 0)
         {
-            for (int bit = 7; bit >= 0; bit--)
-            {
-                if ((data[byte] & (1 << bit)) == 0)
-                {
-                    data[byte] |= (1 << bit);
-                    cache_release_block(filesetup.cptr, data, CACHE_DIRTY);
-                    return (block * KTFS_BLKSZ * BYTE_SIZE) + (byte * BYTE_SIZE + bit);
-                }
-            }
+            next = (g + 1) * FREEMAP_GROUP_WORDS;
+            if (next > nwords)
+                next = nwords;
+            scanned += next - w;
+            w = next;
+            continue;
         }
-        cache_release_block(filesetup.cptr, data, CACHE_CLEAN);
+
+        free = ~map->words[w];
+        if (scanned == 0)
+            free &= ~0ULL << (goal % 64);
+
+        if (free != 0)
+        {
+            bit = w * 64 + __builtin_ctzll(free);
+            if (bit < map->nbits)
+                return bit;
+        }
+
+        w++;
+        scanned++;
     }
-    return -ENODATABLKS;
+
+    return -1;
+}
+
+// Allocates the first free item at or after the cursor. Returns the item
+// number, or -1 if the map is full.
+static long ktfs_freemap_alloc(struct ktfs_freemap *map)
+{
+    long bit = ktfs_freemap_find(map, map->cursor * 64);
+
+    if (bit < 0)
+        return -1;
+
+    ktfs_freemap_set(map, bit);
+    map->cursor = bit / 64;
+    return bit;
+}
+
+// Allocates up to _want_ contiguous items, starting at _goal_ if it is free
+// and otherwise at the first free item after it. Returns the first item and
+// stores the number allocated in _cnt_, or returns -1 if the map is full.
+static long ktfs_freemap_alloc_run(struct ktfs_freemap *map, unsigned long goal, unsigned long want, unsigned long *cnt)
+{
+    long start = ktfs_freemap_find(map, goal);
+    unsigned long n = 0;
+
+    if (start < 0)
+        return -1;
+
+    while (n < want && start + n < map->nbits)
+    {
+        // The run may extend into a group not searched yet
+        ktfs_freemap_wait(map, (start + n) / FREEMAP_GROUP_BITS);
+        if ((map->words[(start + n) / 64] & (1ULL << ((start + n) % 64))) != 0)
+            break;
+        ktfs_freemap_set(map, start + n);
+        n++;
+    }
+
+    map->cursor = (start + n) / 64;
+    *cnt = n;
+    return start;
+}
+
+// Marks _bit_ in use.
+static void ktfs_freemap_set(struct ktfs_freemap *map, unsigned long bit)
+{
+    const uint64_t mask = 1ULL << (bit % 64);
+    const unsigned long g = bit / FREEMAP_GROUP_BITS;
+
+    if (bit >= map->nbits)
+        return;
+    ktfs_freemap_wait(map, g);
+    if ((map->words[bit / 64] & mask) != 0)
+        return;
+
+    map->words[bit / 64] |= mask;
+    map->group_free[g]--;
+    if (map->group_dirty != NULL)
+        map->group_dirty[g] = 1;
+}
+
+// Marks _bit_ free.
+static void ktfs_freemap_clear(struct ktfs_freemap *map, unsigned long bit)
+{
+    const uint64_t mask = 1ULL << (bit % 64);
+    const unsigned long g = bit / FREEMAP_GROUP_BITS;
+
+    if (bit >= map->nbits)
+        return;
+    ktfs_freemap_wait(map, g);
+    if ((map->words[bit / 64] & mask) == 0)
+        return;
+
+    map->words[bit / 64] &= ~mask;
+    map->group_free[g]++;
+    if (map->group_dirty != NULL)
+        map->group_dirty[g] = 1;
+}
+
+// Returns 1 if a bitmap block changed since the last ktfs_bitmap_writeback().
+static int ktfs_bitmap_dirty(void)
+{
+    for (unsigned int g = 0; g < filesetup.block_map.group_cnt; g++)
+    {
+        if (filesetup.block_map.group_dirty[g])
+            return 1;
+    }
+
+    return 0;
+}
+
+// Copies the bitmap blocks changed since the last call into the cache.
+static int ktfs_bitmap_writeback(void)
+{
+    struct ktfs_freemap *const map = &filesetup.block_map;
+    int result;
+
+    for (unsigned int g = 0; g < map->group_cnt; g++)
+    {
+        if (!map->group_dirty[g])
+            continue;
+
+        result = cache_get_block(filesetup.cptr, (1 + g) * KTFS_BLKSZ, (void **)&data);
+        if (result < 0)
+            return result;
+        memcpy(data, map->words + g * FREEMAP_GROUP_WORDS, KTFS_BLKSZ);
+        cache_release_block(filesetup.cptr, data, CACHE_DIRTY | CACHE_META);
+        map->group_dirty[g] = 0;
+    }
+
+    return 0;
 }
@@ -2,9 +2,11 @@
 #include "ioimpl.h"
 #include <limits.h>
 
-#define KTFS_BLKSZ              512
-#define KTFS_BLKS_PER_INDIRECT  128
-#define KTFS_BLKS_PER_DINDIRECT 128*128
+// The block size is KTFS_MIN_BLKSZ << block_shift, from the superblock. An
+// index block holds block size / 4 block numbers.
+#define KTFS_MIN_BLKSZ          512
+#define KTFS_MAX_BLKSZ_SHIFT    3
+#define KTFS_MAX_BLKSZ          (KTFS_MIN_BLKSZ << KTFS_MAX_BLKSZ_SHIFT)
 #define KTFS_INOSZ              32
 #define KTFS_DENSZ              16
 #define KTFS_MAX_FILENAME_LEN        KTFS_DENSZ - sizeof(uint16_t) - sizeof(uint8_t)
@@ -62,6 +64,7 @@ struct ktfs_superblock {
     uint32_t bitmap_block_count;
     uint32_t inode_block_count;
     uint16_t root_directory_inode;
+    uint8_t  block_shift; // log2(block size / 512); 0 in images that predate it
 } __attribute__((packed));
 
 // Inode with indirect and doubly-indirect blocks
@@ -79,14 +82,14 @@ struct ktfs_dir_entry {
     char     name[KTFS_MAX_FILENAME_LEN+sizeof(uint8_t)];   // File name (plus null terminator)
 } __attribute__((packed));
 
-// Bitmap block
+// Bitmap block (block size bytes; shown for 512-byte blocks)
 struct ktfs_bitmap {
-    uint8_t bytes[KTFS_BLKSZ];
+    uint8_t bytes[KTFS_MIN_BLKSZ];
 } __attribute__((packed));
 
 
 struct ktfs_data_block {
-    uint8_t data[KTFS_BLKSZ];
+    uint8_t data[KTFS_MIN_BLKSZ];
 }__attribute__((packed));
 
 
@@ -194,6 +194,10 @@
 #include "dev/virtio.h"
 #include "heap.h"
 #include "string.h"
+#include "profile.h"
+#include "tracepoint.h"
+#include "smp.h"
+#include "dev/ramdisk.h"
 // void test_kernel_pipe(void);
 // void read_func(struct io *io);
 
@@ -210,12 +214,18 @@ void main(void)
   int result;
   int i;
 
+  string_init();
   console_init();
   devmgr_init();
   intrmgr_init();
   thrmgr_init();
   memory_init();
   procmgr_init();
+  console_start_logger();
+  intr_start_bh();
+  profile_init();
+  tracepoint_init();
+  smp_init();
 
   // uart_attach((void *)UART0_MMIO_BASE, UART0_INTR_SRCNO + 0);
   // uart_attach((void *)UART1_MMIO_BASE, UART0_INTR_SRCNO + 1);
@@ -237,6 +247,17 @@ void main(void)
     panic("Failed to open vioblk\n");
   }
 
+#ifdef RAMDISK_BOOT
+  result = ramdisk_load(blkio);
+  if (result < 0)
+    kprintf("ramdisk: cannot load the disk image (%d), using vioblk\n", result);
+  else
+  {
+    ioclose(blkio);
+    open_device("ramdisk", result, &blkio);
+  }
+#endif
+
   result = fsmount(blkio);
   if (result < 0)
   {
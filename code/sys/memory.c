@@ -18,6 +18,7 @@
 #include "riscv.h"
 #include "heap.h"
 #include "elf.h"
+#include "tracepoint.h"
 #include "console.h"
 #include "assert.h"
 #include "string.h"
@@ -25,6 +26,7 @@
 #include "process.h"
 #include "error.h"
 #include "intr.h"
+#include "smp.h"
 
 // COMPILE-TIME CONFIGURATION
 //
@@ -42,7 +44,19 @@
 #define GIGA_SIZE ((1UL << 9) * MEGA_SIZE) // gigapage size
 #define PPN_TO_PMA 12
 
+// Value of the PTE rsw field for a page shared copy-on-write after fork. The
+// PTE has W cleared; the first store copies the page (see break_cow()).
+
+#define PTE_RSW_COW 1
+
 #define PTE_ORDER 3
+
+// Number of buddy allocator orders. The largest block is 2^(BUDDY_ORDER_CNT-1)
+// pages.
+
+#ifndef BUDDY_ORDER_CNT
+#define BUDDY_ORDER_CNT 20
+#endif
 #define PTE_CNT (1U << (PAGE_ORDER - PTE_ORDER))
 
 #ifndef PAGING_MODE
@@ -58,6 +72,26 @@
 #define ROOT_LEVEL 2
 #endif
 
+// Number of ASIDs handed out to memory spaces, including ASID 0 for the main
+// space. Limited further by the ASID bits the hart implements.
+
+#ifndef ASID_CNT
+#define ASID_CNT 256
+#endif
+
+// A fault in anonymous user memory maps every unmapped page of the aligned
+// block of FAULT_AROUND_PAGES pages around it.
+
+#ifndef FAULT_AROUND_PAGES
+#define FAULT_AROUND_PAGES 8
+#endif
+
+// Number of pre-zeroed pages kept for page faults, refilled by the idle thread
+
+#ifndef ZERO_POOL_SIZE
+#define ZERO_POOL_SIZE 16
+#endif
+
 // IMPORTED GLOBAL SYMBOLS
 //
 
@@ -79,20 +113,18 @@ char memory_initialized = 0;
 // INTERNAL TYPE DEFINITIONS
 //
 
-// We keep free physical pages in a linked list of _chunks_, where each chunk
-// consists of several consecutive pages of memory. Initially, all free pages
-// are in a single large chunk. To allocate a block of pages, we break up the
-// smallest chunk on the list.
+// Free physical pages are managed by a binary buddy allocator. A free block of
+// order k is 2^k pages aligned to 2^k pages (counting from RAM_START), and
+// its buddy is the block whose index differs only in bit k. There is one
+// list of free blocks per order.
 
 /**
- * @brief Section of consecutive physical pages. We keep free physical pages in a
- * linked list of chunks. Initially, all free pages are in a single large chunk. To
- * allocate a block of pages, we break up the smallest chunk in the list
+ * @brief Header stored in the first page of a free block.
  */
 struct page_chunk
 {
-    struct page_chunk *next; ///< Next page in list
-    unsigned long pagecnt;   ///< Number of pages in chunk
+    struct page_chunk *next; ///< Next block of the same order
+    struct page_chunk *prev; ///< Previous block of the same order
 };
 
 /**
@@ -136,6 +168,13 @@ static inline mtag_t active_space_mtag(void);
 static inline mtag_t ptab_to_mtag(struct pte *root, unsigned int asid);
 static inline struct pte *mtag_to_ptab(mtag_t mtag);
 static inline struct pte *active_space_ptab(void);
+static inline unsigned int mtag_asid(mtag_t mtag);
+
+static inline void flush_page(uintptr_t vma);
+static inline void flush_space(void);
+
+static unsigned int asid_alloc(void);
+static void asid_free(unsigned int asid);
 
 static inline void *pageptr(uintptr_t n);
 static inline uintptr_t pagenum(const void *p);
@@ -146,11 +185,49 @@ static inline struct pte ptab_pte(const struct pte *pt, uint_fast8_t g_flag);
 static inline struct pte null_pte(void);
 int pt_empty(struct pte *pt_start);
 
+static int fill_mmap_page(const struct process_mmap *map, uintptr_t vma);
+static int break_cow(struct pte *pte, uintptr_t vma);
+
+static void buddy_link(unsigned long idx, unsigned int order);
+static void buddy_unlink(unsigned long idx, unsigned int order);
+static void buddy_free_range(unsigned long idx, unsigned long end);
+
+static struct pte *walk_pt1(uintptr_t vma);
+static int map_mega(uintptr_t vma, void *pp, int rwxug_flags);
+static int split_mega(struct pte *pte1);
+static void free_mega(void *pp);
+
+static void page_share(const void *pp);
+static void page_put(void *pp);
+
+static int fault_anon(uintptr_t vma, int write);
+static int map_anon(uintptr_t vma, int write);
+static void *alloc_zeroed_page(void);
+
+static void copy_user_words(void *dst, const void *src, size_t n);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
 static mtag_t main_mtag;
 
+// Each memory space gets its own ASID at creation, so switching spaces needs
+// no TLB flush. Spaces created once all ASIDs are taken share ASID 0 with the
+// main space, and switching to one of them flushes the TLB. asid0_mtag[n] is
+// the ASID 0 space whose translations the TLB of hart n may hold.
+
+static uint64_t asid_used[ASID_CNT / 64];
+static unsigned int asid_limit;
+static mtag_t asid0_mtag[NHART];
+
+// Untouched anonymous memory that is only read maps this page read-only and
+// copy-on-write. It is never freed and has no share count.
+
+static void *zero_page;
+
+static void *zero_pool[ZERO_POOL_SIZE];
+static unsigned int zero_pool_cnt;
+
 static struct pte main_pt2[PTE_CNT]
     __attribute__((section(".bss.pagetable"), aligned(4096)));
 
@@ -160,7 +237,20 @@ static struct pte main_pt1_0x80000[PTE_CNT]
 static struct pte main_pt0_0x80000[PTE_CNT]
     __attribute__((section(".bss.pagetable"), aligned(4096)));
 
-static struct page_chunk *free_chunk_list;
+static struct page_chunk *free_blocks[BUDDY_ORDER_CNT];
+
+// For the first page of a free block, its order plus one. Zero for every other
+// page, so a block is free and whole exactly when this matches its order.
+
+static uint8_t free_block_order[RAM_SIZE / PAGE_SIZE];
+
+static unsigned long free_page_cnt;
+
+// Number of memory spaces sharing a user page, beyond the first. Zero for a
+// page with a single owner, which is the case for every page until fork.
+// Wide enough that the sharers cannot outnumber it: each holds a page table.
+
+static uint16_t page_share_cnt[RAM_SIZE / PAGE_SIZE];
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -246,6 +336,20 @@ void memory_init(void)
     main_mtag = ptab_to_mtag(main_pt2, 0);
     csrw_satp(main_mtag);
 
+    // Find out how many ASID bits are implemented: they read back as ones
+    // after writing all ones.
+
+    csrw_satp(main_mtag | (0xFFFFUL << RISCV_SATP_ASID_shift));
+    asid_limit = mtag_asid(csrr_satp()) + 1;
+    csrw_satp(main_mtag);
+    sfence_vma();
+
+    if (ASID_CNT < asid_limit)
+        asid_limit = ASID_CNT;
+
+    asid_used[0] = 1; // main space
+    asid0_mtag[0] = main_mtag;
+
     // Give the memory between the end of the kernel image and the next page
     // boundary to the heap allocator, but make sure it is at least
     // HEAP_INIT_MIN bytes.
@@ -269,13 +373,10 @@ void memory_init(void)
     kprintf("Heap allocator: [%p,%p): %zu KB free\n",
             heap_start, heap_end, (heap_end - heap_start) / 1024);
 
-    // TODO: Initialize the free chunk list here
-    // free_chunk_list = kmalloc(sizeof(struct page_chunk));
-    free_chunk_list = heap_end;
+    // Everything from the end of the heap to the end of RAM is free
 
-    free_chunk_list->pagecnt = (RAM_END - heap_end) / PAGE_SIZE; // Question about the pagecount and next
-    // kprintf("\nPagecount:%d\n", free_chunk_list->pagecnt);
-    free_chunk_list->next = NULL;
+    buddy_free_range(pagenum(heap_end) - pagenum(RAM_START),
+                     pagenum(RAM_END) - pagenum(RAM_START));
 
     // Allow supervisor to access user memory. We could be more precise by only
     // enabling supervisor access to user memory when we are explicitly trying
@@ -284,9 +385,20 @@ void memory_init(void)
 
     csrs_sstatus(RISCV_SSTATUS_SUM);
 
+    zero_page = alloc_phys_page();
+    memset(zero_page, 0, PAGE_SIZE);
+
     memory_initialized = 1;
 }
 
+void memory_init_hart(void)
+{
+    csrw_satp(main_mtag);
+    sfence_vma();
+    asid0_mtag[running_hart()] = main_mtag;
+    csrs_sstatus(RISCV_SSTATUS_SUM);
+}
+
 // Reads satp to retrieve tag for active memory space.
 mtag_t active_mspace(void)
 {
@@ -299,25 +411,31 @@ mtag_t switch_mspace(mtag_t mtag)
     mtag_t prev;
 
     prev = csrrw_satp(mtag);
-    sfence_vma();
+
+    if (mtag_asid(mtag) == 0 && mtag != asid0_mtag[running_hart()])
+    {
+        asid0_mtag[running_hart()] = mtag;
+        sfence_vma();
+    }
+
     return prev;
 }
 
-// Copies all pages and page tables from the active memory space into newly allocated memory.
-// ASK OH: DO WE NEED THIS FOR CKPT2?
+// Copies the page tables of the active memory space into newly allocated memory. Leaf pages are
+// shared rather than copied: writable pages become read-only copy-on-write in both spaces, so
+// the cost of fork depends on the size of the page tables, not on resident memory.
 mtag_t clone_active_mspace(void)
 {
     void *pp2;
     void *pp1;
     void *pp0;
-    void *leaf_page;
     struct pte *level_2_pte = active_space_ptab();
     mtag_t new_mtag;
 
     pp2 = alloc_phys_page();
     memset(pp2, 0, PAGE_SIZE);
     struct pte *new_main_pte = (struct pte *)pp2;
-    new_mtag = ptab_to_mtag(new_main_pte, 0);
+    new_mtag = ptab_to_mtag(new_main_pte, asid_alloc());
 
     for (int i = 0; i < PTE_CNT; i++)
     {
@@ -351,6 +469,11 @@ mtag_t clone_active_mspace(void)
                 level_1_pte[j] = null_pte();
                 continue;
             }
+            // Sharing is tracked per 4 KiB page, so a megapage is split first
+            if (PTE_LEAF(level_1_pte[j]) && split_mega(&level_1_pte[j]) != 0)
+            {
+                panic("out of memory");
+            }
             pp0 = alloc_phys_page();
             memset(pp0, 0, PAGE_SIZE);
             new_level_1_pte[j] = ptab_pte((struct pte *)pp0, 0);
@@ -368,19 +491,36 @@ mtag_t clone_active_mspace(void)
                     level_0_pte[k] = null_pte();
                     continue;
                 }
-                leaf_page = alloc_phys_page();
-                memset(leaf_page, 0, PAGE_SIZE);
-                memcpy(leaf_page, pageptr(level_0_pte[k].ppn), PAGE_SIZE);
-                new_level_0_pte[k] = leaf_pte(leaf_page, level_0_pte[k].flags);
-                sfence_vma();
+                if (level_0_pte[k].flags & PTE_W)
+                {
+                    level_0_pte[k].flags &= ~PTE_W;
+                    level_0_pte[k].rsw = PTE_RSW_COW;
+                }
+                new_level_0_pte[k] = level_0_pte[k];
+                page_share(pageptr(level_0_pte[k].ppn));
             }
-            sfence_vma();
         }
-        sfence_vma();
     }
+    flush_space(); // parent mappings lost PTE_W
     return new_mtag;
 }
 
+// Creates an empty user memory space that shares the kernel's global mappings.
+mtag_t create_mspace(void)
+{
+    struct pte *const root = alloc_phys_page();
+
+    memset(root, 0, PAGE_SIZE);
+
+    for (int i = 0; i < PTE_CNT; i++)
+    {
+        if (PTE_VALID(main_pt2[i]) && PTE_GLOBAL(main_pt2[i]))
+            root[i] = main_pt2[i];
+    }
+
+    return ptab_to_mtag(root, asid_alloc());
+}
+
 // Unmaps and frees all non-global pages from the active memory space.
 void reset_active_mspace(void)
 {
@@ -398,6 +538,12 @@ void reset_active_mspace(void)
             {
                 continue;
             }
+            if (PTE_LEAF(level_1_pte[j]))
+            {
+                free_mega(pageptr(level_1_pte[j].ppn));
+                level_1_pte[j] = null_pte();
+                continue;
+            }
             struct pte *level_0_pte = (struct pte *)pageptr(level_1_pte[j].ppn);
             for (int k = 0; k < PTE_CNT; k++)
             {
@@ -405,10 +551,8 @@ void reset_active_mspace(void)
                 {
                     continue;
                 }
-                memset(pageptr(level_0_pte[k].ppn), 0, PAGE_SIZE);
-                free_phys_page(pageptr(level_0_pte[k].ppn));
+                page_put(pageptr(level_0_pte[k].ppn));
                 level_0_pte[k] = null_pte();
-                sfence_vma();
             }
             if (pt_empty(level_0_pte))
             {
@@ -416,7 +560,6 @@ void reset_active_mspace(void)
                 free_phys_page(level_0_pte);
                 level_1_pte[j] = null_pte();
                 // free_phys_page(pageptr(level_1_pte[j].ppn));
-                sfence_vma();
             }
         }
         if (pt_empty(level_1_pte))
@@ -424,19 +567,21 @@ void reset_active_mspace(void)
             memset(level_1_pte, 0, PAGE_SIZE);
             free_phys_page(level_1_pte);
             level_2_pte[i] = null_pte();
-            sfence_vma();
         }
         // free_phys_page(pageptr(level_2_pte[i].ppn));
     }
-    sfence_vma();
+    flush_space();
     return;
 }
 
 // Switches memory spaces to main, unmaps and frees all non-global pages from the previously active memory space.
 mtag_t discard_active_mspace(void)
 {
+    const unsigned int asid = mtag_asid(active_space_mtag());
+
     reset_active_mspace();
     switch_mspace(main_mtag);
+    asid_free(asid);
     return main_mtag;
 }
 
@@ -491,6 +636,10 @@ void *map_page(uintptr_t vma, void *pp, int rwxug_flags)
         pt1 = (struct pte *)pageptr(level_2_pte[VPN2(vma)].ppn);
         // pt1 = (struct pte *)pp1;
     }
+    if (PTE_VALID(pt1[VPN1(vma)]) && PTE_LEAF(pt1[VPN1(vma)]))
+    {
+        return NULL; // inside a megapage
+    }
     if (PTE_VALID(pt1[VPN1(vma)]))
     {
         // uintptr_t pt0_ppn = pt1[VPN1(vma)].ppn;
@@ -513,12 +662,11 @@ void *map_page(uintptr_t vma, void *pp, int rwxug_flags)
     // Throw error if leaf already exists?
     if (PTE_VALID(pt0[VPN0(vma)]))
     {
-        sfence_vma();
         return (void *)vma;
     }
     // DO WE NEED THIS ^
     pt0[VPN0(vma)] = leaf_pte(pp, rwxug_flags);
-    sfence_vma();
+    flush_page(vma);
     return (void *)vma; //(void *)&pt0[VPN0(vma)];
 }
 struct pte *find_physical_page(uintptr_t vma)
@@ -528,7 +676,7 @@ struct pte *find_physical_page(uintptr_t vma)
     {
         return NULL;
     }
-    struct pte *pt1;
+    struct pte *pt1 = NULL;
     struct pte *pt0;
     struct pte *level_2_pte = active_space_ptab();
     if (PTE_VALID(level_2_pte[VPN2(vma)]))
@@ -537,7 +685,7 @@ struct pte *find_physical_page(uintptr_t vma)
         // uintptr_t pt1_pma = pt1_ppn << 12;
         pt1 = (struct pte *)pageptr(level_2_pte[VPN2(vma)].ppn);
     }
-    if (PTE_VALID(pt1[VPN1(vma)]))
+    if (pt1 != NULL && PTE_VALID(pt1[VPN1(vma)]) && !PTE_LEAF(pt1[VPN1(vma)]))
     {
         // uintptr_t pt0_ppn = pt1[VPN1(vma)].ppn;
         // uintptr_t pt0_pma = pt0_ppn << 12;
@@ -607,11 +755,19 @@ void set_pte_flags(uintptr_t vma, int rwxug_flags)
     entry[VPN0(vma)].flags |= rwxug_flags;
 }
 
+// Uses a megapage wherever both addresses are MEGA_SIZE aligned and at least MEGA_SIZE bytes
+// remain, falling back to pages where small pages are already mapped.
 void *map_range(uintptr_t vma, size_t size, void *pp, int rwxug_flags)
 {
     vma = ROUND_DOWN(vma, PAGE_SIZE); // ask in OH if we need to round up the vma to match with page size intially
     for (size_t i = 0; i < size; i += PAGE_SIZE)
     {
+        if ((vma + i) % MEGA_SIZE == 0 && (uintptr_t)(pp + i) % MEGA_SIZE == 0 &&
+            size - i >= MEGA_SIZE && map_mega(vma + i, pp + i, rwxug_flags) == 0)
+        {
+            i += MEGA_SIZE - PAGE_SIZE;
+            continue;
+        }
         void *mappedvma = map_page((uintptr_t)(vma + (i)), (void *)(pp + (i)), rwxug_flags);
         if (mappedvma == NULL)
         {
@@ -636,6 +792,17 @@ void *alloc_and_map_range(uintptr_t vma, size_t size, int rwxug_flags)
     // }
     for (size_t i = 0; i < rsize; i += PAGE_SIZE)
     {
+        // Whole aligned 2 MiB stretches get a megapage when one is free
+        if ((vma + i) % MEGA_SIZE == 0 && rsize - i >= MEGA_SIZE)
+        {
+            pp = alloc_phys_pages(PTE_CNT);
+            if (pp != NULL && map_mega(vma + i, pp, rwxug_flags) == 0)
+            {
+                i += MEGA_SIZE - PAGE_SIZE;
+                continue;
+            }
+            free_phys_pages(pp, PTE_CNT);
+        }
         pp = alloc_phys_page();
         void *mappedvma = map_page((uintptr_t)(vma + (i)), (void *)(pp), rwxug_flags);
         if (mappedvma == NULL)
@@ -662,8 +829,25 @@ void set_range_flags(const void *vp, size_t size, int rwxug_flags)
     // struct pte *mapped_range = map_range(vp, rsize, NULL, rwxug_flags);
     for (size_t i = 0; i < rsize; i += PAGE_SIZE) // How do we change vma? do we have to + i
     {                                             // Should it map continous vma to continuos pma
+        struct pte *pte1 = walk_pt1((uintptr_t)(vp + i));
+        if (pte1 != NULL && PTE_VALID(*pte1) && PTE_LEAF(*pte1))
+        {
+            // A megapage covered entirely keeps its size; otherwise it is split
+            if ((uintptr_t)(vp + i) % MEGA_SIZE == 0 && rsize - i >= MEGA_SIZE)
+            {
+                pte1->flags &= ~(PTE_R | PTE_W | PTE_X | PTE_U | PTE_G);
+                pte1->flags |= rwxug_flags;
+                i += MEGA_SIZE - PAGE_SIZE;
+                continue;
+            }
+            if (split_mega(pte1) != 0)
+            {
+                panic("out of memory");
+            }
+        }
         set_pte_flags((uintptr_t)(vp + i), rwxug_flags);
     }
+    flush_space();
     return;
 }
 
@@ -688,43 +872,56 @@ void unmap_and_free_range(void *vp, size_t size)
     for (size_t i = 0; i < rsize; i += PAGE_SIZE)
     {
         void *newvp = (void *)(vp + i);
+        struct pte *pte1 = walk_pt1((uintptr_t)newvp);
+        if (pte1 != NULL && PTE_VALID(*pte1) && PTE_LEAF(*pte1))
+        {
+            if ((uintptr_t)newvp % MEGA_SIZE == 0 && rsize - i >= MEGA_SIZE)
+            {
+                free_mega(pageptr(pte1->ppn));
+                *pte1 = null_pte();
+                i += MEGA_SIZE - PAGE_SIZE;
+                continue;
+            }
+            if (split_mega(pte1) != 0)
+            {
+                panic("out of memory");
+            }
+        }
         entry = (struct pte *)find_physical_page((uintptr_t)newvp);
         if (entry == NULL)
         {
-            return;
+            continue; // nothing mapped under this level 1 entry
         }
         if (PTE_LEAF(entry[VPN0((uintptr_t)newvp)]))
         {
             void *pp = pageptr(entry[VPN0((uintptr_t)newvp)].ppn);
-            free_phys_page(pp); // Should it just be pageptr(entry[VPN0((uintptr_t)newvp)].ppn)
+            page_put(pp);
             entry[VPN0((uintptr_t)newvp)] = null_pte();
-            sfence_vma();
             pt1_table = find_pte_level_1((uintptr_t)newvp); // ask in OH
             if (pt1_table == NULL)
             {
-                return;
+                break;
             }
             if (pt_empty(pageptr(pt1_table[VPN1((uintptr_t)newvp)].ppn)))
             {
                 free_phys_page(pageptr(pt1_table[VPN1((uintptr_t)newvp)].ppn));
                 // change this null pte logic.
                 pt1_table[VPN1((uintptr_t)newvp)] = null_pte();
-                sfence_vma();
 
                 pt2_table = active_space_ptab();
                 if (pt2_table == NULL)
                 {
-                    return;
+                    break;
                 }
                 if (pt_empty(pageptr(pt2_table[VPN2((uintptr_t)newvp)].ppn)))
                 {
                     free_phys_page(pageptr(pt2_table[VPN2((uintptr_t)newvp)].ppn));
                     pt2_table[VPN2((uintptr_t)newvp)] = null_pte();
-                    sfence_vma();
-                }
+                    }
             }
         }
     }
+    flush_space(); // one fence for the whole range
 }
 
 int pt_empty(struct pte *pt_start)
@@ -751,168 +948,627 @@ void free_phys_page(void *pp)
     free_phys_pages(pp, 1);
 }
 
-// search through chunk list to find the smallest chunk that can accommodate cnt pages
-// When  find a suitable chunk, need to:
-// If the chunk size exactly matches cnt, remove it from the list
-// If the chunk is larger, split it and return a chunk of size cnt
-// Return a pointer to the physical memory address
-
+// Allocates _cnt_ physically contiguous pages, aligned to the power of two at or above _cnt_.
+// The smallest free block that fits is split in halves down to that size, and pages beyond _cnt_
+// go straight back to the free lists. Returns NULL if no block is large enough.
 void *alloc_phys_pages(unsigned int cnt)
 {
-    // int pie = disable_interrupts();
-    struct page_chunk *curr = free_chunk_list;
-    struct page_chunk *prev = NULL;
-    while (curr != NULL)
+    unsigned int order = 0;
+    unsigned int k;
+    unsigned long idx;
+    int pie;
+
+    if (cnt == 0)
+        return NULL;
+
+    while ((1UL << order) < cnt)
+        order += 1;
+
+    if (order >= BUDDY_ORDER_CNT)
+        return NULL;
+
+    pie = disable_interrupts();
+
+    for (k = order; k < BUDDY_ORDER_CNT && free_blocks[k] == NULL; k++)
+        continue;
+
+    if (k == BUDDY_ORDER_CNT)
     {
-        if (curr->pagecnt == cnt)
-        {
-            if (prev == NULL)
-            {
-                free_chunk_list = curr->next;
-            }
-            else
-            {
-                prev->next = curr->next;
-            }
-            // restore_interrupts(pie);
-            return (void *)curr;
-        }
-        prev = curr;
-        curr = curr->next;
+        restore_interrupts(pie);
+        return NULL;
     }
 
-    curr = free_chunk_list;
-    prev = NULL;
-    struct page_chunk *target = NULL;
-    struct page_chunk *targetprev = NULL;
+    idx = pagenum(free_blocks[k]) - pagenum(RAM_START);
+    buddy_unlink(idx, k);
 
-    while (curr != NULL)
+    while (k > order)
     {
-        if (curr->pagecnt > cnt)
-        {
-            if (target == NULL)
-            {
-                target = curr;
-                targetprev = prev;
-            }
-            else if (curr->pagecnt < target->pagecnt)
-            {
-                target = curr;
-                targetprev = prev;
-            }
-        }
-        prev = curr;
-        curr = curr->next;
+        k -= 1;
+        buddy_link(idx + (1UL << k), k);
     }
-    // kprintf("\nPage count: %d\n", free_phys_page_count());
-    // print_chunklist();
-    struct page_chunk *chunk = (void *)target + (cnt * PAGE_SIZE); // issue for some reason
-    // if (chunk == NULL || target == NULL)
-    // {
-    //     kprintf("HELLO BROKE\n");
-    // }
-    chunk->pagecnt = target->pagecnt - cnt;
 
-    chunk->next = target->next;
-    // What are we supposed to do here?
-    // if prev is null
-    if (targetprev == NULL)
+    free_page_cnt -= 1UL << order;
+    buddy_free_range(idx + cnt, idx + (1UL << order));
+    restore_interrupts(pie);
+
+    return pageptr(pagenum(RAM_START) + idx);
+}
+
+// Returns _cnt_ pages starting at _pp_ to the free lists. The range need not have come from a
+// single allocation; it is split into aligned power of two blocks, each merged with its buddy.
+void free_phys_pages(void *pp, unsigned int cnt)
+{
+    unsigned long idx;
+    int pie;
+
+    if (pp == NULL || cnt == 0)
+        return;
+
+    assert(RAM_START <= pp && pp + (size_t)cnt * PAGE_SIZE <= RAM_END);
+    idx = pagenum(pp) - pagenum(RAM_START);
+
+    pie = disable_interrupts();
+    buddy_free_range(idx, idx + cnt);
+    restore_interrupts(pie);
+}
+
+unsigned long free_phys_page_count(void)
+{
+    return free_page_cnt;
+}
+
+// Maps the page _pp_ at _vma_ in the active space as one more sharer, the way fork shares pages.
+// With _cow_ the mapping has W cleared and the first store copies the page (see break_cow()).
+int map_shared_page(uintptr_t vma, void *pp, int rwxug_flags, int cow)
+{
+    struct pte *pt0;
+
+    if (cow)
+        rwxug_flags &= ~PTE_W;
+
+    if (map_page(vma, pp, rwxug_flags) == NULL)
+        return -ENOMEM;
+
+    if (cow)
     {
-        free_chunk_list = chunk;
-        // restore_interrupts(pie);
-        return target;
+        pt0 = find_physical_page(vma);
+        pt0[VPN0(vma)].rsw = PTE_RSW_COW;
     }
 
-    targetprev->next = chunk;
-    // restore_interrupts(pie);
-    return target;
+    page_share(pp);
+    return 0;
 }
 
-// adds a chunk of cnt pages starting at physical address pp back to the free list
-// need to maintain list in a way that makes sense for allocation strategy
+// Drops the caller's reference to a page it shared with map_shared_page(). The page is freed once
+// no memory space maps it.
+void put_shared_page(void *pp)
+{
+    page_put(pp);
+}
 
-void free_phys_pages(void *pp, unsigned int cnt)
+// Called by handle_umode_exception() in excp.c to handle U mode load and store page faults.
+// It returns 1 to indicate the fault has been handled (the instruction should be restarted) and 0 to indicate that the page fault
+// is fatal and the process should be terminated.
+//
+// A fault inside a file mapping (see process_mmap()) is filled from the file. The page is read
+// through the file's io, so it comes from the block cache when the blocks are resident. It is a
+// copy, not the cache block itself: cache blocks may be smaller than a page and are reused on
+// eviction. A store to a read-only mapping faults on a present page and is fatal.
+int handle_umode_page_fault(struct trap_frame *tfr, uintptr_t vma)
 {
-    // int pie = disable_interrupts();
+    struct process_mmap *map = process_find_mmap(vma);
+    struct pte *pt0 = NULL;
+
+    tracepoint(TRACEPOINT_MEMORY, TRACEPOINT_PAGE_FAULT, vma, csrr_scause());
+
+    if (vma >= UMEM_START_VMA && vma < UMEM_END_VMA)
+        pt0 = find_physical_page(vma);
+
+    if (pt0 != NULL && PTE_VALID(pt0[VPN0(vma)]) && pt0[VPN0(vma)].rsw == PTE_RSW_COW)
+        return break_cow(&pt0[VPN0(vma)], ROUND_DOWN(vma, PAGE_SIZE));
+
+    if (map != NULL)
+        return fill_mmap_page(map, ROUND_DOWN(vma, PAGE_SIZE));
+
+    // A fault on a present page that is not copy-on-write is a protection fault
+
+    if (pt0 != NULL && PTE_VALID(pt0[VPN0(vma)]))
+        return 0;
+
+    if (vma >= UMEM_START_VMA && vma < UMEM_END_VMA)
+        return fault_anon(ROUND_DOWN(vma, PAGE_SIZE),
+                          csrr_scause() == RISCV_SCAUSE_STORE_PAGE_FAULT);
+
+    return 0; // not handled
+}
+
+// Called by the idle thread. Zeroes one page into the pool used by page faults. Returns 1 if it
+// added a page, 0 if the pool is full or memory is short.
+int zero_pool_refill(void)
+{
+    void *pp;
+    int pie;
+
+    if (!memory_initialized || zero_pool_cnt == ZERO_POOL_SIZE)
+        return 0;
+
+    pp = alloc_phys_page();
     if (pp == NULL)
+        return 0;
+
+    memset(pp, 0, PAGE_SIZE);
+
+    pie = disable_interrupts();
+    if (zero_pool_cnt < ZERO_POOL_SIZE)
     {
-        // restore_interrupts(pie);
-        return;
+        zero_pool[zero_pool_cnt++] = pp;
+        pp = NULL;
     }
-    if (cnt == 0)
+    restore_interrupts(pie);
+
+    free_phys_page(pp);
+    return (pp == NULL);
+}
+
+int validate_user_range(const void *uptr, size_t n)
+{
+    const uintptr_t addr = (uintptr_t)uptr;
+
+    if (addr < UMEM_START_VMA || addr > UMEM_END_VMA || n > UMEM_END_VMA - addr)
+        return -EINVAL;
+
+    return 0;
+}
+
+int copy_from_user(void *dst, const void *usrc, size_t n)
+{
+    if (validate_user_range(usrc, n) != 0)
+        return -EINVAL;
+
+    copy_user_words(dst, usrc, n);
+    return 0;
+}
+
+int copy_to_user(void *udst, const void *src, size_t n)
+{
+    if (validate_user_range(udst, n) != 0)
+        return -EINVAL;
+
+    copy_user_words(udst, src, n);
+    return 0;
+}
+
+long strncpy_from_user(char *dst, const char *usrc, size_t n)
+{
+    const uintptr_t addr = (uintptr_t)usrc;
+    size_t lim = n;
+    size_t i;
+
+    if (addr < UMEM_START_VMA || addr >= UMEM_END_VMA)
+        return -EINVAL;
+
+    // Bound once by the end of user memory instead of checking every byte
+
+    if (lim > UMEM_END_VMA - addr)
+        lim = UMEM_END_VMA - addr;
+
+    for (i = 0; i < lim; i++)
+    {
+        dst[i] = usrc[i];
+        if (dst[i] == '\0')
+            return i;
+    }
+
+    return (lim < n) ? -EINVAL : (long)n;
+}
+
+// Copies _n_ bytes a doubleword at a time when _dst_ and _src_ are equally
+// aligned, which user buffers usually are, and a byte at a time otherwise.
+static void copy_user_words(void *dst, const void *src, size_t n)
+{
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+
+    if (((uintptr_t)d ^ (uintptr_t)s) % sizeof(uint64_t) == 0)
+    {
+        while (n != 0 && (uintptr_t)d % sizeof(uint64_t) != 0)
+        {
+            *d++ = *s++;
+            n -= 1;
+        }
+
+        while (n >= sizeof(uint64_t))
+        {
+            *(uint64_t *)d = *(const uint64_t *)s;
+            d += sizeof(uint64_t);
+            s += sizeof(uint64_t);
+            n -= sizeof(uint64_t);
+        }
+    }
+
+    while (n != 0)
     {
-        // restore_interrupts(pie);
+        *d++ = *s++;
+        n -= 1;
+    }
+}
+
+// Reads the page of _map_ at _vma_ from the file and maps it. Bytes past the end of the file or
+// past map->filesz read as zero; the file may have shrunk since it was mapped. Returns 1 if the
+// page was mapped, 0 if the fault is fatal.
+static int fill_mmap_page(const struct process_mmap *map, uintptr_t vma)
+{
+    struct pte *pt0 = find_physical_page(vma);
+    const size_t off = vma - map->vma;
+    int flags = PTE_R | PTE_U;
+    unsigned long long end;
+    size_t cnt = 0;
+    long len = 0;
+    void *pp;
+
+    if (pt0 != NULL && PTE_VALID(pt0[VPN0(vma)]))
+        return 0;
+
+    pp = alloc_zeroed_page();
+    if (pp == NULL)
+        return 0;
+
+    if (off < map->filesz)
+        cnt = MIN(PAGE_SIZE, map->filesz - off);
+
+    // Only read what the file still holds, since a read at or past its end fails
+
+    if (cnt != 0)
+    {
+        len = ioctl(map->io, IOCTL_GETEND, &end);
+        if (len == -ENOTSUP)
+            len = 0;
+        else if (len == 0 && end <= map->pos + off)
+            cnt = 0;
+        else if (len == 0 && end - (map->pos + off) < cnt)
+            cnt = end - (map->pos + off);
+    }
+
+    if (len >= 0 && cnt != 0)
+        len = ioreadat(map->io, map->pos + off, pp, cnt);
+    if (len < 0)
+    {
+        free_phys_page(pp);
+        return 0;
+    }
+
+    if (map->flags & MMAP_WRITE)
+        flags |= PTE_W;
+    if (map->flags & MMAP_EXEC)
+    {
+        flags |= PTE_X;
+        fence_i(); // instructions were just stored as data
+    }
+
+    if (map_page(vma, pp, flags) == NULL)
+    {
+        free_phys_page(pp);
+        return 0;
+    }
+    return 1;
+}
+
+// Gives the active memory space its own writable copy of the copy-on-write page at _vma_, mapped by
+// _pte_.
+// The last sharer takes the page over without copying. Returns 1 on success, 0 if out of memory.
+static int break_cow(struct pte *pte, uintptr_t vma)
+{
+    void *old = pageptr(pte->ppn);
+    void *pp;
+    int pie;
+
+    if (old == zero_page)
+    {
+        pp = alloc_zeroed_page();
+        if (pp == NULL)
+            return 0;
+        *pte = leaf_pte(pp, (pte->flags & (PTE_R | PTE_X | PTE_U | PTE_G)) | PTE_W);
+        flush_page(vma);
+        return 1;
+    }
+
+    pie = disable_interrupts();
+    if (page_share_cnt[(old - RAM_START) / PAGE_SIZE] == 0)
+    {
+        restore_interrupts(pie);
+        pte->flags |= PTE_W;
+        pte->rsw = 0;
+        flush_page(vma);
+        return 1;
+    }
+    restore_interrupts(pie);
+
+    pp = alloc_phys_page();
+    if (pp == NULL)
+        return 0;
+
+    memcpy(pp, old, PAGE_SIZE);
+    *pte = leaf_pte(pp, (pte->flags & (PTE_R | PTE_X | PTE_U | PTE_G)) | PTE_W);
+    flush_page(vma);
+    page_put(old);
+    return 1;
+}
+
+// Records one more memory space mapping the user page _pp_.
+static void page_share(const void *pp)
+{
+    int pie;
+
+    if (pp == zero_page)
+        return;
+
+    pie = disable_interrupts();
+    assert(page_share_cnt[(pp - RAM_START) / PAGE_SIZE] != UINT16_MAX);
+    page_share_cnt[(pp - RAM_START) / PAGE_SIZE] += 1;
+    restore_interrupts(pie);
+}
+
+// Drops one memory space's reference to the user page _pp_ and frees it with the last one.
+static void page_put(void *pp)
+{
+    uint16_t *const cnt = &page_share_cnt[(pp - RAM_START) / PAGE_SIZE];
+    int pie;
+
+    if (pp == zero_page)
+        return;
+
+    pie = disable_interrupts();
+
+    if (*cnt != 0)
+    {
+        *cnt -= 1;
+        restore_interrupts(pie);
         return;
     }
+    restore_interrupts(pie);
     memset(pp, 0, PAGE_SIZE);
-    struct page_chunk *chunk = (struct page_chunk *)pp;
-    chunk->pagecnt = cnt;
+    free_phys_page(pp);
+}
+
+// Returns the level 1 PTE covering _vma_ in the active space, or NULL if there is no level 1 table.
+static struct pte *walk_pt1(uintptr_t vma)
+{
+    struct pte *const pt2 = active_space_ptab();
 
-    // need to insert back to the free list order by adderess?
-    if (free_chunk_list == NULL)
+    if (!wellformed(vma) || !PTE_VALID(pt2[VPN2(vma)]) || PTE_LEAF(pt2[VPN2(vma)]))
+        return NULL;
+
+    return (struct pte *)pageptr(pt2[VPN2(vma)].ppn) + VPN1(vma);
+}
+
+// Maps the MEGA_SIZE aligned physical range at _pp_ at _vma_ with a single level 1 leaf. Returns
+// 0 on success, or -EBUSY if anything is already mapped there and -ENOMEM if no level 1 table
+// could be allocated.
+static int map_mega(uintptr_t vma, void *pp, int rwxug_flags)
+{
+    struct pte *const pt2 = active_space_ptab();
+    struct pte *pte1;
+    void *pt1;
+
+    if (!wellformed(vma))
+        return -EINVAL;
+
+    if (!PTE_VALID(pt2[VPN2(vma)]))
     {
-        chunk->next = NULL;
-        free_chunk_list = chunk;
-        // restore_interrupts(pie);
-        return;
+        pt1 = alloc_phys_page();
+        if (pt1 == NULL)
+            return -ENOMEM;
+        memset(pt1, 0, PAGE_SIZE);
+        pt2[VPN2(vma)] = ptab_pte(pt1, 0);
     }
 
-    else if (chunk < free_chunk_list)
+    pte1 = walk_pt1(vma);
+    if (pte1 == NULL || PTE_VALID(*pte1))
+        return -EBUSY;
+
+    *pte1 = leaf_pte(pp, rwxug_flags);
+    flush_page(vma);
+    return 0;
+}
+
+// Replaces the megapage leaf _pte1_ with a level 0 table of 512 leaves with the same flags.
+// Returns 0 on success or -ENOMEM.
+static int split_mega(struct pte *pte1)
+{
+    struct pte *const pt0 = alloc_phys_page();
+
+    if (pt0 == NULL)
+        return -ENOMEM;
+
+    for (int k = 0; k < PTE_CNT; k++)
     {
-        chunk->next = free_chunk_list;
-        free_chunk_list = chunk;
-        // restore_interrupts(pie);
-        return;
+        pt0[k] = *pte1;
+        pt0[k].ppn = pte1->ppn + k;
     }
 
-    struct page_chunk *curr = free_chunk_list->next;
-    struct page_chunk *prev = free_chunk_list;
-    while (curr != NULL && curr < chunk)
+    *pte1 = ptab_pte(pt0, 0);
+    flush_space(); // a leaf became a table
+    return 0;
+}
+
+// Frees the pages of a megapage. Megapages are never shared; see clone_active_mspace().
+static void free_mega(void *pp)
+{
+    memset(pp, 0, MEGA_SIZE);
+    free_phys_pages(pp, PTE_CNT);
+}
+
+// Maps the page at _vma_ in anonymous user memory, then as many of the other unmapped pages of
+// its FAULT_AROUND_PAGES block as memory allows. A store fault maps zeroed writable pages; a load
+// fault maps the shared zero page. Returns 1 if the faulting page was mapped, 0 otherwise.
+static int fault_anon(uintptr_t vma, int write)
+{
+    const uintptr_t start = ROUND_DOWN(vma, FAULT_AROUND_PAGES * PAGE_SIZE);
+    struct pte *pt0;
+
+    if (!map_anon(vma, write))
+        return 0;
+
+    for (uintptr_t va = start; va < start + FAULT_AROUND_PAGES * PAGE_SIZE; va += PAGE_SIZE)
     {
-        prev = curr;
-        curr = curr->next;
+        if (va == vma || va < UMEM_START_VMA || va >= UMEM_END_VMA ||
+            process_find_mmap(va) != NULL)
+            continue;
+
+        pt0 = find_physical_page(va);
+        if (pt0 != NULL && PTE_VALID(pt0[VPN0(va)]))
+            continue;
+
+        if (!map_anon(va, write))
+            break;
     }
-    prev->next = chunk;
-    chunk->next = curr;
-    sfence_vma();
-    // restore_interrupts(pie);
+
+    return 1;
 }
 
-unsigned long free_phys_page_count(void)
+// Maps one anonymous page at _vma_: a zeroed page if _write_, else the shared zero page. Returns
+// 1 on success, 0 on failure.
+static int map_anon(uintptr_t vma, int write)
 {
-    int count = 0;
-    struct page_chunk *curr = free_chunk_list;
-    while (curr != NULL)
+    struct pte *pt0;
+    void *pp;
+
+    if (!write)
     {
-        count += curr->pagecnt;
-        curr = curr->next;
+        if (map_page(vma, zero_page, PTE_R | PTE_U) == NULL)
+            return 0;
+        pt0 = find_physical_page(vma);
+        pt0[VPN0(vma)].rsw = PTE_RSW_COW;
+        return 1;
     }
-    return count;
+
+    pp = alloc_zeroed_page();
+    if (pp == NULL)
+        return 0;
+
+    if (map_page(vma, pp, PTE_R | PTE_W | PTE_U) == NULL)
+    {
+        free_phys_page(pp);
+        return 0;
+    }
+    return 1;
 }
 
-// Called by handle_umode_exception() in excp.c to handle U mode load and store page faults.
-// It returns 1 to indicate the fault has been handled (the instruction should be restarted) and 0 to indicate that the page fault
-// is fatal and the process should be terminated.
-int handle_umode_page_fault(struct trap_frame *tfr, uintptr_t vma)
+// Returns a zeroed page, from the pool if it has one.
+static void *alloc_zeroed_page(void)
 {
+    void *pp = NULL;
+    int pie;
 
-    if (vma >= UMEM_START_VMA && vma < UMEM_END_VMA)
+    pie = disable_interrupts();
+    if (zero_pool_cnt != 0)
+        pp = zero_pool[--zero_pool_cnt];
+    restore_interrupts(pie);
+
+    if (pp == NULL)
     {
-        // kprintf("\nVMA: %llu", vma);
-        void *pp = alloc_phys_page();
-        if (pp == NULL)
+        pp = alloc_phys_page();
+        if (pp != NULL)
+            memset(pp, 0, PAGE_SIZE);
+    }
+    return pp;
+}
+
+// Returns a free ASID, or 0 if all are taken.
+static unsigned int asid_alloc(void)
+{
+    unsigned int asid = 0;
+    int pie = disable_interrupts();
+
+    for (unsigned int i = 1; i < asid_limit; i++)
+    {
+        if ((asid_used[i / 64] & (1UL << (i % 64))) == 0)
         {
-            return 0;
+            asid_used[i / 64] |= 1UL << (i % 64);
+            asid = i;
+            break;
         }
-        void *map = map_page(vma, pp, PTE_R | PTE_W | PTE_U);
-        if (map == NULL)
+    }
+
+    restore_interrupts(pie);
+    return asid;
+}
+
+// Returns _asid_ to the pool, dropping whatever translations the TLB still holds for it.
+static void asid_free(unsigned int asid)
+{
+    int pie;
+
+    if (asid == 0)
+        return;
+
+    sfence_vma_asid(asid);
+    smp_tlb_shootdown();
+    pie = disable_interrupts();
+    asid_used[asid / 64] &= ~(1UL << (asid % 64));
+    restore_interrupts(pie);
+}
+
+// Adds the block of 2^_order_ pages at page index _idx_ to its free list. Must be called with
+// interrupts disabled.
+static void buddy_link(unsigned long idx, unsigned int order)
+{
+    struct page_chunk *const blk = pageptr(pagenum(RAM_START) + idx);
+
+    blk->prev = NULL;
+    blk->next = free_blocks[order];
+    if (blk->next != NULL)
+        blk->next->prev = blk;
+    free_blocks[order] = blk;
+    free_block_order[idx] = order + 1;
+}
+
+// Removes the free block at page index _idx_ from its free list. Must be called with interrupts
+// disabled.
+static void buddy_unlink(unsigned long idx, unsigned int order)
+{
+    struct page_chunk *const blk = pageptr(pagenum(RAM_START) + idx);
+
+    if (blk->prev != NULL)
+        blk->prev->next = blk->next;
+    else
+        free_blocks[order] = blk->next;
+    if (blk->next != NULL)
+        blk->next->prev = blk->prev;
+    free_block_order[idx] = 0;
+}
+
+// Frees pages [_idx_, _end_), given as page indices from RAM_START, as the largest aligned blocks
+// that fit, merging each with its buddy for as long as the buddy is free. Must be called with
+// interrupts disabled.
+static void buddy_free_range(unsigned long idx, unsigned long end)
+{
+    unsigned long next, buddy;
+    unsigned int order;
+
+    while (idx < end)
+    {
+        order = 0;
+        while (order + 1 < BUDDY_ORDER_CNT && idx % (2UL << order) == 0 &&
+               idx + (2UL << order) <= end)
+            order += 1;
+
+        free_page_cnt += 1UL << order;
+        next = idx + (1UL << order);
+
+        while (order + 1 < BUDDY_ORDER_CNT)
         {
-            free_phys_page(pp);
-            return 0;
+            buddy = idx ^ (1UL << order);
+            if (buddy >= RAM_SIZE / PAGE_SIZE || free_block_order[buddy] != order + 1)
+                break;
+            buddy_unlink(buddy, order);
+            idx &= ~(1UL << order);
+            order += 1;
         }
-        return 1;
+
+        buddy_link(idx, order);
+        idx = next;
     }
-    return 0; // not handled
 }
 
 mtag_t active_space_mtag(void)
@@ -938,6 +1594,27 @@ static inline struct pte *active_space_ptab(void)
     return mtag_to_ptab(active_space_mtag());
 }
 
+static inline unsigned int mtag_asid(mtag_t mtag)
+{
+    return (mtag >> RISCV_SATP_ASID_shift) & ((1UL << RISCV_SATP_ASID_nbits) - 1);
+}
+
+// Flushes the translation of the page at _vma_ in the active space. The other
+// harts may run threads of the same space, so they flush too.
+static inline void flush_page(uintptr_t vma)
+{
+    sfence_vma_page(vma, mtag_asid(active_space_mtag()));
+    smp_tlb_shootdown();
+}
+
+// Flushes every non-global translation of the active space, here and on the other harts. Needed after
+// changing a non-leaf PTE.
+static inline void flush_space(void)
+{
+    sfence_vma_asid(mtag_asid(active_space_mtag()));
+    smp_tlb_shootdown();
+}
+
 static inline void *pageptr(uintptr_t n)
 {
     return (void *)(n << PAGE_ORDER);
@@ -976,18 +1653,15 @@ static inline struct pte null_pte(void)
 
 void print_chunklist(void)
 {
-    struct page_chunk *tmp = free_chunk_list;
-    while (tmp != NULL)
-    {
-        // if (tmp->pagecnt == -9)
-        // {
-        //     break;
-        //     return;
-        // }
-        kprintf("Node: %p, ", tmp);
-        kprintf("Page Count:%d\n", tmp->pagecnt);
+    struct page_chunk *blk;
+    unsigned long n;
 
-        tmp = tmp->next;
+    for (unsigned int k = 0; k < BUDDY_ORDER_CNT; k++)
+    {
+        n = 0;
+        for (blk = free_blocks[k]; blk != NULL; blk = blk->next)
+            n += 1;
+        if (n != 0)
+            kprintf("Order %u (%lu pages): %lu free\n", k, 1UL << k, n);
     }
-    return;
-}
\ No newline at end of file
+}
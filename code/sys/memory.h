@@ -45,6 +45,11 @@ extern char memory_initialized;
 
 extern void memory_init(void);
 
+// Switches a secondary hart to the main memory space and lets S mode reach
+// user memory, as memory_init() does for hart 0.
+
+extern void memory_init_hart(void);
+
 extern void print_chunklist(void);
 
 extern mtag_t active_mspace(void);
@@ -53,6 +58,10 @@ extern mtag_t switch_mspace(mtag_t mtag);
 
 extern mtag_t clone_active_mspace(void);
 
+// Returns a new memory space with no user mappings, only the kernel's.
+
+extern mtag_t create_mspace(void);
+
 extern void reset_active_mspace(void);
 
 extern mtag_t discard_active_mspace(void);
@@ -79,7 +88,37 @@ extern void free_phys_pages(void * pp, unsigned int cnt);
 
 extern unsigned long free_phys_page_count(void);
 
+// Maps _pp_, a page the caller holds a reference to, into the active space at
+// _vma_ as one more sharer. With _cow_ the first store gives the space its own
+// copy. Returns 0 or -ENOMEM. put_shared_page() drops the caller's reference;
+// the page is freed when the last space mapping it lets go.
+
+extern int map_shared_page(uintptr_t vma, void * pp, int rwxug_flags, int cow);
+extern void put_shared_page(void * pp);
+
 extern int handle_umode_page_fault (
     struct trap_frame * tfr, uintptr_t vma);
 
+// Zeroes a page ahead of time for a later page fault. Returns 1 if it did,
+// 0 if there was nothing to do. Called by the idle thread.
+
+extern int zero_pool_refill(void);
+
+// Checks that the _n_ bytes at _uptr_ lie within user memory. Returns 0 or
+// -EINVAL. Pages need not be mapped yet; system calls fault them in.
+
+extern int validate_user_range(const void * uptr, size_t n);
+
+// Copy _n_ bytes between kernel memory and the active user memory space after
+// checking the user range once. Return 0 or -EINVAL.
+
+extern int copy_from_user(void * dst, const void * usrc, size_t n);
+extern int copy_to_user(void * udst, const void * src, size_t n);
+
+// Copies the string at _usrc_ into _dst_, which holds _n_ bytes. Returns its
+// length, _n_ if it did not fit (_dst_ is then not terminated), or -EINVAL if
+// it runs outside user memory.
+
+extern long strncpy_from_user(char * dst, const char * usrc, size_t n);
+
 #endif
\ No newline at end of file
@@ -15,6 +15,7 @@
 #include "conf.h"
 #include "plic.h"
 #include "assert.h"
+#include "thread.h" // for running_hart
 
 #include <stdint.h>
 
@@ -79,10 +80,8 @@ static void plic_complete_context_interrupt (
 static void plic_enable_all_sources_for_context(uint_fast32_t ctxno);
 static void plic_disable_all_sources_for_context(uint_fast32_t ctxno);
 
-// We currently only support single-hart operation, sending interrupts to S mode
-// on hart 0 (context 0). The low-level PLIC functions already understand
-// contexts, so we only need to modify the high-level functions (plit_init,
-// plic_claim_request, plic_finish_request)to add support for multiple harts.
+// Every source is routed to the S mode context of each running hart. Whichever
+// hart claims an interrupt first services it; the others claim 0.
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
@@ -95,12 +94,19 @@ void plic_init(void) {
 	for (i = 0; i < PLIC_SRC_CNT; i++)
 		plic_set_source_priority(i, 0);
 	
-	// Route all sources to S mode on hart 0 only
+	// No context takes interrupts until its hart calls plic_init_hart()
 
 	for (int i = 0; i < PLIC_CTX_CNT; i++)
 		plic_disable_all_sources_for_context(i);
 	
-	plic_enable_all_sources_for_context(CTX(0,1));
+	plic_init_hart(0);
+}
+
+extern void plic_init_hart(int hart) {
+	trace("%s(hart=%d)", __func__, hart);
+	assert (0 <= hart && hart < NHART);
+	plic_set_context_threshold(CTX(hart,1), 0);
+	plic_enable_all_sources_for_context(CTX(hart,1));
 }
 
 extern void plic_enable_source(int srcno, int prio) {
@@ -119,17 +125,13 @@ extern void plic_disable_source(int irqno) {
 }
 
 extern int plic_claim_interrupt(void) {
-	// FIXME: Hardwired S-mode hart 0
-	
 	trace("%s()", __func__);
-	return plic_claim_context_interrupt(CTX(0,1));
+	return plic_claim_context_interrupt(CTX(running_hart(),1));
 }
 
 extern void plic_finish_interrupt(int irqno) {
-	// FIXME: Hardwired S-mode hart 0
-	
 	trace("%s(irqno=%d)", __func__, irqno);
-	plic_complete_context_interrupt(CTX(0,1), irqno);
+	plic_complete_context_interrupt(CTX(running_hart(),1), irqno);
 }
 
 // INTERNAL FUNCTION DEFINITIONS
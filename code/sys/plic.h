@@ -14,6 +14,7 @@
 #define PLIC_PRIO_MAX 7
 
 extern void plic_init(void);
+extern void plic_init_hart(int hart); // routes interrupts to _hart_'s S mode context
 
 extern void plic_enable_source(int srcno, int prio);
 extern void plic_disable_source(int srcno);
@@ -27,6 +27,8 @@
 #include "error.h"
 #include "timer.h"
 #include "intr.h"
+#include "ioring.h"
+#include "imgcache.h"
 
 // COMPILE-TIME PARAMETERS
 //
@@ -38,10 +40,37 @@
 // INTERNAL FUNCTION DECLARATIONS
 //
 
-static int build_stack(void *stack, int argc, char **argv);
+static int build_stack(void *stack, int argc, char **argv, int user);
+static int exec_args(struct io *exeio, int argc, char **argv, int user);
 
 static void fork_func(struct condition *forked, struct trap_frame *tfr);
 
+struct spawn_args;
+static void spawn_func(struct spawn_args *args);
+static void __attribute__((noreturn)) enter_umode(void (*eptr)(void), int argc, int stksz);
+static void uthread_func(struct trap_frame *tfr);
+static void process_init_threads(struct process *proc);
+
+static int mmap_overlaps(const struct process *proc, uintptr_t vma, size_t size);
+static void drop_mmaps(struct process *proc);
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Handed from process_spawn() to the child thread. Lives on the parent's stack
+// until the child sets done.
+
+struct spawn_args
+{
+    struct io *exeio;
+    void *stack; // page prepared by build_stack()
+    int stksz;
+    int argc;
+    int status; // result of elf_load()
+    int done;
+    struct condition loaded;
+};
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -67,29 +96,56 @@ void procmgr_init(void)
     main_proc.tid = running_thread();
     main_proc.mtag = active_mspace();
     thread_set_process(main_proc.tid, &main_proc);
+    process_init_threads(&main_proc);
     // main_proc.iotab[0] = create_null_io();
+    imgcache_init();
     procmgr_initialized = 1;
     timer_init();
 }
 
 int process_exec(struct io *exeio, int argc, char **argv)
 {
-    void *stack = alloc_phys_page();
+    return exec_args(exeio, argc, argv, 0);
+}
+
+int process_exec_user(struct io *exeio, int argc, char **uargv)
+{
+    return exec_args(exeio, argc, uargv, 1);
+}
+
+// Does the work of process_exec() and process_exec_user(). The arguments are
+// copied to the new stack page before the memory space holding them is reset.
+
+static int exec_args(struct io *exeio, int argc, char **argv, int user)
+{
+    void *stack;
     void (*eptr)(void) = 0;
-    int size = build_stack(stack, argc, argv); // get the trap frame from the stack
+    int size;
+
+    // The other threads would be left running in the replaced image
+
+    if (current_process()->thrcnt > 1)
+    {
+        return -EBUSY;
+    }
+    stack = alloc_phys_page();
+    if (stack == NULL)
+    {
+        return -ENOMEM;
+    }
+    size = build_stack(stack, argc, argv, user); // get the trap frame from the stack
+    if (size < 0)
+    {
+        free_phys_page(stack);
+        return size;
+    }
+    ioring_destroy(current_process());
+    drop_mmaps(current_process());
     reset_active_mspace();
     map_page(UMEM_END_VMA - PAGE_SIZE, stack, PTE_R | PTE_W | PTE_U);
     sfence_vma();
     elf_load(exeio, &eptr);
-    struct trap_frame *tfr = kcalloc(1, sizeof(struct trap_frame));
-    tfr->sepc = eptr;
-    tfr->a0 = argc;                // a0 stores the count
-    tfr->a1 = UMEM_END_VMA - size; // a1 stores the location of the start of the trap frame
-    tfr->sp = (void *)(UMEM_END_VMA - size);
-    tfr->sstatus = csrr_sstatus();
-    tfr->sstatus |= RISCV_SSTATUS_SPIE;
-    tfr->sstatus &= ~(RISCV_SSTATUS_SPP);
-    trap_frame_jump(tfr, get_stack_anchor());
+    enter_umode(eptr, argc, size);
     return 0;
 }
 
@@ -112,7 +168,18 @@ int process_fork(const struct trap_frame *tfr)
                     proc->iotab[j] = ioaddref(current_process()->iotab[j]);
                 }
             }
+            // Pages already faulted in are copied with the memory space; the
+            // rest are filled from the file when the child touches them.
+            for (int j = 0; j < PROCESS_MMAPMAX; j++)
+            {
+                proc->mmaptab[j] = current_process()->mmaptab[j];
+                if (proc->mmaptab[j].io != NULL)
+                {
+                    ioaddref(proc->mmaptab[j].io);
+                }
+            }
             proc->mtag = clone_active_mspace();
+            process_init_threads(proc);
             // struct condition * forked = kcalloc(1, sizeof(struct condition));
             // condition_init(forked, "forked");
             // Ask OH Can we only do it with condition?
@@ -131,9 +198,145 @@ int process_fork(const struct trap_frame *tfr)
     return -EINVAL;
 }
 
+int process_spawn(struct io *exeio, int argc, char **uargv, const int *fdtab, int fdcnt)
+{
+    struct process *const parent = current_process();
+    struct spawn_args args;
+    struct process *proc;
+    int i, fd, tid, pie;
+
+    if (exeio == NULL)
+    {
+        return -EBADFD;
+    }
+    if (fdtab != NULL && (fdcnt < 0 || fdcnt > PROCESS_IOMAX))
+    {
+        return -EINVAL;
+    }
+    for (i = 0; fdtab != NULL && i < fdcnt; i++)
+    {
+        if (fdtab[i] >= PROCESS_IOMAX || (fdtab[i] >= 0 && parent->iotab[fdtab[i]] == NULL))
+        {
+            return -EBADFD;
+        }
+    }
+
+    for (i = 0; i < NPROC && proctab[i] != NULL; i++)
+    {
+        continue;
+    }
+    if (i == NPROC)
+    {
+        return -EMPROC;
+    }
+
+    // Arguments live in the caller's memory, so the stack page is built here
+
+    args.stack = alloc_phys_page();
+    if (args.stack == NULL)
+    {
+        return -ENOMEM;
+    }
+    args.stksz = build_stack(args.stack, argc, uargv, 1);
+    if (args.stksz < 0)
+    {
+        free_phys_page(args.stack);
+        return args.stksz;
+    }
+
+    proc = kcalloc(1, sizeof(struct process));
+    proc->idx = i;
+    for (fd = 0; fd < PROCESS_IOMAX; fd++)
+    {
+        struct io *io = NULL;
+
+        if (fdtab == NULL)
+        {
+            io = parent->iotab[fd];
+        }
+        else if (fd < fdcnt && fdtab[fd] >= 0)
+        {
+            io = parent->iotab[fdtab[fd]];
+        }
+        proc->iotab[fd] = (io != NULL) ? ioaddref(io) : NULL;
+    }
+    proc->mtag = create_mspace();
+    process_init_threads(proc);
+
+    args.exeio = exeio;
+    args.argc = argc;
+    args.done = 0;
+    condition_init(&args.loaded, "spawn");
+
+    tid = thread_spawn("spawn", (void *)&spawn_func, &args);
+    if (tid < 0)
+    {
+        switch_mspace(proc->mtag);
+        discard_active_mspace();
+        switch_mspace(parent->mtag);
+        for (fd = 0; fd < PROCESS_IOMAX; fd++)
+        {
+            if (proc->iotab[fd] != NULL)
+            {
+                ioclose(proc->iotab[fd]);
+            }
+        }
+        free_phys_page(args.stack);
+        kfree(proc);
+        return tid;
+    }
+    proc->tid = tid;
+    thread_set_process(tid, proc);
+    proctab[i] = proc;
+
+    pie = disable_interrupts();
+    while (!args.done)
+    {
+        condition_wait(&args.loaded);
+    }
+    restore_interrupts(pie);
+
+    if (args.status < 0)
+    {
+        thread_join(tid);
+        return args.status;
+    }
+    return tid;
+}
+
 void process_exit(void)
 {
     struct process *proc = running_thread_process();
+    int pie;
+
+    // The first thread tears the process down, since its id is what the
+    // parent waits for. The others see exiting on their way back to U mode;
+    // those blocked on a futex, pipe or the console are woken to get there.
+
+    proc->exiting = 1;
+    thread_interrupt_process(proc);
+    if (running_thread() != proc->tid)
+    {
+        process_thread_exit();
+    }
+
+    pie = disable_interrupts();
+    while (proc->thrcnt > 1)
+    {
+        condition_wait(&proc->thread_exited);
+    }
+    restore_interrupts(pie);
+    ioring_destroy(proc);
+
+    for (int i = 0; i < PROCESS_THRMAX - 1; i++)
+    {
+        if (proc->thrtab[i].tid != 0)
+        {
+            thread_join(proc->thrtab[i].tid);
+            proc->thrtab[i].tid = 0;
+        }
+    }
+
     fsflush();
     if (proc->tid == 0)
     {
@@ -142,6 +345,7 @@ void process_exit(void)
     // kprintf("PRE-DISCARD: %d\n", free_phys_page_count());
     discard_active_mspace();
     // kprintf("POST-DISCARD: %d\n", free_phys_page_count());
+    drop_mmaps(proc);
     for (int i = 0; i < PROCESS_IOMAX; i++)
     {
         if (proc->iotab[i] != NULL)
@@ -153,63 +357,435 @@ void process_exit(void)
     thread_exit();
 }
 
+int process_thread_create(const struct trap_frame *tfr, uintptr_t entry, uintptr_t arg)
+{
+    struct process *const proc = current_process();
+    struct trap_frame *child_tfr;
+    uintptr_t stack;
+    int slot, tid;
+
+    if (entry < UMEM_START_VMA || entry >= UMEM_END_VMA)
+    {
+        return -EINVAL;
+    }
+    for (slot = 0; slot < PROCESS_THRMAX - 1; slot++)
+    {
+        if (proc->thrtab[slot].tid == 0)
+        {
+            break;
+        }
+    }
+    if (slot == PROCESS_THRMAX - 1)
+    {
+        return -EMTHR;
+    }
+
+    // A fixed address mapping could have been placed over the stack slot
+
+    stack = PROCESS_USTACK_BASE + slot * PROCESS_USTACK_SIZE;
+    if (mmap_overlaps(proc, stack, PROCESS_USTACK_SIZE))
+    {
+        return -ENOMEM;
+    }
+
+    // Freed by the new thread once it has copied it
+
+    child_tfr = kcalloc(1, sizeof(struct trap_frame));
+    memcpy(child_tfr, tfr, sizeof(struct trap_frame));
+    child_tfr->sepc = (void *)entry;
+    child_tfr->a0 = arg;
+    child_tfr->ra = NULL;
+    child_tfr->sp = (void *)(stack + PROCESS_USTACK_SIZE);
+
+    tid = thread_spawn("uthread", (void *)&uthread_func, child_tfr);
+    if (tid < 0)
+    {
+        kfree(child_tfr);
+        return tid;
+    }
+    thread_set_process(tid, proc);
+    proc->thrtab[slot].tid = tid;
+    proc->thrtab[slot].exited = 0;
+    proc->thrcnt += 1;
+    return tid;
+}
+
+void process_thread_exit(void)
+{
+    struct process *const proc = current_process();
+    const int tid = running_thread();
+    int slot;
+
+    if (tid == proc->tid)
+    {
+        process_exit();
+    }
+    for (slot = 0; slot < PROCESS_THRMAX - 1; slot++)
+    {
+        if (proc->thrtab[slot].tid == tid)
+        {
+            break;
+        }
+    }
+    assert(slot < PROCESS_THRMAX - 1);
+
+    unmap_and_free_range((void *)(PROCESS_USTACK_BASE + slot * PROCESS_USTACK_SIZE),
+                         PROCESS_USTACK_SIZE);
+    sfence_vma();
+
+    // With interrupts off until thread_exit() switches away, a thread woken
+    // here finds us exited.
+
+    disable_interrupts();
+    proc->thrtab[slot].exited = 1;
+    proc->thrcnt -= 1;
+    condition_broadcast(&proc->thread_exited);
+    thread_exit();
+}
+
+int process_thread_join(int tid)
+{
+    struct process *const proc = current_process();
+    struct process_thread *thr = NULL;
+    int pie;
+
+    for (int i = 0; i < PROCESS_THRMAX - 1; i++)
+    {
+        if (tid != 0 && proc->thrtab[i].tid == tid)
+        {
+            thr = &proc->thrtab[i];
+            break;
+        }
+    }
+    if (thr == NULL || tid == running_thread())
+    {
+        return -EINVAL;
+    }
+
+    pie = disable_interrupts();
+    while (thr->tid == tid && !thr->exited)
+    {
+        if (condition_wait_interruptible(&proc->thread_exited) != 0)
+        {
+            restore_interrupts(pie);
+            return -EINTR;
+        }
+    }
+    restore_interrupts(pie);
+
+    // Another thread may have joined it first
+
+    if (thr->tid != tid)
+    {
+        return -EINVAL;
+    }
+    thr->tid = 0;
+    thread_join(tid);
+    return tid;
+}
+
+void process_check_exiting(void)
+{
+    struct process *const proc = current_process();
+
+    if (proc != NULL && proc->exiting)
+    {
+        process_exit();
+    }
+}
+
+long process_mmap(struct io *io, uintptr_t vma, size_t size,
+                  unsigned long long pos, size_t filesz, int flags)
+{
+    struct process *proc = current_process();
+    struct process_mmap *map = NULL;
+    uintptr_t top;
+    int i;
+
+    if (io == NULL)
+    {
+        return -EBADFD;
+    }
+    if (size == 0 || vma % PAGE_SIZE != 0 || pos % PAGE_SIZE != 0 ||
+        (flags & ~(MMAP_WRITE | MMAP_EXEC)) != 0)
+    {
+        return -EINVAL;
+    }
+
+    size = ROUND_UP(size, PAGE_SIZE);
+
+    for (i = 0; i < PROCESS_MMAPMAX; i++)
+    {
+        if (proc->mmaptab[i].io == NULL)
+        {
+            map = &proc->mmaptab[i];
+            break;
+        }
+    }
+    if (map == NULL)
+    {
+        return -EMFILE;
+    }
+
+    if (vma == 0)
+    {
+        // First fit going down from just below the rings and thread stacks.
+        // Each overlap moves the candidate below a distinct mapping, so this
+        // terminates.
+        top = PROCESS_RING_VMA;
+        for (i = 0; i <= PROCESS_MMAPMAX; i++)
+        {
+            if (top < UMEM_START_VMA + size)
+            {
+                return -ENOMEM;
+            }
+            vma = top - size;
+            if (!mmap_overlaps(proc, vma, size))
+            {
+                break;
+            }
+            for (int j = 0; j < PROCESS_MMAPMAX; j++)
+            {
+                if (proc->mmaptab[j].io != NULL &&
+                    proc->mmaptab[j].vma < top &&
+                    vma < proc->mmaptab[j].vma + proc->mmaptab[j].size)
+                {
+                    top = proc->mmaptab[j].vma;
+                }
+            }
+        }
+        if (i > PROCESS_MMAPMAX)
+        {
+            return -ENOMEM;
+        }
+    }
+    else if (vma < UMEM_START_VMA || size > UMEM_END_VMA - vma ||
+             mmap_overlaps(proc, vma, size))
+    {
+        return -EINVAL;
+    }
+
+    map->io = ioaddref(io);
+    map->vma = vma;
+    map->size = size;
+    map->pos = pos;
+    map->filesz = filesz;
+    map->flags = flags;
+    return vma;
+}
+
+int process_munmap(uintptr_t vma)
+{
+    struct process *proc = current_process();
+
+    for (int i = 0; i < PROCESS_MMAPMAX; i++)
+    {
+        if (proc->mmaptab[i].io != NULL && proc->mmaptab[i].vma == vma)
+        {
+            unmap_and_free_range((void *)vma, proc->mmaptab[i].size);
+            ioclose(proc->mmaptab[i].io);
+            proc->mmaptab[i].io = NULL;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+struct process_mmap *process_find_mmap(uintptr_t vma)
+{
+    struct process *proc = current_process();
+
+    if (proc == NULL)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < PROCESS_MMAPMAX; i++)
+    {
+        if (proc->mmaptab[i].io != NULL && proc->mmaptab[i].vma <= vma &&
+            vma - proc->mmaptab[i].vma < proc->mmaptab[i].size)
+        {
+            return &proc->mmaptab[i];
+        }
+    }
+    return NULL;
+}
+
 // INTERNAL FUNCTION DEFINITIONS
 //
 
-int build_stack(void *stack, int argc, char **argv)
+// Returns 1 if [vma, vma+size) intersects a mapping of _proc_
+
+int mmap_overlaps(const struct process *proc, uintptr_t vma, size_t size)
 {
-    size_t stksz, argsz;
+    for (int i = 0; i < PROCESS_MMAPMAX; i++)
+    {
+        if (proc->mmaptab[i].io != NULL &&
+            vma < proc->mmaptab[i].vma + proc->mmaptab[i].size &&
+            proc->mmaptab[i].vma < vma + size)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Releases every mapping of _proc_. The caller takes care of the pages.
+
+void drop_mmaps(struct process *proc)
+{
+    for (int i = 0; i < PROCESS_MMAPMAX; i++)
+    {
+        if (proc->mmaptab[i].io != NULL)
+        {
+            ioclose(proc->mmaptab[i].io);
+            proc->mmaptab[i].io = NULL;
+        }
+    }
+}
+
+// Lays out _argc_ and the argument vector _argv_ at the top of _stack_, the page that becomes the
+// top of the new user stack, and returns the number of bytes used. With _user_ set, _argv_ and its
+// strings are in the caller's user memory and are read with copy_from_user() and
+// strncpy_from_user(). Each string is read once, so a string changed meanwhile cannot overrun the
+// page. Returns -ENOMEM if the arguments do not fit in the page or -EINVAL for a bad pointer.
+int build_stack(void *stack, int argc, char **argv, int user)
+{
+    char **const vec = stack; // argument vector, built at the bottom of the page first
+    size_t stksz, room, used;
     uintptr_t *newargv;
     char *p;
+    long len;
     int i;
 
     // We need to be able to fit argv[] on the initial stack page, so _argc_
     // cannot be too large. Note that argv[] contains argc+1 elements (last one
     // is a NULL pointer).
 
+    if (argc < 0)
+        return -EINVAL;
     if (PAGE_SIZE / sizeof(char *) - 1 < argc)
         return -ENOMEM;
 
-    stksz = (argc + 1) * sizeof(char *);
+    if (argc != 0 && user && copy_from_user(vec, argv, argc * sizeof(char *)) != 0)
+        return -EINVAL;
+    if (argc != 0 && !user)
+        memcpy(vec, argv, argc * sizeof(char *));
+
+    // Copy the null-terminated strings that argv[] points to after it.
 
-    // Add the sizes of the null-terminated strings that argv[] points to.
+    p = (char *)(vec + argc + 1);
+    room = PAGE_SIZE - (argc + 1) * sizeof(char *);
 
     for (i = 0; i < argc; i++)
     {
-        argsz = strlen(argv[i]) + 1;
-        if (PAGE_SIZE - stksz < argsz)
+        if (user)
+        {
+            len = strncpy_from_user(p, vec[i], room);
+            if (len < 0)
+                return -EINVAL;
+        }
+        else
+        {
+            len = strlen(vec[i]);
+            if (len < room)
+                memcpy(p, vec[i], len + 1);
+        }
+        if (len >= room)
             return -ENOMEM;
-        stksz += argsz;
+
+        vec[i] = p;
+        p += len + 1;
+        room -= len + 1;
     }
 
     // Round up stksz to a multiple of 16 (RISC-V ABI requirement).
 
-    stksz = ROUND_UP(stksz, 16);
+    used = (void *)p - stack;
+    stksz = ROUND_UP(used, 16);
     assert(stksz <= PAGE_SIZE);
 
-    // Set _newargv_ to point to the location of the argument vector on the new
-    // stack and set _p_ to point to the stack space after it to which we will
-    // copy the strings. Note that the string pointers we write to the new
-    // argument vector must point to where the user process will see the stack.
-    // The user stack will be at the highest page in user memory, the address of
-    // which is `(UMEM_END_VMA - PAGE_SIZE)`. The offset of the _p_ within the
-    // stack is given by `p - newargv'.
+    // Move the vector and strings to the top of the page, copying backwards since the two may
+    // overlap. The string pointers we write to the new argument vector must point to where the
+    // user process will see the stack. The user stack will be at the highest page in user memory,
+    // the address of which is `(UMEM_END_VMA - PAGE_SIZE)`.
 
     newargv = stack + PAGE_SIZE - stksz;
-    p = (char *)(newargv + argc + 1);
+
+    for (p = (char *)newargv + used; p != (char *)newargv; p--)
+        p[-1] = ((char *)stack)[p - (char *)newargv - 1];
 
     for (i = 0; i < argc; i++)
-    {
-        newargv[i] = (UMEM_END_VMA - PAGE_SIZE) + ((void *)p - (void *)stack);
-        argsz = strlen(argv[i]) + 1;
-        memcpy(p, argv[i], argsz);
-        p += argsz;
-    }
+        newargv[i] = (UMEM_END_VMA - stksz) + (newargv[i] - (uintptr_t)stack);
 
     newargv[argc] = 0;
+    memset(stack, 0, PAGE_SIZE - stksz);
     return stksz;
 }
 
+// Body of a spawned process's thread. Loads the image into the new (active) memory space, reports
+// the result to process_spawn(), and enters U mode, or exits if loading failed.
+
+void spawn_func(struct spawn_args *args)
+{
+    struct process *const proc = current_process();
+    const int stksz = args->stksz;
+    const int argc = args->argc;
+    void (*eptr)(void) = 0;
+    int result;
+    int pie;
+
+    switch_mspace(proc->mtag);
+    map_page(UMEM_END_VMA - PAGE_SIZE, args->stack, PTE_R | PTE_W | PTE_U);
+    result = elf_load(args->exeio, &eptr);
+
+    // Once done is set the parent may return, taking args with it
+
+    pie = disable_interrupts();
+    args->status = result;
+    args->done = 1;
+    condition_broadcast(&args->loaded);
+    restore_interrupts(pie);
+
+    if (result < 0)
+    {
+        process_exit();
+    }
+    enter_umode(eptr, argc, stksz);
+}
+
+// Jumps to _eptr_ in U mode with the stack built by build_stack() at the top of user memory.
+
+void enter_umode(void (*eptr)(void), int argc, int stksz)
+{
+    struct trap_frame *tfr = kcalloc(1, sizeof(struct trap_frame));
+    tfr->sepc = eptr;
+    tfr->a0 = argc;                 // a0 stores the count
+    tfr->a1 = UMEM_END_VMA - stksz; // a1 stores the location of the start of the trap frame
+    tfr->sp = (void *)(UMEM_END_VMA - stksz);
+    tfr->sstatus = csrr_sstatus();
+    tfr->sstatus |= RISCV_SSTATUS_SPIE;
+    tfr->sstatus &= ~(RISCV_SSTATUS_SPP);
+    trap_frame_jump(tfr, get_stack_anchor());
+}
+
+// Body of a thread created by process_thread_create(). Copies the trap frame
+// to our stack so the heap copy can be freed before entering U mode.
+
+void uthread_func(struct trap_frame *tfr)
+{
+    struct trap_frame frame = *tfr;
+
+    kfree(tfr);
+    trap_frame_jump(&frame, get_stack_anchor());
+}
+
+void process_init_threads(struct process *proc)
+{
+    proc->thrcnt = 1;
+    proc->exiting = 0;
+    condition_init(&proc->thread_exited, "thread_exited");
+}
+
 void fork_func(struct condition *done, struct trap_frame *tfr)
 {
     tfr->a0 = 0;
@@ -14,6 +14,43 @@
 #define PROCESS_IOMAX 16
 #endif
 
+#ifndef PROCESS_MMAPMAX
+#define PROCESS_MMAPMAX 8
+#endif
+
+// Space left free below UMEM_END_VMA for the stack when the kernel picks the
+// address of a file mapping
+
+#ifndef PROCESS_STACK_GAP
+#define PROCESS_STACK_GAP (1024 * 1024UL)
+#endif
+
+// Threads per process, and the size of the user stack each thread after the
+// first gets. The stacks sit just below the stack gap;
+// file mappings the kernel places go below them.
+
+#ifndef PROCESS_THRMAX
+#define PROCESS_THRMAX 8
+#endif
+
+#ifndef PROCESS_USTACK_SIZE
+#define PROCESS_USTACK_SIZE (64 * 1024UL)
+#endif
+
+#define PROCESS_USTACK_BASE \
+    (UMEM_END_VMA - PROCESS_STACK_GAP - (PROCESS_THRMAX - 1) * PROCESS_USTACK_SIZE)
+
+// Page holding the rings set up by SYSCALL_RING_SETUP (see ioring.h), just
+// below the thread stacks
+
+#define PROCESS_RING_VMA (PROCESS_USTACK_BASE - PAGE_SIZE)
+
+// Flags for SYSCALL_MMAP. Without MMAP_WRITE a mapping is read-only. With
+// it, pages are private copies: stores are never written back to the file.
+
+#define MMAP_WRITE 0x1
+#define MMAP_EXEC 0x2 // kernel only, for executable images
+
 #include "conf.h"
 #include "io.h"
 #include "thread.h"
@@ -24,11 +61,39 @@
 //
 
 
+// A file range mapped into the process. Pages are read from the file on
+// first touch by handle_umode_page_fault().
+
+struct process_mmap {
+    struct io * io; // NULL if the slot is free
+    uintptr_t vma; // page-aligned start
+    size_t size; // bytes mapped, a multiple of PAGE_SIZE
+    unsigned long long pos; // file offset of vma
+    size_t filesz; // bytes read from the file; the rest of the mapping is zero
+    int flags; // MMAP_WRITE, MMAP_EXEC
+};
+
+// A thread created with process_thread_create(). The slot index selects its
+// user stack. The slot stays taken until the thread is joined.
+
+struct process_thread {
+    int tid; // 0 if the slot is free
+    int exited;
+};
+
+struct ioring; // ioring.c
+
 struct process {
     int idx; // index into proctab
     int tid; // thread id of our thread
     mtag_t mtag; // memory space
     struct io * iotab[PROCESS_IOMAX]; // IO objects associated with current process
+    struct process_mmap mmaptab[PROCESS_MMAPMAX]; // file mappings
+    int thrcnt; // threads running in the process, including the first
+    int exiting; // set by process_exit() while other threads still run
+    struct condition thread_exited;
+    struct process_thread thrtab[PROCESS_THRMAX - 1];
+    struct ioring * ioring; // NULL until SYSCALL_RING_SETUP
 };
 
 // EXPORTED FUNCTION DECLARATIONS
@@ -40,14 +105,71 @@ extern char procmgr_initialized;
 extern void procmgr_init(void);
 
 
+// Replaces the image of the calling single-threaded process with _exeio_,
+// passing it _argc_ and _argv_. Does not return unless it fails. _argv_ and
+// its strings are in kernel memory; process_exec_user() takes them from the
+// caller's user memory instead.
+
 extern int process_exec(struct io * exeio, int argc, char ** argv);
+extern int process_exec_user(struct io * exeio, int argc, char ** uargv);
 
 
 extern int process_fork(const struct trap_frame * tfr);
+
+// Starts _exeio_ as a new process with a fresh memory space, without copying
+// the caller. If _fdtab_ is NULL the child inherits every descriptor;
+// otherwise child descriptor i refers to the caller's descriptor fdtab[i] for
+// i < _fdcnt_, or is closed if fdtab[i] is negative. _uargv_ and its strings
+// are in the caller's user memory; _fdtab_ is in kernel memory. Returns the
+// thread id of the child once its image is loaded, or a negative error code.
+
+extern int process_spawn (
+    struct io * exeio, int argc, char ** uargv,
+    const int * fdtab, int fdcnt);
+
+// Maps _size_ bytes at _vma_ into the current process, or at an address below
+// the stack if _vma_ is 0. The first _filesz_ bytes come from _io_ starting at
+// _pos_ and the rest are zero. Returns the address of the mapping or a
+// negative error code. The mapping holds a reference to _io_.
+
+extern long process_mmap (
+    struct io * io, uintptr_t vma, size_t size,
+    unsigned long long pos, size_t filesz, int flags);
+
+// Removes the mapping that starts at _vma_ and frees its pages.
+
+extern int process_munmap(uintptr_t vma);
+
+// Returns the mapping of the current process that contains _vma_, or NULL.
+
+extern struct process_mmap * process_find_mmap(uintptr_t vma);
  
 
 extern void __attribute__ ((noreturn)) process_exit(void);
 
+// Starts a thread in the current process that enters U mode at _entry_ with
+// _arg_ in a0 and a fresh stack, sharing the memory space and descriptors.
+// The other registers are copied from _tfr_, the caller's trap frame. Returns
+// its thread id or a negative error code.
+
+extern int process_thread_create (
+    const struct trap_frame * tfr, uintptr_t entry, uintptr_t arg);
+
+// Ends a thread created by process_thread_create(). Ends the whole process
+// if called by its first thread.
+
+extern void __attribute__ ((noreturn)) process_thread_exit(void);
+
+// Waits for thread _tid_, created by process_thread_create() in the current
+// process, to exit and frees its slot. Returns _tid_ or -EINVAL.
+
+extern int process_thread_join(int tid);
+
+// Exits the running thread if another thread of its process called
+// process_exit(). Called on the way back to U mode.
+
+extern void process_check_exiting(void);
+
 
 
 static inline struct process * current_process(void);
@@ -0,0 +1,205 @@
+// profile.c - Sampling profiler
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#include "profile.h"
+#include "conf.h"
+
+#ifdef WITH_PROFILER
+
+#include "trap.h"
+#include "timer.h"
+#include "thread.h"
+#include "intr.h"
+#include "device.h"
+#include "ioimpl.h"
+#include "string.h"
+#include "riscv.h"
+#include "error.h"
+
+#include <stddef.h>
+
+// Samples per second while the device is open, and samples each hart buffers
+// before new ones are dropped
+
+#ifndef PROFILE_HZ
+#define PROFILE_HZ 1000
+#endif
+
+#ifndef PROFILE_NSAMPLES
+#define PROFILE_NSAMPLES 512
+#endif
+
+#define PROFILE_PERIOD (TIMER_FREQ / PROFILE_HZ)
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct profile_buf {
+    struct io io;
+    unsigned int head; // next sample to read
+    unsigned int tail; // next sample to write
+    unsigned long dropped;
+    struct profile_sample samples[PROFILE_NSAMPLES];
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int profile_open(struct io ** ioptr, void * aux);
+static void profile_close(struct io * io);
+static long profile_read(struct io * io, void * buf, long bufsz);
+
+static unsigned int profile_backtrace(uint64_t * stack, const struct trap_frame * tfr, int umode);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Each hart samples into its own buffer. The hart that opens the first
+// instance arms its timer; the others start at their next timer interrupt.
+
+static struct profile_buf profile_bufs[NHART];
+static int profile_running; // instances open
+static unsigned long long profile_next[NHART];
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void profile_init(void) {
+    static const struct iointf profile_iointf = {
+        .close = &profile_close,
+        .read = &profile_read
+    };
+
+    int i;
+
+    for (i = 0; i < NHART; i++) {
+        ioinit0(&profile_bufs[i].io, &profile_iointf);
+        register_device("profile", profile_open, &profile_bufs[i]);
+    }
+}
+
+void profile_timer(const struct trap_frame * tfr, int umode) {
+    const int hart = running_hart();
+    struct profile_buf * const pb = &profile_bufs[hart];
+    struct profile_sample * smp;
+    unsigned long long now;
+
+    if (!profile_running)
+        return;
+
+    now = rdtime();
+    if (now < profile_next[hart])
+        return;
+
+    profile_next[hart] = now + PROFILE_PERIOD;
+    timer_set_profile(profile_next[hart]);
+
+    if (pb->tail - pb->head == PROFILE_NSAMPLES) {
+        pb->dropped += 1;
+        return;
+    }
+
+    smp = &pb->samples[pb->tail % PROFILE_NSAMPLES];
+    smp->time = now;
+    smp->pc = (uintptr_t)tfr->sepc;
+    smp->tid = running_thread();
+    smp->umode = umode;
+    smp->depth = profile_backtrace(smp->stack, tfr, umode);
+    pb->tail += 1;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+int profile_open(struct io ** ioptr, void * aux) {
+    struct profile_buf * const pb = aux;
+    int pie;
+
+    pie = disable_interrupts();
+
+    // Samples run while any instance is open
+
+    if (iorefcnt(&pb->io) == 0) {
+        pb->head = pb->tail = 0;
+        pb->dropped = 0;
+
+        if (profile_running++ == 0) {
+            profile_next[running_hart()] = rdtime() + PROFILE_PERIOD;
+            timer_set_profile(profile_next[running_hart()]);
+        }
+    }
+
+    restore_interrupts(pie);
+
+    *ioptr = ioaddref(&pb->io);
+    return 0;
+}
+
+void profile_close(struct io * io) {
+    int pie;
+
+    pie = disable_interrupts();
+
+    if (--profile_running == 0)
+        timer_set_profile(UINT64_MAX);
+
+    restore_interrupts(pie);
+}
+
+long profile_read(struct io * io, void * buf, long bufsz) {
+    struct profile_buf * const pb =
+        (void*)io - offsetof(struct profile_buf, io);
+    struct profile_sample * dst = buf;
+    long cnt = 0;
+    int pie;
+
+    pie = disable_interrupts();
+
+    while (sizeof(struct profile_sample) <= bufsz && pb->head != pb->tail) {
+        memcpy(dst++, &pb->samples[pb->head++ % PROFILE_NSAMPLES],
+            sizeof(struct profile_sample));
+        bufsz -= sizeof(struct profile_sample);
+        cnt += sizeof(struct profile_sample);
+    }
+
+    restore_interrupts(pie);
+    return cnt;
+}
+
+// Follows the frame pointer chain. With -fno-omit-frame-pointer, fp points
+// just above the saved return address and the caller's fp. Frames lie between
+// the trap frame and the thread's stack anchor, each above the one before.
+
+unsigned int profile_backtrace(uint64_t * stack, const struct trap_frame * tfr, int umode) {
+    void * const top = get_stack_anchor();
+    void * const * fp = tfr->fp;
+    void * const * prev = (void * const *)tfr;
+    unsigned int depth = 0;
+
+    if (umode) {
+        stack[depth++] = (uintptr_t)tfr->ra;
+        return depth;
+    }
+
+    while (depth < PROFILE_DEPTH
+        && (void*)prev < (void*)fp && (void*)fp <= top
+        && ((uintptr_t)fp & (sizeof(void*) - 1)) == 0)
+    {
+        stack[depth++] = (uintptr_t)fp[-1];
+        prev = fp;
+        fp = fp[-2];
+    }
+
+    return depth;
+}
+
+#else
+
+void profile_init(void) {
+    // nothing
+}
+
+#endif // WITH_PROFILER
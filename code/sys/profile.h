@@ -0,0 +1,50 @@
+// profile.h - Sampling profiler
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdint.h>
+
+struct trap_frame; // extern decl.
+
+// Return addresses kept per sample, innermost first
+
+#define PROFILE_DEPTH 8
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// Reading the "profile" device returns whole samples in this layout. A kernel
+// backtrace follows the frame pointer chain on the thread's kernel stack; a
+// user sample records only the return address register, since user memory is
+// not safe to touch from an interrupt handler. Addresses are symbolized
+// against kernel.elf or the user executable, depending on _umode_.
+
+struct profile_sample {
+    uint64_t time;  // rdtime() when taken
+    uint64_t pc;    // sepc of the interrupted code
+    int32_t tid;    // running thread
+    uint8_t umode;  // 1 if interrupted in U mode
+    uint8_t depth;  // valid entries in stack[]
+    uint16_t reserved;
+    uint64_t stack[PROFILE_DEPTH];
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Registers one "profile" device instance per hart. Sampling runs while an
+// instance is open. Does nothing unless the kernel is built WITH_PROFILER.
+
+extern void profile_init(void);
+
+// Takes a sample if one is due. Called from the timer interrupt before
+// handle_timer_interrupt() with the interrupted context.
+
+extern void profile_timer(const struct trap_frame * tfr, int umode);
+
+#endif // _PROFILE_H_
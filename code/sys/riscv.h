@@ -123,6 +123,8 @@ static inline void csrc_sip(unsigned long mask) {
 #define RISCV_SSTATUS_SIE (1UL << 1)
 #define RISCV_SSTATUS_SPIE (1UL << 3)
 #define RISCV_SSTATUS_SPP (1UL << 8)
+#define RISCV_SSTATUS_VS (3UL << 9)
+#define RISCV_SSTATUS_VS_INITIAL (1UL << 9)
 #define RISCV_SSTATUS_SUM (1UL << 18)
 
 static inline unsigned long csrr_sstatus(void) {
@@ -187,6 +189,24 @@ static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
 
+// Makes instructions written as data visible to instruction fetch
+
+static inline void fence_i(void) {
+    asm inline ("fence.i" ::: "memory");
+}
+
+// Flushes the non-global translations of one address space
+
+static inline void sfence_vma_asid(unsigned long asid) {
+    asm inline ("sfence.vma zero, %0" :: "r" (asid) : "memory");
+}
+
+// Flushes the leaf translation of one page in one address space
+
+static inline void sfence_vma_page(unsigned long vma, unsigned long asid) {
+    asm inline ("sfence.vma %0, %1" :: "r" (vma), "r" (asid) : "memory");
+}
+
 static inline unsigned long long rdtime(void) {
 #if __riscv_xlen == 64
     unsigned long long time;
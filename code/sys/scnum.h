@@ -24,5 +24,22 @@
 #define SYSCALL_IOCTL 19 // issue ioctl on fd
 #define SYSCALL_PIPE 20  // create a pipe
 #define SYSCALL_IODUP 21 // duplicate an I/O
+#define SYSCALL_MMAP 22  // map a file into memory
+#define SYSCALL_MUNMAP 23 // remove a file mapping
+#define SYSCALL_SPAWN 24 // start an executable as a new process
+#define SYSCALL_SETPRIO 25 // pin or unpin a thread's priority
+#define SYSCALL_THREADSTAT 26 // get CPU accounting of a thread or process
+#define SYSCALL_FUTEX_WAIT 27 // sleep if a user word holds a value
+#define SYSCALL_FUTEX_WAKE 28 // wake threads sleeping on a user word
+#define SYSCALL_THREAD_CREATE 29 // start a thread in the calling process
+#define SYSCALL_THREAD_EXIT 30 // end the calling thread
+#define SYSCALL_THREAD_JOIN 31 // wait for a thread of the calling process
+#define SYSCALL_SPLICE 32 // copy between two descriptors inside the kernel
+#define SYSCALL_READV 33 // read into several buffers
+#define SYSCALL_WRITEV 34 // write from several buffers
+#define SYSCALL_POLL 35 // wait for one of several descriptors to be ready
+#define SYSCALL_RING_SETUP 36 // map submission and completion rings
+#define SYSCALL_RING_ENTER 37 // kick the rings and wait for completions
+#define SYSCALL_SCSTAT 38 // get the call count and time of a system call
 
 #endif // _SCNUM_H_
\ No newline at end of file
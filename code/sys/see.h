@@ -13,4 +13,15 @@ extern void halt_success(void) __attribute__ ((noreturn));
 extern void halt_failure(void) __attribute__ ((noreturn)) ;
 extern void set_stcmp(uint64_t stcmp_value);
 
+// Starts parked hart _hartid_ in S mode at _start_, with the hart ID in a0
+// and _opaque_ in a1. Returns 0 or a negative value if there is no such hart.
+
+extern int hart_start(unsigned long hartid, void * start, unsigned long opaque);
+
+// Raises an S mode software interrupt on hart _hartid_. The receiving hart
+// must call ack_ipi() before it can take another.
+
+extern int send_ipi(unsigned long hartid);
+extern void ack_ipi(void);
+
 #endif // _SEE_H_
\ No newline at end of file
@@ -6,14 +6,17 @@
 
 # The code below implements M mode services:
 # 
-# 1. HALT, using virt test device, and
-# 2. TIME, using mtime and mtimecmp MMIO registers.
+# 1. HALT, using virt test device,
+# 2. TIME, using mtime and mtimecmp MMIO registers, and
+# 3. HSM, starting secondary harts and sending IPIs using msip registers.
 # 
-# To support (2), we need to handle timer interrupts in M mode.
+# To support (2), we need to handle timer interrupts in M mode. To support (3),
+# we handle software interrupts in M mode and pass them on to S mode.
 #
 
         .equ    VTEST_ADDR, 0x100000
-        .equ    MTCMP_ADDR, 0x2004000
+        .equ    MSIP_ADDR, 0x2000000  # hart i at MSIP_ADDR+4*i
+        .equ    MTCMP_ADDR, 0x2004000 # hart i at MTCMP_ADDR+8*i
         .equ    MTIME_ADDR, 0x200BFF8
 
         .equ    HALT_EID, 0x0A484c54
@@ -23,6 +26,13 @@
         .equ    TIME_EID, 0x54494D45
         .equ    SET_STCMP_FID, 0
 
+        .equ    HSM_EID, 0x48534D
+        .equ    HART_START_FID, 0
+        .equ    SEND_IPI_FID, 1
+        .equ    ACK_IPI_FID, 2
+
+        .equ    MAX_HARTS, 8 # harts beyond this stay parked
+
         .text
     	.global halt_success
     	.type   halt_success, @function
@@ -51,6 +61,75 @@ set_stcmp:
         ecall
         ret
 
+    	.global hart_start
+    	.type   hart_start, @function
+
+hart_start:
+        li      a7, HSM_EID
+        li      a6, HART_START_FID
+        ecall
+        ret
+
+    	.global send_ipi
+    	.type   send_ipi, @function
+
+send_ipi:
+        li      a7, HSM_EID
+        li      a6, SEND_IPI_FID
+        ecall
+        ret
+
+    	.global ack_ipi
+    	.type   ack_ipi, @function
+
+ack_ipi:
+        li      a7, HSM_EID
+        li      a6, ACK_IPI_FID
+        ecall
+        ret
+
+        # Secondary harts come here from start.s with M mode set up. They
+        # wait for hart_start() to fill in their hart_start_tab entry, then
+        # enter S mode at the given address with a0 = hartid, a1 = opaque.
+
+    	.global _mmode_park
+    	.type   _mmode_park, @function
+
+_mmode_park:
+        csrr    a0, mhartid
+        li      t0, MAX_HARTS
+        bgeu    a0, t0, 3f
+        la      t1, hart_start_tab
+        slli    t0, a0, 4
+        add     t1, t1, t0
+
+        li      t2, MSIP_ADDR
+        slli    t0, a0, 2
+        add     t2, t2, t0      # our msip
+
+        # Clear msip before looking, so a wake-up with nothing to do does not
+        # leave it pending and keep wfi from waiting
+
+1:      wfi
+        sw      zero, (t2)
+        fence
+        ld      t0, 0(t1)
+        beqz    t0, 1b
+
+        # Go to S mode like hart 0 does in start.s
+
+        fence   r, r
+        ld      a1, 8(t1)
+        csrw    mepc, t0
+        li      t0, 0x1002 # bits to clear in mstatus (MPP=0b01,SIE=0)
+        li      t1, 0x0880 # bits to set in mstatus (MPP=0b01,MPIE=1)
+        csrc    mstatus, t0
+        csrs    mstatus, t1
+        mret
+
+3:      wfi
+        j       3b
+
         .global _mmode_trap_entry
     	.type   _mmode_trap_entry, @function
 
@@ -68,11 +147,14 @@ _mmode_trap_entry:
 
 mmode_intr_handler:
 
-	# The only interrupt we handle in M mode is the timer interrupt, to
-	# provide a virtualized timer to S mode.
+	# We handle the timer interrupt, to provide a virtualized timer to S
+	# mode, and the software interrupt, which is passed on as an S mode
+	# software interrupt.
 
 	slli	t0, t0, 1
-	addi	t0, t0, -7 << 1
+	addi	t0, t0, -3 << 1
+	beqz	t0, mmode_soft_intr
+	addi	t0, t0, -4 << 1
 	bnez	t0, unexp_mmode_interrupt
 
         # Set STIP, clear MTIE
@@ -82,7 +164,21 @@ mmode_intr_handler:
         slli    t0, t0, 2       # MTIE
         csrc    mie, t0
         
-        # Restore state and return
+        # Restore state and return
+
+	csrr    t0, mscratch
+        mret
+
+mmode_soft_intr:
+
+        # Set SSIP, clear MSIE. There is no spare register to clear msip here,
+        # so S mode acknowledges with ack_ipi, which clears msip and sets
+        # MSIE again (like set_stcmp re-enables MTIE).
+
+        li      t0, 0x2         # SSIP
+        csrs    mip, t0
+        slli    t0, t0, 2       # MSIE
+        csrc    mie, t0
 
 	csrr    t0, mscratch
         mret
@@ -118,7 +214,10 @@ handle_ecall_from_smode:
         # can use a0 and a1 as temporary registers. Just need to zero a0 before
         # returning to indicate success.
 
+        csrr    a1, mhartid
+        slli    a1, a1, 3
         li      t0, MTCMP_ADDR
+        add     t0, t0, a1
         sd      a0, (t0)
 
         # Depending on the value written to mtcmp, the timer interrupt may
@@ -165,7 +264,67 @@ unexp_mmode_exception:
         li      t1, 0x5555
         sw      t1, (t0)
 
-1:      # Add additional M mode service handlers here
+        # HSM service has three functions:
+        #
+        # int hart_start(unsigned long hartid, void * start, unsigned long opaque)
+        # int send_ipi(unsigned long hartid)
+        # void ack_ipi(void)
+        #
+        # Only t0 (saved in mscratch), a0 and a1 may be clobbered.
+
+1:      li      t0, HSM_EID
+        bne     a7, t0, 1f
+        li      t0, ACK_IPI_FID
+        beq     a6, t0, 4f
+        li      t0, MAX_HARTS
+        bgeu    a0, t0, invalid_param
+        li      t0, SEND_IPI_FID
+        beq     a6, t0, 2f
+        bnez    a6, unsupported_function
+
+        # hart_start: fill in hart_start_tab[hartid], pc last, then wake it
+
+        csrr    t0, mhartid
+        beq     a0, t0, invalid_param
+        la      t0, hart_start_tab
+        slli    a0, a0, 4
+        add     t0, t0, a0
+        srli    a0, a0, 4
+        sd      a2, 8(t0)
+        fence   w, w
+        sd      a1, 0(t0)
+        fence
+
+2:      # send_ipi: set msip of hartid
+
+        li      t0, MSIP_ADDR
+        slli    a0, a0, 2
+        add     t0, t0, a0
+        li      a0, 1
+        sw      a0, (t0)
+        li      a0, 0
+        csrr    t0, mscratch
+        mret
+
+4:      # ack_ipi: clear our msip and enable MSIE again
+
+        csrr    a0, mhartid
+        slli    a0, a0, 2
+        li      t0, MSIP_ADDR
+        add     t0, t0, a0
+        sw      zero, (t0)
+        li      t0, 0x8 # MSIE
+        csrs    mie, t0
+        li      a0, 0
+        csrr    t0, mscratch
+        mret
+
+invalid_param:
+        li      a0, -3
+        csrr    t0, mscratch
+        mret
+
+1:      # Add additional M mode service handlers here
 
         # Fall though: handle request for unsupported function
 
@@ -174,4 +333,13 @@ unsupported_function:
         csrr    t0, mscratch
         mret
 
+        # Start address and opaque argument of each secondary hart, set by
+        # hart_start()
+
+        .section        .data, "wa", @progbits
+        .balign         16
+
+hart_start_tab:
+        .fill   2*MAX_HARTS, 8, 0
+
         .end
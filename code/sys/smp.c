@@ -0,0 +1,180 @@
+// smp.c - Secondary harts, the big kernel lock and TLB shootdown
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef SMP_TRACE
+#define TRACE
+#endif
+
+#ifdef SMP_DEBUG
+#define DEBUG
+#endif
+
+#include "smp.h"
+#include "thread.h"
+#include "memory.h"
+#include "intr.h"
+#include "riscv.h"
+#include "see.h"
+#include "console.h"
+#include "assert.h"
+#include "conf.h"
+
+#include <stdint.h>
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Called from start.s on a secondary hart, on the stack of its idle thread and
+// with tp pointing to it.
+
+extern void smp_secondary_main(unsigned long hartid);
+
+// IMPORTED FUNCTION DECLARATIONS
+//
+
+extern void _smode_secondary_start(void); // start.s
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static int bkl_owner = 0; // hart holding the big kernel lock, or -1
+
+// Bit n is set once hart n runs the kernel. Only harts in the mask can hold
+// translations that a shootdown has to reach.
+
+static unsigned long online_mask = 1;
+
+// Set by the hart doing a shootdown, cleared by the target once it has run
+// sfence.vma
+
+static int tlb_pending[NHART];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void tlb_service(int hart);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void smp_init(void)
+{
+    void *anchor;
+    int hart;
+
+    trace("%s()", __func__);
+
+    for (hart = 1; hart < NHART; hart++)
+    {
+        anchor = create_idle_thread(hart);
+        if (anchor == NULL)
+        {
+            kprintf("smp: no idle thread for hart %d\n", hart);
+            break;
+        }
+
+        // A hart QEMU does not have never comes online and never gets work
+
+        if (hart_start(hart, (void *)&_smode_secondary_start, (uintptr_t)anchor) != 0)
+        {
+            kprintf("smp: cannot start hart %d\n", hart);
+            break;
+        }
+    }
+}
+
+void smp_kernel_enter(void)
+{
+    const int hart = running_hart();
+    int expected;
+
+    for (;;)
+    {
+        expected = -1;
+        if (__atomic_compare_exchange_n(&bkl_owner, &expected, hart, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return;
+        }
+
+        // The holder may be waiting on us in smp_tlb_shootdown()
+
+        tlb_service(hart);
+    }
+}
+
+void smp_kernel_exit(void)
+{
+    assert(bkl_owner == running_hart());
+    __atomic_store_n(&bkl_owner, -1, __ATOMIC_RELEASE);
+}
+
+void smp_tlb_shootdown(void)
+{
+    const int self = running_hart();
+    unsigned long targets;
+    int hart;
+
+    targets = online_mask & ~(1UL << self);
+
+    if (targets == 0)
+    {
+        return;
+    }
+
+    // Targets in U mode take the interrupt and answer while waiting for the
+    // lock we hold; idle targets wake from wfi and do the same.
+
+    for (hart = 0; hart < NHART; hart++)
+    {
+        if (targets & (1UL << hart))
+        {
+            __atomic_store_n(&tlb_pending[hart], 1, __ATOMIC_RELEASE);
+            send_ipi(hart);
+        }
+    }
+
+    for (hart = 0; hart < NHART; hart++)
+    {
+        while (__atomic_load_n(&tlb_pending[hart], __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+    }
+}
+
+void smp_handle_ipi(void)
+{
+    csrc_sip(RV32_SIP_SSIP);
+    ack_ipi();
+    tlb_service(running_hart());
+}
+
+void smp_secondary_main(unsigned long hartid)
+{
+    assert(hartid == running_hart());
+
+    smp_kernel_enter();
+    memory_init_hart();
+    intr_init_hart();
+    online_mask |= 1UL << hartid;
+    debug("hart %lu online", hartid);
+
+    enable_interrupts();
+    thread_idle();
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void tlb_service(int hart)
+{
+    if (__atomic_load_n(&tlb_pending[hart], __ATOMIC_ACQUIRE))
+    {
+        sfence_vma();
+        __atomic_store_n(&tlb_pending[hart], 0, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,38 @@
+// smp.h - Secondary harts, the big kernel lock and TLB shootdown
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _SMP_H_
+#define _SMP_H_
+
+// Kernel code runs on one hart at a time, under the big kernel lock. A hart
+// takes it when it traps in from U mode and drops it on the way back, so the
+// interrupt-disable critical sections used throughout the kernel still
+// exclude every other hart. The idle thread drops it while it waits in wfi.
+// Hart 0 boots holding it.
+
+// Starts harts 1 to NHART-1, each on an idle thread of its own. Called once
+// by the main thread after the thread, memory and interrupt managers are up.
+
+extern void smp_init(void);
+
+// Take and drop the big kernel lock on the running hart, with interrupts
+// disabled. Called from trap.s and the idle thread.
+
+extern void smp_kernel_enter(void);
+extern void smp_kernel_exit(void);
+
+// Makes every other running hart drop its cached address translations, and
+// returns once they have. Called after page table entries are changed or
+// removed.
+
+extern void smp_tlb_shootdown(void);
+
+// Handles a software interrupt, which another hart sends for a shootdown or
+// to wake this hart from wfi when there is work to pick up.
+
+extern void smp_handle_ipi(void);
+
+#endif // _SMP_H_
@@ -7,7 +7,9 @@
 # Imported symbols
 
         .global _mmode_trap_entry # defined in see.s
-        .global _smode_trap_entry # defined in trap.s
+        .global _smode_trap_entry # defined in trap.s
+        .global _mmode_park # defined in see.s
+        .global smp_secondary_main # defined in smp.c
 
 # QEMU RISC-V virt system zero-stage bootloader jumps to 0x8000'0000 to start
 # kernel. The linker script kernel.ld arranges for start.s to be placed here.
@@ -56,10 +58,22 @@ mmode_start:
         la      t0, _mmode_trap_entry
         csrw    mtvec, t0
 
-        # Enable access to cycle, time, and instret counters in S mode
+        # Enable access to cycle, time, and instret counters in S mode
 
         csrs    mcounteren, 7
 
+        # Enable M mode software interrupts, used to deliver IPIs and to
+        # start secondary harts (see.s)
+
+        li      t0, 0x8 # MSIE
+        csrs    mie, t0
+
+        # All harts start here. Only hart 0 boots the kernel; the others wait
+        # in M mode until started with hart_start().
+
+        csrr    t0, mhartid
+        bnez    t0, _mmode_park
+
         # Switch to S mode with M mode interrupts now enabled
 
         li      t0, 0x1002 # bits to clear in mstatus (MPP=0b01,SIE=0)
@@ -93,6 +107,27 @@ smode_start:
         la      ra, halt_failure # see.s
         j       main
 
+        # Secondary harts enter S mode here when started by smp_init(), with
+        # a0 = hart ID and a1 = the stack anchor of the hart's idle thread. The
+        # first word of the anchor points to the thread itself.
+
+        .global _smode_secondary_start
+        .type   _smode_secondary_start, @function
+        .balign 4
+
+_smode_secondary_start:
+
+        la      t0, _smode_trap_entry
+        csrw    stvec, t0
+        csrs    scounteren, 7
+        csrw    sscratch, zero
+
+        mv      fp, zero
+        mv      sp, a1
+        ld      tp, 0(a1) # ktp
+        la      ra, halt_failure # see.s
+        j       smp_secondary_main
+
         .section        .data.stack, "wa", @progbits
         .balign		16
         
@@ -9,6 +9,40 @@
 #include <stdint.h>
 #include <limits.h>
 
+// Bulk operations move a uint64_t at a time once the pointers are aligned.
+// ONES and HIGHS are used to test a word for a zero byte.
+
+#define WORDSZ sizeof(uint64_t)
+#define WORD_ALIGNED(p) (((uintptr_t)(p) & (WORDSZ - 1)) == 0)
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+// With STRING_RVV (make RVV=1), memcpy() and memset() of at least
+// STRING_RVV_MIN bytes use the vector unit if string_init() found one. Only
+// this file is built with the vector extension, so nothing else touches the
+// vector registers. Each strip runs with interrupts disabled because an ISR
+// may also call memcpy(), and user addresses are left to the scalar path
+// because a page fault would lose vl and vtype.
+
+#ifdef STRING_RVV
+
+#include "riscv.h"
+#include "intr.h"
+#include "conf.h"
+
+#ifndef STRING_RVV_MIN
+#define STRING_RVV_MIN 256
+#endif
+
+static char string_rvv = 0;
+
+static int rvv_usable(const void * a, const void * b);
+static void rvv_memcpy(void * dst, const void * src, size_t n);
+static void rvv_memset(void * s, int c, size_t n);
+
+#endif
+
 // INTERNAL STRUCTURE DEFINITIONS
 // 
 
@@ -37,6 +71,15 @@ size_t format_char (
 // EXPORTED FUNCTION DEFINITIONS
 // 
 
+void string_init(void) {
+#ifdef STRING_RVV
+    // sstatus.VS is read-only zero on a hart without the vector extension
+
+    csrs_sstatus(RISCV_SSTATUS_VS_INITIAL);
+    string_rvv = ((csrr_sstatus() & RISCV_SSTATUS_VS) != 0);
+#endif
+}
+
 int strcmp(const char * s1, const char * s2) {
     // A null pointer compares before any non-null pointer
 
@@ -47,6 +90,24 @@ int strcmp(const char * s1, const char * s2) {
             return 1;
     }
 
+    // Skip whole words while both strings are aligned and the words match and
+    // hold no '\0'. An aligned word never crosses a page, so reading past the
+    // terminator is harmless.
+
+    while (!WORD_ALIGNED(s1) && *s1 == *s2 && *s1 != '\0') {
+        s1 += 1;
+        s2 += 1;
+    }
+
+    if (WORD_ALIGNED(s1) && WORD_ALIGNED(s2)) {
+        while (*(const uint64_t *)s1 == *(const uint64_t *)s2 &&
+               !HASZERO(*(const uint64_t *)s1))
+        {
+            s1 += WORDSZ;
+            s2 += WORDSZ;
+        }
+    }
+
     // Find first non-matching character (or '\0')
 
     while (*s1 == *s2 && *s1 != '\0') {
@@ -126,25 +187,84 @@ char * strrchr(const char * s, int c) {
 }
 
 void * memset(void * s, int c, size_t n) {
-  char * p = s;
+    const uint64_t w = ONES * (uint8_t)c;
+    char * p = s;
 
-  while (n != 0) {
-    *p++ = c;
-    n -= 1;
-  }
+#ifdef STRING_RVV
+    if (string_rvv && STRING_RVV_MIN <= n && rvv_usable(s, s)) {
+        rvv_memset(s, c, n);
+        return s;
+    }
+#endif
+
+    while (n != 0 && !WORD_ALIGNED(p)) {
+        *p++ = c;
+        n -= 1;
+    }
+
+    while (WORDSZ * 4 <= n) {
+        ((uint64_t *)p)[0] = w;
+        ((uint64_t *)p)[1] = w;
+        ((uint64_t *)p)[2] = w;
+        ((uint64_t *)p)[3] = w;
+        p += WORDSZ * 4;
+        n -= WORDSZ * 4;
+    }
+
+    while (WORDSZ <= n) {
+        *(uint64_t *)p = w;
+        p += WORDSZ;
+        n -= WORDSZ;
+    }
+
+    while (n != 0) {
+        *p++ = c;
+        n -= 1;
+    }
 
-  return s;
+    return s;
 }
 
+// Buffers whose addresses differ in their low bits cannot both be aligned,
+// and misaligned word accesses trap, so those are copied a byte at a time.
+
 void * memcpy(void * restrict dst, const void * restrict src, size_t n) {
     const char * q = src;
-    char *p = dst;
+    char * p = dst;
+
+#ifdef STRING_RVV
+    if (string_rvv && STRING_RVV_MIN <= n && rvv_usable(dst, src)) {
+        rvv_memcpy(dst, src, n);
+        return dst;
+    }
+#endif
+
+    if (((uintptr_t)p ^ (uintptr_t)q) % WORDSZ == 0) {
+        while (n != 0 && !WORD_ALIGNED(p)) {
+            *p++ = *q++;
+            n -= 1;
+        }
+
+        while (WORDSZ * 4 <= n) {
+            ((uint64_t *)p)[0] = ((const uint64_t *)q)[0];
+            ((uint64_t *)p)[1] = ((const uint64_t *)q)[1];
+            ((uint64_t *)p)[2] = ((const uint64_t *)q)[2];
+            ((uint64_t *)p)[3] = ((const uint64_t *)q)[3];
+            p += WORDSZ * 4;
+            q += WORDSZ * 4;
+            n -= WORDSZ * 4;
+        }
+
+        while (WORDSZ <= n) {
+            *(uint64_t *)p = *(const uint64_t *)q;
+            p += WORDSZ;
+            q += WORDSZ;
+            n -= WORDSZ;
+        }
+    }
+
     while (n != 0) {
-        // kprintf("buf_address_dst: %p\n", p);
-        // kprintf("buf_address_src: %p\n", q);
-        *p = *q; // WHY IS IT BREAKING??
-        p += 1;
-        q += 1;
+        *p++ = *q++;
         n -= 1;
     }
 
@@ -155,6 +275,24 @@ int memcmp(const void * p1, const void * p2, size_t n) {
     const uint8_t * u = p1;
     const uint8_t * v = p2;
 
+    // Skip equal words, then find the differing byte
+
+    if (((uintptr_t)u ^ (uintptr_t)v) % WORDSZ == 0) {
+        while (n != 0 && !WORD_ALIGNED(u) && *u == *v) {
+            u += 1;
+            v += 1;
+            n -= 1;
+        }
+
+        if (WORD_ALIGNED(u)) {
+            while (WORDSZ <= n && *(const uint64_t *)u == *(const uint64_t *)v) {
+                u += WORDSZ;
+                v += WORDSZ;
+                n -= WORDSZ;
+            }
+        }
+    }
+
     while (n != 0) {
         if (*u != *v)
             return (*u - *v);
@@ -369,6 +507,56 @@ size_t vgprintf (
 // INTERNAL FUNCTION DEFINITIONS
 // 
 
+#ifdef STRING_RVV
+
+int rvv_usable(const void * a, const void * b) {
+    return ((uintptr_t)a < UMEM_START_VMA || UMEM_END_VMA <= (uintptr_t)a)
+        && ((uintptr_t)b < UMEM_START_VMA || UMEM_END_VMA <= (uintptr_t)b);
+}
+
+void rvv_memcpy(void * dst, const void * src, size_t n) {
+    size_t vl;
+    int pie;
+
+    while (n != 0) {
+        pie = disable_interrupts();
+        asm volatile (
+        "vsetvli %0, %3, e8, m8, ta, ma" "\n\t"
+        "vle8.v v0, (%2)" "\n\t"
+        "vse8.v v0, (%1)"
+        :   "=&r" (vl)
+        :   "r" (dst), "r" (src), "r" (n)
+        :   "memory", "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7");
+        restore_interrupts(pie);
+
+        dst += vl;
+        src += vl;
+        n -= vl;
+    }
+}
+
+void rvv_memset(void * s, int c, size_t n) {
+    size_t vl;
+    int pie;
+
+    while (n != 0) {
+        pie = disable_interrupts();
+        asm volatile (
+        "vsetvli %0, %2, e8, m8, ta, ma" "\n\t"
+        "vmv.v.x v0, %3" "\n\t"
+        "vse8.v v0, (%1)"
+        :   "=&r" (vl)
+        :   "r" (s), "r" (n), "r" (c)
+        :   "memory", "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7");
+        restore_interrupts(pie);
+
+        s += vl;
+        n -= vl;
+    }
+}
+
+#endif
+
 void vsnprintf_putc(char c, void * aux) {
     struct vsnprintf_state * state = aux;
 
@@ -10,6 +10,11 @@
 #include <stddef.h>
 #include <stdarg.h>
 
+// Picks the fastest memcpy() and memset() the hart supports. Called once at
+// boot, before anything else.
+
+extern void string_init(void);
+
 extern size_t strlen(const char * s);
 extern int strcmp(const char * s1, const char * s2);
 extern int strncmp(const char * s1, const char * s2, size_t n);
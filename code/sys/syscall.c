@@ -26,7 +26,10 @@
 #include "thread.h"
 #include "process.h"
 #include "ktfs.h"
+#include "futex.h"
+#include "ioring.h"
 #include "dev/fbuf.h"
+#include "tracepoint.h"
 // #define ENULLIO 239
 
 // EXPORTED FUNCTION DECLARATIONS
@@ -34,6 +37,43 @@
 
 extern void handle_syscall(struct trap_frame *tfr); // called from excp.c
 
+// COMPILE-TIME PARAMETERS
+//
+
+// Longest device or file name, plus terminator, a system call copies in
+
+#ifndef SYSCALL_NAME_MAX
+#define SYSCALL_NAME_MAX 64
+#endif
+
+// Longest message sysprint() prints; longer ones are cut short
+
+#ifndef SYSCALL_PRINT_MAX
+#define SYSCALL_PRINT_MAX 256
+#endif
+
+// System call numbers below this are counted if SYSCALL_STATS is defined
+
+#define SYSCALL_STATS_CNT 64
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Layout shared with user programs (usr/syscall.h)
+
+struct pollfd
+{
+    int fd; // ignored if negative
+    short events;
+    short revents;
+};
+
+struct syscall_stat
+{
+    unsigned long long count; // calls made
+    unsigned long long time;  // timer ticks from trap to return, blocking included
+};
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -55,16 +95,57 @@ static long syswrite(int fd, const void *buf, size_t len);
 static int sysioctl(int fd, int cmd, void *arg);
 static int syspipe(int *wfdptr, int *rfdptr);
 static int sysiodup(int oldfd, int newfd);
+static long sysmmap(int fd, void *addr, size_t len, unsigned long long pos, int flags);
+static int sysmunmap(void *addr);
+static int sysspawn(int fd, int argc, char **argv, const int *fdtab, int fdcnt);
+static int syssetprio(int tid, int prio);
+static int systhreadstat(int tid, struct thread_stat *st);
+static int sysfutexwait(uint32_t *uaddr, uint32_t val);
+static int sysfutexwake(uint32_t *uaddr, int cnt);
+static int systhreadcreate(const struct trap_frame *tfr, uintptr_t entry, uintptr_t arg);
+static int systhreadexit(void);
+static int systhreadjoin(int tid);
+static long syssplice(int outfd, int infd, long len);
+static long sysreadv(int fd, const struct iovec *iov, int cnt);
+static long syswritev(int fd, const struct iovec *iov, int cnt);
+static int syspoll(struct pollfd *fds, int cnt, long timeout_ms);
+static long sysringsetup(void);
+static int sysringenter(unsigned int min_complete);
+static int sysscstat(int num, struct syscall_stat *st);
 
 static int sysfscreate(const char *name);
 static int sysfsdelete(const char *name);
+
+static int copy_name(char *kname, const char *uname);
+static int check_fd(int fd);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+#ifdef SYSCALL_STATS
+static struct syscall_stat syscall_stats[SYSCALL_STATS_CNT];
+#endif
 // EXPORTED FUNCTION DEFINITIONS
 //
 
 void handle_syscall(struct trap_frame *tfr)
 {
+    const unsigned long num = tfr->a7;
+#ifdef SYSCALL_STATS
+    const unsigned long long tstart = rdtime();
+#endif
+
     tfr->sepc += 4;
     tfr->a0 = syscall(tfr);
+    tracepoint(TRACEPOINT_SYSCALL, TRACEPOINT_SYSCALL_EXIT, num, tfr->a0);
+
+#ifdef SYSCALL_STATS
+    if (num < SYSCALL_STATS_CNT)
+    {
+        syscall_stats[num].count += 1;
+        syscall_stats[num].time += rdtime() - tstart;
+    }
+#endif
 }
 
 // INTERNAL FUNCTION DEFINITIONS
@@ -122,6 +203,59 @@ int64_t syscall(const struct trap_frame *tfr)
     case SYSCALL_IODUP:
         return sysiodup((int)tfr->a0, (int)tfr->a1);
         break;
+    case SYSCALL_MMAP:
+        return sysmmap((int)tfr->a0, (void *)tfr->a1, (size_t)tfr->a2,
+                       (unsigned long long)tfr->a3, (int)tfr->a4);
+        break;
+    case SYSCALL_MUNMAP:
+        return sysmunmap((void *)tfr->a0);
+        break;
+    case SYSCALL_SPAWN:
+        return sysspawn((int)tfr->a0, (int)tfr->a1, (char **)tfr->a2,
+                        (const int *)tfr->a3, (int)tfr->a4);
+        break;
+    case SYSCALL_SETPRIO:
+        return syssetprio((int)tfr->a0, (int)tfr->a1);
+        break;
+    case SYSCALL_THREADSTAT:
+        return systhreadstat((int)tfr->a0, (struct thread_stat *)tfr->a1);
+        break;
+    case SYSCALL_FUTEX_WAIT:
+        return sysfutexwait((uint32_t *)tfr->a0, (uint32_t)tfr->a1);
+        break;
+    case SYSCALL_FUTEX_WAKE:
+        return sysfutexwake((uint32_t *)tfr->a0, (int)tfr->a1);
+        break;
+    case SYSCALL_THREAD_CREATE:
+        return systhreadcreate(tfr, (uintptr_t)tfr->a0, (uintptr_t)tfr->a1);
+        break;
+    case SYSCALL_THREAD_EXIT:
+        return systhreadexit();
+        break;
+    case SYSCALL_THREAD_JOIN:
+        return systhreadjoin((int)tfr->a0);
+        break;
+    case SYSCALL_SPLICE:
+        return syssplice((int)tfr->a0, (int)tfr->a1, (long)tfr->a2);
+        break;
+    case SYSCALL_READV:
+        return sysreadv((int)tfr->a0, (const struct iovec *)tfr->a1, (int)tfr->a2);
+        break;
+    case SYSCALL_WRITEV:
+        return syswritev((int)tfr->a0, (const struct iovec *)tfr->a1, (int)tfr->a2);
+        break;
+    case SYSCALL_POLL:
+        return syspoll((struct pollfd *)tfr->a0, (int)tfr->a1, (long)tfr->a2);
+        break;
+    case SYSCALL_RING_SETUP:
+        return sysringsetup();
+        break;
+    case SYSCALL_RING_ENTER:
+        return sysringenter((unsigned int)tfr->a0);
+        break;
+    case SYSCALL_SCSTAT:
+        return sysscstat((int)tfr->a0, (struct syscall_stat *)tfr->a1);
+        break;
     default:
         break;
     }
@@ -136,16 +270,15 @@ int sysexit(void)
 int sysexec(int fd, int argc, char **argv)
 {
     // kprintf("Exec #\n");
-    if (fd < 0 || fd > PROCESS_IOMAX)
+    int result;
+
+    if (fd < 0 || fd >= PROCESS_IOMAX || current_process()->iotab[fd] == NULL)
     {
         return -EBADFD;
     }
-    if (current_process()->iotab[fd] != NULL)
-    {
-        process_exec(current_process()->iotab[fd], argc, argv);
-        sysclose(fd);
-    }
-    return 0;
+    result = process_exec_user(current_process()->iotab[fd], argc, argv);
+    sysclose(fd);
+    return result;
 }
 
 int sysfork(const struct trap_frame *tfr)
@@ -174,6 +307,15 @@ int syswait(int tid)
 // 0 on sucess else error from validate_vstr
 int sysprint(const char *msg)
 {
+    char kmsg[SYSCALL_PRINT_MAX];
+    long len = strncpy_from_user(kmsg, msg, sizeof(kmsg));
+
+    if (len < 0)
+    {
+        return len;
+    }
+    kmsg[sizeof(kmsg) - 1] = '\0';
+    msg = kmsg;
     kprintf("Thread <%s:%d> says: %s\n", thread_name(running_thread()), running_thread(), msg);
     return 0;
 }
@@ -226,6 +368,14 @@ int sysusleep(unsigned long us)
 
 int sysdevopen(int fd, const char *name, int instno)
 {
+    char kname[SYSCALL_NAME_MAX];
+    int result = copy_name(kname, name);
+
+    if (result < 0)
+    {
+        return result;
+    }
+    name = kname;
     if (fd >= 0)
     {
         if (fd < PROCESS_IOMAX && current_process()->iotab[fd] == NULL)
@@ -264,6 +414,14 @@ int sysdevopen(int fd, const char *name, int instno)
 
 int sysfsopen(int fd, const char *name)
 {
+    char kname[SYSCALL_NAME_MAX];
+    int result = copy_name(kname, name);
+
+    if (result < 0)
+    {
+        return result;
+    }
+    name = kname;
     // kprintf("\nName: %s and FD: %d", name, fd);
     if (fd >= 0)
     {
@@ -325,6 +483,14 @@ int sysclose(int fd)
 
 long sysread(int fd, void *buf, size_t bufsz)
 {
+    if (check_fd(fd) != 0)
+    {
+        return -EBADFD;
+    }
+    if (validate_user_range(buf, bufsz) != 0)
+    {
+        return -EINVAL;
+    }
     if (fd >= 0)
     {
         long ret = ioread(current_process()->iotab[fd], buf, bufsz);
@@ -340,6 +506,14 @@ long sysread(int fd, void *buf, size_t bufsz)
 
 long syswrite(int fd, const void *buf, size_t len)
 {
+    if (check_fd(fd) != 0)
+    {
+        return -EBADFD;
+    }
+    if (validate_user_range(buf, len) != 0)
+    {
+        return -EINVAL;
+    }
     if (fd >= 0)
     {
         // kprintf("ERROR FD: %d\n", fd);
@@ -357,15 +531,21 @@ long syswrite(int fd, const void *buf, size_t len)
 
 int sysioctl(int fd, int cmd, void *arg)
 {
-    if (fd >= 0)
+    if (check_fd(fd) != 0)
     {
-        return ioctl(current_process()->iotab[fd], cmd, arg);
+        return -EBADFD;
     }
-    return -EBADFD;
+
+    return ioctl_user(current_process()->iotab[fd], cmd, arg);
 }
 
 int syspipe(int *wfdptr, int *rfdptr)
 {
+    if (validate_user_range(wfdptr, sizeof(int)) != 0 ||
+        validate_user_range(rfdptr, sizeof(int)) != 0)
+    {
+        return -EINVAL;
+    }
 
     if (*wfdptr >= 0 && *rfdptr >= 0)
     {
@@ -424,10 +604,305 @@ int syspipe(int *wfdptr, int *rfdptr)
 
 int sysfscreate(const char *name)
 {
+    char kname[SYSCALL_NAME_MAX];
+    int result = copy_name(kname, name);
+
+    if (result < 0)
+    {
+        return result;
+    }
+    name = kname;
     return fscreate(name);
 }
 
 int sysfsdelete(const char *name)
 {
+    char kname[SYSCALL_NAME_MAX];
+    int result = copy_name(kname, name);
+
+    if (result < 0)
+    {
+        return result;
+    }
+    name = kname;
     return fsdelete(name);
 }
+
+// Maps _len_ bytes of the file open on _fd_, starting at _pos_, at _addr_ (or
+// wherever the kernel chooses if _addr_ is NULL). Returns the address of the
+// mapping or a negative error code.
+
+long sysmmap(int fd, void *addr, size_t len, unsigned long long pos, int flags)
+{
+    if (fd < 0 || fd >= PROCESS_IOMAX || current_process()->iotab[fd] == NULL)
+    {
+        return -EBADFD;
+    }
+    if ((flags & ~MMAP_WRITE) != 0)
+    {
+        return -EINVAL;
+    }
+    return process_mmap(current_process()->iotab[fd], (uintptr_t)addr, len, pos, len, flags);
+}
+
+int sysmunmap(void *addr)
+{
+    return process_munmap((uintptr_t)addr);
+}
+
+// Starts the executable open on _fd_ as a new process. See process_spawn()
+// for _fdtab_. Returns the thread id of the child, which can be waited for.
+
+int sysspawn(int fd, int argc, char **argv, const int *fdtab, int fdcnt)
+{
+    int kfdtab[PROCESS_IOMAX];
+    int i;
+
+    if (fd < 0 || fd >= PROCESS_IOMAX || current_process()->iotab[fd] == NULL)
+    {
+        return -EBADFD;
+    }
+    if (fdtab == NULL)
+    {
+        return process_spawn(current_process()->iotab[fd], argc, argv, NULL, 0);
+    }
+
+    // The table is read once into kernel memory and checked there
+
+    if (fdcnt < 0 || fdcnt > PROCESS_IOMAX || copy_from_user(kfdtab, fdtab, fdcnt * sizeof(int)) != 0)
+    {
+        return -EINVAL;
+    }
+    for (i = 0; i < fdcnt; i++)
+    {
+        if (kfdtab[i] >= PROCESS_IOMAX)
+        {
+            return -EBADFD;
+        }
+    }
+    return process_spawn(current_process()->iotab[fd], argc, argv, kfdtab, fdcnt);
+}
+
+// Pins thread _tid_ of the calling process (0 for the calling thread) at
+// priority _prio_, or unpins it if _prio_ is negative. Returns the previous
+// priority.
+
+int syssetprio(int tid, int prio)
+{
+    if (tid == 0)
+    {
+        tid = running_thread();
+    }
+    if (thread_process(tid) != current_process())
+    {
+        return -EINVAL;
+    }
+    return thread_setprio(tid, prio);
+}
+
+// Fills _st_ with the CPU accounting of thread _tid_ (0 for the calling
+// thread) or, if _tid_ is -1, with the sum over the calling process.
+
+int systhreadstat(int tid, struct thread_stat *st)
+{
+    if (validate_user_range(st, sizeof(struct thread_stat)) != 0)
+    {
+        return -EINVAL;
+    }
+    if (tid == -1)
+    {
+        thread_stat_process(current_process(), st);
+        return 0;
+    }
+    if (tid == 0)
+    {
+        tid = running_thread();
+    }
+    return thread_stat(tid, st);
+}
+
+// Sleeps until woken by futex_wake on _uaddr_, unless *uaddr != val.
+
+int sysfutexwait(uint32_t *uaddr, uint32_t val)
+{
+    return futex_wait(uaddr, val);
+}
+
+int sysfutexwake(uint32_t *uaddr, int cnt)
+{
+    return futex_wake(uaddr, cnt);
+}
+
+// Starts a thread at _entry_ in the calling process with _arg_ as its argument.
+
+int systhreadcreate(const struct trap_frame *tfr, uintptr_t entry, uintptr_t arg)
+{
+    return process_thread_create(tfr, entry, arg);
+}
+
+int systhreadexit(void)
+{
+    process_thread_exit();
+}
+
+int systhreadjoin(int tid)
+{
+    return process_thread_join(tid);
+}
+
+// Copies up to _len_ bytes from _infd_ to _outfd_ without a user buffer.
+
+long syssplice(int outfd, int infd, long len)
+{
+    struct process *const proc = current_process();
+
+    if (outfd < 0 || outfd >= PROCESS_IOMAX || proc->iotab[outfd] == NULL ||
+        infd < 0 || infd >= PROCESS_IOMAX || proc->iotab[infd] == NULL)
+    {
+        return -EBADFD;
+    }
+    return iosplice(proc->iotab[outfd], proc->iotab[infd], len);
+}
+
+// Read into or write from _cnt_ buffers in one call.
+
+long sysreadv(int fd, const struct iovec *iov, int cnt)
+{
+    struct iovec kiov[IOV_MAX];
+
+    if (check_fd(fd) != 0)
+    {
+        return -EBADFD;
+    }
+    if (cnt < 0 || cnt > IOV_MAX || copy_from_user(kiov, iov, cnt * sizeof(struct iovec)) != 0)
+    {
+        return -EINVAL;
+    }
+    for (int i = 0; i < cnt; i++)
+    {
+        if (validate_user_range(kiov[i].base, kiov[i].len) != 0)
+        {
+            return -EINVAL;
+        }
+    }
+    return ioreadv(current_process()->iotab[fd], kiov, cnt);
+}
+
+long syswritev(int fd, const struct iovec *iov, int cnt)
+{
+    struct iovec kiov[IOV_MAX];
+
+    if (check_fd(fd) != 0)
+    {
+        return -EBADFD;
+    }
+    if (cnt < 0 || cnt > IOV_MAX || copy_from_user(kiov, iov, cnt * sizeof(struct iovec)) != 0)
+    {
+        return -EINVAL;
+    }
+    for (int i = 0; i < cnt; i++)
+    {
+        if (validate_user_range(kiov[i].base, kiov[i].len) != 0)
+        {
+            return -EINVAL;
+        }
+    }
+    return iowritev(current_process()->iotab[fd], kiov, cnt);
+}
+
+// Waits until one of _cnt_ descriptors is ready or _timeout_ms_ passes.
+
+int syspoll(struct pollfd *fds, int cnt, long timeout_ms)
+{
+    struct process *const proc = current_process();
+    struct iopollfd iofds[IOPOLL_MAX];
+    int i, n, result;
+
+    if (cnt < 0 || cnt > IOPOLL_MAX || validate_user_range(fds, cnt * sizeof(struct pollfd)) != 0)
+    {
+        return -EINVAL;
+    }
+
+    n = 0;
+    for (i = 0; i < cnt; i++)
+    {
+        fds[i].revents = 0;
+        if (fds[i].fd < 0)
+        {
+            continue;
+        }
+        if (fds[i].fd >= PROCESS_IOMAX || proc->iotab[fds[i].fd] == NULL)
+        {
+            return -EBADFD;
+        }
+        iofds[n].io = proc->iotab[fds[i].fd];
+        iofds[n].events = fds[i].events;
+        n += 1;
+    }
+
+    result = iopollv(iofds, n, timeout_ms);
+
+    n = 0;
+    for (i = 0; result > 0 && i < cnt; i++)
+    {
+        if (fds[i].fd >= 0)
+        {
+            fds[i].revents = iofds[n++].revents;
+        }
+    }
+    return result;
+}
+
+// Maps the submission and completion rings and returns their address.
+
+long sysringsetup(void)
+{
+    return ioring_setup();
+}
+
+// Hands new submissions to the ring thread and waits for _min_complete_
+// completions.
+
+int sysringenter(unsigned int min_complete)
+{
+    return ioring_enter(min_complete);
+}
+
+// Fills _st_ with the count and time of system call _num_ since boot.
+
+int sysscstat(int num, struct syscall_stat *st)
+{
+#ifdef SYSCALL_STATS
+    if (num < 0 || num >= SYSCALL_STATS_CNT)
+    {
+        return -EINVAL;
+    }
+    return copy_to_user(st, &syscall_stats[num], sizeof(struct syscall_stat));
+#else
+    return -ENOTSUP;
+#endif
+}
+
+// Copies a name argument into _kname_, which holds SYSCALL_NAME_MAX bytes.
+
+int copy_name(char *kname, const char *uname)
+{
+    long len = strncpy_from_user(kname, uname, SYSCALL_NAME_MAX);
+
+    if (len < 0 || len == SYSCALL_NAME_MAX)
+    {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+// Returns 0 if _fd_ names an open descriptor of the current process.
+
+int check_fd(int fd)
+{
+    if (fd < 0 || fd >= PROCESS_IOMAX || current_process()->iotab[fd] == NULL)
+    {
+        return -EBADFD;
+    }
+    return 0;
+}
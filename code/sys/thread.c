@@ -26,22 +26,53 @@
 #include "memory.h"
 #include "error.h"
 #include "process.h"
+#include "tracepoint.h"
+#include "smp.h"
+#include "see.h"
+#include "conf.h"
 
 #include <stdarg.h>
 
 //  COMPILE-TIME PARAMETERS
 //
 
-//  NTHR is the maximum number of threads
+//  NTHR is the initial size of the thread table, which doubles as needed up
+//  to NTHR_MAX threads
 
 #ifndef NTHR
 #define NTHR 16
 #endif
 
+#ifndef NTHR_MAX
+#define NTHR_MAX NTHR
+#endif
+
+//  Number of stacks and thread structures of reclaimed threads kept for reuse
+
+#ifndef THREAD_POOL_MAX
+#define THREAD_POOL_MAX 8
+#endif
+
 #ifndef STACK_SIZE
 #define STACK_SIZE 4000
 #endif
 
+//  Priority of a newly created thread, and the number of levels a thread rises
+//  when woken from a condition. A thread drops one level each time it uses up
+//  its time slice, down to THREAD_PRIO_IDLE-1.
+
+#ifndef THREAD_PRIO_DEFAULT
+#define THREAD_PRIO_DEFAULT (THREAD_PRIO_CNT / 2)
+#endif
+
+#ifndef THREAD_PRIO_BOOST
+#define THREAD_PRIO_BOOST 2
+#endif
+
+#if THREAD_PRIO_CNT < 2 || THREAD_PRIO_CNT > 32
+#error "THREAD_PRIO_CNT must be between 2 and 32"
+#endif
+
 //  EXPORTED GLOBAL VARIABLES
 //
 
@@ -75,7 +106,8 @@ struct thread_stack_anchor
 struct thread
 {
     struct thread_context ctx; //  must be first member (thrasm.s)
-    int id;                    //  index into thrtab[]
+    int id;                    //  index into thrtab[]
+    int hart;                  //  hart it runs on, or last ran on
     enum thread_state state;
     const char *name;
     struct thread_stack_anchor *stack_anchor;
@@ -85,10 +117,18 @@ struct thread
     struct condition *wait_cond;
     struct condition child_exit;
     struct process *thr_proc;
+    int prio;   //  own priority, 0 is highest
+    int pinned; //  prio set by thread_setprio(), does not adapt
+    int pi_prio; //  priority lent by lock waiters, THREAD_PRIO_CNT if none
+    unsigned long long slice_end; //  rdtime() when the thread's time slice runs out
+    struct lock *wait_lock; //  lock the thread is blocked on, if any
+    int intr_wait;   //  waiting in condition_wait_interruptible()
+    int interrupted; //  set by thread_interrupt_process(), never cleared
+    unsigned long long state_since; //  rdtime() when state last changed
+    struct thread_stat stat;
     struct
     {
-        struct lock *head;
-        struct lock *tail;
+        struct lock *head; //  most recently acquired first
     } lock_list;
 };
 
@@ -99,8 +139,9 @@ struct thread
 
 #define TP ((struct thread *)__builtin_thread_pointer())
 
-//  Macro for changing thread state. If compiled for debugging (DEBUG is
-//  defined), prints function that changed thread state.
+//  Macro for changing thread state. Charges the time spent in the old state
+//  to the thread. If compiled for debugging (DEBUG is defined), prints
+//  function that changed thread state.
 
 #define set_thread_state(t, s)                                               \
     do                                                                       \
@@ -111,6 +152,7 @@ struct thread
               thread_state_name(s),                                          \
               TP->name, TP->id,                                              \
               __func__);                                                     \
+        thread_account(t, rdtime());                                         \
         (t)->state = (s);                                                    \
     } while (0)
 
@@ -122,7 +164,15 @@ struct thread
 static void init_main_thread(void);
 static void init_idle_thread(void);
 
-//  Sets the RISC-V thread pointer to point to a thread.
+//  Charges the time from the last state change of _thr_ to _now_ to its
+//  current state. thread_stat_add() adds the accounting of _thr_ as of _now_
+//  to _st_ without charging it.
+
+static void thread_account(struct thread *thr, unsigned long long now);
+static void thread_stat_add(const struct thread *thr, unsigned long long now,
+                            struct thread_stat *st);
+
+//  Sets the RISC-V thread pointer to point to a thread.
 
 static void set_running_thread(struct thread *thr);
 
@@ -139,6 +189,22 @@ static const char *thread_state_name(enum thread_state state)
 
 static void thread_reclaim(int tid);
 
+//  Thread IDs come from a stack of free IDs. thrtab_grow() enlarges the thread
+//  table (and the free ID stack), returning 0 on success or -EMTHR if it is
+//  already NTHR_MAX long.
+
+static int tid_alloc(void);
+static void tid_free(int tid);
+static int thrtab_grow(void);
+
+//  Pools of stack pages and struct threads of reclaimed threads. The get
+//  functions fall back to the page and heap allocators.
+
+static void *stack_get(void);
+static void stack_put(void *stack_page);
+static struct thread *thread_get(void);
+static void thread_put(struct thread *thr);
+
 //  struct thread * create_thread(const char * name)
 //
 //  Creates and initializes a new thread structure. The new thread is not added
@@ -159,7 +225,7 @@ static void running_thread_suspend(void);
 
 //  The following functions manipulate a thread list (struct thread_list). Note
 //  that threads form a linked list via the list_next member of each thread
-//  structure. Thread lists are used for the ready-to-run list (ready_list) and
+//  structure. Thread lists are used for the ready-to-run lists (ready_queues) and
 //  for the list of waiting threads of each condition variable. These functions
 //  are not interrupt-safe! The caller must disable interrupts before calling any
 //  thread list function that may modify a list that is used in an ISR.
@@ -168,11 +234,38 @@ static void tlclear(struct thread_list *list);
 static int tlempty(const struct thread_list *list);
 static void tlinsert(struct thread_list *list, struct thread *thr);
 static struct thread *tlremove(struct thread_list *list);
+static void tlunlink(struct thread_list *list, struct thread *thr);
+
+//  Each hart has its own ready-to-run lists, one per priority, with a bitmask
+//  of the non-empty ones. A thread is queued on the hart it last ran on, and a
+//  hart with nothing of its own to run steals from the others. Idle threads
+//  never move. These functions must also be called with interrupts disabled.
+
+static void ready_insert(struct thread *thr);
+static struct thread *ready_remove(void);
+static int ready_empty(void);
 // static void tlappend(struct thread_list * l0, struct thread_list * l1);
 static void llinsert(struct thread *thr, struct lock *lock);
 static void llremove(struct thread *thr, struct lock *lock);
 static void llclear(struct thread *thr);
 
+//  Priority a thread is scheduled at: its own or the one lent to it through
+//  the locks it holds, whichever is higher.
+
+static int effective_prio(const struct thread *thr);
+
+//  Contended lock paths. lock_lend_prio() raises the owner of _lock_ (and the
+//  owner of the lock that owner waits on, and so on) to the priority of the
+//  running thread. held_waiter_prio() returns the highest priority of any
+//  thread waiting on a lock held by _thr_. Must be called with interrupts
+//  disabled.
+
+static void lock_acquire_slow(struct lock *lock);
+static void lock_release_slow(struct lock *lock);
+static void lock_lend_prio(struct lock *lock);
+static int held_waiter_prio(const struct thread *thr);
+static void ready_move(struct thread *thr, int old_prio);
+
 static void
 idle_thread_func(void);
 
@@ -202,6 +295,8 @@ static struct thread main_thread = {
     .state = THREAD_RUNNING,
     .stack_anchor = (void *)_main_stack_anchor,
     .stack_lowest = _main_stack_lowest,
+    .prio = THREAD_PRIO_DEFAULT,
+    .pi_prio = THREAD_PRIO_CNT,
     .child_exit.name = "main.child_exit"};
 
 extern char _idle_stack_lowest[]; //  from thrasm.s
@@ -214,6 +309,9 @@ static struct thread idle_thread = {
     .parent = &main_thread,
     .stack_anchor = (void *)_idle_stack_anchor,
     .stack_lowest = _idle_stack_lowest,
+    .prio = THREAD_PRIO_IDLE,
+    .pinned = 1,
+    .pi_prio = THREAD_PRIO_CNT,
     .ctx.sp = _idle_stack_anchor,
     .ctx.ra = (void *)&_thread_startup,
     .ctx.s[10] = (uint64_t)&thread_exit,     // set correct s register to address of thread_exit
@@ -221,13 +319,35 @@ static struct thread idle_thread = {
     //  FIXME your code goes here
 };
 
-static struct thread *thrtab[NTHR] = {
+static struct thread *thrtab_init[NTHR] = {
     [MAIN_TID] = &main_thread,
     [IDLE_TID] = &idle_thread};
 
-static struct thread_list ready_list = {
-    .head = &idle_thread,
-    .tail = &idle_thread};
+static struct thread **thrtab = thrtab_init;
+static int thrtab_size = NTHR;
+
+static int tid_free_init[NTHR];
+static int *tid_free_stack = tid_free_init; //  thrtab_size entries
+static int tid_free_cnt;
+
+static void *stack_pool; //  first word of each page links to the next
+static int stack_pool_cnt;
+static struct thread *thread_pool; //  linked by list_next
+static int thread_pool_cnt;
+
+static struct ready_queue
+{
+    struct thread_list lists[THREAD_PRIO_CNT];
+    unsigned int mask; //  bit n: lists[n] non-empty
+} ready_queues[NHART] = {
+    [0] = {
+        .lists[THREAD_PRIO_IDLE] = {
+            .head = &idle_thread,
+            .tail = &idle_thread},
+        .mask = 1U << THREAD_PRIO_IDLE}};
+
+static struct thread *idle_threads[NHART] = {[0] = &idle_thread};
+static unsigned int idle_harts; //  bit n: hart n waits in wfi for work
 
 //  EXPORTED FUNCTION DEFINITIONS
 //
@@ -242,11 +362,22 @@ void *get_stack_anchor(void)
     return TP->stack_anchor;
 }
 
+int running_hart(void)
+{
+    return TP->hart;
+}
+
 void thrmgr_init(void)
 {
     trace("%s()", __func__);
     init_main_thread();
     init_idle_thread();
+
+    //  Lowest IDs on top of the free ID stack
+
+    for (int tid = IDLE_TID - 1; tid > MAIN_TID; tid--)
+        tid_free(tid);
+
     set_running_thread(&main_thread);
     thrmgr_initialized = 1;
 }
@@ -273,10 +404,11 @@ int thread_spawn(
     if (child == NULL)
         return -EMTHR;
 
+    child->state_since = rdtime();
     set_thread_state(child, THREAD_READY);
 
     pie = disable_interrupts();
-    tlinsert(&ready_list, child);
+    ready_insert(child);
     restore_interrupts(pie);
 
     //  FIXME your code goes here
@@ -308,17 +440,49 @@ void thread_exit(void)
     //   FIXME your code goes here
     if (TP->id == main_thread.id)
     { // if its the main thread, then it should halt success, otherwise set the TP's state to exited
+        console_flush();
         halt_success();
     }
     else
     {
-        TP->state = THREAD_EXITED;
+        set_thread_state(TP, THREAD_EXITED);
     }
     condition_broadcast(&TP->parent->child_exit); // signal to the parent that the current thread is going to exit and then call running thread suspend to suspend the current thread
     running_thread_suspend();
     halt_failure(); // if running_thread_suspend returns something, then it should halt a failure
 }
 
+void *create_idle_thread(int hart)
+{
+    struct thread *thr;
+
+    assert(0 < hart && hart < NHART);
+
+    thr = create_thread("idle");
+
+    if (thr == NULL)
+        return NULL;
+
+    //  No parent, so that thread_join(0) in the main thread never waits on it
+
+    thr->hart = hart;
+    thr->parent = NULL;
+    thr->prio = THREAD_PRIO_IDLE;
+    thr->pinned = 1;
+    thr->slice_end = UINT64_MAX;
+    thr->state_since = rdtime();
+    set_thread_state(thr, THREAD_RUNNING);
+
+    idle_threads[hart] = thr;
+    return thr->stack_anchor;
+}
+
+void thread_idle(void)
+{
+    assert(TP == idle_threads[TP->hart]);
+    idle_thread_func();
+}
+
 void thread_yield(void)
 {
     trace("%s() in <%s:%d>", __func__, TP->name, TP->id);
@@ -335,7 +499,11 @@ int thread_join(int tid)
 {
     trace("%s()", __func__);
     //  FIXME your code goes here
-    if (tid != 0)
+    if (tid < 0 || tid >= thrtab_size)
+    {
+        return -EINVAL;
+    }
+    else if (tid != 0)
     {
         if (thrtab[tid] != NULL && thrtab[tid]->state == THREAD_EXITED)
         { // if the identified child exists and the state of the child is exited, then reclaim the tid and return the tid
@@ -357,7 +525,7 @@ int thread_join(int tid)
     }
     else
     {
-        for (int i = 1; i < NTHR; i++)
+        for (int i = 1; i < thrtab_size; i++)
         {
             if (thrtab[i] != NULL && thrtab[i]->parent == TP && thrtab[i]->state == THREAD_EXITED)
             { // if you have found the identified child, the child exists, and the state of the child is exited, then reclaim the i and return the i
@@ -382,7 +550,7 @@ int thread_join(int tid)
 
 const char *thread_name(int tid)
 {
-    assert(0 <= tid && tid < NTHR);
+    assert(0 <= tid && tid < thrtab_size);
     assert(thrtab[tid] != NULL);
     return thrtab[tid]->name;
 }
@@ -420,6 +588,18 @@ void condition_wait(struct condition *cond)
     running_thread_suspend();
 }
 
+int condition_wait_interruptible(struct condition *cond)
+{
+    if (TP->interrupted)
+        return -EINTR;
+
+    TP->intr_wait = 1;
+    condition_wait(cond);
+    TP->intr_wait = 0;
+
+    return TP->interrupted ? -EINTR : 0;
+}
+
 // void condition_broadcast(struct condition * cond)
 // Inputs: struct condition * cond - the condition that has all of the threads that we want to wake up in its wait list.
 // Outputs: None
@@ -434,8 +614,10 @@ void condition_broadcast(struct condition *cond)
     while (tlempty(&cond->wait_list) == 0)
     {
         struct thread *ready_thread = tlremove(&cond->wait_list); // Sets all of the threads in the wait list to ready. Removes all of the threads from the wait list and adds them to the ready list
-        ready_thread->state = THREAD_READY;
-        tlinsert(&ready_list, ready_thread);
+        set_thread_state(ready_thread, THREAD_READY);
+        if (!ready_thread->pinned) // a thread that waited is likely I/O-bound, so it goes ahead of threads using up the CPU
+            ready_thread->prio = (ready_thread->prio > THREAD_PRIO_BOOST) ? ready_thread->prio - THREAD_PRIO_BOOST : 0;
+        ready_insert(ready_thread);
     }
     restore_interrupts(pie); // restores interrupts as it has reached the end of the critical section
 }
@@ -449,62 +631,212 @@ void lock_init(struct lock *lock)
     lock->next = NULL;
 }
 
+// void lock_acquire(struct lock * lock)
+// The uncontended case is a single compare-and-swap of the owner. Only if the
+// lock is held does the thread go through lock_acquire_slow() to lend its
+// priority and wait. The lock list is only touched by its own thread, so it
+// needs no interrupt masking.
+
 void lock_acquire(struct lock *lock)
 {
+    struct thread *expected = NULL;
+
     trace("%s()", __func__);
     if (lock->owner == TP)
     {
         lock->count++;
+        return;
     }
-    else
+
+    if (!__atomic_compare_exchange_n(&lock->owner, &expected, TP, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        lock_acquire_slow(lock);
+
+    llinsert(TP, lock);
+}
+
+// void lock_release(struct lock * lock)
+// Clears the owner and only takes the slow path if some thread is waiting for
+// the lock or lent the running thread its priority.
+
+void lock_release(struct lock *lock)
+{
+    trace("%s()", __func__);
+
+    if (lock->count != 0)
     {
-        while (lock->owner != NULL)
-        {
-            // kprintf("Waiting:%s\n", TP->name);
-            condition_wait(&lock->released);
-        }
-        lock->owner = TP;
-        int pie = disable_interrupts();
-        llinsert(TP, lock);
-        restore_interrupts(pie);
+        lock->count--;
+        return;
     }
-    // kprintf("Owner:%s\n", lock->owner->name);
+
+    llremove(TP, lock);
+    __atomic_store_n(&lock->owner, NULL, __ATOMIC_RELEASE);
+
+    if (!tlempty(&lock->released.wait_list) || TP->pi_prio != THREAD_PRIO_CNT)
+        lock_release_slow(lock);
 }
 
-void lock_release(struct lock *lock)
+void rwlock_init(struct rwlock *rw)
 {
     trace("%s()", __func__);
-    // assert(lock != NULL);
-    // assert(lock->owner != NULL);
-    // assert(lock->owner->id == TP->id);
-    // kprintf("Releasing:%s\n", lock->owner->name);
-    if (lock->count == 0)
+    memset(rw, 0, sizeof(struct rwlock));
+    condition_init(&rw->changed, NULL);
+}
+
+void rwlock_acquire_read(struct rwlock *rw)
+{
+    int pie = disable_interrupts();
+    while (rw->writer != NULL || rw->writers_waiting != 0)
     {
-        // kprintf("Lock successfully released:%s\n", lock->owner->name);
-        int pie = disable_interrupts();
-        llremove(TP, lock);
-        restore_interrupts(pie);
-        lock->owner = NULL;
-        condition_broadcast(&lock->released);
+        condition_wait(&rw->changed);
+    }
+    rw->readers++;
+    restore_interrupts(pie);
+}
+
+void rwlock_release_read(struct rwlock *rw)
+{
+    int pie = disable_interrupts();
+    assert(rw->readers > 0);
+    rw->readers--;
+    if (rw->readers == 0)
+    {
+        condition_broadcast(&rw->changed);
+    }
+    restore_interrupts(pie);
+}
+
+void rwlock_acquire_write(struct rwlock *rw)
+{
+    int pie = disable_interrupts();
+    rw->writers_waiting++;
+    while (rw->writer != NULL || rw->readers != 0)
+    {
+        condition_wait(&rw->changed);
+    }
+    rw->writers_waiting--;
+    rw->writer = TP;
+    restore_interrupts(pie);
+}
+
+void rwlock_release_write(struct rwlock *rw)
+{
+    int pie = disable_interrupts();
+    assert(rw->writer == TP);
+    rw->writer = NULL;
+    condition_broadcast(&rw->changed);
+    restore_interrupts(pie);
+}
+
+int thread_setprio(int tid, int prio)
+{
+    int old;
+
+    if (tid < 0 || tid >= thrtab_size || thrtab[tid] == NULL ||
+        thrtab[tid] == idle_threads[thrtab[tid]->hart])
+        return -EINVAL;
+
+    if (prio >= THREAD_PRIO_IDLE)
+        return -EINVAL;
+
+    old = thrtab[tid]->prio;
+
+    if (prio < 0)
+    {
+        thrtab[tid]->pinned = 0;
     }
     else
     {
-        lock->count--;
+        thrtab[tid]->prio = prio;
+        thrtab[tid]->pinned = 1;
+    }
+
+    return old;
+}
+
+int thread_stat(int tid, struct thread_stat *st)
+{
+    int pie;
+
+    if (tid < 0 || tid >= thrtab_size || thrtab[tid] == NULL)
+        return -EINVAL;
+
+    memset(st, 0, sizeof(struct thread_stat));
+    pie = disable_interrupts();
+    thread_stat_add(thrtab[tid], rdtime(), st);
+    restore_interrupts(pie);
+    return 0;
+}
+
+void thread_stat_process(const struct process *proc, struct thread_stat *st)
+{
+    unsigned long long now;
+    int pie;
+    int tid;
+
+    memset(st, 0, sizeof(struct thread_stat));
+    pie = disable_interrupts();
+    now = rdtime();
+
+    for (tid = 0; tid < thrtab_size; tid++)
+    {
+        if (thrtab[tid] != NULL && thrtab[tid]->thr_proc == proc)
+            thread_stat_add(thrtab[tid], now, st);
+    }
+
+    restore_interrupts(pie);
+}
+
+void thread_interrupt_process(const struct process *proc)
+{
+    struct thread *thr;
+    int pie;
+    int tid;
+
+    pie = disable_interrupts();
+
+    for (tid = 0; tid < thrtab_size; tid++)
+    {
+        thr = thrtab[tid];
+        if (thr == NULL || thr == TP || thr->thr_proc != proc)
+            continue;
+
+        thr->interrupted = 1;
+
+        //  Take it off its condition alone, so other waiters stay asleep
+
+        if (thr->state == THREAD_WAITING && thr->intr_wait)
+        {
+            tlunlink(&thr->wait_cond->wait_list, thr);
+            set_thread_state(thr, THREAD_READY);
+            ready_insert(thr);
+        }
     }
+
+    restore_interrupts(pie);
 }
 
 struct process *thread_process(int tid)
 {
-    assert(tid >= 0 && tid < NTHR);
+    if (tid < 0 || tid >= thrtab_size || thrtab[tid] == NULL)
+        return NULL;
     return thrtab[tid]->thr_proc;
 }
 
 void thread_set_process(int tid, struct process *proc)
 {
-    assert(tid >= 0 && tid < NTHR);
+    assert(tid >= 0 && tid < thrtab_size);
     thrtab[tid]->thr_proc = proc;
 }
 
+int running_thread_should_yield(void)
+{
+    //  Threads at a higher priority (a lower level) are in the low bits
+
+    return (TP->slice_end <= rdtime() ||
+            (ready_queues[TP->hart].mask & ((1U << effective_prio(TP)) - 1)) != 0);
+}
+
 struct process *running_thread_process(void)
 {
     return TP->thr_proc;
@@ -525,6 +857,48 @@ void init_idle_thread(void)
     idle_thread.stack_anchor->ktp = &idle_thread;
 }
 
+//  Returns the counter of _thr_ that time in _state_ is charged to, or NULL if
+//  time in that state is not counted.
+
+static unsigned long long *state_counter(struct thread_stat *st, enum thread_state state)
+{
+    switch (state)
+    {
+    case THREAD_RUNNING:
+        return &st->run_time;
+    case THREAD_READY:
+        return &st->ready_time;
+    case THREAD_WAITING:
+        return &st->wait_time;
+    default:
+        return NULL;
+    }
+}
+
+void thread_account(struct thread *thr, unsigned long long now)
+{
+    unsigned long long *const counter = state_counter(&thr->stat, thr->state);
+
+    if (counter != NULL)
+        *counter += now - thr->state_since;
+
+    thr->state_since = now;
+}
+
+void thread_stat_add(const struct thread *thr, unsigned long long now,
+                     struct thread_stat *st)
+{
+    unsigned long long *const counter = state_counter(st, thr->state);
+
+    st->run_time += thr->stat.run_time;
+    st->ready_time += thr->stat.ready_time;
+    st->wait_time += thr->stat.wait_time;
+    st->switches += thr->stat.switches;
+
+    if (counter != NULL)
+        *counter += now - thr->state_since;
+}
+
 static void set_running_thread(struct thread *thr)
 {
     asm inline("mv tp, %0" ::"r"(thr) : "tp");
@@ -550,21 +924,119 @@ void thread_reclaim(int tid)
     struct thread *const thr = thrtab[tid];
     int ctid;
 
-    assert(0 < tid && tid < NTHR && thr != NULL);
+    assert(0 < tid && tid < thrtab_size && thr != NULL);
     assert(thr->state == THREAD_EXITED);
 
     //  Make our parent thread the parent of our child threads. We need to scan
     //  all threads to find our children. We could keep a list of all of a
     //  thread's children to make this operation more efficient.
 
-    for (ctid = 1; ctid < NTHR; ctid++)
+    for (ctid = 1; ctid < thrtab_size; ctid++)
     {
         if (thrtab[ctid] != NULL && thrtab[ctid]->parent == thr)
             thrtab[ctid]->parent = thr->parent;
     }
 
     thrtab[tid] = NULL;
-    kfree(thr);
+    tid_free(tid);
+    thread_put(thr);
+}
+
+int tid_alloc(void)
+{
+    if (tid_free_cnt == 0 && thrtab_grow() != 0)
+        return -EMTHR;
+
+    tid_free_cnt -= 1;
+    return tid_free_stack[tid_free_cnt];
+}
+
+void tid_free(int tid)
+{
+    assert(tid_free_cnt < thrtab_size);
+    tid_free_stack[tid_free_cnt++] = tid;
+}
+
+int thrtab_grow(void)
+{
+    const int new_size = (2 * thrtab_size < NTHR_MAX) ? 2 * thrtab_size : NTHR_MAX;
+    struct thread **new_tab;
+    int *new_free;
+    int tid;
+
+    if (new_size <= thrtab_size)
+        return -EMTHR;
+
+    new_tab = kcalloc(new_size, sizeof(struct thread *));
+    new_free = kcalloc(new_size, sizeof(int));
+    memcpy(new_tab, thrtab, thrtab_size * sizeof(struct thread *));
+    memcpy(new_free, tid_free_stack, tid_free_cnt * sizeof(int));
+
+    if (thrtab != thrtab_init)
+    {
+        kfree(thrtab);
+        kfree(tid_free_stack);
+    }
+
+    thrtab = new_tab;
+    tid_free_stack = new_free;
+
+    for (tid = new_size - 1; tid >= thrtab_size; tid--)
+        tid_free_stack[tid_free_cnt++] = tid;
+
+    thrtab_size = new_size;
+    return 0;
+}
+
+void *stack_get(void)
+{
+    void *stack_page = stack_pool;
+
+    if (stack_page == NULL)
+        return alloc_phys_page();
+
+    stack_pool = *(void **)stack_page;
+    stack_pool_cnt -= 1;
+    return stack_page;
+}
+
+void stack_put(void *stack_page)
+{
+    if (stack_pool_cnt == THREAD_POOL_MAX)
+    {
+        free_phys_page(stack_page);
+        return;
+    }
+
+    *(void **)stack_page = stack_pool;
+    stack_pool = stack_page;
+    stack_pool_cnt += 1;
+}
+
+struct thread *thread_get(void)
+{
+    struct thread *thr = thread_pool;
+
+    if (thr == NULL)
+        return kcalloc(1, sizeof(struct thread));
+
+    thread_pool = thr->list_next;
+    thread_pool_cnt -= 1;
+    memset(thr, 0, sizeof(struct thread));
+    return thr;
+}
+
+void thread_put(struct thread *thr)
+{
+    if (thread_pool_cnt == THREAD_POOL_MAX)
+    {
+        kfree(thr);
+        return;
+    }
+
+    thr->list_next = thread_pool;
+    thread_pool = thr;
+    thread_pool_cnt += 1;
 }
 
 struct thread *create_thread(const char *name)
@@ -577,21 +1049,24 @@ struct thread *create_thread(const char *name)
 
     trace("%s(name=\"%s\") in <%s:%d>", __func__, name, TP->name, TP->id);
 
-    //  Find a free thread slot.
+    //  Take a free thread slot.
 
-    tid = 0;
-    while (++tid < NTHR)
-        if (thrtab[tid] == NULL)
-            break;
+    tid = tid_alloc();
 
-    if (tid == NTHR)
+    if (tid < 0)
         return NULL;
 
-    //  Allocate a struct thread and a stack
+    //  Get a struct thread and a stack, recycled if possible
 
-    thr = kcalloc(1, sizeof(struct thread));
+    stack_page = stack_get();
 
-    stack_page = alloc_phys_page();
+    if (stack_page == NULL)
+    {
+        tid_free(tid);
+        return NULL;
+    }
+
+    thr = thread_get();
     anchor = stack_page + STACK_SIZE;
     anchor -= 1; //  anchor is at base of stack
     thr->stack_lowest = stack_page;
@@ -603,9 +1078,11 @@ struct thread *create_thread(const char *name)
 
     thr->id = tid;
     thr->name = name;
+    thr->hart = TP->hart;
     thr->parent = TP;
+    thr->prio = THREAD_PRIO_DEFAULT;
+    thr->pi_prio = THREAD_PRIO_CNT;
     thr->lock_list.head = NULL;
-    thr->lock_list.tail = NULL;
     return thr;
 }
 
@@ -617,16 +1094,28 @@ struct thread *create_thread(const char *name)
 
 void running_thread_suspend(void)
 {
-    trace("%s()", __func__);
-    //  FIXME your code goes here
+    //  FIXME your code goes here
     int pie = disable_interrupts(); // disable the interrupts as its a critical section as you're modifying a thread list
     if (TP->state == THREAD_RUNNING)
     { // if the current thread is running, then change the state of it to ready and insert it into the ready list
-        TP->state = THREAD_READY;
-        tlinsert(&ready_list, TP);
+        set_thread_state(TP, THREAD_READY);
+        if (!TP->pinned && TP->prio < THREAD_PRIO_IDLE - 1 && TP->slice_end <= rdtime()) // used up its slice, so CPU-bound: drop a level
+            TP->prio += 1;
+        ready_insert(TP);
+    }
+    struct thread *next_thread = ready_remove(); // remove the highest priority ready thread and change the state of that to running
+    set_thread_state(next_thread, THREAD_RUNNING);
+    next_thread->hart = TP->hart; // it may have been stolen from another hart
+    if (next_thread != TP)
+    {
+        next_thread->stat.switches += 1;
+        tracepoint(TRACEPOINT_THREAD, TRACEPOINT_THREAD_SWITCH, next_thread->id, 0);
     }
-    struct thread *next_thread = tlremove(&ready_list); // remove the next thread from the ready list and change the state of that to running
-    next_thread->state = THREAD_RUNNING;
+    if (next_thread != idle_threads[TP->hart])
+        next_thread->slice_end = rdtime() + THREAD_QUANTUM_MS * (TIMER_FREQ / 1000);
+    else
+        next_thread->slice_end = UINT64_MAX;
+    timer_set_slice(next_thread->slice_end);
     restore_interrupts(pie); // restores interrupts as it has reached the end of the critical section
 
     enable_interrupts();
@@ -641,7 +1130,7 @@ void running_thread_suspend(void)
         int pie = disable_interrupts();
         llclear(old_thread);
         restore_interrupts(pie);
-        free_phys_page(old_thread->stack_lowest); // free the old thread's stack from the memory
+        stack_put(old_thread->stack_lowest); // return the old thread's stack to the pool
     }
 }
 
@@ -706,81 +1195,258 @@ struct thread *tlremove(struct thread_list *list)
     return thr;
 }
 
-void llinsert(struct thread *thread, struct lock *lock)
+void tlunlink(struct thread_list *list, struct thread *thr)
 {
-    trace("%s()", __func__);
-    if (lock == NULL)
-        return;
+    struct thread *prev = NULL;
+    struct thread *cur = list->head;
 
-    if (thread->lock_list.tail != NULL)
+    while (cur != NULL && cur != thr)
     {
-        // assert(thread->lock_list.head != NULL);
-        thread->lock_list.tail->next = lock;
-        lock->next = NULL;
+        prev = cur;
+        cur = cur->list_next;
     }
+
+    if (cur == NULL)
+        return;
+
+    if (prev != NULL)
+        prev->list_next = thr->list_next;
     else
-    {
-        // assert(thread->lock_list.head == NULL);
-        thread->lock_list.head = lock;
-        lock->next = NULL;
-    }
+        list->head = thr->list_next;
 
-    thread->lock_list.tail = lock;
+    if (list->tail == thr)
+        list->tail = prev;
+
+    thr->list_next = NULL;
 }
 
-void llremove(struct thread *thread, struct lock *lock)
+void ready_insert(struct thread *thr)
 {
-    trace("%s()", __func__);
-    if (thread->lock_list.head == NULL)
+    struct ready_queue *const rq = &ready_queues[thr->hart];
+    const int prio = effective_prio(thr);
+    int hart;
+
+    tlinsert(&rq->lists[prio], thr);
+    rq->mask |= 1U << prio;
+
+    //  Wake a hart sleeping in wfi to run it: its own hart if that one is
+    //  asleep, otherwise any, which then steals it.
+
+    if (idle_harts != 0 && thr != idle_threads[thr->hart])
     {
-        return;
+        hart = (idle_harts & (1U << thr->hart)) ? thr->hart : __builtin_ctz(idle_harts);
+        idle_harts &= ~(1U << hart);
+        send_ipi(hart);
     }
+}
 
-    if (thread->lock_list.head == lock)
-    {
-        struct lock *new_head = thread->lock_list.head->next;
-        thread->lock_list.head = new_head;
+struct thread *ready_remove(void)
+{
+    const unsigned int busy = (1U << THREAD_PRIO_IDLE) - 1; //  all levels but idle
+    struct ready_queue *rq = &ready_queues[TP->hart];
+    struct thread *thr;
+    unsigned int mask;
+    int hart;
+    int prio;
+
+    //  Our own threads first, then the best of what other harts have queued,
+    //  and only then our idle thread
 
-        if (new_head == NULL)
+    if ((rq->mask & busy) == 0)
+    {
+        for (hart = 0; hart < NHART; hart++)
         {
-            thread->lock_list.tail = NULL;
+            mask = ready_queues[hart].mask & busy;
+            if (mask != 0 && ((rq->mask & busy) == 0 ||
+                              __builtin_ctz(mask) < __builtin_ctz(rq->mask & busy)))
+                rq = &ready_queues[hart];
         }
+    }
+
+    if (rq->mask == 0)
+        return NULL;
+
+    prio = __builtin_ctz(rq->mask);
+    thr = tlremove(&rq->lists[prio]);
+
+    if (tlempty(&rq->lists[prio]))
+        rq->mask &= ~(1U << prio);
+
+    return thr;
+}
 
+//  Returns 1 if the running hart has nothing to run but its idle thread.
+
+int ready_empty(void)
+{
+    const unsigned int busy = (1U << THREAD_PRIO_IDLE) - 1;
+    int hart;
+
+    if (ready_queues[TP->hart].mask != 0)
+        return 0;
+
+    for (hart = 0; hart < NHART; hart++)
+    {
+        if ((ready_queues[hart].mask & busy) != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+void llinsert(struct thread *thread, struct lock *lock)
+{
+    trace("%s()", __func__);
+    lock->next = thread->lock_list.head;
+    thread->lock_list.head = lock;
+}
+
+//  Locks are mostly released in the reverse of the order they were acquired,
+//  so the lock is usually at the head.
+
+void llremove(struct thread *thread, struct lock *lock)
+{
+    struct lock **link = &thread->lock_list.head;
+
+    trace("%s()", __func__);
+    while (*link != NULL && *link != lock)
+        link = &(*link)->next;
+
+    if (*link != NULL)
+        *link = lock->next;
+
+    lock->next = NULL;
+}
+
+//  Releases every lock still held by an exited thread. Called from another
+//  thread, so the locks are dropped directly rather than with lock_release().
+
+void llclear(struct thread *thread)
+{
+    struct lock *lock;
+
+    trace("%s()", __func__);
+    while (thread->lock_list.head != NULL)
+    {
+        lock = thread->lock_list.head;
+        thread->lock_list.head = lock->next;
         lock->next = NULL;
-        return;
+        lock->count = 0;
+        __atomic_store_n(&lock->owner, NULL, __ATOMIC_RELEASE);
+        condition_broadcast(&lock->released);
     }
-    struct lock *curr = thread->lock_list.head;
-    while (curr != NULL && curr->next != lock)
+}
+
+int effective_prio(const struct thread *thr)
+{
+    return (thr->pi_prio < thr->prio) ? thr->pi_prio : thr->prio;
+}
+
+void lock_acquire_slow(struct lock *lock)
+{
+    struct thread *expected;
+    int pie;
+
+    pie = disable_interrupts();
+    TP->wait_lock = lock;
+
+    for (;;)
     {
-        curr = curr->next;
+        expected = NULL;
+        if (__atomic_compare_exchange_n(&lock->owner, &expected, TP, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+
+        lock_lend_prio(lock);
+        condition_wait(&lock->released);
     }
 
-    if (curr != NULL && curr->next == lock)
+    TP->wait_lock = NULL;
+    restore_interrupts(pie);
+}
+
+void lock_release_slow(struct lock *lock)
+{
+    int pie;
+
+    pie = disable_interrupts();
+
+    //  Keep only what is still lent through the locks we hold
+
+    TP->pi_prio = held_waiter_prio(TP);
+    condition_broadcast(&lock->released);
+    restore_interrupts(pie);
+}
+
+void lock_lend_prio(struct lock *lock)
+{
+    const int prio = effective_prio(TP);
+    struct thread *owner = lock->owner;
+    int old_prio;
+
+    while (owner != NULL && prio < effective_prio(owner))
     {
-        curr->next = lock->next;
+        old_prio = effective_prio(owner);
+        owner->pi_prio = prio;
 
-        if (lock == thread->lock_list.tail)
-        {
-            thread->lock_list.tail = curr;
-        }
+        if (owner->state == THREAD_READY)
+            ready_move(owner, old_prio);
 
-        lock->next = NULL;
+        owner = (owner->wait_lock != NULL) ? owner->wait_lock->owner : NULL;
     }
 }
-void llclear(struct thread *thread)
+
+int held_waiter_prio(const struct thread *thr)
 {
-    trace("%s()", __func__);
-    while (thread->lock_list.head != NULL)
+    const struct lock *lock;
+    const struct thread *waiter;
+    int prio = THREAD_PRIO_CNT;
+
+    for (lock = thr->lock_list.head; lock != NULL; lock = lock->next)
     {
-        for (int i = 0; i <= thread->lock_list.head->count; i++)
+        for (waiter = lock->released.wait_list.head; waiter != NULL; waiter = waiter->list_next)
         {
-            lock_release(thread->lock_list.head);
+            if (effective_prio(waiter) < prio)
+                prio = effective_prio(waiter);
         }
-        thread->lock_list.head = thread->lock_list.head->next;
     }
-    thread->lock_list.head = NULL;
-    thread->lock_list.tail = NULL;
+
+    return prio;
+}
+
+//  Moves a ready thread whose effective priority changed from _old_prio_ to
+//  the list for its new one.
+
+void ready_move(struct thread *thr, int old_prio)
+{
+    struct ready_queue *const rq = &ready_queues[thr->hart];
+    struct thread_list *const list = &rq->lists[old_prio];
+    struct thread *prev = NULL;
+    struct thread *curr = list->head;
+
+    while (curr != NULL && curr != thr)
+    {
+        prev = curr;
+        curr = curr->list_next;
+    }
+
+    if (curr == NULL)
+        return;
+
+    if (prev != NULL)
+        prev->list_next = thr->list_next;
+    else
+        list->head = thr->list_next;
+
+    if (list->tail == thr)
+        list->tail = prev;
+
+    if (tlempty(list))
+        rq->mask &= ~(1U << old_prio);
+
+    ready_insert(thr);
 }
+
 //  Appends elements of l1 to the end of l0 and clears l1.
 
 // void tlappend(struct thread_list * l0, struct thread_list * l1) {
@@ -814,17 +1480,31 @@ void idle_thread_func(void)
     {
         //  If there are runnable threads, yield to them.
 
-        while (!tlempty(&ready_list))
+        while (!ready_empty())
             thread_yield();
 
-        //  No runnable threads. Sleep using the wfi instruction. Note that we
-        //  need to disable interrupts and check the runnable thread list one
-        //  more time (make sure it is empty) to avoid a race condition where an
-        //  ISR marks a thread ready before we call the wfi instruction.
+        //  Nothing to run: zero pages for future page faults, one page per
+        //  pass so a thread that becomes ready waits for at most one page.
+
+        if (zero_pool_refill())
+            continue;
+
+        //  No runnable threads. Sleep using the wfi instruction. Note that we
+        //  need to disable interrupts and check the runnable thread list one
+        //  more time (make sure it is empty) to avoid a race condition where an
+        //  ISR marks a thread ready before we call the wfi instruction. Other
+        //  harts may use the kernel meanwhile; ready_insert() sends an IPI to
+        //  wake us, which wfi sees with interrupts disabled.
 
         disable_interrupts();
-        if (tlempty(&ready_list))
+        if (ready_empty())
+        {
+            idle_harts |= 1U << TP->hart;
+            smp_kernel_exit();
             asm("wfi");
+            smp_kernel_enter();
+            idle_harts &= ~(1U << TP->hart);
+        }
         enable_interrupts();
     }
 }
\ No newline at end of file
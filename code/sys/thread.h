@@ -29,7 +29,37 @@ struct lock
     struct lock *next;
 };
 
-//  EXPORTED FUNCTION DECLARATIONS
+//  CPU accounting of a thread or process, in rdtime() ticks (TIMER_FREQ per
+//  second). Time is charged to the state it was spent in; switches counts the
+//  times the thread was switched to.
+
+struct thread_stat
+{
+    unsigned long long run_time;   //  running
+    unsigned long long ready_time; //  on the ready-to-run list
+    unsigned long long wait_time;  //  blocked on a condition
+    unsigned long long switches;
+};
+
+struct rwlock
+{
+    struct condition changed;
+    struct thread *writer;
+    int readers;
+    int writers_waiting;
+};
+
+//  Scheduling priorities run from 0 (highest) to THREAD_PRIO_IDLE, which is
+//  reserved for the idle thread. The priority of a thread moves with its
+//  behavior unless pinned with thread_setprio().
+
+#ifndef THREAD_PRIO_CNT
+#define THREAD_PRIO_CNT 8
+#endif
+
+#define THREAD_PRIO_IDLE (THREAD_PRIO_CNT - 1)
+
+//  EXPORTED FUNCTION DECLARATIONS
 //
 
 extern char thrmgr_initialized;
@@ -41,6 +71,20 @@ extern void thrmgr_init(void);
 extern int running_thread(void);
 extern void * get_stack_anchor(void);
 
+//  Returns the ID of the hart the caller runs on.
+
+extern int running_hart(void);
+
+//  void * create_idle_thread(int hart)
+//
+//  Creates the idle thread of secondary hart _hart_ and returns the stack
+//  anchor the hart starts on; its first word points to the thread. The hart
+//  then calls thread_idle(), which does not return. Returns NULL if there is
+//  no memory for the thread.
+
+extern void * create_idle_thread(int hart);
+extern void thread_idle(void);
+
 //  int thread_spawn(const char * name, void (*start)(void *), ...)
 //  
 //  Creates and starts a new thread. Argument _name_ is the name of the thread
@@ -61,6 +105,13 @@ extern int thread_spawn(
 
 extern void thread_yield(void);
 
+//  int running_thread_should_yield(void)
+//
+//  Returns 1 if the running thread has used up its time slice or a thread of
+//  higher priority is ready to run, 0 otherwise.
+
+extern int running_thread_should_yield(void);
+
 //  int thread_join(int tid)
 //
 //  Waits for a child of the current thread to exit. if _tid_ is not zero, the
@@ -108,6 +159,16 @@ extern void condition_init(struct condition *cond, const char *name);
 
 extern void condition_wait(struct condition *cond);
 
+//  int condition_wait_interruptible(struct condition * cond)
+//
+//  Like condition_wait(), but for waits that may never end, such as for input.
+//  Returns -EINTR, without waiting or as soon as it is woken, once the running
+//  thread has been interrupted by thread_interrupt_process(). Returns 0 after
+//  an ordinary wake-up. Callers loop on their condition as usual and give up
+//  on an error.
+
+extern int condition_wait_interruptible(struct condition *cond);
+
 //  void condition_broadcast(struct condition * cond)
 
 //  Wakes up all threads waiting on a condition. This function may be called from
@@ -124,8 +185,49 @@ void lock_acquire(struct lock *lock);
 
 void lock_release(struct lock *lock);
 
+//  Reader-writer lock: any number of readers or one writer. A waiting writer
+//  holds off new readers, so writers do not starve. Not recursive.
+
+void rwlock_init(struct rwlock *rw);
+
+void rwlock_acquire_read(struct rwlock *rw);
+
+void rwlock_release_read(struct rwlock *rw);
+
+void rwlock_acquire_write(struct rwlock *rw);
+
+void rwlock_release_write(struct rwlock *rw);
+
+//  int thread_setprio(int tid, int prio)
+//
+//  Pins thread _tid_ at priority _prio_, which must be below THREAD_PRIO_IDLE,
+//  or lets its priority adapt again if _prio_ is negative. A thread already on
+//  the ready-to-run list keeps its place there until next scheduled. Returns
+//  the previous priority, or -EINVAL if there is no such thread or _prio_ is
+//  out of range.
+
+extern int thread_setprio(int tid, int prio);
+
+//  Returns the process of thread _tid_, or NULL if there is no such thread or
+//  it belongs to no process.
+
 struct process *thread_process(int tid);
 
+//  Interrupts every thread of _proc_ except the running one: threads blocked
+//  in condition_wait_interruptible() wake up, and later calls return -EINTR at
+//  once. Used by process_exit() so that blocked threads can unwind and exit.
+
+extern void thread_interrupt_process(const struct process *proc);
+
+//  Fills _st_ with the accounting of thread _tid_, including time in its
+//  current state. Returns 0, or -EINVAL if there is no such thread.
+
+extern int thread_stat(int tid, struct thread_stat *st);
+
+//  Fills _st_ with the sum of the accounting of the live threads of _proc_.
+
+extern void thread_stat_process(const struct process *proc, struct thread_stat *st);
+
 void thread_set_process(int tid, struct process *proc);
 
 struct process *running_thread_process(void);
@@ -29,12 +29,42 @@ char timer_initialized = 0;
 //  INTERNVAL GLOBAL VARIABLE DEFINITIONS
 //
 
-static struct alarm *sleep_list;
-struct alarm interruptAlrm;
+//  The sleep queue is a binary min-heap on twake of the pending alarms. Each
+//  queued alarm has a sleeping thread, so NTHR_MAX entries always suffice.
 
-//  INTERNAL FUNCTION DECLARATIONS
+static struct alarm *sleep_heap[NTHR_MAX];
+static int sleep_cnt;
+
+//  End of the running thread's time slice, and the time last given to
+//  set_stcmp(), for each hart. UINT64_MAX if none. Every hart also arms its
+//  timer for the first sleeping alarm, and whichever hart's timer fires first
+//  wakes it; a hart left armed for an alarm already woken takes one early
+//  interrupt and rearms.
+
+static unsigned long long slice_twake[NHART] = {[0 ... NHART - 1] = UINT64_MAX};
+static unsigned long long stcmp_twake[NHART] = {[0 ... NHART - 1] = UINT64_MAX};
+
+#ifdef WITH_PROFILER
+//  Next sample the profiler wants on each hart, UINT64_MAX if none.
+
+static unsigned long long profile_twake[NHART] = {[0 ... NHART - 1] = UINT64_MAX};
+#endif
+
+//  INTERNAL FUNCTION DECLARATIONS
 //
 
+//  Programs the timer for the earlier of the first alarm and the end of the
+//  time slice, or disables timer interrupts if there is neither. Must be called
+//  with interrupts disabled.
+
+static void timer_rearm(void);
+
+//  Sleep queue operations. Must be called with interrupts disabled.
+
+static void sleep_insert(struct alarm *al);
+static void sleep_remove(struct alarm *al);
+static void sleep_place(struct alarm *al, int slot);
+
 //  EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -44,32 +74,9 @@ void timer_init(void)
         return;
     }
     set_stcmp(UINT64_MAX);
-    alarm_init(&interruptAlrm, "interrupter");
-    alarm_sleep_ms(&interruptAlrm, 20);
     timer_initialized = 1;
 }
 
-// void interrupter(void)
-// {
-//     struct alarm al;
-
-//     alarm_init(&al, "interrupter");
-
-//     for (;;)
-//     {
-//         // alarm_sleep_us(&al, 100);
-//         alarm_sleep_ms(&al, 5);
-//     }
-// }
-
-// void start_interrupter(void)
-// {
-//     // thread_spawn("interrupter", &interrupter);
-//     alarm_init(&interruptAlrm, "interrupter");
-
-//     alarm_sleep_us(&interruptAlrm, 2000);
-// }
-
 // void alarm_init(struct alarm * al, const char * name)
 // Inputs: struct alarm * al - pointer to the alarm object to initialize the members of, const char * name - name of the alarm
 // Outputs: None
@@ -84,7 +91,7 @@ void alarm_init(struct alarm *al, const char *name)
         name = "alarm";
     }
     condition_init(&al->cond, name); // Intializes the alarm object and all of its fields
-    al->next = NULL;
+    al->slot = -1;
     al->twake = rdtime();
 }
 
@@ -97,7 +104,6 @@ void alarm_init(struct alarm *al, const char *name)
 void alarm_sleep(struct alarm *al, unsigned long long tcnt)
 {
     unsigned long long now;
-    struct alarm *prev;
     int pie;
 
     now = rdtime();
@@ -116,37 +122,18 @@ void alarm_sleep(struct alarm *al, unsigned long long tcnt)
 
     //  FIXME your code goes here
 
-    pie = disable_interrupts(); // disables interrupts here for critical section as I am modifiying the sleep_list and eventually going to condition_wait
+    pie = disable_interrupts(); // disables interrupts here for critical section as I am modifiying the sleep queue and eventually going to condition_wait
 
-    if (sleep_list == NULL)
-    { // if there is nothing in the sleep_list, add the alarm in the sleep_list
-        sleep_list = al;
-    }
-    else if (al->twake < sleep_list->twake)
-    { // if the alarm's twake is less than the sleep_list's twake, insert the alarm at the sleep_list spot and make that alarm the new head of the sleep_list
-        al->next = sleep_list;
-        sleep_list = al;
-    }
-    else
+    if (al->slot < 0)
     {
-        struct alarm *curr = sleep_list;
-        prev = curr;
-        curr = curr->next;
-        while (curr != NULL && curr->twake < al->twake)
-        { // look through the sleep_list until you find where the alarm's twake is less than the curr's twake and insert a node at that spot of the sleep_list
-            prev = curr;
-            curr = curr->next;
-        }
-        prev->next = al;
-        al->next = curr;
-    }
-
-    set_stcmp(sleep_list->twake); // set the interrupt expiry time
-    csrs_sie(RISCV_SIE_STIE);     // enable timer interrupts
-    if (strcmp(al->cond.name, "interrupter") != 0)
+        sleep_insert(al);
+    }
+
+    if (sleep_heap[0] == al)
     {
-        condition_wait(&al->cond); // condition wait to sleep the alarm
+        timer_rearm(); // set the interrupt expiry time
     }
+    condition_wait(&al->cond); // condition wait to sleep the alarm
     restore_interrupts(pie); // restores interrupts as it has reached the end of the critical section
 }
 
@@ -164,6 +151,23 @@ void alarm_reset(struct alarm *al)
     al->twake = rdtime(); // sets the alarm's twake to the current time in ticks
 }
 
+void alarm_cancel(struct alarm *al)
+{
+    int pie;
+
+    pie = disable_interrupts();
+
+    if (al->slot >= 0)
+    {
+        sleep_remove(al);
+        condition_broadcast(&al->cond);
+
+        //  Leave the timer programmed: an interrupt with nothing due is harmless
+    }
+
+    restore_interrupts(pie);
+}
+
 void alarm_sleep_sec(struct alarm *al, unsigned int sec)
 {
     alarm_sleep(al, sec * TIMER_FREQ);
@@ -202,12 +206,11 @@ void sleep_us(unsigned long us)
 // void handle_timer_interrupt(void)
 // Inputs: None
 // Outputs: None
-// Description: This function services the timer interrupts. It is an ISR and handle timer interrupts by waking all ready threads and updates the sleep_list and mtimecmp registers
+// Description: This function services the timer interrupts. It is an ISR and handle timer interrupts by waking all ready threads and updates the sleep queue and mtimecmp registers
 // Side Effects: Changes the sleep list and calls condition broadcast
 
 void handle_timer_interrupt(void)
 {
-    struct alarm *next;
     uint64_t now;
     int pie;
 
@@ -219,33 +222,145 @@ void handle_timer_interrupt(void)
     //  FIXME your code goes here
 
     pie = disable_interrupts(); // disables interrupts here for critical section as I am modifiying the condition's wait list
-    while (sleep_list != NULL && sleep_list->twake < now)
+    while (sleep_cnt != 0 && sleep_heap[0]->twake <= now)
     {
-        if (strcmp(sleep_list->cond.name, "interrupter") == 0)
-        {
-            alarm_reset(sleep_list);
-            next = sleep_list->next;
-            sleep_list->next = NULL; // removing the alarms from the wait list
-            sleep_list = next;
-            alarm_sleep_ms(&interruptAlrm, 20);
-        }
-        else
-        {
-            condition_broadcast(&sleep_list->cond); // wake up the alarms using condition broadcast
-            next = sleep_list->next;
-            sleep_list->next = NULL; // removing the alarms from the wait list
-            sleep_list = next;
-        }
-    }
-    // sleep_list = head;
+        condition_broadcast(&sleep_heap[0]->cond); // wake up the alarms using condition broadcast
+        sleep_remove(sleep_heap[0]);
+    }
+
+    //  An expired slice needs nothing more here: the running thread sees it
+    //  on its way back to U mode (handle_umode_interrupt) and yields.
+
+    if (slice_twake[running_hart()] <= now)
+    {
+        slice_twake[running_hart()] = UINT64_MAX;
+    }
+
+#ifdef WITH_PROFILER
+    if (profile_twake[running_hart()] <= now) // profile_timer() did not want another sample
+    {
+        profile_twake[running_hart()] = UINT64_MAX;
+    }
+#endif
+
+    timer_rearm(); //  set the timer interrupt threshold for the next wake-up event or end of slice
     restore_interrupts(pie); // restores interrupts as it has reached the end of the critical section
+}
+
+void timer_set_slice(unsigned long long twake)
+{
+    slice_twake[running_hart()] = twake;
+
+    //  A later deadline than the one programmed just costs one early interrupt,
+    //  so only reprogram if the slice ends first.
+
+    if (timer_initialized && twake < stcmp_twake[running_hart()])
+    {
+        timer_rearm();
+    }
+}
+
+#ifdef WITH_PROFILER
+void timer_set_profile(unsigned long long twake)
+{
+    profile_twake[running_hart()] = twake;
+
+    if (timer_initialized && twake < stcmp_twake[running_hart()])
+    {
+        timer_rearm();
+    }
+}
+#endif
+
+//  INTERNAL FUNCTION DEFINITIONS
+//
+
+void timer_rearm(void)
+{
+    const int hart = running_hart();
+    unsigned long long twake = slice_twake[hart];
 
-    if (sleep_list != NULL)
+#ifdef WITH_PROFILER
+    if (profile_twake[hart] < twake)
     {
-        set_stcmp(sleep_list->twake); //  set the timer interrupt threshold for waiting for the next wake-up event on the sleep_list
+        twake = profile_twake[hart];
+    }
+#endif
+
+    if (sleep_cnt != 0 && sleep_heap[0]->twake < twake)
+    {
+        twake = sleep_heap[0]->twake;
+    }
+
+    stcmp_twake[hart] = twake;
+
+    if (twake != UINT64_MAX)
+    {
+        set_stcmp(twake);
+        csrs_sie(RISCV_SIE_STIE); // enable timer interrupts
     }
     else
     {
         csrc_sie(RISCV_SIE_STIE); // disables timer interrupts
     }
-}
\ No newline at end of file
+}
+
+void sleep_insert(struct alarm *al)
+{
+    assert(sleep_cnt < NTHR_MAX);
+    sleep_cnt += 1;
+    sleep_place(al, sleep_cnt - 1);
+}
+
+void sleep_remove(struct alarm *al)
+{
+    const int slot = al->slot;
+    struct alarm *const last = sleep_heap[sleep_cnt - 1];
+
+    assert(0 <= slot && slot < sleep_cnt && sleep_heap[slot] == al);
+
+    sleep_cnt -= 1;
+    al->slot = -1;
+
+    if (last != al)
+    {
+        sleep_place(last, slot);
+    }
+}
+
+//  Puts _al_ into the hole at _slot_ and moves it up or down until the heap
+//  order holds again.
+
+void sleep_place(struct alarm *al, int slot)
+{
+    int child;
+
+    while (slot > 0 && al->twake < sleep_heap[(slot - 1) / 2]->twake)
+    {
+        sleep_heap[slot] = sleep_heap[(slot - 1) / 2];
+        sleep_heap[slot]->slot = slot;
+        slot = (slot - 1) / 2;
+    }
+
+    for (;;)
+    {
+        child = 2 * slot + 1;
+
+        if (child >= sleep_cnt)
+            break;
+
+        if (child + 1 < sleep_cnt &&
+            sleep_heap[child + 1]->twake < sleep_heap[child]->twake)
+            child += 1;
+
+        if (sleep_heap[child]->twake >= al->twake)
+            break;
+
+        sleep_heap[slot] = sleep_heap[child];
+        sleep_heap[slot]->slot = slot;
+        slot = child;
+    }
+
+    sleep_heap[slot] = al;
+    al->slot = slot;
+}
@@ -15,7 +15,7 @@
 
 struct alarm {
     struct condition cond;
-    struct alarm * next;
+    int slot; // position in the sleep queue, -1 if not queued
     unsigned long long twake;
 };
 
@@ -40,16 +40,31 @@ extern void alarm_sleep(struct alarm * al, unsigned long long tcnt);
 
 extern void alarm_reset(struct alarm * al);
 
+// Removes the alarm from the sleep queue, if it is queued, and wakes the
+// threads sleeping on it early.
+
+extern void alarm_cancel(struct alarm * al);
+
 extern void alarm_sleep_sec(struct alarm * al, unsigned int sec);
 extern void alarm_sleep_ms(struct alarm * al, unsigned long ms);
 extern void alarm_sleep_us(struct alarm * al, unsigned long us);
-extern void interrupter(void);
-extern void start_interrupter(void);
 
 extern void sleep_sec(unsigned int sec);
 extern void sleep_ms(unsigned long ms);
 extern void sleep_us(unsigned long us);
 
-extern void handle_timer_interrupt(void); // called from trap.s
+// Arranges for a timer interrupt on the running hart at _twake_, the end of
+// the running thread's time slice, replacing any earlier slice. Called by the scheduler. Must be
+// called with interrupts disabled.
+
+extern void timer_set_slice(unsigned long long twake);
+
+// Arranges for a timer interrupt on the running hart at _twake_ for its next
+// profiler sample, or none if UINT64_MAX. Only in kernels built WITH_PROFILER. Must be called with
+// interrupts disabled.
+
+extern void timer_set_profile(unsigned long long twake);
+
+extern void handle_timer_interrupt(void); // called from trap.s
 
 #endif // _TIMER_H_
\ No newline at end of file
@@ -0,0 +1,124 @@
+// tracepoint.c - Runtime-enabled binary tracepoints
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#include "tracepoint.h"
+#include "thread.h"
+#include "intr.h"
+#include "device.h"
+#include "ioimpl.h"
+#include "string.h"
+#include "riscv.h"
+#include "error.h"
+
+#include <stddef.h>
+
+// Records kept in the ring
+
+#ifndef TRACEPOINT_NRECORDS
+#define TRACEPOINT_NRECORDS 512
+#endif
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int trace_open(struct io ** ioptr, void * aux);
+static int trace_cntl(struct io * io, int cmd, void * arg);
+static long trace_read(struct io * io, void * buf, long bufsz);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct io trace_io;
+static unsigned long trace_head; // next record to read
+static unsigned long trace_tail; // next record to write
+static struct tracepoint_record trace_ring[TRACEPOINT_NRECORDS];
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+unsigned int tracepoint_mask = 0;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void tracepoint_init(void) {
+    static const struct iointf trace_iointf = {
+        .cntl = &trace_cntl,
+        .read = &trace_read
+    };
+
+    ioinit0(&trace_io, &trace_iointf);
+    register_device("trace", trace_open, NULL);
+}
+
+void tracepoint_record(unsigned int event, uint64_t arg0, uint64_t arg1) {
+    struct tracepoint_record * rec;
+    int pie;
+
+    pie = disable_interrupts();
+
+    if (trace_tail - trace_head == TRACEPOINT_NRECORDS)
+        trace_head += 1;
+
+    rec = &trace_ring[trace_tail++ % TRACEPOINT_NRECORDS];
+    rec->time = rdtime();
+    rec->event = event;
+    rec->reserved = 0;
+    rec->tid = running_thread();
+    rec->arg[0] = arg0;
+    rec->arg[1] = arg1;
+
+    restore_interrupts(pie);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+int trace_open(struct io ** ioptr, void * aux) {
+    *ioptr = ioaddref(&trace_io);
+    return 0;
+}
+
+int trace_cntl(struct io * io, int cmd, void * arg) {
+    switch (cmd) {
+    case IOCTL_GETBLKSZ:
+        return sizeof(struct tracepoint_record);
+    case IOCTL_GETTRACEMASK:
+        *(unsigned int *)arg = tracepoint_mask;
+        return 0;
+    case IOCTL_SETTRACEMASK:
+        tracepoint_mask = *(const unsigned int *)arg;
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+// Copies records out one at a time, so that a fault on the user buffer is not
+// taken with interrupts disabled.
+
+long trace_read(struct io * io, void * buf, long bufsz) {
+    struct tracepoint_record * dst = buf;
+    struct tracepoint_record rec;
+    long cnt = 0;
+    int pie;
+
+    while (sizeof(struct tracepoint_record) <= bufsz) {
+        pie = disable_interrupts();
+        if (trace_head == trace_tail) {
+            restore_interrupts(pie);
+            break;
+        }
+        rec = trace_ring[trace_head++ % TRACEPOINT_NRECORDS];
+        restore_interrupts(pie);
+
+        memcpy(dst++, &rec, sizeof(struct tracepoint_record));
+        bufsz -= sizeof(struct tracepoint_record);
+        cnt += sizeof(struct tracepoint_record);
+    }
+
+    return cnt;
+}
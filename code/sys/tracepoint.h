@@ -0,0 +1,72 @@
+// tracepoint.h - Runtime-enabled binary tracepoints
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _TRACEPOINT_H_
+#define _TRACEPOINT_H_
+
+#include <stdint.h>
+
+// Subsystems, one bit each in the trace mask
+
+#define TRACEPOINT_CACHE    (1U << 0)
+#define TRACEPOINT_VIOBLK   (1U << 1)
+#define TRACEPOINT_THREAD   (1U << 2)
+#define TRACEPOINT_SYSCALL  (1U << 3)
+#define TRACEPOINT_MEMORY   (1U << 4)
+
+// Events and their arguments
+
+#define TRACEPOINT_CACHE_GET      1 // pos, result
+#define TRACEPOINT_VIOBLK_READ    2 // pos, result
+#define TRACEPOINT_THREAD_SWITCH  3 // next tid, 0
+#define TRACEPOINT_SYSCALL_EXIT   4 // number, result
+#define TRACEPOINT_PAGE_FAULT     5 // vma, scause
+
+// Device-specific ioctls of the "trace" device. IOCTL_GETBLKSZ returns the
+// record size.
+
+#define IOCTL_GETTRACEMASK 110 // arg is unsigned int *
+#define IOCTL_SETTRACEMASK 111 // arg is const unsigned int *
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// Reading the "trace" device returns whole records in this layout, oldest
+// first. When the ring is full, new records replace the oldest ones.
+
+struct tracepoint_record {
+    uint64_t time;   // rdtime() when recorded
+    uint16_t event;  // TRACEPOINT_xxx event
+    uint16_t reserved;
+    int32_t tid;     // running thread
+    uint64_t arg[2];
+};
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+extern unsigned int tracepoint_mask; // enabled subsystems
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Registers the "trace" device. Tracing starts with every subsystem off.
+
+extern void tracepoint_init(void);
+
+// Appends a record to the trace ring. Called through tracepoint().
+
+extern void tracepoint_record(unsigned int event, uint64_t arg0, uint64_t arg1);
+
+// Records _event_ if subsystem _sub_ is enabled. When it is not, this costs a
+// load and a branch predicted not taken.
+
+#define tracepoint(sub, event, arg0, arg1) do { \
+    if (__builtin_expect((tracepoint_mask & (sub)) != 0, 0)) \
+        tracepoint_record((event), (uint64_t)(arg0), (uint64_t)(arg1)); \
+} while (0)
+
+#endif // _TRACEPOINT_H_
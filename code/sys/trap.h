@@ -40,7 +40,7 @@ extern void trap_frame_jump(struct trap_frame *tfr, void *sscratch) __attribute_
 extern void handle_smode_exception(unsigned int cause, struct trap_frame *tfr);
 extern void handle_umode_exception(unsigned int cause, struct trap_frame *tfr);
 
-extern void handle_smode_interrupt(unsigned int cause);
-extern void handle_umode_interrupt(unsigned int cause);
+extern void handle_smode_interrupt(unsigned int cause, struct trap_frame * tfr);
+extern void handle_umode_interrupt(unsigned int cause, struct trap_frame * tfr);
 
 #endif // _TRAP_H_
\ No newline at end of file
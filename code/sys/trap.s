@@ -136,11 +136,18 @@ smode_trap_entry_from_umode:
         csrr    t6, sepc
         sd      t6, SEPC(sp)
 
-        # Set up _fp_ to look like a normal stack frame
+        # Set up _fp_ to look like a normal stack frame
 
         addi    fp, sp, TFRSZ
 
+        # Take the big kernel lock (smp.c) before touching anything shared,
+        # and drop it with interrupts disabled on the way out, so no S mode
+        # trap comes in between.
+
+        call    smp_kernel_enter
         call    smode_trap_entry_from_umode_cont
+        csrci   sstatus, 2 # SIE
+        call    smp_kernel_exit
 
         ld      a0, A0(sp)
         ld      a1, A1(sp)
@@ -335,6 +342,17 @@ smode_trap_entry_from_umode_cont:
 # a1 is pointer to thread stack anchor - sizeof(trap frame)
 trap_frame_jump:
 
+        # We are leaving the kernel, so drop the big kernel lock (smp.c) with
+        # interrupts disabled. The callee-saved registers are restored from
+        # the trap frame below anyway.
+
+        csrci   sstatus, 2 # SIE
+        mv      s1, a0
+        mv      s2, a1
+        call    smp_kernel_exit
+        mv      a0, s1
+        mv      a1, s2
+
         # Start by restoring some GPRs now (_early_) and some after disabling
         # interrupts (_late_). See discussion in smode_trap_entry_from_umode.
         # The _late_ registers are _gp_, _tp_, _sp_, as well as _a0_ (points to
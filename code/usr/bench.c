@@ -0,0 +1,186 @@
+// bench.c - User half of the benchmark suite
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// Run by the bench kernel image (sys/bench.c) after the kernel benchmarks.
+// Prints one "BENCH <name> <value> <unit>" line per result. Run with the
+// argument "child", it exits at once; the process benchmarks use that.
+//
+
+#include "syscall.h"
+#include "string.h"
+#include "heap.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_NAME "bench"
+#define BENCH_EXEFD 3
+#define BENCH_TIMER_FREQ 10000000UL // same as the kernel's TIMER_FREQ
+#define BENCH_PAGE_SIZE 4096
+#define BENCH_FAULT_PAGES 256
+#define BENCH_PIPE_BYTES (1024 * 1024UL)
+
+#define BENCH_NS(ticks) ((ticks) * (1000000000UL / BENCH_TIMER_FREQ))
+#define BENCH_KBPS(bytes, ticks) \
+    ((ticks) ? (bytes) / 1024 * BENCH_TIMER_FREQ / (ticks) : 0)
+
+static unsigned long long rdtime(void) {
+    unsigned long long t;
+
+    asm volatile ("rdtime %0" : "=r" (t));
+    return t;
+}
+
+static void report(const char * name, unsigned long long value, const char * unit) {
+    char line[80];
+
+    snprintf(line, sizeof(line), "BENCH %s %llu %s", name, value, unit);
+    _print(line);
+}
+
+static char * child_argv[] = { BENCH_NAME, "child", NULL };
+
+// Process creation: fork and wait, fork and exec and wait, spawn and wait.
+
+static void bench_process(void) {
+    const int iters = 16;
+    unsigned long long t0, t1;
+    int tid;
+    int i;
+
+    t0 = rdtime();
+    for (i = 0; i < iters; i++) {
+        tid = _fork();
+        if (tid == 0)
+            _exit();
+        if (tid > 0)
+            _wait(tid);
+    }
+    t1 = rdtime();
+    report("fork_wait", BENCH_NS(t1 - t0) / iters / 1000, "us");
+
+    if (_fsopen(BENCH_EXEFD, BENCH_NAME) < 0) {
+        _print("bench: cannot open " BENCH_NAME "; exec and spawn skipped");
+        return;
+    }
+
+    t0 = rdtime();
+    for (i = 0; i < iters; i++) {
+        tid = _fork();
+        if (tid == 0) {
+            _exec(BENCH_EXEFD, 2, child_argv);
+            _exit();
+        }
+        if (tid > 0)
+            _wait(tid);
+    }
+    t1 = rdtime();
+    report("fork_exec_wait", BENCH_NS(t1 - t0) / iters / 1000, "us");
+
+    t0 = rdtime();
+    for (i = 0; i < iters; i++) {
+        tid = _spawn(BENCH_EXEFD, 2, child_argv, NULL, 0);
+        if (tid > 0)
+            _wait(tid);
+    }
+    t1 = rdtime();
+    report("spawn_wait", BENCH_NS(t1 - t0) / iters / 1000, "us");
+
+    _close(BENCH_EXEFD);
+}
+
+// Demand paging: first touch of fresh heap pages.
+
+static void bench_fault(void) {
+    unsigned long long t0, t1;
+    volatile char * p;
+    int i;
+
+    p = malloc(BENCH_FAULT_PAGES * BENCH_PAGE_SIZE);
+    if (p == NULL)
+        return;
+
+    t0 = rdtime();
+    for (i = 0; i < BENCH_FAULT_PAGES; i++)
+        p[i * BENCH_PAGE_SIZE] = 1;
+    t1 = rdtime();
+    report("page_fault", BENCH_NS(t1 - t0) / BENCH_FAULT_PAGES, "ns");
+
+    free((void*)p);
+}
+
+// Pipes: bandwidth from a child to its parent, then one-byte round trips
+// between the two, which take two process switches each.
+
+static void bench_pipe(void) {
+    static char buf[BENCH_PAGE_SIZE];
+    const int iters = 512;
+    unsigned long long t0, t1;
+    unsigned long total = 0;
+    int wfd, rfd, wfd2, rfd2;
+    long cnt;
+    int tid;
+    int i;
+
+    if (_pipe(&wfd, &rfd) < 0)
+        return;
+
+    t0 = rdtime();
+    tid = _fork();
+    if (tid == 0) {
+        _close(rfd);
+        for (total = 0; total < BENCH_PIPE_BYTES; total += sizeof(buf))
+            _write(wfd, buf, sizeof(buf));
+        _exit();
+    }
+
+    _close(wfd);
+    while ((cnt = _read(rfd, buf, sizeof(buf))) > 0)
+        total += cnt;
+    t1 = rdtime();
+    _close(rfd);
+    if (tid > 0)
+        _wait(tid);
+    report("pipe_bw", BENCH_KBPS(total, t1 - t0), "KB/s");
+
+    if (_pipe(&wfd, &rfd) < 0)
+        return;
+    if (_pipe(&wfd2, &rfd2) < 0)
+        return;
+
+    tid = _fork();
+    if (tid == 0) {
+        for (i = 0; i < iters; i++) {
+            _read(rfd, buf, 1);
+            _write(wfd2, buf, 1);
+        }
+        _exit();
+    }
+
+    t0 = rdtime();
+    for (i = 0; i < iters; i++) {
+        _write(wfd, buf, 1);
+        _read(rfd2, buf, 1);
+    }
+    t1 = rdtime();
+    if (tid > 0)
+        _wait(tid);
+    report("proc_switch", BENCH_NS(t1 - t0) / (2 * iters), "ns");
+
+    _close(wfd);
+    _close(rfd);
+    _close(wfd2);
+    _close(rfd2);
+}
+
+void main(int argc, char ** argv) {
+    if (argc > 1 && strcmp(argv[1], "child") == 0)
+        return;
+
+    bench_process();
+    bench_fault();
+    bench_pipe();
+    _print("BENCH end");
+}
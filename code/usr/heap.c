@@ -1,6 +1,6 @@
-// heap.c - Simple, non-freeing user heap memory manager
+// heap.c - User heap memory manager
 //
-// Copyright (c) 2024-2025 University of Illinois
+// Copyright (c) 2024-2025 University of Illinois
 // SPDX-License-identifier: NCSA
 //
 
@@ -9,57 +9,158 @@
 #include "syscall.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
-// INTERNAL GLOBAL VARIABLES
+// Requests up to HEAP_CLASS_MAX bytes are rounded up to a power of two size
+// class of at least HEAP_CLASS_MIN bytes and served from the class free list,
+// which is refilled a page at a time. Larger requests get a run of whole
+// pages. Pages come from the heap region given to heap_init(), which the
+// kernel backs on first touch; freed runs are kept on an address-ordered list
+// and merged with their neighbors, so the heap only grows when no freed run
+// fits.
+
+#define HEAP_PAGE_SIZE 4096
+#define HEAP_ALIGN 16
+
+#ifndef HEAP_CLASS_MIN
+#define HEAP_CLASS_MIN 16
+#endif
+
+#ifndef HEAP_CLASS_MAX
+#define HEAP_CLASS_MAX 2048
+#endif
+
+#define HEAP_ALLOC_MAGIC 0xEAEAEAEA
+#define HEAP_FREE_MAGIC 0x25252525
+
+#define ROUND_UP(n,k) (((n)+(k)-1)/(k)*(k))
+
+// INTERNAL TYPE DEFINITIONS
 //
 
-static void * heap_low; // lowest address of heap memory
+// Header that precedes each block. The size field is the size of the class,
+// or the number of usable bytes in the pages of a large block. Must be a
+// multiple of HEAP_ALIGN.
+
+struct heap_header {
+    uint32_t magic; ///< HEAP_ALLOC_MAGIC or HEAP_FREE_MAGIC
+    uint32_t size; ///< Usable size of the block
+    uint64_t reserved;
+};
+
+// A free small block holds the link to the next free block of its class.
+
+struct heap_free_block {
+    struct heap_free_block * next;
+};
+
+// A free run of pages starts with its length and the next run up.
+
+struct heap_run {
+    struct heap_run * next;
+    size_t pgcnt;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void heap_fail(const char * msg);
+static void heap_lock(void);
+static void heap_unlock(void);
+
+static unsigned int heap_class(size_t size);
+static int heap_refill(unsigned int cls);
+static void * heap_alloc_pages(size_t pgcnt);
+static void heap_free_pages(void * pp, size_t pgcnt);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static void * heap_brk; // lowest address never handed out
 static void * heap_end; // end of heap memory
 
-// EXPORTED GLOBAL VARIABLES
+static struct heap_free_block * free_lists[32];
+static struct heap_run * free_runs; // ascending addresses
+
+// 0 unlocked, 1 locked, 2 locked with possible waiters in _futex_wait()
+
+static volatile unsigned int heap_mutex;
+
+// EXPORTED GLOBAL VARIABLES
 //
 
 char heap_initialized = 0;
 
-// EXPORTED FUNCTION DEFINITIONS
+// EXPORTED FUNCTION DEFINITIONS
 //
 
 void heap_init(void * start, void * end) {
+    start = (void*)ROUND_UP((uintptr_t)start, HEAP_PAGE_SIZE);
+    end = (void*)((uintptr_t)end / HEAP_PAGE_SIZE * HEAP_PAGE_SIZE);
+
     if (start > end){
         _print("Heap Uninitialized");
         _exit();
     }
 
-    heap_low = start;
+    heap_brk = start;
     heap_end = end;
     heap_initialized = 1;
 }
 
 void * malloc(size_t size) {
-    void * ptr;
+    struct heap_header * hdr;
+    struct heap_free_block * blk;
+    unsigned int cls;
+    size_t pgcnt;
 
     if (size == 0)
         return NULL;
 
-    if (size > heap_end - heap_low) {
-        _print("Heap Overflow");
-        _exit();
+    if (UINT32_MAX - HEAP_PAGE_SIZE < size)
+        heap_fail("Heap Overflow");
+
+    heap_lock();
+
+    if (HEAP_CLASS_MAX < size) {
+        pgcnt = ROUND_UP(size + sizeof(struct heap_header), HEAP_PAGE_SIZE)
+            / HEAP_PAGE_SIZE;
+        hdr = heap_alloc_pages(pgcnt);
+        if (hdr == NULL)
+            heap_fail("Heap Overflow");
+        hdr->size = pgcnt * HEAP_PAGE_SIZE - sizeof(struct heap_header);
+    } else {
+        cls = heap_class(size);
+
+        if (free_lists[cls] == NULL && heap_refill(cls) != 0)
+            heap_fail("Heap Overflow");
+
+        blk = free_lists[cls];
+        free_lists[cls] = blk->next;
+        hdr = (struct heap_header*)blk - 1;
+
+        if (hdr->magic != HEAP_FREE_MAGIC)
+            heap_fail("Heap Corrupted");
     }
 
-    ptr = heap_low;
-    heap_low += size;
-    
-    return ptr;
+    hdr->magic = HEAP_ALLOC_MAGIC;
+    heap_unlock();
+
+    return hdr+1;
 }
 
 void * calloc(size_t nelts, size_t eltsz) {
     size_t size;
     void * ptr;
+
+    if (eltsz != 0 && nelts > SIZE_MAX / eltsz)
+        return NULL;
+
     size =  nelts * eltsz;
 
     ptr = malloc(size);
-    
-    // check if malloc allocated any memory
+
+    // check if malloc allocated any memory
     if (!ptr) return NULL;
 
     memset(ptr, 0, size);
@@ -67,6 +168,180 @@ void * calloc(size_t nelts, size_t eltsz) {
 }
 
 void free(void * ptr) {
-    // DO NOTHING
+    struct heap_header * hdr;
+    struct heap_free_block * blk;
+    unsigned int cls;
+
+    if (ptr == NULL)
+        return;
+
+    hdr = (struct heap_header*)ptr - 1;
+
+    if (hdr->magic != HEAP_ALLOC_MAGIC) {
+        if (hdr->magic == HEAP_FREE_MAGIC)
+            heap_fail("Double Free");
+        else
+            heap_fail("Bad Free");
+    }
+
+    heap_lock();
+    hdr->magic = HEAP_FREE_MAGIC;
+
+    if (HEAP_CLASS_MAX < hdr->size) {
+        heap_free_pages(hdr, (hdr->size + sizeof(struct heap_header))
+            / HEAP_PAGE_SIZE);
+    } else {
+        // Freed blocks are reused first, while they are still in the cache
+
+        cls = heap_class(hdr->size);
+        blk = ptr;
+        blk->next = free_lists[cls];
+        free_lists[cls] = blk;
+    }
+
+    heap_unlock();
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void heap_fail(const char * msg) {
+    _print(msg);
+    _exit();
+}
+
+void heap_lock(void) {
+    unsigned int c = 0;
+
+    if (__atomic_compare_exchange_n(&heap_mutex, &c, 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    if (c != 2)
+        c = __atomic_exchange_n(&heap_mutex, 2, __ATOMIC_ACQUIRE);
+
+    while (c != 0) {
+        _futex_wait(&heap_mutex, 2);
+        c = __atomic_exchange_n(&heap_mutex, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+void heap_unlock(void) {
+    if (__atomic_exchange_n(&heap_mutex, 0, __ATOMIC_RELEASE) == 2)
+        _futex_wake(&heap_mutex, 1);
+}
+
+// Returns the log2 of the size class for a request of _size_ bytes.
+
+unsigned int heap_class(size_t size) {
+    unsigned int cls = __builtin_ctzl(HEAP_CLASS_MIN);
+
+    while ((1UL << cls) < size)
+        cls += 1;
+
+    return cls;
+}
+
+// Carves a fresh page into blocks of class _cls_ on the class free list.
+// Returns 0 on success or -1 if the heap is exhausted.
+
+int heap_refill(unsigned int cls) {
+    const size_t blksz = sizeof(struct heap_header) + (1UL << cls);
+    struct heap_header * hdr;
+    struct heap_free_block * blk;
+    void * page;
+    void * p;
+
+    page = heap_alloc_pages(1);
+    if (page == NULL)
+        return -1;
+
+    // Push in reverse so the list hands blocks out in address order
+
+    p = page + (HEAP_PAGE_SIZE / blksz - 1) * blksz;
+
+    for (;;) {
+        hdr = p;
+        hdr->magic = HEAP_FREE_MAGIC;
+        hdr->size = 1UL << cls;
+        blk = (void*)(hdr+1);
+        blk->next = free_lists[cls];
+        free_lists[cls] = blk;
+
+        if (p == page)
+            break;
+        p -= blksz;
+    }
+
+    return 0;
+}
+
+// Returns _pgcnt_ contiguous pages from the first freed run that fits, or
+// from the untouched part of the heap, or NULL if neither has room.
+
+void * heap_alloc_pages(size_t pgcnt) {
+    struct heap_run ** link;
+    struct heap_run * run;
+    void * pp;
+
+    for (link = &free_runs; *link != NULL; link = &(*link)->next) {
+        run = *link;
+        if (run->pgcnt < pgcnt)
+            continue;
+
+        // Hand out the tail of the run so the rest stays in place
+
+        run->pgcnt -= pgcnt;
+        if (run->pgcnt == 0)
+            *link = run->next;
+        return (void*)run + run->pgcnt * HEAP_PAGE_SIZE;
+    }
+
+    if ((heap_end - heap_brk) / HEAP_PAGE_SIZE < pgcnt)
+        return NULL;
+
+    pp = heap_brk;
+    heap_brk += pgcnt * HEAP_PAGE_SIZE;
+    return pp;
 }
 
+// Returns a run of pages to the free list, merging it with the runs before and
+// after it. A run that ends at the break moves the break down instead.
+
+void heap_free_pages(void * pp, size_t pgcnt) {
+    struct heap_run ** link = &free_runs;
+    struct heap_run ** prevlink = NULL;
+    struct heap_run * run = pp;
+
+    while (*link != NULL && (void*)*link < pp) {
+        prevlink = link;
+        link = &(*link)->next;
+    }
+
+    run->pgcnt = pgcnt;
+    run->next = *link;
+    *link = run;
+
+    if (run->next != NULL
+        && pp + pgcnt * HEAP_PAGE_SIZE == (void*)run->next)
+    {
+        run->pgcnt += run->next->pgcnt;
+        run->next = run->next->next;
+    }
+
+    if (prevlink != NULL
+        && (void*)*prevlink + (*prevlink)->pgcnt * HEAP_PAGE_SIZE == pp)
+    {
+        (*prevlink)->pgcnt += run->pgcnt;
+        (*prevlink)->next = run->next;
+        run = *prevlink;
+        link = prevlink;
+    }
+
+    if (run->next == NULL
+        && (void*)run + run->pgcnt * HEAP_PAGE_SIZE == heap_brk)
+    {
+        heap_brk = run;
+        *link = NULL;
+    }
+}
@@ -12,4 +12,7 @@ extern char heap_initialized;
 extern void heap_init(void * start, void * end);
 extern void * malloc(size_t size);
 extern void * calloc(size_t nelts, size_t eltsz);
+// Returns a block from malloc() or calloc() to the heap for reuse. Freeing a
+// block twice or a pointer the heap did not return ends the program.
+
 extern void free(void * ptr);
@@ -5,6 +5,7 @@
 //
 
 #include "io.h"
+#include "syscall.h"
 
 #include <stddef.h>
 
@@ -29,6 +30,22 @@ static int ioterm_ioctl(struct io * io, int cmd, void * arg);
 
 static void iovprintf_putc(char c, void * aux);
 
+static void iofd_close(struct io * io);
+static long iofd_read(struct io * io, void * buf, long len);
+static long iofd_write(struct io * io, const void * buf, long len);
+static int iofd_ioctl(struct io * io, int cmd, void * arg);
+
+static void iobuf_close(struct io * io);
+static long iobuf_read(struct io * io, void * buf, long len);
+static long iobuf_write(struct io * io, const void * buf, long len);
+static int iobuf_ioctl(struct io * io, int cmd, void * arg);
+static int iobuf_flush(struct io_buf * iob);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct io_buf * iobuf_list; // open io_buf objects
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -172,6 +189,48 @@ struct io * ioterm_init(struct io_term * iot, struct io * rawio) {
     return &iot->io;
 };
 
+struct io * iofd_init(struct io_fd * iofd, int fd) {
+    static const struct iointf ops = {
+        .close = iofd_close,
+        .read = iofd_read,
+        .write = iofd_write,
+        .cntl = iofd_ioctl
+    };
+
+    iofd->io.intf = &ops;
+    iofd->io.refcnt = 1;
+    iofd->fd = fd;
+
+    return &iofd->io;
+}
+
+struct io * iobuf_init(struct io_buf * iob, struct io * rawio, int mode) {
+    static const struct iointf ops = {
+        .close = iobuf_close,
+        .read = iobuf_read,
+        .write = iobuf_write,
+        .cntl = iobuf_ioctl
+    };
+
+    iob->io.intf = &ops;
+    iob->io.refcnt = 1;
+    iob->rawio = rawio;
+    iob->mode = mode;
+    iob->len = 0;
+
+    iob->next = iobuf_list;
+    iobuf_list = iob;
+
+    return &iob->io;
+}
+
+void ioflushall(void) {
+    struct io_buf * iob;
+
+    for (iob = iobuf_list; iob != NULL; iob = iob->next)
+        iobuf_flush(iob);
+}
+
 char * ioterm_getsn(struct io_term * iot, char * buf, size_t n) {
     char * p = buf;
     int result;
@@ -426,3 +485,125 @@ void iovprintf_putc(char c, void * aux) {
             state->err = result;
     }
 }
+
+void iofd_close(struct io * io) {
+    struct io_fd * const iofd = (void*)io - offsetof(struct io_fd, io);
+    _close(iofd->fd);
+}
+
+long iofd_read(struct io * io, void * buf, long len) {
+    struct io_fd * const iofd = (void*)io - offsetof(struct io_fd, io);
+    return _read(iofd->fd, buf, len);
+}
+
+long iofd_write(struct io * io, const void * buf, long len) {
+    struct io_fd * const iofd = (void*)io - offsetof(struct io_fd, io);
+    return _write(iofd->fd, buf, len);
+}
+
+int iofd_ioctl(struct io * io, int cmd, void * arg) {
+    struct io_fd * const iofd = (void*)io - offsetof(struct io_fd, io);
+    return _ioctl(iofd->fd, cmd, arg);
+}
+
+void iobuf_close(struct io * io) {
+    struct io_buf * const iob = (void*)io - offsetof(struct io_buf, io);
+    struct io_buf ** link;
+
+    iobuf_flush(iob);
+
+    for (link = &iobuf_list; *link != NULL; link = &(*link)->next) {
+        if (*link == iob) {
+            *link = iob->next;
+            break;
+        }
+    }
+
+    ioclose(iob->rawio);
+}
+
+long iobuf_read(struct io * io, void * buf, long len) {
+    struct io_buf * const iob = (void*)io - offsetof(struct io_buf, io);
+    int result;
+
+    // Make sure a prompt is out before waiting for the answer
+
+    result = iobuf_flush(iob);
+    if (result < 0)
+        return result;
+
+    return ioread(iob->rawio, buf, len);
+}
+
+long iobuf_write(struct io * io, const void * buf, long len) {
+    struct io_buf * const iob = (void*)io - offsetof(struct io_buf, io);
+    const char * p = buf;
+    int newline = 0;
+    long acc = 0;
+    long cnt;
+    int result;
+
+    while (acc < len) {
+        cnt = IOBUF_SIZE - iob->len;
+        if (len - acc < cnt)
+            cnt = len - acc;
+
+        memcpy(iob->buf + iob->len, p + acc, cnt);
+        iob->len += cnt;
+        acc += cnt;
+
+        if (iob->len == IOBUF_SIZE) {
+            result = iobuf_flush(iob);
+            if (result < 0)
+                return result;
+        }
+    }
+
+    if (iob->mode == IOBUF_LINE) {
+        while (newline == 0 && len != 0)
+            newline = (p[--len] == '\n');
+
+        if (newline) {
+            result = iobuf_flush(iob);
+            if (result < 0)
+                return result;
+        }
+    }
+
+    return acc;
+}
+
+int iobuf_ioctl(struct io * io, int cmd, void * arg) {
+    struct io_buf * const iob = (void*)io - offsetof(struct io_buf, io);
+    int result;
+
+    // Flush first, so positions and sizes seen below account for everything
+    // written so far.
+
+    result = iobuf_flush(iob);
+    if (result < 0)
+        return result;
+
+    if (cmd == IOCTL_FLUSH && iob->rawio->intf->cntl == NULL)
+        return 0;
+
+    return ioctl(iob->rawio, cmd, arg);
+}
+
+// Writes out whatever is in the buffer. Returns 0 on success or a negative
+// error code, in which case the unwritten bytes are dropped.
+
+int iobuf_flush(struct io_buf * iob) {
+    long cnt;
+
+    if (iob->len == 0)
+        return 0;
+
+    cnt = iowrite(iob->rawio, iob->buf, iob->len);
+    iob->len = 0;
+
+    if (cnt < 0)
+        return cnt;
+
+    return 0;
+}
@@ -59,9 +59,30 @@ struct iointf {
 
 struct io_term {
     struct io io; // I/O abstraction
-    struct io * rawio; // "raw" I/O object
-    int8_t cr_out; // Output CRLF normalization
-    int8_t cr_in; // Input CRLF normalization
+    struct io * rawio; // "raw" I/O object
+    int8_t cr_out; // Output CRLF normalization
+    int8_t cr_in; // Input CRLF normalization
+};
+
+#ifndef IOBUF_SIZE
+#define IOBUF_SIZE 512
+#endif
+
+#define IOBUF_LINE 0 // flush after each write containing \n
+#define IOBUF_FULL 1 // flush only when the buffer fills
+
+struct io_buf {
+    struct io io; // I/O abstraction
+    struct io * rawio; // backing I/O object
+    struct io_buf * next; // next on the list flushed at exit
+    int mode; // IOBUF_LINE or IOBUF_FULL
+    long len; // bytes waiting in buf
+    char buf[IOBUF_SIZE];
+};
+
+struct io_fd {
+    struct io io; // I/O abstraction
+    int fd; // file descriptor
 };
 
 
@@ -70,6 +91,10 @@ struct io_term {
 #define IOCTL_SETEND    3
 #define IOCTL_GETPOS    4
 #define IOCTL_SETPOS    5
+#define IOCTL_GETREADAHEAD  6
+#define IOCTL_SETREADAHEAD  7
+#define IOCTL_FLUSH         8
+#define IOCTL_PREALLOC      11
 
 // refcount functions
 unsigned long iorefcnt(const struct io * io);
@@ -139,7 +164,25 @@ struct io * ioterm_init(struct io_term * iot, struct io * rawio);
 // backspace) and limits the input to /n/ characters.
 char * ioterm_getsn(struct io_term * iot, char * buf, size_t n);
 
-// definitions for putc and getc
+// An io_fd object makes a file descriptor usable as an I/O object. Reads,
+// writes and ioctls become system calls on /fd/, and closing it closes /fd/.
+struct io * iofd_init(struct io_fd * iofd, int fd);
+
+// An io_buf object collects writes to a backing I/O object and passes them on
+// in IOBUF_SIZE pieces, so that ioputc() and ioprintf() do not each cost a
+// system call. In IOBUF_LINE mode, meant for terminals, a write containing a
+// newline also flushes; in IOBUF_FULL mode, for files and pipes, only a full
+// buffer does. A read, an ioctl (including IOCTL_FLUSH) and ioclose() flush
+// first, and _exit() flushes every io_buf still open.
+//
+// iobuf_init initializes /iob/ for use with /rawio/ and returns its I/O object
+// with a reference count of one.
+struct io * iobuf_init(struct io_buf * iob, struct io * rawio, int mode);
+
+// The ioflushall function flushes every open io_buf. Called by _exit().
+void ioflushall(void);
+
+// definitions for putc and getc
 static inline int ioputc(struct io * io, char c) {
     long wlen;
 
@@ -15,6 +15,15 @@
 #define UART_DESC 2
 #define NDEV     16
 
+// Bulk operations move a uint64_t at a time once the pointers are aligned.
+// ONES and HIGHS are used to test a word for a zero byte.
+
+#define WORDSZ sizeof(uint64_t)
+#define WORD_ALIGNED(p) (((uintptr_t)(p) & (WORDSZ - 1)) == 0)
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
 // INTERNAL STRUCTURE DEFINITIONS
 // 
 
@@ -187,6 +196,24 @@ int strcmp(const char * s1, const char * s2) {
             return 1;
     }
 
+    // Skip whole words while both strings are aligned and the words match and
+    // hold no '\0'. An aligned word never crosses a page, so reading past the
+    // terminator is harmless.
+
+    while (!WORD_ALIGNED(s1) && *s1 == *s2 && *s1 != '\0') {
+        s1 += 1;
+        s2 += 1;
+    }
+
+    if (WORD_ALIGNED(s1) && WORD_ALIGNED(s2)) {
+        while (*(const uint64_t *)s1 == *(const uint64_t *)s2 &&
+               !HASZERO(*(const uint64_t *)s1))
+        {
+            s1 += WORDSZ;
+            s2 += WORDSZ;
+        }
+    }
+
     // Find first non-matching character (or '\0')
 
     while (*s1 == *s2 && *s1 != '\0') {
@@ -266,24 +293,70 @@ char * strrchr(const char * s, int c) {
 }
 
 void * memset(void * s, int c, size_t n) {
-  char * p = s;
+    const uint64_t w = ONES * (uint8_t)c;
+    char * p = s;
 
-  while (n != 0) {
-    *p++ = c;
-    n -= 1;
-  }
+    while (n != 0 && !WORD_ALIGNED(p)) {
+        *p++ = c;
+        n -= 1;
+    }
+
+    while (WORDSZ * 4 <= n) {
+        ((uint64_t *)p)[0] = w;
+        ((uint64_t *)p)[1] = w;
+        ((uint64_t *)p)[2] = w;
+        ((uint64_t *)p)[3] = w;
+        p += WORDSZ * 4;
+        n -= WORDSZ * 4;
+    }
+
+    while (WORDSZ <= n) {
+        *(uint64_t *)p = w;
+        p += WORDSZ;
+        n -= WORDSZ;
+    }
+
+    while (n != 0) {
+        *p++ = c;
+        n -= 1;
+    }
 
-  return s;
+    return s;
 }
 
+// Buffers whose addresses differ in their low bits cannot both be aligned,
+// and misaligned word accesses trap, so those are copied a byte at a time.
+
 void * memcpy(void * restrict dst, const void * restrict src, size_t n) {
     const char * q = src;
     char * p = dst;
-    
+
+    if (((uintptr_t)p ^ (uintptr_t)q) % WORDSZ == 0) {
+        while (n != 0 && !WORD_ALIGNED(p)) {
+            *p++ = *q++;
+            n -= 1;
+        }
+
+        while (WORDSZ * 4 <= n) {
+            ((uint64_t *)p)[0] = ((const uint64_t *)q)[0];
+            ((uint64_t *)p)[1] = ((const uint64_t *)q)[1];
+            ((uint64_t *)p)[2] = ((const uint64_t *)q)[2];
+            ((uint64_t *)p)[3] = ((const uint64_t *)q)[3];
+            p += WORDSZ * 4;
+            q += WORDSZ * 4;
+            n -= WORDSZ * 4;
+        }
+
+        while (WORDSZ <= n) {
+            *(uint64_t *)p = *(const uint64_t *)q;
+            p += WORDSZ;
+            q += WORDSZ;
+            n -= WORDSZ;
+        }
+    }
+
     while (n != 0) {
-        *p = *q;
-        p += 1;
-        q += 1;
+        *p++ = *q++;
         n -= 1;
     }
 
@@ -294,6 +367,24 @@ int memcmp(const void * p1, const void * p2, size_t n) {
     const uint8_t * u = p1;
     const uint8_t * v = p2;
 
+    // Skip equal words, then find the differing byte
+
+    if (((uintptr_t)u ^ (uintptr_t)v) % WORDSZ == 0) {
+        while (n != 0 && !WORD_ALIGNED(u) && *u == *v) {
+            u += 1;
+            v += 1;
+            n -= 1;
+        }
+
+        if (WORD_ALIGNED(u)) {
+            while (WORDSZ <= n && *(const uint64_t *)u == *(const uint64_t *)v) {
+                u += WORDSZ;
+                v += WORDSZ;
+                n -= WORDSZ;
+            }
+        }
+    }
+
     while (n != 0) {
         if (*u != *v)
             return (*u - *v);
@@ -26,4 +26,167 @@ extern int _fscreate(const char* name);
 extern int _fsdelete(const char* name);
 extern int _iodup(int oldfd, int newfd);
 extern int _pipe(int * wfdptr, int * rfdptr);
+
+// Flags for _mmap. Without MMAP_WRITE the mapping is read-only; with it, the
+// pages are a private copy and stores are not written back to the file.
+
+#define MMAP_WRITE 0x1
+
+// Returns the address of the mapping, or a negative error code cast to a
+// pointer. _addr_ may be NULL to let the kernel choose.
+
+extern void * _mmap(int fd, void * addr, size_t len,
+    unsigned long long pos, int flags);
+extern int _munmap(void * addr);
+
+// Starts the executable open on _fd_ as a new process and returns its thread
+// id. If _fdtab_ is not NULL, child descriptor i is a copy of descriptor
+// fdtab[i] for i < _fdcnt_ (closed if negative) and the rest are closed;
+// otherwise the child inherits every descriptor.
+
+extern int _spawn(int fd, int argc, char ** argv,
+    const int * fdtab, int fdcnt);
+
+// Pins thread _tid_ (0 for the calling thread) at priority _prio_, from 0
+// (highest) to 6, or lets the kernel adjust its priority again if _prio_ is
+// negative. Returns the previous priority.
+
+extern int _setprio(int tid, int prio);
+
+// CPU accounting in timer ticks (10 MHz): time running, waiting to run and
+// blocked, and the number of times the thread was switched to.
+
+struct thread_stat {
+    unsigned long long run_time;
+    unsigned long long ready_time;
+    unsigned long long wait_time;
+    unsigned long long switches;
+};
+
+// Fills _st_ with the accounting of thread _tid_ (0 for the calling thread),
+// or of all threads of the calling process if _tid_ is -1.
+
+extern int _threadstat(int tid, struct thread_stat * st);
+
+// Sleeps until _futex_wake_ is called on _uaddr_, unless the word at _uaddr_
+// does not hold _val_, in which case it returns -EAGAIN at once. Used to build
+// locks that only enter the kernel when contended.
+
+extern int _futex_wait(volatile unsigned int * uaddr, unsigned int val);
+
+// Wakes up to _cnt_ threads sleeping on _uaddr_. Returns the number woken.
+
+extern int _futex_wake(volatile unsigned int * uaddr, int cnt);
+
+// Starts a thread that runs _entry_(_arg_) on its own stack, sharing memory
+// and descriptors with the caller. Returns the thread id. _entry_ must not
+// return; it ends with _thread_exit().
+
+extern int _thread_create(void (*entry)(void *), void * arg);
+
+// Ends the calling thread. Called by the first thread, ends the process.
+
+extern void __attribute__ ((noreturn)) _thread_exit(void);
+
+// Waits for a thread started with _thread_create() to exit.
+
+extern int _thread_join(int tid);
+
+// Copies up to _len_ bytes from _infd_ to _outfd_ inside the kernel. Returns
+// the number of bytes copied, which is short at end of file.
+
+extern long _splice(int outfd, int infd, long len);
+
+// One buffer of _readv_ or _writev_, as in the kernel. At most IOV_MAX
+// buffers per call.
+
+struct iovec {
+    void * base;
+    unsigned long len;
+};
+
+#define IOV_MAX 16
+
+// Read into or write from _cnt_ buffers in turn with one trap. Return the
+// total number of bytes transferred, stopping at the first short transfer.
+
+extern long _readv(int fd, const struct iovec * iov, int cnt);
+extern long _writev(int fd, const struct iovec * iov, int cnt);
+
+// Descriptor to wait on with _poll_. Entries with a negative fd are skipped.
+
+struct pollfd {
+    int fd;
+    short events; // POLLIN, POLLOUT
+    short revents; // also POLLERR, POLLHUP
+};
+
+#define POLLIN 0x01
+#define POLLOUT 0x04
+#define POLLERR 0x08
+#define POLLHUP 0x10
+
+// Waits until a read or write on one of _cnt_ descriptors would not block,
+// or for _timeout_ms_ milliseconds if it is not negative. Files are always
+// ready. Returns the number of ready descriptors, 0 on timeout.
+
+extern int _poll(struct pollfd * fds, int cnt, long timeout_ms);
+
+// Submission and completion rings, laid out as in the kernel (sys/ioring.h).
+// Fill sqes[sq_tail % IORING_ENTRIES] and advance sq_tail, then call
+// _ring_enter. Results appear at cqes[cq_head % IORING_ENTRIES] up to
+// cq_tail; advance cq_head to consume them. A kernel thread runs the requests
+// in order while the caller goes on.
+
+#define IORING_ENTRIES 64
+
+#define IORING_OP_NOP 0
+#define IORING_OP_READ 1 // like _read(fd, addr, len)
+#define IORING_OP_WRITE 2 // like _write(fd, addr, len)
+#define IORING_OP_IOCTL 3 // like _ioctl(fd, len, addr)
+
+struct ioring_sqe {
+    unsigned int op;
+    int fd;
+    unsigned long long addr;
+    unsigned long long len;
+    unsigned long long user_data;
+};
+
+struct ioring_cqe {
+    unsigned long long user_data;
+    long long result;
+};
+
+struct ioring_shared {
+    volatile unsigned int sq_head;
+    volatile unsigned int sq_tail;
+    volatile unsigned int cq_head;
+    volatile unsigned int cq_tail;
+    struct ioring_sqe sqes[IORING_ENTRIES];
+    struct ioring_cqe cqes[IORING_ENTRIES];
+};
+
+// Maps the rings into the process. Returns their address, or a negative error
+// code cast to a pointer.
+
+extern struct ioring_shared * _ring_setup(void);
+
+// Starts the submissions made since the last call and waits until at least
+// _min_complete_ completions are ready. Returns the number ready.
+
+extern int _ring_enter(unsigned int min_complete);
+
+// Calls made to a system call and timer ticks spent in them, blocking
+// included. Only kept if the kernel is built with SYSCALL_STATS.
+
+struct syscall_stat {
+    unsigned long long count;
+    unsigned long long time;
+};
+
+// Fills _st_ for system call number _num_. Returns -ENOTSUP if the kernel
+// does not keep statistics.
+
+extern int _scstat(int num, struct syscall_stat * st);
 #endif // _SYSCALL_H_
\ No newline at end of file